@@ -309,6 +309,7 @@ static void jni_framebuffer_remove(rvvm_mmio_dev_t* dev)
 static const rvvm_mmio_type_t jni_framebuffer_dev_type = {
     .name = "framebuffer",
     .remove = jni_framebuffer_remove,
+    .save = rvvm_save_none,
 };
 
 JNIEXPORT jlong JNICALL Java_lekkit_rvvm_RVVMNative_framebuffer_1init_1auto(JNIEnv* env, jclass class, jlong machine, jobjectArray fb, jint x, jint y, jint bpp)
@@ -0,0 +1,426 @@
+/*
+blk_cache.c - Block device cache layer
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "blk_io.h"
+#include "hashmap.h"
+#include "utils.h"
+#include "spinlock.h"
+
+#include <string.h>
+
+/*
+ * A write-back LRU cache of 64k chunks, stacked on top of any block device.
+ *
+ * Small accesses (ATA PIO sectors, MTD MMIO) are served from memory instead
+ * of a host syscall each. Misses on consecutive chunks grow a readahead window,
+ * dirty chunks are written back in LRU order once the dirty limit is exceeded,
+ * large transfers bypass the cache altogether. blk_sync() writes back everything
+ * before syncing the underlying device, so it stays a durability barrier.
+ */
+
+#define CACHE_CHUNK_BITS    16
+#define CACHE_CHUNK_SIZE    (1U << CACHE_CHUNK_BITS)
+#define CACHE_DEFAULT_SIZE  (4U << 20)
+#define CACHE_MAX_READAHEAD 16
+#define CACHE_BYPASS_CHUNKS 4
+
+#define CACHE_NONE ((size_t)-1)
+
+typedef struct {
+    uint8_t* data;
+    uint64_t chunk;
+    size_t   prev; // LRU list, towards most recently used
+    size_t   next; // LRU list, towards least recently used
+    uint32_t dirty_start;
+    uint32_t dirty_end;
+} cache_entry_t;
+
+typedef struct {
+    blkdev_t*      base;
+    cache_entry_t* entries;
+    uint8_t*       buffer;
+    size_t*        free;
+    hashmap_t      map; // Chunk index -> entry index + 1
+    spinlock_t     lock;
+    size_t         count;
+    size_t         free_count;
+    size_t         dirty_count;
+    size_t         dirty_limit;
+    size_t         lru_head;
+    size_t         lru_tail;
+    uint64_t       ra_next;
+    size_t         ra_window;
+    size_t         ra_max;
+} blk_cache_t;
+
+static inline size_t cache_chunk_len(blk_cache_t* cache, uint64_t chunk)
+{
+    return EVAL_MIN(cache->base->size - (chunk << CACHE_CHUNK_BITS), CACHE_CHUNK_SIZE);
+}
+
+static inline size_t cache_lookup(blk_cache_t* cache, uint64_t chunk)
+{
+    return hashmap_get(&cache->map, chunk) - 1;
+}
+
+static void cache_lru_unlink(blk_cache_t* cache, size_t id)
+{
+    cache_entry_t* entry = &cache->entries[id];
+    if (entry->prev != CACHE_NONE) {
+        cache->entries[entry->prev].next = entry->next;
+    } else {
+        cache->lru_head = entry->next;
+    }
+    if (entry->next != CACHE_NONE) {
+        cache->entries[entry->next].prev = entry->prev;
+    } else {
+        cache->lru_tail = entry->prev;
+    }
+}
+
+static void cache_lru_push(blk_cache_t* cache, size_t id)
+{
+    cache_entry_t* entry = &cache->entries[id];
+    entry->prev = CACHE_NONE;
+    entry->next = cache->lru_head;
+    if (cache->lru_head != CACHE_NONE) {
+        cache->entries[cache->lru_head].prev = id;
+    } else {
+        cache->lru_tail = id;
+    }
+    cache->lru_head = id;
+}
+
+static void cache_touch(blk_cache_t* cache, size_t id)
+{
+    if (cache->lru_head != id) {
+        cache_lru_unlink(cache, id);
+        cache_lru_push(cache, id);
+    }
+}
+
+static bool cache_writeback(blk_cache_t* cache, size_t id)
+{
+    cache_entry_t* entry = &cache->entries[id];
+    if (entry->dirty_end > entry->dirty_start) {
+        size_t size = entry->dirty_end - entry->dirty_start;
+        uint64_t pos = (entry->chunk << CACHE_CHUNK_BITS) + entry->dirty_start;
+        if (cache->base->type->write(cache->base->data, entry->data + entry->dirty_start, size, pos) != size) {
+            return false;
+        }
+        entry->dirty_start = 0;
+        entry->dirty_end = 0;
+        cache->dirty_count--;
+    }
+    return true;
+}
+
+static void cache_drop(blk_cache_t* cache, size_t id)
+{
+    cache_lru_unlink(cache, id);
+    hashmap_remove(&cache->map, cache->entries[id].chunk);
+    cache->free[cache->free_count++] = id;
+}
+
+// Get a free entry, evicting the least recently used chunk if needed
+static size_t cache_alloc(blk_cache_t* cache, uint64_t chunk)
+{
+    if (!cache->free_count) {
+        size_t victim = cache->lru_tail;
+        if (!cache_writeback(cache, victim)) {
+            return CACHE_NONE;
+        }
+        cache_drop(cache, victim);
+    }
+    size_t id = cache->free[--cache->free_count];
+    cache->entries[id].chunk = chunk;
+    cache->entries[id].dirty_start = 0;
+    cache->entries[id].dirty_end = 0;
+    hashmap_put(&cache->map, chunk, id + 1);
+    cache_lru_push(cache, id);
+    return id;
+}
+
+// Read missing chunks starting at chunk into the cache, returns entry of the first one
+static size_t cache_fill(blk_cache_t* cache, uint64_t chunk, bool readahead)
+{
+    uint64_t chunks = (cache->base->size + CACHE_CHUNK_SIZE - 1) >> CACHE_CHUNK_BITS;
+    size_t window = 1;
+    if (readahead) {
+        // Grow the window while the guest keeps reading sequentially
+        if (chunk == cache->ra_next) {
+            cache->ra_window = EVAL_MIN(cache->ra_window << 1, cache->ra_max);
+        } else {
+            cache->ra_window = 1;
+        }
+        window = EVAL_MIN(cache->ra_window, chunks - chunk);
+        for (size_t i = 1; i < window; ++i) {
+            if (cache_lookup(cache, chunk + i) != CACHE_NONE) {
+                window = i;
+                break;
+            }
+        }
+        cache->ra_next = chunk + window;
+    }
+
+    blk_iovec_t iov[CACHE_MAX_READAHEAD] = {0};
+    size_t ids[CACHE_MAX_READAHEAD] = {0};
+    size_t size = 0;
+    for (size_t i = 0; i < window; ++i) {
+        ids[i] = cache_alloc(cache, chunk + i);
+        if (ids[i] == CACHE_NONE) {
+            window = i;
+            break;
+        }
+        iov[i].buffer = cache->entries[ids[i]].data;
+        iov[i].size = cache_chunk_len(cache, chunk + i);
+        size += iov[i].size;
+    }
+    if (window == 0) {
+        return CACHE_NONE;
+    }
+
+    bool ok = true;
+    uint64_t pos = chunk << CACHE_CHUNK_BITS;
+    if (window > 1 && cache->base->type->readv) {
+        ok = cache->base->type->readv(cache->base->data, iov, window, pos) == size;
+    } else {
+        for (size_t i = 0; i < window && ok; ++i) {
+            ok = cache->base->type->read(cache->base->data, iov[i].buffer, iov[i].size, pos) == iov[i].size;
+            pos += iov[i].size;
+        }
+    }
+    if (!ok) {
+        for (size_t i = 0; i < window; ++i) {
+            cache_drop(cache, ids[i]);
+        }
+        return CACHE_NONE;
+    }
+    // Prefetched chunks shouldn't push out the one actually requested
+    cache_touch(cache, ids[0]);
+    return ids[0];
+}
+
+static bool cache_writeback_range(blk_cache_t* cache, uint64_t offset, uint64_t size)
+{
+    uint64_t first = offset >> CACHE_CHUNK_BITS;
+    uint64_t last = (offset + size - 1) >> CACHE_CHUNK_BITS;
+    for (size_t id = 0; id < cache->count; ++id) {
+        cache_entry_t* entry = &cache->entries[id];
+        if (entry->dirty_end > entry->dirty_start && entry->chunk >= first && entry->chunk <= last) {
+            if (!cache_writeback(cache, id)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool cache_writeback_all(blk_cache_t* cache)
+{
+    bool ret = true;
+    for (size_t id = 0; id < cache->count && cache->dirty_count; ++id) {
+        ret = cache_writeback(cache, id) && ret;
+    }
+    return ret;
+}
+
+// Write back least recently used dirty chunks until under the dirty limit
+static bool cache_enforce_dirty_limit(blk_cache_t* cache)
+{
+    size_t id = cache->lru_tail;
+    while (cache->dirty_count > cache->dirty_limit && id != CACHE_NONE) {
+        if (!cache_writeback(cache, id)) {
+            return false;
+        }
+        id = cache->entries[id].prev;
+    }
+    return true;
+}
+
+/*
+ * Block device interface
+ */
+
+static void cache_close(void* dev)
+{
+    blk_cache_t* cache = dev;
+    if (!cache_writeback_all(cache)) {
+        rvvm_warn("Failed to write back block cache on close");
+    }
+    blk_close(cache->base);
+    hashmap_destroy(&cache->map);
+    free(cache->entries);
+    free(cache->buffer);
+    free(cache->free);
+    free(cache);
+}
+
+static size_t cache_read(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    blk_cache_t* cache = dev;
+    uint8_t* buffer = dst;
+    size_t done = 0;
+    spin_lock_slow(&cache->lock);
+    if (size >= (CACHE_BYPASS_CHUNKS << CACHE_CHUNK_BITS)) {
+        // Large reads go directly to the device, dirty chunks are written back first
+        if (cache_writeback_range(cache, offset, size)) {
+            done = cache->base->type->read(cache->base->data, dst, size, offset);
+        }
+        spin_unlock(&cache->lock);
+        return done;
+    }
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint64_t chunk = pos >> CACHE_CHUNK_BITS;
+        size_t chunk_off = pos & (CACHE_CHUNK_SIZE - 1);
+        size_t len = EVAL_MIN(size - done, CACHE_CHUNK_SIZE - chunk_off);
+        size_t id = cache_lookup(cache, chunk);
+        if (id == CACHE_NONE) {
+            id = cache_fill(cache, chunk, true);
+            if (id == CACHE_NONE) break;
+        } else {
+            cache_touch(cache, id);
+        }
+        memcpy(buffer + done, cache->entries[id].data + chunk_off, len);
+        done += len;
+    }
+    spin_unlock(&cache->lock);
+    return done;
+}
+
+static size_t cache_write(void* dev, const void* src, size_t size, uint64_t offset)
+{
+    blk_cache_t* cache = dev;
+    const uint8_t* buffer = src;
+    size_t done = 0;
+    spin_lock_slow(&cache->lock);
+    if (size >= (CACHE_BYPASS_CHUNKS << CACHE_CHUNK_BITS)) {
+        // Large writes go directly to the device, cached copies are updated in place
+        done = cache->base->type->write(cache->base->data, src, size, offset);
+        for (size_t id = 0; id < cache->count; ++id) {
+            cache_entry_t* entry = &cache->entries[id];
+            uint64_t chunk_pos = entry->chunk << CACHE_CHUNK_BITS;
+            if (hashmap_get(&cache->map, entry->chunk) == id + 1
+             && chunk_pos < offset + done && chunk_pos + CACHE_CHUNK_SIZE > offset) {
+                uint64_t start = EVAL_MAX(chunk_pos, offset);
+                uint64_t end = EVAL_MIN(chunk_pos + cache_chunk_len(cache, entry->chunk), offset + done);
+                memcpy(entry->data + (start - chunk_pos), buffer + (start - offset), end - start);
+            }
+        }
+        spin_unlock(&cache->lock);
+        return done;
+    }
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint64_t chunk = pos >> CACHE_CHUNK_BITS;
+        size_t chunk_off = pos & (CACHE_CHUNK_SIZE - 1);
+        size_t chunk_len = cache_chunk_len(cache, chunk);
+        size_t len = EVAL_MIN(size - done, chunk_len - chunk_off);
+        size_t id = cache_lookup(cache, chunk);
+        if (id == CACHE_NONE) {
+            // Whole chunk overwrites don't need the old contents
+            id = (len == chunk_len) ? cache_alloc(cache, chunk) : cache_fill(cache, chunk, false);
+            if (id == CACHE_NONE) break;
+        } else {
+            cache_touch(cache, id);
+        }
+        cache_entry_t* entry = &cache->entries[id];
+        memcpy(entry->data + chunk_off, buffer + done, len);
+        if (entry->dirty_end > entry->dirty_start) {
+            entry->dirty_start = EVAL_MIN(entry->dirty_start, chunk_off);
+            entry->dirty_end = EVAL_MAX(entry->dirty_end, chunk_off + len);
+        } else {
+            entry->dirty_start = chunk_off;
+            entry->dirty_end = chunk_off + len;
+            cache->dirty_count++;
+        }
+        done += len;
+    }
+    if (!cache_enforce_dirty_limit(cache)) {
+        // Data is still cached, but the device is failing
+        rvvm_warn("Block cache write back failed");
+    }
+    spin_unlock(&cache->lock);
+    return done;
+}
+
+static bool cache_trim(void* dev, uint64_t offset, uint64_t size)
+{
+    blk_cache_t* cache = dev;
+    bool ret = false;
+    if (!cache->base->type->trim || !size) {
+        return false;
+    }
+    spin_lock_slow(&cache->lock);
+    if (cache_writeback_range(cache, offset, size)) {
+        // Drop discarded chunks, the device decides what they read back as
+        uint64_t first = offset >> CACHE_CHUNK_BITS;
+        uint64_t last = (offset + size - 1) >> CACHE_CHUNK_BITS;
+        for (size_t id = 0; id < cache->count; ++id) {
+            uint64_t chunk = cache->entries[id].chunk;
+            if (chunk >= first && chunk <= last && cache_lookup(cache, chunk) == id) {
+                cache_drop(cache, id);
+            }
+        }
+        ret = cache->base->type->trim(cache->base->data, offset, size);
+    }
+    spin_unlock(&cache->lock);
+    return ret;
+}
+
+static bool cache_sync(void* dev)
+{
+    blk_cache_t* cache = dev;
+    spin_lock_slow(&cache->lock);
+    bool ret = cache_writeback_all(cache);
+    spin_unlock(&cache->lock);
+    return ret && blk_sync(cache->base);
+}
+
+static const blkdev_type_t blkdev_type_cache = {
+    .name  = "blk-cache",
+    .close = cache_close,
+    .read  = cache_read,
+    .write = cache_write,
+    .trim  = cache_trim,
+    .sync  = cache_sync,
+};
+
+blkdev_t* blk_cache_create(blkdev_t* base, size_t size)
+{
+    if (!base) return NULL;
+    blk_cache_t* cache = safe_new_obj(blk_cache_t);
+    cache->base = base;
+    cache->count = EVAL_MAX((size ? size : CACHE_DEFAULT_SIZE) >> CACHE_CHUNK_BITS, CACHE_MAX_READAHEAD);
+    // Writethrough devices get no dirty chunks, every write reaches the device before completion
+    cache->dirty_limit = (base->mode == BLKDEV_MODE_WRITETHROUGH) ? 0 : cache->count / 4;
+    cache->ra_max = EVAL_MIN(CACHE_MAX_READAHEAD, cache->count / 4);
+    cache->ra_next = CACHE_NONE;
+    cache->ra_window = 1;
+    cache->lru_head = CACHE_NONE;
+    cache->lru_tail = CACHE_NONE;
+    cache->entries = safe_new_arr(cache_entry_t, cache->count);
+    cache->buffer = safe_malloc(cache->count << CACHE_CHUNK_BITS);
+    cache->free = safe_new_arr(size_t, cache->count);
+    for (size_t i = 0; i < cache->count; ++i) {
+        cache->entries[i].data = cache->buffer + (i << CACHE_CHUNK_BITS);
+        cache->entries[i].chunk = CACHE_NONE;
+        cache->free[i] = cache->count - i - 1;
+    }
+    cache->free_count = cache->count;
+    hashmap_init(&cache->map, cache->count);
+    spin_init(&cache->lock);
+
+    blkdev_t* dev = safe_new_obj(blkdev_t);
+    dev->type = &blkdev_type_cache;
+    dev->size = base->size;
+    dev->data = cache;
+    return dev;
+}
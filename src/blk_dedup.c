@@ -0,0 +1,795 @@
+/*
+blk_dedup.c - Deduplicated block device image
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "hashmap.h"
+#include "bit_ops.h"
+#include "dlib.h"
+#include "vector.h"
+
+/*
+ * Dedup image layout (Little endian):
+ * 0x0    Magic "RVVM_BDV"
+ * 0x8    Version (1)
+ * 0xC    Chunk size bits
+ * 0x10   Image size
+ * 0x18   Chunk map offset
+ * 0x20   Compression codec for new chunks
+ * 0x40   Chunk table extent offsets
+ *
+ * Chunk map holds a 32-bit chunk ID for each guest chunk, ID 0 is a zero chunk.
+ * Chunk table extent N holds (BDV_EXTENT_BASE << N) entries of 32 bytes:
+ * 0x0    Data offset
+ * 0x8    Content hash
+ * 0x10   Stored size
+ * 0x14   Reference count
+ * 0x18   Codec
+ *
+ * Chunk data is stored at the end of image, aligned to BDV_DATA_ALIGN.
+ * Released chunks become holes in the host file, their IDs are reused.
+ * Holes are refilled by new chunk data while the image stays open.
+ */
+
+#define BDV_MAGIC        "RVVM_BDV"
+#define BDV_VERSION      1
+#define BDV_HEADER_SIZE  0x1000
+#define BDV_EXTENT_TABLE 0x40
+#define BDV_EXTENTS      32
+#define BDV_EXTENT_BASE  1024
+#define BDV_ENTRY_SIZE   32
+#define BDV_DATA_ALIGN   0x1000
+#define BDV_CHUNK_BITS   16
+
+#define BDV_CODEC_NONE 0
+#define BDV_CODEC_LZ4  1
+#define BDV_CODEC_ZSTD 2
+
+// Decompressed chunks kept in memory
+#define BDV_CACHE_SIZE 64
+
+typedef struct {
+    uint64_t offset;
+    uint64_t hash;
+    uint32_t size;
+    uint32_t refs;
+    uint32_t codec;
+} bdv_chunk_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} bdv_hole_t;
+
+typedef struct {
+    uint32_t id; // Chunk ID, 0 for an empty slot
+    uint64_t used;
+    uint8_t* data;
+} bdv_cache_t;
+
+typedef struct {
+    rvfile_t*    file;
+    spinlock_t   lock;
+    hashmap_t    index;  // Content hash -> Chunk ID
+    uint32_t*    map;    // Guest chunk -> Chunk ID
+    bdv_chunk_t* extents[BDV_EXTENTS];
+    uint64_t     extent_offsets[BDV_EXTENTS];
+    uint32_t*    free_ids;
+    size_t       free_count;
+    vector_t(bdv_hole_t) holes; // Space of freed chunk data, reused for new data
+    uint32_t     next_id;
+
+    uint64_t size;
+    uint64_t map_offset;
+    uint64_t alloc_offset; // Chunk data and tables are allocated at the end of image
+    uint64_t lru_clock;
+    uint32_t chunk_bits;
+    uint32_t chunk_size;
+    uint32_t codec;
+
+    uint8_t* buffer;  // Chunk contents being written
+    uint8_t* cbuffer; // Compressed chunk
+
+    bdv_cache_t cache[BDV_CACHE_SIZE];
+} bdv_image_t;
+
+/*
+ * Compression codecs, loaded dynamically
+ */
+
+static int (*lz4_compress)(const char* src, char* dst, int src_size, int dst_cap) = NULL;
+static int (*lz4_decompress)(const char* src, char* dst, int src_size, int dst_cap) = NULL;
+static size_t (*zstd_compress)(void* dst, size_t dst_cap, const void* src, size_t src_size, int level) = NULL;
+static size_t (*zstd_decompress)(void* dst, size_t dst_cap, const void* src, size_t src_size) = NULL;
+static unsigned (*zstd_is_error)(size_t code) = NULL;
+
+static dlib_ctx_t* bdv_open_lib(const char* name, const char* soname)
+{
+    dlib_ctx_t* lib = dlib_open(name, DLIB_NAME_PROBE);
+    return lib ? lib : dlib_open(soname, 0);
+}
+
+static void bdv_load_codecs(void)
+{
+    dlib_ctx_t* liblz4 = bdv_open_lib("lz4", "liblz4.so.1");
+    lz4_compress = dlib_resolve(liblz4, "LZ4_compress_default");
+    lz4_decompress = dlib_resolve(liblz4, "LZ4_decompress_safe");
+    dlib_close(liblz4);
+
+    dlib_ctx_t* libzstd = bdv_open_lib("zstd", "libzstd.so.1");
+    zstd_compress = dlib_resolve(libzstd, "ZSTD_compress");
+    zstd_decompress = dlib_resolve(libzstd, "ZSTD_decompress");
+    zstd_is_error = dlib_resolve(libzstd, "ZSTD_isError");
+    dlib_close(libzstd);
+}
+
+static bool bdv_codec_available(uint32_t codec)
+{
+    DO_ONCE(bdv_load_codecs());
+    switch (codec) {
+        case BDV_CODEC_NONE: return true;
+        case BDV_CODEC_LZ4:  return lz4_compress && lz4_decompress;
+        case BDV_CODEC_ZSTD: return zstd_compress && zstd_decompress && zstd_is_error;
+        default: return false;
+    }
+}
+
+// Returns compressed size, or 0 if the chunk doesn't compress
+static size_t bdv_compress(uint32_t codec, void* dst, const void* src, size_t size)
+{
+    if (codec == BDV_CODEC_LZ4) {
+        int ret = lz4_compress(src, dst, size, size - 1);
+        return (ret > 0) ? ret : 0;
+    } else if (codec == BDV_CODEC_ZSTD) {
+        size_t ret = zstd_compress(dst, size - 1, src, size, 3);
+        return zstd_is_error(ret) ? 0 : ret;
+    }
+    return 0;
+}
+
+static bool bdv_decompress(uint32_t codec, void* dst, size_t dst_size, const void* src, size_t size)
+{
+    if (codec == BDV_CODEC_LZ4 && bdv_codec_available(codec)) {
+        return lz4_decompress(src, dst, size, dst_size) == (int)dst_size;
+    } else if (codec == BDV_CODEC_ZSTD && bdv_codec_available(codec)) {
+        return zstd_decompress(dst, dst_size, src, size) == dst_size;
+    }
+    return false;
+}
+
+static uint32_t bdv_codec_by_name(const char* name)
+{
+    if (name && rvvm_strcmp(name, "lz4")) return BDV_CODEC_LZ4;
+    if (name && rvvm_strcmp(name, "zstd")) return BDV_CODEC_ZSTD;
+    return BDV_CODEC_NONE;
+}
+
+/*
+ * Chunk table
+ */
+
+static uint64_t bdv_hash(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i += 8) {
+        hash = (hash ^ read_uint64_le_m(data + i)) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    hash ^= hash >> 32;
+    return hash * 0xD6E8FEB86659FD93ULL;
+}
+
+static bool bdv_is_zero(const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i += 8) {
+        if (read_uint64_le_m(data + i)) return false;
+    }
+    return true;
+}
+
+static inline uint32_t bdv_extent_of(uint32_t id)
+{
+    return 63 - bit_clz64((id / BDV_EXTENT_BASE) + 1);
+}
+
+static inline size_t bdv_extent_entries(uint32_t extent)
+{
+    return (size_t)BDV_EXTENT_BASE << extent;
+}
+
+static inline size_t bdv_extent_index(uint32_t id, uint32_t extent)
+{
+    return id - BDV_EXTENT_BASE * ((1ULL << extent) - 1);
+}
+
+static bdv_chunk_t* bdv_get_chunk(bdv_image_t* bdv, uint32_t id)
+{
+    uint32_t extent = bdv_extent_of(id);
+    if (extent >= BDV_EXTENTS || !bdv->extents[extent]) {
+        return NULL;
+    }
+    return &bdv->extents[extent][bdv_extent_index(id, extent)];
+}
+
+static bool bdv_write_chunk_entry(bdv_image_t* bdv, uint32_t id)
+{
+    uint32_t extent = bdv_extent_of(id);
+    const bdv_chunk_t* chunk = bdv_get_chunk(bdv, id);
+    uint8_t entry[BDV_ENTRY_SIZE] = {0};
+    write_uint64_le_m(entry, chunk->offset);
+    write_uint64_le_m(entry + 0x8, chunk->hash);
+    write_uint32_le_m(entry + 0x10, chunk->size);
+    write_uint32_le_m(entry + 0x14, chunk->refs);
+    write_uint32_le_m(entry + 0x18, chunk->codec);
+    uint64_t offset = bdv->extent_offsets[extent] + bdv_extent_index(id, extent) * BDV_ENTRY_SIZE;
+    return rvwrite(bdv->file, entry, sizeof(entry), offset) == sizeof(entry);
+}
+
+static uint64_t bdv_alloc_space(bdv_image_t* bdv, uint64_t size)
+{
+    uint64_t offset = bdv->alloc_offset;
+    bdv->alloc_offset = align_size_up(offset + size, BDV_DATA_ALIGN);
+    return offset;
+}
+
+// Allocate space for chunk data, prefer holes left by freed chunks
+static uint64_t bdv_alloc_data(bdv_image_t* bdv, uint64_t size)
+{
+    uint64_t space = align_size_up(size, BDV_DATA_ALIGN);
+    vector_foreach_back(bdv->holes, i) {
+        bdv_hole_t* hole = &vector_at(bdv->holes, i);
+        if (hole->size >= space) {
+            uint64_t offset = hole->offset;
+            hole->offset += space;
+            hole->size -= space;
+            if (!hole->size) {
+                vector_erase(bdv->holes, i);
+            }
+            return offset;
+        }
+    }
+    return bdv_alloc_space(bdv, size);
+}
+
+// Free chunk data space, nothing may reference it on disk anymore
+static void bdv_free_data(bdv_image_t* bdv, uint64_t offset, uint64_t size)
+{
+    bdv_hole_t hole = {
+        .offset = offset,
+        .size = align_size_up(size, BDV_DATA_ALIGN),
+    };
+    if (hole.size) {
+        rvtrim(bdv->file, hole.offset, hole.size);
+        vector_push_back(bdv->holes, hole);
+    }
+}
+
+static uint32_t bdv_alloc_id(bdv_image_t* bdv)
+{
+    if (bdv->free_count) {
+        return bdv->free_ids[--bdv->free_count];
+    }
+    uint32_t id = bdv->next_id;
+    uint32_t extent = bdv_extent_of(id);
+    if (extent >= BDV_EXTENTS || id == 0xFFFFFFFFU) {
+        rvvm_error("Dedup image chunk table is full");
+        return 0;
+    }
+    if (!bdv->extents[extent]) {
+        // Allocate the next chunk table extent, it's sparse until used
+        size_t entries = bdv_extent_entries(extent);
+        uint64_t offset = bdv_alloc_space(bdv, entries * BDV_ENTRY_SIZE);
+        uint8_t tmp[8] = {0};
+        write_uint64_le_m(tmp, offset);
+        if ((rvfilesize(bdv->file) < bdv->alloc_offset && !rvtruncate(bdv->file, bdv->alloc_offset))
+         || rvwrite(bdv->file, tmp, sizeof(tmp), BDV_EXTENT_TABLE + (extent << 3)) != sizeof(tmp)) {
+            rvvm_error("Failed to grow dedup image chunk table");
+            return 0;
+        }
+        bdv->extents[extent] = safe_new_arr(bdv_chunk_t, entries);
+        bdv->extent_offsets[extent] = offset;
+    }
+    bdv->next_id++;
+    return id;
+}
+
+/*
+ * Chunk cache
+ */
+
+static void bdv_cache_drop(bdv_image_t* bdv, uint32_t id)
+{
+    for (size_t i = 0; i < BDV_CACHE_SIZE; ++i) {
+        if (bdv->cache[i].id == id) {
+            bdv->cache[i].id = 0;
+            bdv->cache[i].used = 0;
+        }
+    }
+}
+
+static const uint8_t* bdv_cache_get(bdv_image_t* bdv, uint32_t id)
+{
+    bdv_cache_t* victim = &bdv->cache[0];
+    for (size_t i = 0; i < BDV_CACHE_SIZE; ++i) {
+        if (bdv->cache[i].id == id) {
+            bdv->cache[i].used = ++bdv->lru_clock;
+            return bdv->cache[i].data;
+        }
+        if (bdv->cache[i].used < victim->used) {
+            victim = &bdv->cache[i];
+        }
+    }
+    // Evict the least recently used chunk
+    const bdv_chunk_t* chunk = bdv_get_chunk(bdv, id);
+    if (!victim->data) {
+        victim->data = safe_malloc(bdv->chunk_size);
+    }
+    victim->id = 0;
+    victim->used = 0;
+    if (chunk->codec == BDV_CODEC_NONE) {
+        if (rvread(bdv->file, victim->data, bdv->chunk_size, chunk->offset) != bdv->chunk_size) {
+            return NULL;
+        }
+    } else if (chunk->size >= bdv->chunk_size
+            || rvread(bdv->file, bdv->cbuffer, chunk->size, chunk->offset) != chunk->size
+            || !bdv_decompress(chunk->codec, victim->data, bdv->chunk_size, bdv->cbuffer, chunk->size)) {
+        rvvm_error("Failed to decompress dedup image chunk %u", id);
+        return NULL;
+    }
+    victim->id = id;
+    victim->used = ++bdv->lru_clock;
+    return victim->data;
+}
+
+/*
+ * Chunk management
+ */
+
+static void bdv_release_chunk(bdv_image_t* bdv, uint32_t id)
+{
+    bdv_chunk_t* chunk = bdv_get_chunk(bdv, id);
+    if (!chunk || !chunk->refs) {
+        rvvm_warn("Dedup image chunk %u is already free", id);
+        return;
+    }
+    chunk->refs--;
+    bdv_write_chunk_entry(bdv, id);
+    if (chunk->refs == 0) {
+        if (hashmap_get(&bdv->index, chunk->hash) == id) {
+            hashmap_remove(&bdv->index, chunk->hash);
+        }
+        bdv_free_data(bdv, chunk->offset, chunk->size);
+        bdv_cache_drop(bdv, id);
+        bdv->free_ids[bdv->free_count++] = id;
+    }
+}
+
+// Store chunk data into newly allocated space, the chunk entry is updated by the caller
+static bool bdv_store_data(bdv_image_t* bdv, bdv_chunk_t* chunk, const uint8_t* data)
+{
+    size_t size = bdv->chunk_size;
+    uint32_t codec = BDV_CODEC_NONE;
+    if (bdv->codec != BDV_CODEC_NONE) {
+        size_t compressed = bdv_compress(bdv->codec, bdv->cbuffer, data, bdv->chunk_size);
+        if (compressed) {
+            data = bdv->cbuffer;
+            size = compressed;
+            codec = bdv->codec;
+        }
+    }
+    chunk->offset = bdv_alloc_data(bdv, size);
+    chunk->size = size;
+    chunk->codec = codec;
+    return rvwrite(bdv->file, data, size, chunk->offset) == size;
+}
+
+// Write whole guest chunk contents, caller holds the lock
+static bool bdv_write_chunk(bdv_image_t* bdv, uint64_t index, const uint8_t* data)
+{
+    uint32_t old_id = bdv->map[index];
+    uint32_t id = 0;
+    if (!bdv_is_zero(data, bdv->chunk_size)) {
+        uint64_t hash = bdv_hash(data, bdv->chunk_size);
+        id = hashmap_get(&bdv->index, hash);
+        if (id) {
+            // Verify the match, hash collisions are stored separately
+            const uint8_t* match = bdv_cache_get(bdv, id);
+            if (!match) {
+                return false;
+            }
+            if (memcmp(match, data, bdv->chunk_size)) {
+                id = 0;
+            } else if (id == old_id) {
+                return true;
+            }
+        }
+        if (id) {
+            bdv_chunk_t* chunk = bdv_get_chunk(bdv, id);
+            chunk->refs++;
+            if (!bdv_write_chunk_entry(bdv, id)) {
+                return false;
+            }
+        } else if (old_id && bdv_get_chunk(bdv, old_id)->refs == 1) {
+            // Rewrite an exclusively owned chunk. New data goes to a new location and the
+            // entry is switched afterwards, so the old contents stay readable on a crash
+            bdv_chunk_t* chunk = bdv_get_chunk(bdv, old_id);
+            bdv_chunk_t old_chunk = *chunk;
+            chunk->hash = hash;
+            if (!bdv_store_data(bdv, chunk, data)) {
+                bdv_free_data(bdv, chunk->offset, chunk->size);
+                *chunk = old_chunk;
+                return false;
+            }
+            if (!bdv_write_chunk_entry(bdv, old_id)) {
+                // Entry may point to either copy now, keep both
+                *chunk = old_chunk;
+                return false;
+            }
+            bdv_free_data(bdv, old_chunk.offset, old_chunk.size);
+            if (hashmap_get(&bdv->index, old_chunk.hash) == old_id) {
+                hashmap_remove(&bdv->index, old_chunk.hash);
+            }
+            bdv_cache_drop(bdv, old_id);
+            if (!hashmap_get(&bdv->index, hash)) {
+                hashmap_put(&bdv->index, hash, old_id);
+            }
+            return true;
+        } else {
+            id = bdv_alloc_id(bdv);
+            if (!id) {
+                return false;
+            }
+            bdv_chunk_t* chunk = bdv_get_chunk(bdv, id);
+            chunk->hash = hash;
+            chunk->refs = 1;
+            // Data must hit the image before the chunk entry
+            if (!bdv_store_data(bdv, chunk, data) || !bdv_write_chunk_entry(bdv, id)) {
+                chunk->refs = 0;
+                bdv->free_ids[bdv->free_count++] = id;
+                return false;
+            }
+            if (!hashmap_get(&bdv->index, hash)) {
+                hashmap_put(&bdv->index, hash, id);
+            }
+        }
+    } else if (!old_id) {
+        return true;
+    }
+    uint8_t tmp[4] = {0};
+    write_uint32_le_m(tmp, id);
+    if (rvwrite(bdv->file, tmp, sizeof(tmp), bdv->map_offset + (index << 2)) != sizeof(tmp)) {
+        return false;
+    }
+    bdv->map[index] = id;
+    if (old_id) {
+        bdv_release_chunk(bdv, old_id);
+    }
+    return true;
+}
+
+/*
+ * Block device interface
+ */
+
+static void bdv_close(void* dev)
+{
+    bdv_image_t* bdv = dev;
+    for (size_t i = 0; i < BDV_EXTENTS; ++i) {
+        free(bdv->extents[i]);
+    }
+    for (size_t i = 0; i < BDV_CACHE_SIZE; ++i) {
+        free(bdv->cache[i].data);
+    }
+    hashmap_destroy(&bdv->index);
+    rvclose(bdv->file);
+    free(bdv->map);
+    free(bdv->free_ids);
+    vector_free(bdv->holes);
+    free(bdv->buffer);
+    free(bdv->cbuffer);
+    free(bdv);
+}
+
+static size_t bdv_read(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    bdv_image_t* bdv = dev;
+    uint8_t* buffer = dst;
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = offset + done;
+        size_t chunk_off = pos & (bdv->chunk_size - 1);
+        size_t len = EVAL_MIN(size - done, bdv->chunk_size - chunk_off);
+        spin_lock_slow(&bdv->lock);
+        uint32_t id = bdv->map[pos >> bdv->chunk_bits];
+        const bdv_chunk_t* chunk = id ? bdv_get_chunk(bdv, id) : NULL;
+        if (!id) {
+            spin_unlock(&bdv->lock);
+            memset(buffer + done, 0, len);
+        } else if (chunk->codec == BDV_CODEC_NONE) {
+            // Coalesce contiguous uncompressed chunks into a single read
+            uint64_t host = chunk->offset + chunk_off;
+            while (done + len < size) {
+                uint32_t next_id = bdv->map[(pos + len) >> bdv->chunk_bits];
+                const bdv_chunk_t* next = next_id ? bdv_get_chunk(bdv, next_id) : NULL;
+                if (!next || next->codec != BDV_CODEC_NONE || next->offset != host + len) {
+                    break;
+                }
+                len += EVAL_MIN(size - done - len, bdv->chunk_size);
+            }
+            spin_unlock(&bdv->lock);
+            if (rvread(bdv->file, buffer + done, len, host) != len) {
+                break;
+            }
+        } else {
+            const uint8_t* data = bdv_cache_get(bdv, id);
+            if (data) {
+                memcpy(buffer + done, data + chunk_off, len);
+            }
+            spin_unlock(&bdv->lock);
+            if (!data) {
+                break;
+            }
+        }
+        done += len;
+    }
+    return done;
+}
+
+static size_t bdv_write(void* dev, const void* src, size_t size, uint64_t offset)
+{
+    bdv_image_t* bdv = dev;
+    const uint8_t* buffer = src;
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint64_t index = pos >> bdv->chunk_bits;
+        size_t chunk_off = pos & (bdv->chunk_size - 1);
+        size_t len = EVAL_MIN(size - done, bdv->chunk_size - chunk_off);
+        const uint8_t* data = buffer + done;
+        bool ret = true;
+        spin_lock_slow(&bdv->lock);
+        if (len != bdv->chunk_size) {
+            // Merge partial write with previous chunk contents
+            uint32_t id = bdv->map[index];
+            const uint8_t* prev = id ? bdv_cache_get(bdv, id) : NULL;
+            if (prev) {
+                memcpy(bdv->buffer, prev, bdv->chunk_size);
+            } else {
+                memset(bdv->buffer, 0, bdv->chunk_size);
+                ret = !id;
+            }
+            memcpy(bdv->buffer + chunk_off, data, len);
+            data = bdv->buffer;
+        }
+        ret = ret && bdv_write_chunk(bdv, index, data);
+        spin_unlock(&bdv->lock);
+        if (!ret) {
+            break;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static bool bdv_trim(void* dev, uint64_t offset, uint64_t size)
+{
+    bdv_image_t* bdv = dev;
+    void* zeroes = safe_calloc(bdv->chunk_size, 1);
+    bool ret = true;
+    while (size && ret) {
+        size_t len = EVAL_MIN(size, bdv->chunk_size - (offset & (bdv->chunk_size - 1)));
+        // Whole chunks are dropped from the map, partial chunks are zeroed
+        ret = bdv_write(bdv, zeroes, len, offset) == len;
+        offset += len;
+        size -= len;
+    }
+    free(zeroes);
+    return ret;
+}
+
+static bool bdv_sync(void* dev)
+{
+    bdv_image_t* bdv = dev;
+    return rvfsync(bdv->file);
+}
+
+static const blkdev_type_t blkdev_type_dedup = {
+    .name  = "blk-dedup",
+    .close = bdv_close,
+    .read  = bdv_read,
+    .write = bdv_write,
+    .trim  = bdv_trim,
+    .sync  = bdv_sync,
+};
+
+/*
+ * Image management
+ */
+
+static bool bdv_load(bdv_image_t* bdv, const char* filename)
+{
+    uint8_t header[BDV_HEADER_SIZE] = {0};
+    if (rvread(bdv->file, header, sizeof(header), 0) != sizeof(header) || memcmp(header, BDV_MAGIC, 8)) {
+        rvvm_error("%s is not a dedup image", filename);
+        return false;
+    }
+    bdv->chunk_bits = read_uint32_le_m(header + 0xC);
+    bdv->size = read_uint64_le_m(header + 0x10);
+    bdv->map_offset = read_uint64_le_m(header + 0x18);
+    bdv->codec = read_uint32_le_m(header + 0x20);
+    if (read_uint32_le_m(header + 0x8) != BDV_VERSION || bdv->chunk_bits < 12 || bdv->chunk_bits > 20
+     || !bdv->size || (bdv->size >> bdv->chunk_bits) >= 0xFFFFFFFFU) {
+        rvvm_error("Invalid dedup image %s", filename);
+        return false;
+    }
+    if (!bdv_codec_available(bdv->codec)) {
+        rvvm_error("Dedup image %s needs %s library", filename, bdv->codec == BDV_CODEC_LZ4 ? "lz4" : "zstd");
+        return false;
+    }
+    bdv->chunk_size = 1U << bdv->chunk_bits;
+    bdv->alloc_offset = align_size_up(rvfilesize(bdv->file), BDV_DATA_ALIGN);
+
+    // Load chunk map
+    size_t chunks = (bdv->size + bdv->chunk_size - 1) >> bdv->chunk_bits;
+    bdv->map = safe_new_arr(uint32_t, chunks);
+    if (rvread(bdv->file, bdv->map, chunks << 2, bdv->map_offset) != (chunks << 2)) {
+        rvvm_error("Failed to read dedup image chunk map");
+        return false;
+    }
+    for (size_t i = 0; i < chunks; ++i) {
+        bdv->map[i] = read_uint32_le_m(&bdv->map[i]);
+    }
+
+    // Load chunk table, rebuild the content index
+    size_t total = 0;
+    uint8_t* table = NULL;
+    for (uint32_t extent = 0; extent < BDV_EXTENTS; ++extent) {
+        uint64_t offset = read_uint64_le_m(header + BDV_EXTENT_TABLE + (extent << 3));
+        size_t entries = bdv_extent_entries(extent);
+        if (!offset) {
+            break;
+        }
+        table = safe_realloc(table, entries * BDV_ENTRY_SIZE);
+        if (rvread(bdv->file, table, entries * BDV_ENTRY_SIZE, offset) != entries * BDV_ENTRY_SIZE) {
+            rvvm_error("Failed to read dedup image chunk table");
+            free(table);
+            return false;
+        }
+        bdv->extents[extent] = safe_new_arr(bdv_chunk_t, entries);
+        bdv->extent_offsets[extent] = offset;
+        for (size_t i = 0; i < entries; ++i) {
+            bdv_chunk_t* chunk = &bdv->extents[extent][i];
+            chunk->offset = read_uint64_le_m(table + i * BDV_ENTRY_SIZE);
+            chunk->hash = read_uint64_le_m(table + i * BDV_ENTRY_SIZE + 0x8);
+            chunk->size = read_uint32_le_m(table + i * BDV_ENTRY_SIZE + 0x10);
+            chunk->refs = read_uint32_le_m(table + i * BDV_ENTRY_SIZE + 0x14);
+            chunk->codec = read_uint32_le_m(table + i * BDV_ENTRY_SIZE + 0x18);
+        }
+        total += entries;
+    }
+    free(table);
+
+    // Each chunk write frees at most one ID, so the free list never exceeds the table
+    bdv->free_ids = safe_new_arr(uint32_t, total + chunks + 1);
+    hashmap_init(&bdv->index, total);
+    bdv->next_id = 1;
+    for (uint32_t id = 1; id < total; ++id) {
+        const bdv_chunk_t* chunk = bdv_get_chunk(bdv, id);
+        if (chunk->refs) {
+            hashmap_put(&bdv->index, chunk->hash, id);
+            bdv->next_id = id + 1;
+        }
+    }
+    for (uint32_t id = 1; id < bdv->next_id; ++id) {
+        if (!bdv_get_chunk(bdv, id)->refs) {
+            bdv->free_ids[bdv->free_count++] = id;
+        }
+    }
+    for (size_t i = 0; i < chunks; ++i) {
+        if (bdv->map[i] && (bdv->map[i] >= bdv->next_id || !bdv_get_chunk(bdv, bdv->map[i])->refs)) {
+            rvvm_error("Dedup image %s is corrupted", filename);
+            return false;
+        }
+    }
+    return true;
+}
+
+blkdev_t* blk_dedup_open(const char* filename, uint8_t filemode)
+{
+    rvfile_t* file = rvopen(filename, filemode);
+    if (!file) return NULL;
+    bdv_image_t* bdv = safe_new_obj(bdv_image_t);
+    bdv->file = file;
+    spin_init(&bdv->lock);
+    if (!bdv_load(bdv, filename)) {
+        bdv_close(bdv);
+        return NULL;
+    }
+    bdv->buffer = safe_malloc(bdv->chunk_size);
+    bdv->cbuffer = safe_malloc(bdv->chunk_size);
+
+    blkdev_t* dev = safe_new_obj(blkdev_t);
+    dev->type = &blkdev_type_dedup;
+    dev->size = bdv->size;
+    dev->data = bdv;
+    return dev;
+}
+
+static bool bdv_import(blkdev_t* dst, const char* source)
+{
+    blkdev_t* src = blk_open(source, 0);
+    if (!src) {
+        rvvm_error("Failed to open image %s", source);
+        return false;
+    }
+    size_t buf_size = 0x100000;
+    void* buffer = safe_malloc(buf_size);
+    bool ret = true;
+    for (uint64_t pos = 0; pos < blk_getsize(src) && ret; pos += buf_size) {
+        size_t len = EVAL_MIN(buf_size, blk_getsize(src) - pos);
+        ret = blk_read(src, buffer, len, pos) == len && blk_write(dst, buffer, len, pos) == len;
+    }
+    free(buffer);
+    blk_close(src);
+    return ret;
+}
+
+bool blk_dedup_create(const char* filename, uint64_t size, const char* source, const char* compress)
+{
+    uint32_t codec = bdv_codec_by_name(compress);
+    if (compress && codec == BDV_CODEC_NONE) {
+        rvvm_error("Unknown compression %s, expected lz4 or zstd", compress);
+        return false;
+    }
+    if (!bdv_codec_available(codec)) {
+        rvvm_error("Failed to load %s library", compress);
+        return false;
+    }
+    if (source) {
+        blkdev_t* src = blk_open(source, 0);
+        if (!src) {
+            rvvm_error("Failed to open image %s", source);
+            return false;
+        }
+        size = blk_getsize(src);
+        blk_close(src);
+    }
+    if (!size) {
+        rvvm_error("Invalid dedup image size");
+        return false;
+    }
+    // Fail if the image already exists
+    rvfile_t* file = rvopen(filename, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    if (!file) {
+        rvvm_error("Failed to create dedup image %s", filename);
+        return false;
+    }
+    uint64_t chunks = (size + (1ULL << BDV_CHUNK_BITS) - 1) >> BDV_CHUNK_BITS;
+    uint8_t header[BDV_HEADER_SIZE] = {0};
+    memcpy(header, BDV_MAGIC, 8);
+    write_uint32_le_m(header + 0x8, BDV_VERSION);
+    write_uint32_le_m(header + 0xC, BDV_CHUNK_BITS);
+    write_uint64_le_m(header + 0x10, size);
+    write_uint64_le_m(header + 0x18, BDV_HEADER_SIZE);
+    write_uint32_le_m(header + 0x20, codec);
+    bool ret = rvwrite(file, header, sizeof(header), 0) == sizeof(header)
+            && rvtruncate(file, align_size_up(BDV_HEADER_SIZE + (chunks << 2), BDV_DATA_ALIGN));
+    rvclose(file);
+    if (ret && source) {
+        blkdev_t* dev = blk_dedup_open(filename, RVFILE_RW | RVFILE_EXCL);
+        ret = dev && bdv_import(dev, source) && blk_sync(dev);
+        blk_close(dev);
+    }
+    if (!ret) {
+        rvvm_error("Failed to create dedup image %s", filename);
+    }
+    return ret;
+}
@@ -49,6 +49,13 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include <sys/syscall.h> // For SYS_fspacectl()
 #endif
 
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+// Use preadv()/pwritev()
+#include <sys/uio.h>
+#define RVFILE_VECTORED_IMPL
+#define RVFILE_MAX_IOV 1024
+#endif
+
 static bool try_lock_fd(int fd)
 {
     struct flock flk = {
@@ -86,10 +93,15 @@ typedef struct {
 #define RVFILE_POS_WRITE   0x2
 #endif
 
+#include <stdio.h> // For remove()
+
 // RVVM internal headers come after system headers because of safe_free()
 #include "mem_ops.h"
 #include "utils.h"
 #include "spinlock.h"
+#include "vma_ops.h"
+#include "threading.h"
+#include "rvtimer.h"
 
 struct blk_io_rvfile {
     uint64_t size;
@@ -255,6 +267,22 @@ rvfile_t* rvopen(const char* filepath, uint8_t filemode)
 #endif
 }
 
+rvfile_t* rvopen_anon(uint64_t size)
+{
+#if defined(POSIX_FILE_IMPL)
+    int fd = vma_anon_memfd(size);
+    if (fd < 0) return NULL;
+
+    rvfile_t* file = safe_new_obj(rvfile_t);
+    file->size = lseek(fd, 0, SEEK_END);
+    file->fd = fd;
+    return file;
+#else
+    UNUSED(size);
+    return NULL;
+#endif
+}
+
 void rvclose(rvfile_t* file)
 {
     if (!file) return;
@@ -368,6 +396,83 @@ size_t rvwrite(rvfile_t* file, const void* src, size_t size, uint64_t offset)
     return ret;
 }
 
+#ifdef RVFILE_VECTORED_IMPL
+
+BUILD_ASSERT(sizeof(blk_iovec_t) == sizeof(struct iovec));
+BUILD_ASSERT(offsetof(blk_iovec_t, buffer) == offsetof(struct iovec, iov_base));
+BUILD_ASSERT(offsetof(blk_iovec_t, size) == offsetof(struct iovec, iov_len));
+
+static size_t rvfile_vectored(rvfile_t* file, const blk_iovec_t* iov, size_t iov_count, uint64_t offset, bool write)
+{
+    size_t ret = 0;
+    while (iov_count) {
+        int count = EVAL_MIN(iov_count, RVFILE_MAX_IOV);
+        ssize_t tmp = write ? pwritev(file->fd, (const struct iovec*)iov, count, offset + ret)
+                            : preadv(file->fd, (const struct iovec*)iov, count, offset + ret);
+        if (tmp < 0 && errno == EINTR) {
+            continue;
+        }
+        if (tmp <= 0) {
+            // IO error, or end of file
+            break;
+        }
+        ret += tmp;
+        // Skip processed buffers
+        while (iov_count && (size_t)tmp >= iov->size) {
+            tmp -= iov->size;
+            iov++;
+            iov_count--;
+        }
+        if (tmp) {
+            // Finish a partially processed buffer
+            size_t size = iov->size - tmp;
+            uint8_t* buffer = ((uint8_t*)iov->buffer) + tmp;
+            size_t done = write ? rvwrite(file, buffer, size, offset + ret) : rvread(file, buffer, size, offset + ret);
+            ret += done;
+            if (done != size) break;
+            iov++;
+            iov_count--;
+        }
+    }
+    return ret;
+}
+
+#endif
+
+size_t rvreadv(rvfile_t* file, const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    if (!file || offset == RVFILE_CUR) return 0;
+#ifdef RVFILE_VECTORED_IMPL
+    return rvfile_vectored(file, iov, iov_count, offset, false);
+#else
+    size_t ret = 0;
+    for (size_t i = 0; i < iov_count; ++i) {
+        size_t tmp = rvread(file, iov[i].buffer, iov[i].size, offset + ret);
+        ret += tmp;
+        if (tmp != iov[i].size) break;
+    }
+    return ret;
+#endif
+}
+
+size_t rvwritev(rvfile_t* file, const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    if (!file || offset == RVFILE_CUR) return 0;
+#ifdef RVFILE_VECTORED_IMPL
+    size_t ret = rvfile_vectored(file, iov, iov_count, offset, true);
+    rvfile_grow_internal(file, offset + ret);
+    return ret;
+#else
+    size_t ret = 0;
+    for (size_t i = 0; i < iov_count; ++i) {
+        size_t tmp = rvwrite(file, iov[i].buffer, iov[i].size, offset + ret);
+        ret += tmp;
+        if (tmp != iov[i].size) break;
+    }
+    return ret;
+#endif
+}
+
 bool rvtrim(rvfile_t* file, uint64_t offset, uint64_t size)
 {
     if (!file) return false;
@@ -499,6 +604,21 @@ bool rvfallocate(rvfile_t* file, uint64_t length)
     return true;
 }
 
+bool rvpath_absolute(char* dst, size_t size, const char* path)
+{
+#if defined(POSIX_FILE_IMPL)
+    char* real = realpath(path, NULL);
+    bool ret = real && rvvm_strlcpy(dst, real, size) < size;
+    free(real);
+    return ret;
+#elif defined(_WIN32) && !defined(UNDER_CE)
+    return _fullpath(dst, path, size) != NULL;
+#else
+    // No way to resolve the path, use it as is
+    return rvvm_strlcpy(dst, path, size) < size;
+#endif
+}
+
 int rvfile_get_posix_fd(rvfile_t* file)
 {
 #if defined(POSIX_FILE_IMPL)
@@ -547,34 +667,427 @@ static size_t blk_raw_write(void* dev, const void* src, size_t size, uint64_t of
     return rvwrite(file, src, size, offset);
 }
 
+static size_t blk_raw_readv(void* dev, const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    rvfile_t* file = dev;
+    return rvreadv(file, iov, iov_count, offset);
+}
+
+static size_t blk_raw_writev(void* dev, const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    rvfile_t* file = dev;
+    return rvwritev(file, iov, iov_count, offset);
+}
+
 static bool blk_raw_trim(void* dev, uint64_t offset, uint64_t size)
 {
     rvfile_t* file = dev;
     return rvtrim(file, offset, size);
 }
 
+static bool blk_raw_sync(void* dev)
+{
+    rvfile_t* file = dev;
+    return rvfsync(file);
+}
+
+// Each mapping may split a guest RAM VMA, stay well below vm.max_map_count
+#define BLK_MAP_BUDGET 16384
+
+// Recount live VMAs once per this many refused mappings
+#define BLK_MAP_RECOUNT 256
+
+// Estimated VMA count, grows with each mapping until it's recounted
+static uint32_t blk_map_count = 0;
+static uint32_t blk_map_refused = 0;
+
+static bool blk_map_allowed(void)
+{
+    if (atomic_load_uint32_relax(&blk_map_count) < BLK_MAP_BUDGET) {
+        return true;
+    }
+    if (!(atomic_add_uint32(&blk_map_refused, 1) & (BLK_MAP_RECOUNT - 1))) {
+        // Mappings go away with guest RAM or get replaced by later mappings
+        size_t vmas = vma_count();
+        if (vmas) {
+            atomic_store_uint32(&blk_map_count, vmas);
+            return vmas < BLK_MAP_BUDGET;
+        }
+    }
+    return false;
+}
+
+static size_t blk_raw_map(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    rvfile_t* file = dev;
+    size_t page_mask = vma_page_size() - 1;
+    size_t map_size = size & ~page_mask;
+    if (map_size && !(((size_t)dst) & page_mask) && !(offset & page_mask)
+     && blk_map_allowed()) {
+        if (vma_remap_file(dst, map_size, VMA_RDWR, file, offset)) {
+            atomic_add_uint32(&blk_map_count, 1);
+            return map_size;
+        }
+    }
+    return 0;
+}
+
+bool blk_uring_init(void);
+bool blk_uring_submit(int fd, blk_io_req_t* req);
+
+static bool blk_raw_submit(void* dev, blk_io_req_t* req)
+{
+#if defined(POSIX_FILE_IMPL)
+    rvfile_t* file = dev;
+    if (!(req->flags & BLKDEV_IO_MAP)) {
+        return blk_uring_submit(file->fd, req);
+    }
+#else
+    UNUSED(dev);
+    UNUSED(req);
+#endif
+    return false;
+}
+
 // Raw block device implementation
 // Be careful with function prototypes
 static const blkdev_type_t blkdev_type_raw = {
-    .name  = "blk-raw",
-    .close = blk_raw_close,
-    .read  = blk_raw_read,
-    .write = blk_raw_write,
-    .trim  = blk_raw_trim,
+    .name   = "blk-raw",
+    .close  = blk_raw_close,
+    .read   = blk_raw_read,
+    .write  = blk_raw_write,
+    .trim   = blk_raw_trim,
+    .sync   = blk_raw_sync,
+    .readv  = blk_raw_readv,
+    .writev = blk_raw_writev,
+    .submit = blk_raw_submit,
 };
 
-static blkdev_t* blk_raw_open(const char* filename, uint8_t filemode)
+// Read-only image pages are shared between machines via mapping
+static const blkdev_type_t blkdev_type_raw_ro = {
+    .name   = "blk-raw-ro",
+    .close  = blk_raw_close,
+    .read   = blk_raw_read,
+    .write  = blk_raw_write,
+    .trim   = blk_raw_trim,
+    .sync   = blk_raw_sync,
+    .map    = blk_raw_map,
+    .readv  = blk_raw_readv,
+    .writev = blk_raw_writev,
+    .submit = blk_raw_submit,
+};
+
+/*
+ * Direct IO on raw images
+ *
+ * O_DIRECT needs buffers, offsets and sizes aligned to the host sector size.
+ * Aligned transfers go straight to the file, others are staged through a pool
+ * of aligned bounce buffers. Partial sectors of unaligned writes are read back
+ * first, such writes are serialized so they don't lose each other's data.
+ * While a read-modify-write is in flight, aligned writes take the bounce path
+ * as well, so a concurrent write to the same sector is never undone.
+ */
+
+#define BLK_DIRECT_ALIGN  0x1000
+#define BLK_BOUNCE_SIZE   0x100000
+#define BLK_BOUNCE_COUNT  16
+
+// Internal request flag: a native write is counted in blk_direct_t writers
+#define BLK_DIRECT_IO_WRITER 0x80
+
+typedef struct {
+    rvfile_t*  file;
+    spinlock_t lock;
+    uint32_t   writers; // Aligned writes in flight outside of the lock
+    uint32_t   rmw;     // Read-modify-write in flight, set under the lock
+} blk_direct_t;
+
+static void*    blk_bounce_pool[BLK_BOUNCE_COUNT];
+static uint32_t blk_bounce_used;
+
+static uint8_t* blk_bounce_get(void)
+{
+    for (size_t i = 0; i < BLK_BOUNCE_COUNT; ++i) {
+        uint32_t bit = 1U << i;
+        if (!(atomic_or_uint32(&blk_bounce_used, bit) & bit)) {
+            // Claimed a pool slot, allocate its buffer on first use
+            if (blk_bounce_pool[i] == NULL) {
+                blk_bounce_pool[i] = vma_alloc(NULL, BLK_BOUNCE_SIZE, VMA_RDWR);
+            }
+            if (blk_bounce_pool[i]) {
+                return blk_bounce_pool[i];
+            }
+            atomic_and_uint32(&blk_bounce_used, ~bit);
+        }
+    }
+    // Pool exhausted, use a temporary buffer
+    return vma_alloc(NULL, BLK_BOUNCE_SIZE, VMA_RDWR);
+}
+
+static void blk_bounce_put(uint8_t* buffer)
+{
+    for (size_t i = 0; i < BLK_BOUNCE_COUNT; ++i) {
+        if (blk_bounce_pool[i] == buffer) {
+            atomic_and_uint32(&blk_bounce_used, ~(1U << i));
+            return;
+        }
+    }
+    vma_free(buffer, BLK_BOUNCE_SIZE);
+}
+
+static inline bool blk_direct_aligned(uint64_t val)
+{
+    return !(val & (BLK_DIRECT_ALIGN - 1));
+}
+
+static bool blk_direct_iov_aligned(const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    if (!blk_direct_aligned(offset)) {
+        return false;
+    }
+    for (size_t i = 0; i < iov_count; ++i) {
+        if (!blk_direct_aligned((size_t)iov[i].buffer) || !blk_direct_aligned(iov[i].size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copy between a flat buffer and a vector, starting at byte skip of the vector
+static void blk_iov_copy(const blk_iovec_t* iov, size_t iov_count, size_t skip, uint8_t* buffer, size_t size, bool to_iov)
+{
+    for (size_t i = 0; i < iov_count && size; ++i) {
+        if (skip >= iov[i].size) {
+            skip -= iov[i].size;
+            continue;
+        }
+        size_t len = EVAL_MIN(iov[i].size - skip, size);
+        uint8_t* ptr = ((uint8_t*)iov[i].buffer) + skip;
+        if (to_iov) {
+            memcpy(ptr, buffer, len);
+        } else {
+            memcpy(buffer, ptr, len);
+        }
+        buffer += len;
+        size -= len;
+        skip = 0;
+    }
+}
+
+static size_t blk_direct_bounce(blk_direct_t* direct, const blk_iovec_t* iov, size_t iov_count, uint64_t offset, bool write)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < iov_count; ++i) {
+        size += iov[i].size;
+    }
+    uint8_t* bounce = blk_bounce_get();
+    if (bounce == NULL) {
+        return 0;
+    }
+    if (write) {
+        spin_lock_slow(&direct->lock);
+        // Divert new aligned writes here and drain the ones already in flight
+        atomic_store_uint32(&direct->rmw, 1);
+        while (atomic_load_uint32(&direct->writers)) {
+            sleep_ms(1);
+        }
+    }
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint64_t start = pos & ~(uint64_t)(BLK_DIRECT_ALIGN - 1);
+        size_t head = pos - start;
+        size_t len = EVAL_MIN(size - done, BLK_BOUNCE_SIZE - head);
+        size_t window = (head + len + BLK_DIRECT_ALIGN - 1) & ~(size_t)(BLK_DIRECT_ALIGN - 1);
+        if (write) {
+            // Preserve the untouched parts of partially written sectors
+            size_t tail = window - BLK_DIRECT_ALIGN;
+            if (head && rvread(direct->file, bounce, BLK_DIRECT_ALIGN, start) != BLK_DIRECT_ALIGN) {
+                break;
+            }
+            if (!blk_direct_aligned(head + len) && (tail || !head)
+             && rvread(direct->file, bounce + tail, BLK_DIRECT_ALIGN, start + tail) != BLK_DIRECT_ALIGN) {
+                break;
+            }
+            blk_iov_copy(iov, iov_count, done, bounce + head, len, false);
+            if (rvwrite(direct->file, bounce, window, start) != window) {
+                break;
+            }
+        } else {
+            if (rvread(direct->file, bounce, window, start) != window) {
+                break;
+            }
+            blk_iov_copy(iov, iov_count, done, bounce + head, len, true);
+        }
+        done += len;
+    }
+    if (write) {
+        atomic_store_uint32(&direct->rmw, 0);
+        spin_unlock(&direct->lock);
+    }
+    blk_bounce_put(bounce);
+    return done;
+}
+
+static bool blk_direct_write_begin(blk_direct_t* direct)
+{
+    // Pairs with the writers check in blk_direct_bounce(), either side sees the other
+    atomic_add_uint32(&direct->writers, 1);
+    if (atomic_load_uint32(&direct->rmw)) {
+        atomic_sub_uint32(&direct->writers, 1);
+        return false;
+    }
+    return true;
+}
+
+static void blk_direct_write_end(blk_direct_t* direct)
+{
+    atomic_sub_uint32(&direct->writers, 1);
+}
+
+// Release a native write once it completes or is handed over to a worker thread
+static void blk_direct_req_end(blk_io_req_t* req)
+{
+    if (req->flags & BLK_DIRECT_IO_WRITER) {
+        req->flags &= ~BLK_DIRECT_IO_WRITER;
+        blk_direct_write_end(req->dev->data);
+    }
+}
+
+static void blk_direct_close(void* dev)
+{
+    blk_direct_t* direct = dev;
+    rvclose(direct->file);
+    free(direct);
+}
+
+static size_t blk_direct_readv(void* dev, const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    blk_direct_t* direct = dev;
+    if (blk_direct_iov_aligned(iov, iov_count, offset)) {
+        return rvreadv(direct->file, iov, iov_count, offset);
+    }
+    return blk_direct_bounce(direct, iov, iov_count, offset, false);
+}
+
+static size_t blk_direct_writev(void* dev, const blk_iovec_t* iov, size_t iov_count, uint64_t offset)
+{
+    blk_direct_t* direct = dev;
+    if (blk_direct_iov_aligned(iov, iov_count, offset) && blk_direct_write_begin(direct)) {
+        size_t ret = rvwritev(direct->file, iov, iov_count, offset);
+        blk_direct_write_end(direct);
+        return ret;
+    }
+    return blk_direct_bounce(direct, iov, iov_count, offset, true);
+}
+
+static size_t blk_direct_read(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    blk_iovec_t iov = { .buffer = dst, .size = size, };
+    return blk_direct_readv(dev, &iov, 1, offset);
+}
+
+static size_t blk_direct_write(void* dev, const void* src, size_t size, uint64_t offset)
+{
+    blk_iovec_t iov = { .buffer = (void*)src, .size = size, };
+    return blk_direct_writev(dev, &iov, 1, offset);
+}
+
+static bool blk_direct_trim(void* dev, uint64_t offset, uint64_t size)
+{
+    blk_direct_t* direct = dev;
+    return rvtrim(direct->file, offset, size);
+}
+
+static bool blk_direct_sync(void* dev)
+{
+    // O_DIRECT bypasses the page cache, but not the disk write cache
+    blk_direct_t* direct = dev;
+    return rvfsync(direct->file);
+}
+
+static bool blk_direct_submit(void* dev, blk_io_req_t* req)
+{
+#if defined(POSIX_FILE_IMPL)
+    blk_direct_t* direct = dev;
+    if (!blk_direct_iov_aligned(req->iov, req->iov_count, req->offset)) {
+        return false;
+    }
+    if (req->opcode == BLKDEV_IO_WRITE) {
+        // Counted until completion, see blk_direct_req_end()
+        if (!blk_direct_write_begin(direct)) {
+            return false;
+        }
+        req->flags |= BLK_DIRECT_IO_WRITER;
+    }
+    if (blk_uring_submit(direct->file->fd, req)) {
+        return true;
+    }
+    blk_direct_req_end(req);
+#else
+    UNUSED(dev);
+    UNUSED(req);
+#endif
+    return false;
+}
+
+static const blkdev_type_t blkdev_type_raw_direct = {
+    .name   = "blk-raw-direct",
+    .close  = blk_direct_close,
+    .read   = blk_direct_read,
+    .write  = blk_direct_write,
+    .trim   = blk_direct_trim,
+    .sync   = blk_direct_sync,
+    .readv  = blk_direct_readv,
+    .writev = blk_direct_writev,
+    .submit = blk_direct_submit,
+};
+
+static blkdev_t* blk_direct_open(const char* filename, uint8_t filemode)
 {
     rvfile_t* file = rvopen(filename, filemode);
+    if (!file) {
+        return NULL;
+    }
+    if (!blk_direct_aligned(rvfilesize(file))) {
+        rvclose(file);
+        return NULL;
+    }
+    blk_direct_t* direct = safe_new_obj(blk_direct_t);
+    direct->file = file;
+    spin_init(&direct->lock);
+    blkdev_t* dev = safe_new_obj(blkdev_t);
+    dev->type = &blkdev_type_raw_direct;
+    dev->size = rvfilesize(file);
+    dev->data = direct;
+    blk_uring_init();
+    return dev;
+}
+
+static blkdev_t* blk_raw_open(const char* filename, uint8_t filemode)
+{
+    if ((filemode & RVFILE_DIRECT) && (filemode & RVFILE_RW)) {
+        blkdev_t* dev = blk_direct_open(filename, filemode);
+        if (dev) {
+            return dev;
+        }
+        // Host filesystem may not support O_DIRECT (tmpfs), or the image is not sector-sized
+        rvvm_warn("Direct IO is not possible on %s, using host page cache", filename);
+    }
+    rvfile_t* file = rvopen(filename, filemode & ~RVFILE_DIRECT);
     if (!file) return NULL;
     blkdev_t* dev = safe_new_obj(blkdev_t);
-    dev->type = &blkdev_type_raw;
+    dev->type = (filemode & RVFILE_RW) ? &blkdev_type_raw : &blkdev_type_raw_ro;
     dev->size = rvfilesize(file);
     dev->data = file;
+    // Shared IO ring is set up along with the first raw image, not on the submission path
+    blk_uring_init();
     return dev;
 }
 
 blkdev_t* blk_dedup_open(const char* filename, uint8_t filemode);
+blkdev_t* blk_qcow2_open(const char* filename, uint8_t filemode);
+blkdev_t* blk_overlay_open(const char* filename, uint8_t filemode);
 
 static bool check_file_ext(const char* filename, const char* ext)
 {
@@ -588,23 +1101,259 @@ static bool check_file_ext(const char* filename, const char* ext)
     return r && rvvm_strcmp(r, ext);
 }
 
+static uint32_t blk_default_mode = BLKDEV_MODE_WRITEBACK;
+
+void blk_set_default_mode(uint8_t mode)
+{
+    atomic_store_uint32(&blk_default_mode, mode ? mode : BLKDEV_MODE_WRITEBACK);
+}
+
+uint8_t blk_parse_mode(const char* name)
+{
+    if (rvvm_strcmp(name, "writeback")) {
+        return BLKDEV_MODE_WRITEBACK;
+    } else if (rvvm_strcmp(name, "writethrough")) {
+        return BLKDEV_MODE_WRITETHROUGH;
+    } else if (rvvm_strcmp(name, "direct") || rvvm_strcmp(name, "none")) {
+        return BLKDEV_MODE_DIRECT;
+    } else if (rvvm_strcmp(name, "unsafe")) {
+        return BLKDEV_MODE_UNSAFE;
+    }
+    return BLKDEV_MODE_DEFAULT;
+}
+
+static blkdev_t* blk_open_image(const char* filename, uint8_t filemode)
+{
+    if (check_file_ext(filename, ".bdv")) {
+        return blk_dedup_open(filename, filemode);
+    }
+    if (check_file_ext(filename, ".qcow2")) {
+        return blk_qcow2_open(filename, filemode);
+    }
+    if (check_file_ext(filename, ".ovl")) {
+        return blk_overlay_open(filename, filemode);
+    }
+    return blk_raw_open(filename, filemode);
+}
+
 blkdev_t* blk_open(const char* filename, uint8_t opts)
 {
     uint8_t filemode = (opts & BLKDEV_RW) ? (RVFILE_RW | RVFILE_EXCL) : 0;
-    if (check_file_ext(filename, ".bdv")) {
+    uint8_t mode = opts & BLKDEV_MODE_MASK;
+    if (mode == BLKDEV_MODE_DEFAULT) {
+        mode = atomic_load_uint32(&blk_default_mode);
+    }
+    if (mode == BLKDEV_MODE_WRITETHROUGH) {
+        filemode |= RVFILE_SYNC;
+    } else if (mode == BLKDEV_MODE_DIRECT) {
+        if (check_file_ext(filename, ".bdv") || check_file_ext(filename, ".qcow2") || check_file_ext(filename, ".ovl")) {
+            // Image formats do unaligned metadata IO
+            rvvm_warn("Direct IO is only supported on raw images, using host page cache for %s", filename);
+            mode = BLKDEV_MODE_WRITEBACK;
+        } else {
+            filemode |= RVFILE_DIRECT;
+        }
+    }
+    blkdev_t* dev = blk_open_image(filename, filemode);
+    if (dev == NULL) {
         return NULL;
     }
-    if (check_file_ext(filename, ".qcow2")) {
-        rvvm_error("QCOW2 images aren't supported yet");
+    if (mode == BLKDEV_MODE_DIRECT && dev->type != &blkdev_type_raw_direct) {
+        mode = BLKDEV_MODE_WRITEBACK;
+    }
+    dev->mode = mode;
+    if (opts & BLKDEV_CACHE) {
+        // Cache writes through as well when the drive is in writethrough mode
+        dev = blk_cache_create(dev, 0);
+        dev->mode = mode;
+    }
+    blk_stats_register(&dev->stats, filename);
+    return dev;
+}
+
+blkdev_t* blk_open_disk(rvvm_machine_t* machine, const char* filename, uint8_t opts)
+{
+    if (!(opts & BLKDEV_RW) || machine == NULL || !rvvm_get_opt(machine, RVVM_OPT_DISK_OVERLAY)) {
+        return blk_open(filename, opts);
+    }
+    char overlay[256] = {0};
+    if (!blk_overlay_create_temp(overlay, sizeof(overlay), filename)) {
         return NULL;
     }
-    return blk_raw_open(filename, filemode);
+    blkdev_t* dev = blk_open(overlay, opts);
+    // The overlay is only reachable via this handle, hosts which can't unlink open files leave it behind
+    if (remove(overlay) != 0) {
+        rvvm_warn("Failed to remove temporary overlay %s", overlay);
+    } else if (dev) {
+        rvvm_info("Machine writes %s into a private overlay", filename);
+    }
+    return dev;
 }
 
 void blk_close(blkdev_t* dev)
 {
     if (dev) {
+        while (atomic_load_uint32(&dev->inflight)) sleep_ms(1);
+        blk_stats_unregister(&dev->stats);
         dev->type->close(dev->data);
         free(dev);
     }
 }
+
+bool blk_trim_ranges(blkdev_t* dev, blk_range_t* ranges, size_t count, bool zeroes)
+{
+    bool ret = true;
+    // Guests usually send few sorted ranges, insertion sort is fine
+    for (size_t i = 1; i < count; ++i) {
+        blk_range_t range = ranges[i];
+        size_t j = i;
+        for (; j && ranges[j - 1].offset > range.offset; --j) {
+            ranges[j] = ranges[j - 1];
+        }
+        ranges[j] = range;
+    }
+    for (size_t i = 0; i < count;) {
+        uint64_t offset = ranges[i].offset;
+        uint64_t end = offset + ranges[i].size;
+        for (++i; i < count && ranges[i].offset <= end; ++i) {
+            end = EVAL_MAX(end, ranges[i].offset + ranges[i].size);
+        }
+        if (end > offset) {
+            if (zeroes) {
+                ret = blk_write_zeroes(dev, offset, end - offset) && ret;
+            } else {
+                ret = blk_trim(dev, offset, end - offset) && ret;
+            }
+        }
+    }
+    return ret;
+}
+
+bool blk_write_zeroes(blkdev_t* dev, uint64_t offset, uint64_t size)
+{
+    if (blk_trim(dev, offset, size)) {
+        return true;
+    }
+    if (dev == NULL || offset > dev->size || size > dev->size - offset) {
+        return false;
+    }
+    // Discard is not supported by the host, write zeroes explicitly
+    size_t buf_size = EVAL_MIN(size, 0x10000);
+    void* zeroes = safe_calloc(buf_size, 1);
+    while (size) {
+        size_t len = EVAL_MIN(size, buf_size);
+        if (blk_write(dev, zeroes, len, offset) != len) {
+            break;
+        }
+        offset += len;
+        size -= len;
+    }
+    free(zeroes);
+    return !size;
+}
+
+/*
+ * Asynchronous IO
+ */
+
+void blk_io_complete(blk_io_req_t* req, bool success)
+{
+    blkdev_t* dev = req->dev;
+    uint64_t bytes = (req->opcode == BLKDEV_IO_SYNC) ? 0 : req->size;
+    blk_stats_end(&dev->stats, req->opcode, bytes, req->start, success);
+    blk_direct_req_end(req);
+    req->complete(req, success);
+    atomic_sub_uint32(&dev->inflight, 1);
+}
+
+static bool blk_io_rw(blk_io_req_t* req)
+{
+    blkdev_t* dev = req->dev;
+    uint64_t pos = req->offset;
+    if (req->done == 0 && !(req->flags & BLKDEV_IO_MAP)) {
+        // Transfer the whole vector at once if possible
+        size_t merged = req->iov_count ? req->iov_count - 1 : 0;
+        if (req->opcode == BLKDEV_IO_WRITE && dev->type->writev) {
+            blk_stats_merged(&dev->stats, merged);
+            return dev->type->writev(dev->data, req->iov, req->iov_count, pos) == req->size;
+        }
+        if (req->opcode == BLKDEV_IO_READ && dev->type->readv) {
+            blk_stats_merged(&dev->stats, merged);
+            return dev->type->readv(dev->data, req->iov, req->iov_count, pos) == req->size;
+        }
+    }
+    for (size_t i = 0; i < req->iov_count; ++i) {
+        uint8_t* buffer = req->iov[i].buffer;
+        size_t size = req->iov[i].size;
+        if (pos + size > req->offset + req->done) {
+            // Skip the part which was already transferred
+            size_t skip = (pos < req->offset + req->done) ? (req->offset + req->done - pos) : 0;
+            size_t tmp = 0;
+            if (req->opcode == BLKDEV_IO_WRITE) {
+                tmp = dev->type->write(dev->data, buffer + skip, size - skip, pos + skip);
+            } else if ((req->flags & BLKDEV_IO_MAP) && dev->type->map) {
+                tmp = dev->type->map(dev->data, buffer + skip, size - skip, pos + skip);
+                if (tmp < size - skip) {
+                    tmp += dev->type->read(dev->data, buffer + skip + tmp, size - skip - tmp, pos + skip + tmp);
+                }
+            } else {
+                tmp = dev->type->read(dev->data, buffer + skip, size - skip, pos + skip);
+            }
+            if (tmp != size - skip) {
+                return false;
+            }
+        }
+        pos += size;
+    }
+    return true;
+}
+
+static void* blk_io_worker(void* arg)
+{
+    blk_io_req_t* req = arg;
+    bool ret = false;
+    switch (req->opcode) {
+        case BLKDEV_IO_READ:
+        case BLKDEV_IO_WRITE:
+            ret = blk_io_rw(req);
+            break;
+        case BLKDEV_IO_SYNC:
+            ret = req->dev->mode == BLKDEV_MODE_UNSAFE || (req->dev->type->sync && req->dev->type->sync(req->dev->data));
+            break;
+        case BLKDEV_IO_TRIM:
+            ret = req->dev->type->trim && req->dev->type->trim(req->dev->data, req->offset, req->size);
+            break;
+    }
+    blk_io_complete(req, ret);
+    return NULL;
+}
+
+void blk_io_fallback(blk_io_req_t* req)
+{
+    // The remainder goes through the synchronous path, which counts its own writes
+    blk_direct_req_end(req);
+    thread_create_task(blk_io_worker, req);
+}
+
+void blk_submit(blk_io_req_t* req)
+{
+    blkdev_t* dev = req->dev;
+    req->done = 0;
+    if (req->opcode == BLKDEV_IO_READ || req->opcode == BLKDEV_IO_WRITE) {
+        req->size = 0;
+        for (size_t i = 0; i < req->iov_count; ++i) {
+            req->size += req->iov[i].size;
+        }
+    }
+    req->start = blk_stats_begin(&dev->stats);
+    if (req->opcode != BLKDEV_IO_SYNC && (req->offset > dev->size || req->size > dev->size - req->offset)) {
+        // Out of device bounds
+        blk_stats_end(&dev->stats, req->opcode, 0, req->start, false);
+        req->complete(req, false);
+        return;
+    }
+    atomic_add_uint32(&dev->inflight, 1);
+    if (!dev->type->submit || !dev->type->submit(dev->data, req)) {
+        blk_io_fallback(req);
+    }
+}
@@ -15,6 +15,7 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "rvvmlib.h"
 
 /*
  * File API
@@ -39,10 +40,19 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
 typedef struct blk_io_rvfile rvfile_t;
 
+// Scatter-gather buffer
+typedef struct {
+    void*  buffer;
+    size_t size;
+} blk_iovec_t;
+
 // Returns NULL on failure
 rvfile_t* rvopen(const char* filepath, uint8_t filemode);
 void      rvclose(rvfile_t* file);
 
+// Create an anonymous memory-backed file (POSIX only!), returns NULL on failure
+rvfile_t* rvopen_anon(uint64_t size);
+
 // Get file size (Not synced across processes)
 uint64_t  rvfilesize(rvfile_t* file);
 
@@ -51,6 +61,10 @@ uint64_t  rvfilesize(rvfile_t* file);
 size_t    rvread(rvfile_t* file, void* dst, size_t size, uint64_t offset);
 size_t    rvwrite(rvfile_t* file, const void* src, size_t size, uint64_t offset);
 
+// Vectored rvread/rvwrite, offset should be explicit
+size_t    rvreadv(rvfile_t* file, const blk_iovec_t* iov, size_t iov_count, uint64_t offset);
+size_t    rvwritev(rvfile_t* file, const blk_iovec_t* iov, size_t iov_count, uint64_t offset);
+
 // Seek/tell for positioned IO
 bool      rvseek(rvfile_t* file, int64_t offset, uint8_t startpos);
 uint64_t  rvtell(rvfile_t* file);
@@ -66,6 +80,9 @@ bool      rvfallocate(rvfile_t* file, uint64_t length);
 // NOTE: If this fails, do NOT perform further actions and GTFO!
 bool      rvfsync(rvfile_t* file);
 
+// Resolve an absolute path of an existing file, returns false on failure
+bool      rvpath_absolute(char* dst, size_t size, const char* path);
+
 // Get native POSIX file descriptor, returns -1 on failure
 int rvfile_get_posix_fd(rvfile_t* file);
 
@@ -78,7 +95,16 @@ void* rvfile_get_win32_handle(rvfile_t* file);
  * It's illegal to seek out of device bounds, resizing the device is also impossible.
  */
 
-#define BLKDEV_RW  RVFILE_RW
+#define BLKDEV_RW    RVFILE_RW
+#define BLKDEV_CACHE 0x2 // Stack a write-back chunk cache, for devices doing small synchronous IO
+
+// Host caching modes, images opened with BLKDEV_MODE_DEFAULT use blk_set_default_mode()
+#define BLKDEV_MODE_DEFAULT      0x00
+#define BLKDEV_MODE_WRITEBACK    0x10 // Host page cache is used, guest flushes reach the disk
+#define BLKDEV_MODE_WRITETHROUGH 0x20 // Writes are durable upon completion, no volatile cache
+#define BLKDEV_MODE_DIRECT       0x30 // Bypass host page cache (Raw images only), guest flushes reach the disk
+#define BLKDEV_MODE_UNSAFE       0x40 // Guest flushes are ignored, for throwaway VMs and CI
+#define BLKDEV_MODE_MASK         0x70
 
 #define BLKDEV_SEEK_SET RVFILE_SEEK_SET
 #define BLKDEV_SEEK_CUR RVFILE_SEEK_CUR
@@ -86,6 +112,34 @@ void* rvfile_get_win32_handle(rvfile_t* file);
 
 #define BLKDEV_CUR RVFILE_CUR
 
+// Asynchronous IO operations
+#define BLKDEV_IO_READ  0x0
+#define BLKDEV_IO_WRITE 0x1
+#define BLKDEV_IO_SYNC  0x2
+#define BLKDEV_IO_TRIM  0x3
+
+// Asynchronous IO flags
+#define BLKDEV_IO_MAP   0x1 // Read via blk_read_map()
+
+// IO statistics are tracked per operation type, indexed by BLKDEV_IO_* opcode
+#define BLKDEV_IO_OPS   0x4
+
+// Latency histogram bucket N counts operations which took [2^(N-1), 2^N) microseconds
+#define BLK_STATS_BUCKETS 24
+
+typedef struct blk_io_req blk_io_req_t;
+
+// Live IO counters of a block device or a device queue, updated with relaxed atomics
+typedef struct {
+    uint64_t ops[BLKDEV_IO_OPS];
+    uint64_t bytes[BLKDEV_IO_OPS];
+    uint64_t errors;
+    uint64_t merged;
+    uint64_t latency[BLKDEV_IO_OPS][BLK_STATS_BUCKETS];
+    uint32_t inflight;
+    uint32_t inflight_max;
+} blk_stats_t;
+
 typedef struct {
     const char* name;
     void     (*close)(void* dev);
@@ -93,6 +147,13 @@ typedef struct {
     size_t   (*write)(void* dev, const void* src, size_t count, uint64_t offset);
     bool     (*trim)(void* dev, uint64_t offset, uint64_t count);
     bool     (*sync)(void* dev);
+    // Map whole pages copy-on-write into private memory, returns mapped size. May be NULL
+    size_t   (*map)(void* dev, void* dst, size_t count, uint64_t offset);
+    // Vectored read/write in a single operation. May be NULL
+    size_t   (*readv)(void* dev, const blk_iovec_t* iov, size_t iov_count, uint64_t offset);
+    size_t   (*writev)(void* dev, const blk_iovec_t* iov, size_t iov_count, uint64_t offset);
+    // Natively submit an asynchronous request, returns false to use a worker thread instead. May be NULL
+    bool     (*submit)(void* dev, blk_io_req_t* req);
 } blkdev_type_t;
 
 typedef struct blkdev_t blkdev_t;
@@ -102,14 +163,92 @@ struct blkdev_t {
     void* data;
     uint64_t size;
     uint64_t pos;
+    uint32_t inflight;
+    uint8_t  mode; // BLKDEV_MODE_*, set by blk_open()
+    blk_stats_t stats;
+};
+
+// The request and its buffers must stay valid until completion
+struct blk_io_req {
+    blkdev_t* dev;
+    const blk_iovec_t* iov;
+    size_t   iov_count;
+    uint64_t offset;
+    uint64_t size;  // Set to a total size of iovecs upon submission of read/write, range size for trim
+    void   (*complete)(blk_io_req_t* req, bool success);
+    void*    data;  // Opaque pointer for the completion callback
+    uint8_t  opcode;
+    uint8_t  flags;
+    // Amount of bytes already transferred and submission timestamp, internal to the block layer
+    size_t   done;
+    uint64_t start;
 };
 
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} blk_range_t;
+
 // Open a block device image
 blkdev_t* blk_open(const char* filename, uint8_t opts);
 
-// Close a block device handle
+// Open a disk image for a machine device, writable images of a cloned machine get a private temporary overlay
+blkdev_t* blk_open_disk(rvvm_machine_t* machine, const char* filename, uint8_t opts);
+
+// Set host caching mode for images opened without an explicit one, writeback by default
+void      blk_set_default_mode(uint8_t mode);
+
+// Parse caching mode name (writeback, writethrough, direct, unsafe), returns BLKDEV_MODE_DEFAULT if unknown
+uint8_t   blk_parse_mode(const char* name);
+
+// Close a block device handle, waits for inflight asynchronous requests
 void      blk_close(blkdev_t* dev);
 
+// Discard a batch of ranges (Reordered in place), adjacent and overlapping ranges are merged into a single trim.
+// With zeroes set, ranges which can't be discarded are zeroed, so they always read back as zeroes
+bool      blk_trim_ranges(blkdev_t* dev, blk_range_t* ranges, size_t count, bool zeroes);
+
+// Zero a range, discarding it where possible
+bool      blk_write_zeroes(blkdev_t* dev, uint64_t offset, uint64_t size);
+
+// Submit an asynchronous request, completion callback may be invoked from any thread
+void      blk_submit(blk_io_req_t* req);
+
+// Complete a natively submitted request, or pass it to a worker thread to finish the transfer
+void      blk_io_complete(blk_io_req_t* req, bool success);
+void      blk_io_fallback(blk_io_req_t* req);
+
+// Stack a write-back LRU cache of the given size in bytes (0 for default) on top of a device.
+// Takes ownership of the underlying device, which is closed together with the cache
+blkdev_t* blk_cache_create(blkdev_t* dev, size_t size);
+
+// Start accounting an operation, returns a timestamp for blk_stats_end()
+uint64_t  blk_stats_begin(blk_stats_t* stats);
+
+// Account a finished operation, op is a BLKDEV_IO_* opcode, anything else only counts errors
+void      blk_stats_end(blk_stats_t* stats, uint32_t op, uint64_t bytes, uint64_t start, bool success);
+
+// Account buffers coalesced into a single host operation
+void      blk_stats_merged(blk_stats_t* stats, uint64_t count);
+
+// Make counters visible via rvvm_get_blk_stats() and the periodic dump until unregistered
+void      blk_stats_register(blk_stats_t* stats, const char* name);
+void      blk_stats_unregister(blk_stats_t* stats);
+
+// Create a copy-on-write .ovl overlay on top of a read-only base image (Relative to the overlay)
+bool      blk_overlay_create(const char* filename, const char* base);
+
+// Create an overlay under a unique name in the temporary directory, writes the overlay path into filename
+bool      blk_overlay_create_temp(char* filename, size_t size, const char* base);
+
+// Create a deduplicated .bdv image, importing contents of another image if source isn't NULL.
+// Chunks may be compressed with "lz4" or "zstd" if the library is available, or NULL
+bool      blk_dedup_create(const char* filename, uint64_t size, const char* source, const char* compress);
+
+// Merge overlay changes into the base image, leaving the overlay empty.
+// The base image must not be used by anyone else, and the overlay should be idle
+bool      blk_overlay_commit(blkdev_t* dev);
+
 // Get block device size in bytes
 static inline uint64_t blk_getsize(blkdev_t* dev)
 {
@@ -125,7 +264,9 @@ static inline size_t blk_read(blkdev_t* dev, void* dst, size_t size, uint64_t of
     if (dev) {
         uint64_t real_pos = (offset == BLKDEV_CUR) ? dev->pos : offset;
         if (real_pos + size <= dev->size) {
+            uint64_t start = blk_stats_begin(&dev->stats);
             size_t ret = dev->type->read(dev->data, dst, size, real_pos);
+            blk_stats_end(&dev->stats, BLKDEV_IO_READ, ret, start, ret == size);
             if (offset == BLKDEV_CUR) dev->pos += ret;
             return ret;
         }
@@ -133,13 +274,35 @@ static inline size_t blk_read(blkdev_t* dev, void* dst, size_t size, uint64_t of
     return 0;
 }
 
+// Read data into private anonymous memory, whole pages of read-only images may be shared with the host page cache
+static inline size_t blk_read_map(blkdev_t* dev, void* dst, size_t size, uint64_t offset)
+{
+    if (dev && dev->type->map) {
+        uint64_t real_pos = (offset == BLKDEV_CUR) ? dev->pos : offset;
+        if (real_pos + size <= dev->size) {
+            uint64_t start = blk_stats_begin(&dev->stats);
+            size_t ret = dev->type->map(dev->data, dst, size, real_pos);
+            if (ret < size) {
+                ret += dev->type->read(dev->data, ((uint8_t*)dst) + ret, size - ret, real_pos + ret);
+            }
+            blk_stats_end(&dev->stats, BLKDEV_IO_READ, ret, start, ret == size);
+            if (offset == BLKDEV_CUR) dev->pos += ret;
+            return ret;
+        }
+        return 0;
+    }
+    return blk_read(dev, dst, size, offset);
+}
+
 // Write data to block device
 static inline size_t blk_write(blkdev_t* dev, const void* src, size_t size, uint64_t offset)
 {
     if (dev) {
         uint64_t real_pos = (offset == BLKDEV_CUR) ? dev->pos : offset;
         if (real_pos + size <= dev->size) {
+            uint64_t start = blk_stats_begin(&dev->stats);
             size_t ret = dev->type->write(dev->data, src, size, real_pos);
+            blk_stats_end(&dev->stats, BLKDEV_IO_WRITE, ret, start, ret == size);
             if (offset == BLKDEV_CUR) dev->pos += ret;
             return ret;
         }
@@ -177,23 +340,39 @@ static inline uint64_t blk_tell(blkdev_t* dev)
     return 0;
 }
 
-// Discard physical blocks, preferably zeroing them
+// Discard physical blocks, they read back as zeroes afterwards
 static inline bool blk_trim(blkdev_t* dev, uint64_t offset, uint64_t size)
 {
     if (dev && dev->type->trim) {
         uint64_t real_pos = (offset == BLKDEV_CUR) ? dev->pos : offset;
-        if (real_pos + size > dev->size) {
-            return dev->type->trim(dev->data, real_pos, size);
+        if (real_pos <= dev->size && size <= dev->size - real_pos) {
+            uint64_t start = blk_stats_begin(&dev->stats);
+            bool ret = dev->type->trim(dev->data, real_pos, size);
+            blk_stats_end(&dev->stats, BLKDEV_IO_TRIM, size, start, ret);
+            return ret;
         }
     }
     return false;
 }
 
+// Whether the device has a volatile write cache, which makes blk_sync() necessary for durability
+static inline bool blk_write_cached(blkdev_t* dev)
+{
+    return dev && dev->mode != BLKDEV_MODE_WRITETHROUGH;
+}
+
 // Flush write buffers
 static inline bool blk_sync(blkdev_t* dev)
 {
+    if (dev && dev->mode == BLKDEV_MODE_UNSAFE) {
+        // Pretend the data reached the disk
+        return true;
+    }
     if (dev && dev->type->sync) {
-        return dev->type->sync(dev->data);
+        uint64_t start = blk_stats_begin(&dev->stats);
+        bool ret = dev->type->sync(dev->data);
+        blk_stats_end(&dev->stats, BLKDEV_IO_SYNC, 0, start, ret);
+        return ret;
     }
     return false;
 }
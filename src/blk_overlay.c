@@ -0,0 +1,468 @@
+/*
+blk_overlay.c - Copy-on-write overlay images
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "atomics.h"
+
+/*
+ * Overlay image layout (Little endian):
+ * 0x0    Magic "RVVM_OVL"
+ * 0x8    Version (1)
+ * 0xC    Cluster size bits
+ * 0x10   Image size, must match the base image
+ * 0x18   Cluster bitmap offset
+ * 0x20   Data area offset
+ * 0x28   Base image path length
+ * 0x40   Base image path, relative to the overlay
+ *
+ * The data area is a sparse copy of the whole image, clusters
+ * marked in the bitmap are present in the overlay, other clusters
+ * are read from the base image.
+ */
+
+#define OVL_MAGIC        "RVVM_OVL"
+#define OVL_VERSION      1
+#define OVL_HEADER_SIZE  0x1000
+#define OVL_NAME_OFFSET  0x40
+#define OVL_NAME_MAX     (OVL_HEADER_SIZE - OVL_NAME_OFFSET - 1)
+#define OVL_CLUSTER_BITS 16
+#define OVL_MAX_DEPTH    16
+
+typedef struct {
+    rvfile_t*  file;
+    blkdev_t*  base;
+    uint32_t*  bitmap;
+    uint8_t*   buffer; // Cluster buffer for partial writes
+    spinlock_t lock;
+    uint64_t   size;
+    uint64_t   bitmap_offset;
+    uint64_t   data_offset;
+    uint32_t   cluster_bits;
+    uint32_t   cluster_size;
+    char       base_path[256];
+} ovl_image_t;
+
+static inline size_t ovl_bitmap_words(uint64_t size, uint32_t cluster_bits)
+{
+    uint64_t clusters = (size + (1ULL << cluster_bits) - 1) >> cluster_bits;
+    return (clusters + 31) >> 5;
+}
+
+static inline bool ovl_present(ovl_image_t* ovl, uint64_t cluster)
+{
+    return !!(atomic_load_uint32(&ovl->bitmap[cluster >> 5]) & (1U << (cluster & 0x1F)));
+}
+
+// Lookup a run of clusters that are all present or all missing in the overlay
+static size_t ovl_extent(ovl_image_t* ovl, uint64_t pos, size_t size, bool* present)
+{
+    uint64_t cluster = pos >> ovl->cluster_bits;
+    size_t len = EVAL_MIN(size, ovl->cluster_size - (pos & (ovl->cluster_size - 1)));
+    *present = ovl_present(ovl, cluster);
+    while (len < size && ovl_present(ovl, ++cluster) == *present) {
+        len += EVAL_MIN(size - len, ovl->cluster_size);
+    }
+    return len;
+}
+
+// Mark clusters as present and write back the affected bitmap words
+static bool ovl_mark_present(ovl_image_t* ovl, uint64_t pos, uint64_t size)
+{
+    uint64_t first = pos >> ovl->cluster_bits;
+    uint64_t last = (pos + size - 1) >> ovl->cluster_bits;
+    for (uint64_t cluster = first; cluster <= last; ++cluster) {
+        atomic_or_uint32(&ovl->bitmap[cluster >> 5], 1U << (cluster & 0x1F));
+    }
+    for (uint64_t word = first >> 5; word <= (last >> 5); ++word) {
+        uint8_t tmp[4] = {0};
+        write_uint32_le_m(tmp, atomic_load_uint32(&ovl->bitmap[word]));
+        if (rvwrite(ovl->file, tmp, sizeof(tmp), ovl->bitmap_offset + (word << 2)) != sizeof(tmp)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ovl_read_base(ovl_image_t* ovl, void* dst, size_t size, uint64_t pos)
+{
+    return blk_read(ovl->base, dst, size, pos) == size;
+}
+
+// Copy clusters into the overlay upon first write, caller holds the lock
+static bool ovl_write_missing(ovl_image_t* ovl, const uint8_t* src, size_t size, uint64_t pos)
+{
+    uint64_t end = pos + size;
+    uint64_t cur = pos;
+    while (cur < end) {
+        uint64_t cluster_pos = cur & ~(uint64_t)(ovl->cluster_size - 1);
+        uint64_t cluster_end = EVAL_MIN(cluster_pos + ovl->cluster_size, ovl->size);
+        uint64_t next = EVAL_MIN(cluster_end, end);
+        if (cur == cluster_pos && next == cluster_end) {
+            // Whole clusters are written in a single go
+            while (next < end && EVAL_MIN(next + ovl->cluster_size, ovl->size) <= end) {
+                next = EVAL_MIN(next + ovl->cluster_size, ovl->size);
+            }
+            if (rvwrite(ovl->file, src + (cur - pos), next - cur, ovl->data_offset + cur) != next - cur) {
+                return false;
+            }
+        } else if (ovl_present(ovl, cur >> ovl->cluster_bits)) {
+            // Cluster was copied by a concurrent write
+            if (rvwrite(ovl->file, src + (cur - pos), next - cur, ovl->data_offset + cur) != next - cur) {
+                return false;
+            }
+        } else {
+            // Partial cluster is filled from the base image
+            size_t cluster_len = cluster_end - cluster_pos;
+            if (!ovl_read_base(ovl, ovl->buffer, cluster_len, cluster_pos)) {
+                return false;
+            }
+            memcpy(ovl->buffer + (cur - cluster_pos), src + (cur - pos), next - cur);
+            if (rvwrite(ovl->file, ovl->buffer, cluster_len, ovl->data_offset + cluster_pos) != cluster_len) {
+                return false;
+            }
+        }
+        cur = next;
+    }
+    // Data must hit the overlay before the bitmap
+    return ovl_mark_present(ovl, pos, size);
+}
+
+/*
+ * Block device interface
+ */
+
+static void ovl_close(void* dev)
+{
+    ovl_image_t* ovl = dev;
+    blk_close(ovl->base);
+    rvclose(ovl->file);
+    free(ovl->bitmap);
+    free(ovl->buffer);
+    free(ovl);
+}
+
+static size_t ovl_read(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    ovl_image_t* ovl = dev;
+    uint8_t* buffer = dst;
+    size_t done = 0;
+    while (done < size) {
+        bool present = false;
+        size_t len = ovl_extent(ovl, offset + done, size - done, &present);
+        if (present) {
+            if (rvread(ovl->file, buffer + done, len, ovl->data_offset + offset + done) != len) {
+                break;
+            }
+        } else if (!ovl_read_base(ovl, buffer + done, len, offset + done)) {
+            break;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static size_t ovl_write(void* dev, const void* src, size_t size, uint64_t offset)
+{
+    ovl_image_t* ovl = dev;
+    const uint8_t* buffer = src;
+    size_t done = 0;
+    while (done < size) {
+        bool present = false;
+        size_t len = ovl_extent(ovl, offset + done, size - done, &present);
+        if (present) {
+            if (rvwrite(ovl->file, buffer + done, len, ovl->data_offset + offset + done) != len) {
+                break;
+            }
+        } else {
+            spin_lock_slow(&ovl->lock);
+            bool ret = ovl_write_missing(ovl, buffer + done, len, offset + done);
+            spin_unlock(&ovl->lock);
+            if (!ret) {
+                break;
+            }
+        }
+        done += len;
+    }
+    return done;
+}
+
+static bool ovl_trim(void* dev, uint64_t offset, uint64_t size)
+{
+    ovl_image_t* ovl = dev;
+    uint64_t cluster_mask = ovl->cluster_size - 1;
+    uint64_t start = EVAL_MIN((offset + cluster_mask) & ~cluster_mask, offset + size);
+    uint64_t end = EVAL_MAX((offset + size) & ~cluster_mask, start);
+    if (offset + size == ovl->size) {
+        end = offset + size;
+    }
+    // Zero partial clusters at the edges
+    void* zeroes = safe_calloc(ovl->cluster_size, 1);
+    bool ret = (start == offset || ovl_write(ovl, zeroes, start - offset, offset) == start - offset)
+            && (end == offset + size || ovl_write(ovl, zeroes, offset + size - end, end) == offset + size - end);
+    free(zeroes);
+    if (ret && end > start) {
+        // Whole clusters become present holes in the overlay, base is masked by zeroes
+        spin_lock_slow(&ovl->lock);
+        ret = rvtrim(ovl->file, ovl->data_offset + start, end - start) && ovl_mark_present(ovl, start, end - start);
+        spin_unlock(&ovl->lock);
+    }
+    return ret;
+}
+
+static bool ovl_sync(void* dev)
+{
+    ovl_image_t* ovl = dev;
+    return rvfsync(ovl->file);
+}
+
+static size_t ovl_map(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    ovl_image_t* ovl = dev;
+    bool present = false;
+    size_t len = ovl_extent(ovl, offset, size, &present);
+    if (!present && ovl->base->type->map) {
+        // Share unmodified pages of the base image
+        return ovl->base->type->map(ovl->base->data, dst, len, offset);
+    }
+    return 0;
+}
+
+static const blkdev_type_t blkdev_type_overlay = {
+    .name  = "blk-overlay",
+    .close = ovl_close,
+    .read  = ovl_read,
+    .write = ovl_write,
+    .trim  = ovl_trim,
+    .sync  = ovl_sync,
+    .map   = ovl_map,
+};
+
+/*
+ * Image management
+ */
+
+static blkdev_t* ovl_open_internal(const char* filename, uint8_t filemode, uint32_t depth);
+
+static bool ovl_is_overlay(const char* filename)
+{
+    rvfile_t* file = rvopen(filename, 0);
+    char magic[8] = {0};
+    if (file) {
+        rvread(file, magic, sizeof(magic), 0);
+        rvclose(file);
+    }
+    return !memcmp(magic, OVL_MAGIC, sizeof(magic));
+}
+
+static blkdev_t* ovl_open_base(const char* path, uint8_t filemode, uint32_t depth)
+{
+    if (ovl_is_overlay(path)) {
+        if (depth >= OVL_MAX_DEPTH) {
+            rvvm_error("Overlay chain is too deep");
+            return NULL;
+        }
+        return ovl_open_internal(path, filemode, depth + 1);
+    }
+    return blk_open(path, filemode);
+}
+
+static blkdev_t* ovl_open_internal(const char* filename, uint8_t filemode, uint32_t depth)
+{
+    rvfile_t* file = rvopen(filename, filemode);
+    if (!file) return NULL;
+    ovl_image_t* ovl = safe_new_obj(ovl_image_t);
+    uint8_t header[OVL_HEADER_SIZE] = {0};
+    ovl->file = file;
+    spin_init(&ovl->lock);
+    if (rvread(file, header, sizeof(header), 0) != sizeof(header) || memcmp(header, OVL_MAGIC, 8)) {
+        rvvm_error("%s is not an overlay image", filename);
+        ovl_close(ovl);
+        return NULL;
+    }
+    ovl->cluster_bits = read_uint32_le_m(header + 0xC);
+    ovl->size = read_uint64_le_m(header + 0x10);
+    ovl->bitmap_offset = read_uint64_le_m(header + 0x18);
+    ovl->data_offset = read_uint64_le_m(header + 0x20);
+    uint32_t name_len = read_uint32_le_m(header + 0x28);
+    if (read_uint32_le_m(header + 0x8) != OVL_VERSION || ovl->cluster_bits < 9 || ovl->cluster_bits > 24
+     || !ovl->size || (ovl->size >> ovl->cluster_bits) >= 0x100000000ULL || name_len > OVL_NAME_MAX) {
+        rvvm_error("Invalid overlay image %s", filename);
+        ovl_close(ovl);
+        return NULL;
+    }
+    ovl->cluster_size = 1U << ovl->cluster_bits;
+    header[OVL_NAME_OFFSET + name_len] = 0;
+    rvvm_path_relative(ovl->base_path, sizeof(ovl->base_path), filename, (const char*)header + OVL_NAME_OFFSET);
+
+    // Load cluster bitmap
+    size_t words = ovl_bitmap_words(ovl->size, ovl->cluster_bits);
+    ovl->bitmap = safe_new_arr(uint32_t, words);
+    if (rvread(file, ovl->bitmap, words << 2, ovl->bitmap_offset) != (words << 2)) {
+        rvvm_error("Failed to read overlay bitmap");
+        ovl_close(ovl);
+        return NULL;
+    }
+    for (size_t i = 0; i < words; ++i) {
+        ovl->bitmap[i] = read_uint32_le_m(&ovl->bitmap[i]);
+    }
+
+    // Base image is always read-only
+    ovl->base = ovl_open_base(ovl->base_path, 0, depth);
+    if (!ovl->base || blk_getsize(ovl->base) != ovl->size) {
+        rvvm_error("Base image %s of overlay %s is missing or was resized", ovl->base_path, filename);
+        ovl_close(ovl);
+        return NULL;
+    }
+    ovl->buffer = safe_malloc(ovl->cluster_size);
+
+    blkdev_t* dev = safe_new_obj(blkdev_t);
+    dev->type = &blkdev_type_overlay;
+    dev->size = ovl->size;
+    dev->data = ovl;
+    return dev;
+}
+
+blkdev_t* blk_overlay_open(const char* filename, uint8_t filemode)
+{
+    return ovl_open_internal(filename, filemode, 0);
+}
+
+bool blk_overlay_create(const char* filename, const char* base)
+{
+    char base_path[256] = {0};
+    size_t name_len = rvvm_strlen(base);
+    size_t file_len = rvvm_strlen(filename);
+    rvvm_path_relative(base_path, sizeof(base_path), filename, base);
+    if (file_len < 4 || !rvvm_strcmp(filename + file_len - 4, ".ovl")) {
+        rvvm_error("Overlay image name should end with .ovl");
+        return false;
+    }
+    if (name_len > OVL_NAME_MAX) {
+        rvvm_error("Base image path is too long");
+        return false;
+    }
+    blkdev_t* base_dev = ovl_open_base(base_path, 0, 0);
+    if (!base_dev) {
+        rvvm_error("Failed to open base image %s", base_path);
+        return false;
+    }
+    uint64_t size = blk_getsize(base_dev);
+    blk_close(base_dev);
+
+    // Fail if the overlay already exists, it is never overwritten
+    rvfile_t* file = rvopen(filename, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    if (!file) {
+        rvvm_error("Failed to create overlay %s", filename);
+        return false;
+    }
+    uint64_t cluster_size = 1ULL << OVL_CLUSTER_BITS;
+    uint64_t bitmap_size = ovl_bitmap_words(size, OVL_CLUSTER_BITS) << 2;
+    uint64_t data_offset = align_size_up(OVL_HEADER_SIZE + bitmap_size, cluster_size);
+    uint8_t header[OVL_HEADER_SIZE] = {0};
+    memcpy(header, OVL_MAGIC, 8);
+    write_uint32_le_m(header + 0x8, OVL_VERSION);
+    write_uint32_le_m(header + 0xC, OVL_CLUSTER_BITS);
+    write_uint64_le_m(header + 0x10, size);
+    write_uint64_le_m(header + 0x18, OVL_HEADER_SIZE);
+    write_uint64_le_m(header + 0x20, data_offset);
+    write_uint32_le_m(header + 0x28, name_len);
+    memcpy(header + OVL_NAME_OFFSET, base, name_len);
+    // The rest of overlay is sparse, so creation takes constant time & space
+    bool ret = rvwrite(file, header, sizeof(header), 0) == sizeof(header)
+            && rvtruncate(file, data_offset + size);
+    rvclose(file);
+    if (!ret) {
+        rvvm_error("Failed to create overlay %s", filename);
+    }
+    return ret;
+}
+
+bool blk_overlay_create_temp(char* filename, size_t size, const char* base)
+{
+    // The overlay lives elsewhere, so the base image is referenced by absolute path
+    char base_path[256] = {0};
+    if (!rvpath_absolute(base_path, sizeof(base_path), base)) {
+        rvvm_error("Failed to resolve path of base image %s", base);
+        return false;
+    }
+#ifdef _WIN32
+    const char* dir = getenv("TEMP");
+#else
+    const char* dir = getenv("TMPDIR");
+#endif
+    if (dir == NULL || !dir[0]) {
+#ifdef _WIN32
+        dir = ".";
+#else
+        dir = "/var/tmp";
+#endif
+    }
+    // Random name, creating the overlay fails instead of reusing an existing file
+    size_t len = rvvm_strlcpy(filename, dir, size);
+    len += rvvm_strlcpy(filename + len, "/rvvm-XXXXXXXXXXXX.ovl", size - len);
+    if (len >= size) {
+        rvvm_error("Temporary directory path %s is too long", dir);
+        return false;
+    }
+    rvvm_randomserial(filename + len - 16, 12);
+    return blk_overlay_create(filename, base_path);
+}
+
+bool blk_overlay_commit(blkdev_t* dev)
+{
+    if (!dev || dev->type != &blkdev_type_overlay) {
+        rvvm_error("Not an overlay image");
+        return false;
+    }
+    ovl_image_t* ovl = dev->data;
+    blkdev_t* base = ovl_open_base(ovl->base_path, BLKDEV_RW, 0);
+    if (!base) {
+        rvvm_error("Failed to open base image %s for writing", ovl->base_path);
+        return false;
+    }
+    bool ret = true;
+    spin_lock_slow(&ovl->lock);
+    for (uint64_t pos = 0; pos < ovl->size && ret;) {
+        bool present = false;
+        size_t len = ovl_extent(ovl, pos, EVAL_MIN(ovl->size - pos, 0x100000), &present);
+        if (present) {
+            // Reuse the cluster buffer in chunks
+            for (size_t off = 0; off < len && ret; off += ovl->cluster_size) {
+                size_t chunk = EVAL_MIN(len - off, ovl->cluster_size);
+                ret = rvread(ovl->file, ovl->buffer, chunk, ovl->data_offset + pos + off) == chunk
+                   && blk_write(base, ovl->buffer, chunk, pos + off) == chunk;
+            }
+        }
+        pos += len;
+    }
+    // Base must be durable before the overlay is emptied, if the backend supports flushing
+    ret = ret && (!base->type->sync || blk_sync(base));
+    blk_close(base);
+    if (ret) {
+        size_t words = ovl_bitmap_words(ovl->size, ovl->cluster_bits);
+        memset(ovl->bitmap, 0, words << 2);
+        void* zeroes = safe_calloc(words, 4);
+        ret = rvwrite(ovl->file, zeroes, words << 2, ovl->bitmap_offset) == (words << 2);
+        free(zeroes);
+        rvtrim(ovl->file, ovl->data_offset, ovl->size);
+        ret = ret && rvfsync(ovl->file);
+        // Drop metadata cached by the read-only base handle
+        blk_close(ovl->base);
+        ovl->base = ovl_open_base(ovl->base_path, 0, 0);
+        ret = ret && ovl->base;
+    }
+    spin_unlock(&ovl->lock);
+    if (!ret) {
+        rvvm_error("Failed to commit overlay into %s", ovl->base_path);
+    }
+    return ret;
+}
@@ -0,0 +1,1079 @@
+/*
+blk_qcow2.c - QCOW2 image block device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+
+#define QCOW2_MAGIC 0x514649FB
+
+#define QCOW2_HEADER_V2_SIZE 72
+#define QCOW2_HEADER_V3_SIZE 104
+
+// Incompatible feature bits
+#define QCOW2_INCOMPAT_DIRTY    0x1
+#define QCOW2_INCOMPAT_CORRUPT  0x2
+#define QCOW2_INCOMPAT_DATAFILE 0x4
+#define QCOW2_INCOMPAT_COMPRESS 0x8
+#define QCOW2_INCOMPAT_EXTL2    0x10
+
+// Compression type only matters for compressed clusters, which are rejected on access
+#define QCOW2_INCOMPAT_KNOWN (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT | QCOW2_INCOMPAT_COMPRESS)
+
+// L1/L2 table entry bits
+#define QCOW2_OFLAG_COPIED     0x8000000000000000ULL
+#define QCOW2_OFLAG_COMPRESSED 0x4000000000000000ULL
+#define QCOW2_OFLAG_ZERO       0x1ULL
+#define QCOW2_OFFSET_MASK      0x00FFFFFFFFFFFE00ULL
+
+// Sanity limits, same as in QEMU
+#define QCOW2_MAX_L1_SIZE       0x2000000
+#define QCOW2_MAX_REFTABLE_SIZE 0x800000
+#define QCOW2_MAX_BACKING_NAME  1023
+#define QCOW2_MAX_BACKING_DEPTH 16
+
+// Cached tables per image
+#define QCOW2_L2_CACHE_SIZE  32
+#define QCOW2_REF_CACHE_SIZE 8
+
+// Guest cluster state
+#define QCOW2_CLUSTER_UNALLOC    0x0 // Reads from backing file or as zeroes
+#define QCOW2_CLUSTER_ZERO       0x1 // Reads as zeroes, may have preallocated host cluster
+#define QCOW2_CLUSTER_DATA       0x2
+#define QCOW2_CLUSTER_COMPRESSED 0x3 // Unsupported
+
+// Online compaction
+#define QCOW2_COMPACT_MIN   (16ULL << 20) // Released bytes to trigger compaction
+#define QCOW2_COMPACT_BATCH 64            // Clusters moved per lock hold
+
+// Host cluster owners found by compaction scan
+#define QCOW2_OWNER_DATA 0x4000000000000000ULL // Guest data, low bits hold guest cluster
+#define QCOW2_OWNER_L2   0x8000000000000000ULL // L2 table, low bits hold L1 index
+#define QCOW2_OWNER_REF  0xC000000000000000ULL // Refcount block, low bits hold refcount table index
+#define QCOW2_OWNER_MASK 0x3FFFFFFFFFFFFFFFULL
+
+typedef struct {
+    uint64_t offset; // Host offset of the table, 0 for an empty slot
+    uint64_t used;   // LRU timestamp
+    uint8_t* data;   // Raw big-endian table
+} qcow2_table_t;
+
+typedef struct {
+    rvfile_t* file;
+    blkdev_t* backing;
+    spinlock_t lock;
+
+    uint64_t* l1;       // Whole L1 table, native endian
+    uint64_t* reftable; // Whole refcount table, native endian
+    uint8_t*  buffer;   // Cluster buffer for partial writes into new clusters
+
+    uint64_t l1_offset;
+    uint64_t reftable_offset;
+    uint64_t alloc_offset; // Clusters are allocated at the end of image
+    uint64_t lru_clock;
+    uint64_t punch_offset; // Pending run of released host clusters
+    uint64_t punch_size;
+    uint64_t released;     // Bytes released since the last compaction
+    uint32_t unlocked;     // Data transfers in flight outside the lock
+    uint32_t compacting;
+    uint32_t compact_stop; // Set on close to interrupt compaction
+    thread_ctx_t* compact_thread;
+
+    uint32_t version;
+    uint32_t l1_size;
+    uint32_t reftable_size;
+    uint32_t cluster_bits;
+    uint32_t cluster_size;
+    uint32_t l2_bits;     // log2 of entries per L2 table
+    uint32_t ref_order;   // log2 of refcount width in bits
+    uint32_t refblk_bits; // log2 of entries per refcount block
+
+    qcow2_table_t l2_cache[QCOW2_L2_CACHE_SIZE];
+    qcow2_table_t ref_cache[QCOW2_REF_CACHE_SIZE];
+} qcow2_image_t;
+
+/*
+ * Metadata cache
+ */
+
+static uint8_t* qcow2_get_table(qcow2_image_t* qcow, qcow2_table_t* cache, size_t count, uint64_t offset, bool load)
+{
+    qcow2_table_t* victim = &cache[0];
+    for (size_t i = 0; i < count; ++i) {
+        if (cache[i].offset == offset) {
+            cache[i].used = ++qcow->lru_clock;
+            return cache[i].data;
+        }
+        if (cache[i].used < victim->used) {
+            victim = &cache[i];
+        }
+    }
+    // Evict the least recently used table
+    if (!victim->data) {
+        victim->data = safe_malloc(qcow->cluster_size);
+    }
+    victim->offset = 0;
+    victim->used = 0;
+    if (load) {
+        if (rvread(qcow->file, victim->data, qcow->cluster_size, offset) != qcow->cluster_size) {
+            rvvm_error("Failed to read QCOW2 metadata at 0x%llx", (unsigned long long)offset);
+            return NULL;
+        }
+    } else {
+        memset(victim->data, 0, qcow->cluster_size);
+    }
+    victim->offset = offset;
+    victim->used = ++qcow->lru_clock;
+    return victim->data;
+}
+
+static bool qcow2_write_meta(qcow2_image_t* qcow, const void* data, size_t size, uint64_t offset)
+{
+    if (rvwrite(qcow->file, data, size, offset) != size) {
+        rvvm_error("Failed to write QCOW2 metadata at 0x%llx", (unsigned long long)offset);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Refcounts & cluster allocation
+ */
+
+static uint64_t qcow2_refcount_read(const uint8_t* block, uint32_t order, size_t index)
+{
+    switch (order) {
+        case 3: return block[index];
+        case 4: return read_uint16_be_m(block + (index << 1));
+        case 5: return read_uint32_be_m(block + (index << 2));
+        default: return read_uint64_be_m(block + (index << 3));
+    }
+}
+
+static void qcow2_refcount_write(uint8_t* block, uint32_t order, size_t index, uint64_t val)
+{
+    switch (order) {
+        case 3: block[index] = val; break;
+        case 4: write_uint16_be_m(block + (index << 1), val); break;
+        case 5: write_uint32_be_m(block + (index << 2), val); break;
+        default: write_uint64_be_m(block + (index << 3), val); break;
+    }
+}
+
+static uint8_t* qcow2_get_refblock(qcow2_image_t* qcow, uint64_t offset, size_t* index, bool alloc);
+static bool qcow2_free_cluster(qcow2_image_t* qcow, uint64_t offset);
+
+static bool qcow2_set_refcount(qcow2_image_t* qcow, uint64_t offset, uint64_t val)
+{
+    size_t index = 0;
+    uint8_t* block = qcow2_get_refblock(qcow, offset, &index, true);
+    if (!block) {
+        return false;
+    }
+    size_t entry_size = 1 << (qcow->ref_order - 3);
+    uint64_t block_offset = qcow->reftable[(offset >> qcow->cluster_bits) >> qcow->refblk_bits];
+    qcow2_refcount_write(block, qcow->ref_order, index, val);
+    return qcow2_write_meta(qcow, block + index * entry_size, entry_size, block_offset + index * entry_size);
+}
+
+// Relocate the refcount table to the end of image with enough space for ref_index
+static bool qcow2_grow_reftable(qcow2_image_t* qcow, uint64_t ref_index)
+{
+    uint64_t old_offset = qcow->reftable_offset;
+    uint32_t old_clusters = (qcow->reftable_size << 3) >> qcow->cluster_bits;
+    uint32_t new_clusters = old_clusters;
+    while ((((uint64_t)new_clusters << qcow->cluster_bits) >> 3) <= ref_index + 1) {
+        new_clusters <<= 1;
+    }
+    if (((uint64_t)new_clusters << qcow->cluster_bits) > QCOW2_MAX_REFTABLE_SIZE) {
+        rvvm_error("QCOW2 refcount table is full");
+        return false;
+    }
+    uint64_t new_offset = qcow->alloc_offset;
+    size_t new_size = ((size_t)new_clusters << qcow->cluster_bits) >> 3;
+    uint64_t* reftable = safe_new_arr(uint64_t, new_size);
+    for (size_t i = 0; i < qcow->reftable_size; ++i) {
+        write_uint64_be_m(&reftable[i], qcow->reftable[i]);
+    }
+    qcow->alloc_offset += (uint64_t)new_clusters << qcow->cluster_bits;
+    // Write the new table, then switch the header to it
+    uint8_t header[12] = {0};
+    write_uint64_be_m(header, new_offset);
+    write_uint32_be_m(header + 8, new_clusters);
+    bool ret = qcow2_write_meta(qcow, reftable, new_size << 3, new_offset)
+            && qcow2_write_meta(qcow, header, sizeof(header), 48);
+    if (ret) {
+        for (size_t i = 0; i < new_size; ++i) {
+            reftable[i] = (i < qcow->reftable_size) ? qcow->reftable[i] : 0;
+        }
+        free(qcow->reftable);
+        qcow->reftable = reftable;
+        qcow->reftable_offset = new_offset;
+        qcow->reftable_size = new_size;
+        // Account the new table, release the old one
+        for (uint32_t i = 0; i < new_clusters && ret; ++i) {
+            ret = qcow2_set_refcount(qcow, new_offset + ((uint64_t)i << qcow->cluster_bits), 1);
+        }
+        for (uint32_t i = 0; i < old_clusters && ret; ++i) {
+            ret = qcow2_free_cluster(qcow, old_offset + ((uint64_t)i << qcow->cluster_bits));
+        }
+    } else {
+        free(reftable);
+    }
+    return ret;
+}
+
+static uint8_t* qcow2_get_refblock(qcow2_image_t* qcow, uint64_t offset, size_t* index, bool alloc)
+{
+    uint64_t cluster = offset >> qcow->cluster_bits;
+    uint64_t ref_index = cluster >> qcow->refblk_bits;
+    *index = cluster & ((1ULL << qcow->refblk_bits) - 1);
+    if (ref_index >= qcow->reftable_size && (!alloc || !qcow2_grow_reftable(qcow, ref_index))) {
+        return NULL;
+    }
+    uint64_t block_offset = qcow->reftable[ref_index];
+    if (block_offset) {
+        return qcow2_get_table(qcow, qcow->ref_cache, QCOW2_REF_CACHE_SIZE, block_offset, true);
+    }
+    if (!alloc) {
+        return NULL;
+    }
+    // Allocate a new refcount block, then account it in itself or in another block
+    block_offset = qcow->alloc_offset;
+    qcow->alloc_offset += qcow->cluster_size;
+    uint8_t* block = qcow2_get_table(qcow, qcow->ref_cache, QCOW2_REF_CACHE_SIZE, block_offset, false);
+    uint8_t entry[8] = {0};
+    write_uint64_be_m(entry, block_offset);
+    if (!qcow2_write_meta(qcow, block, qcow->cluster_size, block_offset)
+     || !qcow2_write_meta(qcow, entry, sizeof(entry), qcow->reftable_offset + (ref_index << 3))) {
+        return NULL;
+    }
+    qcow->reftable[ref_index] = block_offset;
+    if (!qcow2_set_refcount(qcow, block_offset, 1)) {
+        return NULL;
+    }
+    // The block could have been evicted by recursive allocation
+    return qcow2_get_table(qcow, qcow->ref_cache, QCOW2_REF_CACHE_SIZE, block_offset, true);
+}
+
+static uint64_t qcow2_alloc_cluster(qcow2_image_t* qcow)
+{
+    uint64_t offset = qcow->alloc_offset;
+    qcow->alloc_offset += qcow->cluster_size;
+    if (!qcow2_set_refcount(qcow, offset, 1)) {
+        return 0;
+    }
+    return offset;
+}
+
+static void qcow2_punch_flush(qcow2_image_t* qcow)
+{
+    if (qcow->punch_size) {
+        rvtrim(qcow->file, qcow->punch_offset, qcow->punch_size);
+        qcow->punch_size = 0;
+    }
+}
+
+// Queue a released cluster for hole punching, contiguous runs are punched at once
+static void qcow2_punch(qcow2_image_t* qcow, uint64_t offset)
+{
+    if (qcow->punch_size && offset == qcow->punch_offset + qcow->punch_size) {
+        qcow->punch_size += qcow->cluster_size;
+    } else if (qcow->punch_size && offset + qcow->cluster_size == qcow->punch_offset) {
+        qcow->punch_offset = offset;
+        qcow->punch_size += qcow->cluster_size;
+    } else {
+        qcow2_punch_flush(qcow);
+        qcow->punch_offset = offset;
+        qcow->punch_size = qcow->cluster_size;
+    }
+}
+
+static bool qcow2_free_cluster(qcow2_image_t* qcow, uint64_t offset)
+{
+    size_t index = 0;
+    uint8_t* block = qcow2_get_refblock(qcow, offset, &index, false);
+    uint64_t refcount = block ? qcow2_refcount_read(block, qcow->ref_order, index) : 0;
+    if (refcount == 0) {
+        rvvm_warn("QCOW2 cluster at 0x%llx is already free", (unsigned long long)offset);
+        return false;
+    }
+    if (!qcow2_set_refcount(qcow, offset, refcount - 1)) {
+        return false;
+    }
+    if (refcount == 1) {
+        // Release the space on the host, only compaction reuses freed clusters
+        qcow2_punch(qcow, offset);
+        qcow->released += qcow->cluster_size;
+    }
+    return true;
+}
+
+/*
+ * Cluster mapping
+ */
+
+static uint32_t qcow2_cluster_type(qcow2_image_t* qcow, uint64_t entry)
+{
+    if (entry & QCOW2_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    }
+    if ((entry & QCOW2_OFLAG_ZERO) && qcow->version >= 3) {
+        return QCOW2_CLUSTER_ZERO;
+    }
+    if (entry & QCOW2_OFFSET_MASK) {
+        return QCOW2_CLUSTER_DATA;
+    }
+    return QCOW2_CLUSTER_UNALLOC;
+}
+
+static bool qcow2_get_l2_entry(qcow2_image_t* qcow, uint64_t pos, uint64_t* entry)
+{
+    uint64_t l1_index = pos >> (qcow->cluster_bits + qcow->l2_bits);
+    size_t l2_index = (pos >> qcow->cluster_bits) & ((1ULL << qcow->l2_bits) - 1);
+    uint64_t l2_offset = (l1_index < qcow->l1_size) ? (qcow->l1[l1_index] & QCOW2_OFFSET_MASK) : 0;
+    *entry = 0;
+    if (l2_offset) {
+        const uint8_t* l2 = qcow2_get_table(qcow, qcow->l2_cache, QCOW2_L2_CACHE_SIZE, l2_offset, true);
+        if (!l2) {
+            return false;
+        }
+        *entry = read_uint64_be_m(l2 + (l2_index << 3));
+    }
+    return true;
+}
+
+static bool qcow2_set_l2_entry(qcow2_image_t* qcow, uint64_t pos, uint64_t entry)
+{
+    uint64_t l1_index = pos >> (qcow->cluster_bits + qcow->l2_bits);
+    size_t l2_index = (pos >> qcow->cluster_bits) & ((1ULL << qcow->l2_bits) - 1);
+    uint8_t* l2 = NULL;
+    if (l1_index >= qcow->l1_size) {
+        return false;
+    }
+    uint64_t l2_offset = qcow->l1[l1_index] & QCOW2_OFFSET_MASK;
+    if (l2_offset) {
+        l2 = qcow2_get_table(qcow, qcow->l2_cache, QCOW2_L2_CACHE_SIZE, l2_offset, true);
+    } else {
+        // Allocate an empty L2 table, then link it into L1
+        l2_offset = qcow2_alloc_cluster(qcow);
+        if (!l2_offset) {
+            return false;
+        }
+        l2 = qcow2_get_table(qcow, qcow->l2_cache, QCOW2_L2_CACHE_SIZE, l2_offset, false);
+        uint8_t l1_entry[8] = {0};
+        write_uint64_be_m(l1_entry, l2_offset | QCOW2_OFLAG_COPIED);
+        if (!qcow2_write_meta(qcow, l2, qcow->cluster_size, l2_offset)
+         || !qcow2_write_meta(qcow, l1_entry, sizeof(l1_entry), qcow->l1_offset + (l1_index << 3))) {
+            return false;
+        }
+        qcow->l1[l1_index] = l2_offset | QCOW2_OFLAG_COPIED;
+    }
+    if (!l2) {
+        return false;
+    }
+    write_uint64_be_m(l2 + (l2_index << 3), entry);
+    return qcow2_write_meta(qcow, l2 + (l2_index << 3), 8, l2_offset + (l2_index << 3));
+}
+
+// Lookup a run of clusters with the same type and physically contiguous data
+static uint32_t qcow2_map_extent(qcow2_image_t* qcow, uint64_t pos, size_t* size, uint64_t* host)
+{
+    uint64_t entry = 0;
+    size_t cluster_off = pos & (qcow->cluster_size - 1);
+    size_t len = EVAL_MIN(*size, qcow->cluster_size - cluster_off);
+    if (!qcow2_get_l2_entry(qcow, pos, &entry)) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    }
+    uint32_t type = qcow2_cluster_type(qcow, entry);
+    *host = (entry & QCOW2_OFFSET_MASK) + cluster_off;
+    while (len < *size) {
+        uint64_t next = 0;
+        if (!qcow2_get_l2_entry(qcow, pos + len, &next) || qcow2_cluster_type(qcow, next) != type) {
+            break;
+        }
+        if (type == QCOW2_CLUSTER_DATA && (next & QCOW2_OFFSET_MASK) != *host + len) {
+            break;
+        }
+        len += EVAL_MIN(*size - len, qcow->cluster_size);
+    }
+    *size = len;
+    return type;
+}
+
+static bool qcow2_read_backing(qcow2_image_t* qcow, void* dst, size_t size, uint64_t pos)
+{
+    uint64_t backing_size = blk_getsize(qcow->backing);
+    size_t avail = (pos < backing_size) ? EVAL_MIN(size, backing_size - pos) : 0;
+    if (avail && blk_read(qcow->backing, dst, avail, pos) != avail) {
+        return false;
+    }
+    memset(((uint8_t*)dst) + avail, 0, size - avail);
+    return true;
+}
+
+// Write into a cluster without an allocated host cluster
+static bool qcow2_write_alloc(qcow2_image_t* qcow, const void* src, size_t size, uint64_t pos)
+{
+    uint64_t entry = 0;
+    uint64_t cluster_pos = pos & ~(uint64_t)(qcow->cluster_size - 1);
+    size_t cluster_off = pos - cluster_pos;
+    if (!qcow2_get_l2_entry(qcow, pos, &entry)) {
+        return false;
+    }
+    uint32_t type = qcow2_cluster_type(qcow, entry);
+    uint64_t host = entry & QCOW2_OFFSET_MASK;
+    if (type == QCOW2_CLUSTER_COMPRESSED) {
+        rvvm_error("Compressed QCOW2 clusters aren't supported");
+        return false;
+    }
+    if (type == QCOW2_CLUSTER_DATA) {
+        // Allocated concurrently
+        return rvwrite(qcow->file, src, size, host + cluster_off) == size;
+    }
+    if (!host) {
+        // Zero clusters may keep a preallocated host cluster
+        host = qcow2_alloc_cluster(qcow);
+        if (!host) {
+            return false;
+        }
+    }
+    if (size != qcow->cluster_size) {
+        // Fill the rest of cluster with previous contents
+        if (type == QCOW2_CLUSTER_ZERO || !qcow->backing) {
+            memset(qcow->buffer, 0, qcow->cluster_size);
+        } else if (!qcow2_read_backing(qcow, qcow->buffer, qcow->cluster_size, cluster_pos)) {
+            return false;
+        }
+        memcpy(qcow->buffer + cluster_off, src, size);
+        src = qcow->buffer;
+    }
+    // Data must hit the image before the mapping
+    if (rvwrite(qcow->file, src, qcow->cluster_size, host) != qcow->cluster_size) {
+        return false;
+    }
+    return qcow2_set_l2_entry(qcow, cluster_pos, host | QCOW2_OFLAG_COPIED);
+}
+
+// Deallocate a whole cluster, leaving zeroes
+static bool qcow2_discard_cluster(qcow2_image_t* qcow, uint64_t pos)
+{
+    uint64_t entry = 0;
+    if (!qcow2_get_l2_entry(qcow, pos, &entry)) {
+        return false;
+    }
+    uint32_t type = qcow2_cluster_type(qcow, entry);
+    uint64_t host = (type == QCOW2_CLUSTER_COMPRESSED) ? 0 : (entry & QCOW2_OFFSET_MASK);
+    if (type == QCOW2_CLUSTER_UNALLOC && !qcow->backing) {
+        return true;
+    }
+    if (type == QCOW2_CLUSTER_ZERO && !host) {
+        return true;
+    }
+    if (qcow->backing && qcow->version < 3) {
+        // No zero clusters in QCOW2 v2, unallocated cluster would expose the backing file
+        if (!host) {
+            memset(qcow->buffer, 0, qcow->cluster_size);
+            return qcow2_write_alloc(qcow, qcow->buffer, qcow->cluster_size, pos);
+        }
+        return rvtrim(qcow->file, host, qcow->cluster_size);
+    }
+    if (!qcow2_set_l2_entry(qcow, pos, qcow->backing ? QCOW2_OFLAG_ZERO : 0)) {
+        return false;
+    }
+    if (host && type != QCOW2_CLUSTER_COMPRESSED) {
+        return qcow2_free_cluster(qcow, host);
+    }
+    return true;
+}
+
+/*
+ * Online compaction
+ *
+ * Discarded clusters become holes in the host file, but new clusters are
+ * still allocated at the end of image, so its apparent size only grows.
+ * Once enough space was released, a background task moves data clusters,
+ * L2 tables and refcount blocks from the end of image into free clusters below,
+ * and truncates the file. L1 and refcount tables are never moved. Moves are
+ * done in small batches under the image lock, after draining transfers which
+ * access data clusters outside of it. Cluster owners are found by a single scan
+ * per run, the map is kept up to date with moves and refreshed only when a
+ * cluster allocated after the scan reaches the top.
+ */
+
+static uint64_t qcow2_get_refcount(qcow2_image_t* qcow, uint64_t offset, bool* present)
+{
+    size_t index = 0;
+    uint8_t* block = qcow2_get_refblock(qcow, offset, &index, false);
+    if (present) {
+        *present = !!block;
+    }
+    return block ? qcow2_refcount_read(block, qcow->ref_order, index) : 0;
+}
+
+// Map host clusters to the table entries referencing them
+static bool qcow2_scan_owners(qcow2_image_t* qcow, uint64_t* owners, uint64_t clusters)
+{
+    uint8_t* l2 = safe_malloc(qcow->cluster_size);
+    bool ret = true;
+    for (uint64_t ref_index = 0; ref_index < qcow->reftable_size; ++ref_index) {
+        uint64_t block_offset = qcow->reftable[ref_index];
+        if (block_offset && (block_offset >> qcow->cluster_bits) < clusters) {
+            owners[block_offset >> qcow->cluster_bits] = QCOW2_OWNER_REF | ref_index;
+        }
+    }
+    for (uint64_t l1_index = 0; l1_index < qcow->l1_size && ret; ++l1_index) {
+        uint64_t l2_offset = qcow->l1[l1_index] & QCOW2_OFFSET_MASK;
+        if (!l2_offset) {
+            continue;
+        }
+        if ((l2_offset >> qcow->cluster_bits) < clusters) {
+            owners[l2_offset >> qcow->cluster_bits] = QCOW2_OWNER_L2 | l1_index;
+        }
+        ret = rvread(qcow->file, l2, qcow->cluster_size, l2_offset) == qcow->cluster_size;
+        for (size_t i = 0; ret && i < (1ULL << qcow->l2_bits); ++i) {
+            uint64_t entry = read_uint64_be_m(l2 + (i << 3));
+            uint64_t host = entry & QCOW2_OFFSET_MASK;
+            if (host && !(entry & QCOW2_OFLAG_COMPRESSED) && (host >> qcow->cluster_bits) < clusters) {
+                owners[host >> qcow->cluster_bits] = QCOW2_OWNER_DATA | ((l1_index << qcow->l2_bits) + i);
+            }
+        }
+    }
+    free(l2);
+    return ret;
+}
+
+static bool qcow2_move_cluster(qcow2_image_t* qcow, uint64_t owner, uint64_t src, uint64_t dst)
+{
+    // Destination is accounted first, an interrupted move only leaks a cluster
+    if (!qcow2_set_refcount(qcow, dst, 1)
+     || rvread(qcow->file, qcow->buffer, qcow->cluster_size, src) != qcow->cluster_size
+     || rvwrite(qcow->file, qcow->buffer, qcow->cluster_size, dst) != qcow->cluster_size) {
+        return false;
+    }
+    uint64_t index = owner & QCOW2_OWNER_MASK;
+    if ((owner & ~QCOW2_OWNER_MASK) == QCOW2_OWNER_REF) {
+        // Destination refcount may live in this very block, it was updated before the copy
+        uint8_t tmp[8] = {0};
+        write_uint64_be_m(tmp, dst);
+        if (!qcow2_write_meta(qcow, tmp, sizeof(tmp), qcow->reftable_offset + (index << 3))) {
+            return false;
+        }
+        qcow->reftable[index] = dst;
+        for (size_t i = 0; i < QCOW2_REF_CACHE_SIZE; ++i) {
+            if (qcow->ref_cache[i].offset == src) {
+                qcow->ref_cache[i].offset = 0;
+                qcow->ref_cache[i].used = 0;
+            }
+        }
+    } else if ((owner & ~QCOW2_OWNER_MASK) == QCOW2_OWNER_L2) {
+        uint64_t l1_index = index;
+        uint64_t l1_entry = (qcow->l1[l1_index] & ~QCOW2_OFFSET_MASK) | dst;
+        uint8_t tmp[8] = {0};
+        write_uint64_be_m(tmp, l1_entry);
+        if (!qcow2_write_meta(qcow, tmp, sizeof(tmp), qcow->l1_offset + (l1_index << 3))) {
+            return false;
+        }
+        qcow->l1[l1_index] = l1_entry;
+        for (size_t i = 0; i < QCOW2_L2_CACHE_SIZE; ++i) {
+            if (qcow->l2_cache[i].offset == src) {
+                qcow->l2_cache[i].offset = 0;
+                qcow->l2_cache[i].used = 0;
+            }
+        }
+    } else {
+        uint64_t pos = index << qcow->cluster_bits;
+        uint64_t entry = 0;
+        if (!qcow2_get_l2_entry(qcow, pos, &entry)
+         || !qcow2_set_l2_entry(qcow, pos, (entry & ~QCOW2_OFFSET_MASK) | dst)) {
+            return false;
+        }
+    }
+    return qcow2_free_cluster(qcow, src);
+}
+
+// Compaction state kept between batches
+typedef struct {
+    uint64_t* owners;  // Host cluster -> Owner, built once and updated by moves
+    uint64_t clusters; // Host clusters covered by the owner map
+    uint64_t low;      // No free clusters below this one
+} qcow2_compact_t;
+
+static bool qcow2_compact_rescan(qcow2_image_t* qcow, qcow2_compact_t* compact)
+{
+    free(compact->owners);
+    compact->clusters = qcow->alloc_offset >> qcow->cluster_bits;
+    compact->owners = safe_new_arr(uint64_t, compact->clusters);
+    return qcow2_scan_owners(qcow, compact->owners, compact->clusters);
+}
+
+// Check that the owner still references the cluster, the image changes between batches
+static bool qcow2_owner_valid(qcow2_image_t* qcow, uint64_t owner, uint64_t offset)
+{
+    uint64_t index = owner & QCOW2_OWNER_MASK;
+    if ((owner & ~QCOW2_OWNER_MASK) == QCOW2_OWNER_REF) {
+        return index < qcow->reftable_size && qcow->reftable[index] == offset;
+    } else if ((owner & ~QCOW2_OWNER_MASK) == QCOW2_OWNER_L2) {
+        return index < qcow->l1_size && (qcow->l1[index] & QCOW2_OFFSET_MASK) == offset;
+    } else if (owner) {
+        uint64_t entry = 0;
+        return qcow2_get_l2_entry(qcow, index << qcow->cluster_bits, &entry)
+            && !(entry & QCOW2_OFLAG_COMPRESSED) && (entry & QCOW2_OFFSET_MASK) == offset;
+    }
+    return false;
+}
+
+// Move a batch of clusters into free space, returns false when compaction is finished
+static bool qcow2_compact_step(qcow2_image_t* qcow, qcow2_compact_t* compact)
+{
+    while (atomic_load_uint32(&qcow->unlocked)) {
+        sleep_ms(0);
+    }
+    qcow2_punch_flush(qcow);
+    uint64_t top = qcow->alloc_offset >> qcow->cluster_bits;
+    size_t moved = 0;
+    bool ret = compact->owners || qcow2_compact_rescan(qcow, compact);
+    bool rescanned = false;
+    while (top && !qcow2_get_refcount(qcow, (top - 1) << qcow->cluster_bits, NULL)) {
+        top--;
+    }
+    while (ret && moved < QCOW2_COMPACT_BATCH) {
+        bool present = false;
+        uint64_t src = top - 1;
+        // Free clusters without a refcount block would need one allocated at the end
+        while (compact->low < src
+           && (qcow2_get_refcount(qcow, compact->low << qcow->cluster_bits, &present) || !present)) {
+            compact->low++;
+        }
+        if (compact->low >= src || qcow2_get_refcount(qcow, src << qcow->cluster_bits, NULL) != 1) {
+            // No free space below, or the last cluster is shared
+            break;
+        }
+        if (src < compact->clusters && !compact->owners[src]) {
+            // Unmovable metadata, clusters below the map end are only allocated by compaction
+            break;
+        }
+        if (src >= compact->clusters || !qcow2_owner_valid(qcow, compact->owners[src], src << qcow->cluster_bits)) {
+            // Cluster was allocated since the owner map was built, refresh it once per batch
+            if (rescanned) {
+                break;
+            }
+            rescanned = true;
+            ret = qcow2_compact_rescan(qcow, compact);
+            if (!ret || !qcow2_owner_valid(qcow, compact->owners[src], src << qcow->cluster_bits)) {
+                // Unmovable metadata
+                break;
+            }
+        }
+        uint64_t owner = compact->owners[src];
+        uint64_t dst = compact->low;
+        ret = qcow2_move_cluster(qcow, owner, src << qcow->cluster_bits, dst << qcow->cluster_bits);
+        compact->owners[src] = 0;
+        compact->owners[dst] = owner;
+        moved++;
+        while (top && !qcow2_get_refcount(qcow, (top - 1) << qcow->cluster_bits, NULL)) {
+            top--;
+        }
+    }
+    qcow2_punch_flush(qcow);
+    if (!ret) {
+        rvvm_warn("QCOW2 image compaction failed");
+        return false;
+    }
+    if (moved < QCOW2_COMPACT_BATCH) {
+        // Cut off the free tail
+        uint64_t end = top << qcow->cluster_bits;
+        if (end < qcow->alloc_offset && rvtruncate(qcow->file, end)) {
+            qcow->alloc_offset = end;
+        }
+        return false;
+    }
+    return true;
+}
+
+static void* qcow2_compact_worker(void* arg)
+{
+    qcow2_image_t* qcow = arg;
+    qcow2_compact_t compact = {0};
+    uint64_t size = rvfilesize(qcow->file);
+    bool more = true;
+    while (more && !atomic_load_uint32(&qcow->compact_stop)) {
+        spin_lock_slow(&qcow->lock);
+        more = qcow2_compact_step(qcow, &compact);
+        spin_unlock(&qcow->lock);
+    }
+    free(compact.owners);
+    if (rvfilesize(qcow->file) + (1 << 20) <= size) {
+        rvvm_info("Compacted QCOW2 image by %llu MiB", (unsigned long long)((size - rvfilesize(qcow->file)) >> 20));
+    }
+    atomic_store_uint32(&qcow->compacting, 0);
+    return NULL;
+}
+
+/*
+ * Block device interface
+ */
+
+static void qcow2_close(void* dev)
+{
+    qcow2_image_t* qcow = dev;
+    atomic_store_uint32(&qcow->compact_stop, 1);
+    if (qcow->compact_thread) {
+        thread_join(qcow->compact_thread);
+    }
+    qcow2_punch_flush(qcow);
+    for (size_t i = 0; i < QCOW2_L2_CACHE_SIZE; ++i) {
+        free(qcow->l2_cache[i].data);
+    }
+    for (size_t i = 0; i < QCOW2_REF_CACHE_SIZE; ++i) {
+        free(qcow->ref_cache[i].data);
+    }
+    blk_close(qcow->backing);
+    rvclose(qcow->file);
+    free(qcow->l1);
+    free(qcow->reftable);
+    free(qcow->buffer);
+    free(qcow);
+}
+
+static size_t qcow2_read(void* dev, void* dst, size_t size, uint64_t offset)
+{
+    qcow2_image_t* qcow = dev;
+    uint8_t* buffer = dst;
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint64_t host = 0;
+        size_t len = size - done;
+        spin_lock_slow(&qcow->lock);
+        uint32_t type = qcow2_map_extent(qcow, pos, &len, &host);
+        if (type == QCOW2_CLUSTER_DATA) {
+            // Data is read outside the lock, compaction waits for such transfers
+            atomic_add_uint32(&qcow->unlocked, 1);
+        }
+        spin_unlock(&qcow->lock);
+        switch (type) {
+            case QCOW2_CLUSTER_DATA: {
+                bool ret = rvread(qcow->file, buffer + done, len, host) == len;
+                atomic_sub_uint32(&qcow->unlocked, 1);
+                if (!ret) {
+                    return done;
+                }
+                break;
+            }
+            case QCOW2_CLUSTER_ZERO:
+                memset(buffer + done, 0, len);
+                break;
+            case QCOW2_CLUSTER_UNALLOC:
+                if (!qcow2_read_backing(qcow, buffer + done, len, pos)) {
+                    return done;
+                }
+                break;
+            default:
+                rvvm_error("Compressed QCOW2 clusters aren't supported");
+                return done;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static size_t qcow2_write(void* dev, const void* src, size_t size, uint64_t offset)
+{
+    qcow2_image_t* qcow = dev;
+    const uint8_t* buffer = src;
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint64_t host = 0;
+        size_t len = size - done;
+        spin_lock_slow(&qcow->lock);
+        uint32_t type = qcow2_map_extent(qcow, pos, &len, &host);
+        if (type == QCOW2_CLUSTER_DATA) {
+            atomic_add_uint32(&qcow->unlocked, 1);
+            spin_unlock(&qcow->lock);
+            bool ret = rvwrite(qcow->file, buffer + done, len, host) == len;
+            atomic_sub_uint32(&qcow->unlocked, 1);
+            if (!ret) {
+                return done;
+            }
+        } else {
+            len = EVAL_MIN(size - done, qcow->cluster_size - (pos & (qcow->cluster_size - 1)));
+            bool ret = qcow2_write_alloc(qcow, buffer + done, len, pos);
+            spin_unlock(&qcow->lock);
+            if (!ret) {
+                return done;
+            }
+        }
+        done += len;
+    }
+    return done;
+}
+
+// Check whether a cluster already reads as zeroes without looking at its data
+static bool qcow2_cluster_zeroed(qcow2_image_t* qcow, uint64_t pos)
+{
+    uint64_t entry = 0;
+    spin_lock_slow(&qcow->lock);
+    bool ret = qcow2_get_l2_entry(qcow, pos, &entry);
+    uint32_t type = qcow2_cluster_type(qcow, entry);
+    spin_unlock(&qcow->lock);
+    if (!ret) {
+        return false;
+    }
+    if (type == QCOW2_CLUSTER_UNALLOC) {
+        // Unallocated clusters past the end of backing file are zero as well
+        return !qcow->backing || (pos & ~(uint64_t)(qcow->cluster_size - 1)) >= blk_getsize(qcow->backing);
+    }
+    return type == QCOW2_CLUSTER_ZERO;
+}
+
+static bool qcow2_write_zeroes(qcow2_image_t* qcow, uint64_t offset, uint64_t size)
+{
+    void* zeroes = NULL;
+    bool ret = true;
+    while (size && ret) {
+        size_t len = EVAL_MIN(size, qcow->cluster_size - (offset & (qcow->cluster_size - 1)));
+        if (!qcow2_cluster_zeroed(qcow, offset)) {
+            // Don't allocate a cluster just to store zeroes in it
+            if (!zeroes) zeroes = safe_calloc(qcow->cluster_size, 1);
+            ret = qcow2_write(qcow, zeroes, len, offset) == len;
+        }
+        offset += len;
+        size -= len;
+    }
+    free(zeroes);
+    return ret;
+}
+
+static bool qcow2_trim(void* dev, uint64_t offset, uint64_t size)
+{
+    qcow2_image_t* qcow = dev;
+    uint64_t cluster_mask = qcow->cluster_size - 1;
+    uint64_t start = (offset + cluster_mask) & ~cluster_mask;
+    uint64_t end = (offset + size) & ~cluster_mask;
+    bool ret = true;
+    if (start >= end) {
+        // No whole clusters in range
+        start = end = offset + size;
+    }
+    // Zero partial clusters at the edges
+    if (!qcow2_write_zeroes(qcow, offset, start - offset)
+     || !qcow2_write_zeroes(qcow, end, offset + size - end)) {
+        return false;
+    }
+    spin_lock_slow(&qcow->lock);
+    for (uint64_t pos = start; pos < end && ret; pos += qcow->cluster_size) {
+        ret = qcow2_discard_cluster(qcow, pos);
+    }
+    qcow2_punch_flush(qcow);
+    bool compact = qcow->released >= QCOW2_COMPACT_MIN && qcow->released >= (qcow->alloc_offset >> 3)
+                && !atomic_swap_uint32(&qcow->compacting, 1);
+    if (compact) {
+        qcow->released = 0;
+    }
+    spin_unlock(&qcow->lock);
+    if (compact) {
+        // Compaction runs for long, don't occupy a shared pool worker with it.
+        // The previous compaction thread has already finished at this point
+        if (qcow->compact_thread) {
+            thread_join(qcow->compact_thread);
+        }
+        qcow->compact_thread = thread_create(qcow2_compact_worker, qcow);
+        if (qcow->compact_thread == NULL) {
+            atomic_store_uint32(&qcow->compacting, 0);
+        }
+    }
+    return ret;
+}
+
+static bool qcow2_sync(void* dev)
+{
+    qcow2_image_t* qcow = dev;
+    return rvfsync(qcow->file);
+}
+
+static const blkdev_type_t blkdev_type_qcow2 = {
+    .name  = "blk-qcow2",
+    .close = qcow2_close,
+    .read  = qcow2_read,
+    .write = qcow2_write,
+    .trim  = qcow2_trim,
+    .sync  = qcow2_sync,
+};
+
+/*
+ * Image opening
+ */
+
+static blkdev_t* qcow2_open_internal(const char* filename, uint8_t filemode, uint32_t depth);
+
+static blkdev_t* qcow2_open_backing(const char* filename, const char* name, uint32_t depth)
+{
+    char path[256] = {0};
+    rvvm_path_relative(path, sizeof(path), filename, name);
+    if (depth >= QCOW2_MAX_BACKING_DEPTH) {
+        rvvm_error("QCOW2 backing chain is too deep");
+        return NULL;
+    }
+    rvfile_t* file = rvopen(path, 0);
+    uint8_t magic[4] = {0};
+    if (!file) {
+        rvvm_error("Failed to open QCOW2 backing file %s", path);
+        return NULL;
+    }
+    rvread(file, magic, sizeof(magic), 0);
+    rvclose(file);
+    if (read_uint32_be_m(magic) == QCOW2_MAGIC) {
+        return qcow2_open_internal(path, 0, depth + 1);
+    }
+    return blk_open(path, 0);
+}
+
+static bool qcow2_load_table(qcow2_image_t* qcow, uint64_t** table, uint64_t offset, size_t count)
+{
+    *table = safe_new_arr(uint64_t, count);
+    if (rvread(qcow->file, *table, count << 3, offset) != (count << 3)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        (*table)[i] = read_uint64_be_m(&(*table)[i]);
+    }
+    return true;
+}
+
+static bool qcow2_parse_header(qcow2_image_t* qcow, const char* filename, uint8_t filemode, uint32_t depth, uint64_t* size)
+{
+    uint8_t header[QCOW2_HEADER_V3_SIZE] = {0};
+    if (rvread(qcow->file, header, QCOW2_HEADER_V2_SIZE, 0) != QCOW2_HEADER_V2_SIZE
+     || read_uint32_be_m(header) != QCOW2_MAGIC) {
+        rvvm_error("%s is not a QCOW2 image", filename);
+        return false;
+    }
+    qcow->version = read_uint32_be_m(header + 4);
+    if (qcow->version == 3) {
+        size_t tail = QCOW2_HEADER_V3_SIZE - QCOW2_HEADER_V2_SIZE;
+        if (rvread(qcow->file, header + QCOW2_HEADER_V2_SIZE, tail, QCOW2_HEADER_V2_SIZE) != tail) {
+            return false;
+        }
+    } else if (qcow->version != 2) {
+        rvvm_error("Unsupported QCOW2 version %u", qcow->version);
+        return false;
+    }
+
+    uint64_t backing_offset = read_uint64_be_m(header + 8);
+    uint32_t backing_size = read_uint32_be_m(header + 16);
+    uint64_t incompat = read_uint64_be_m(header + 72);
+    qcow->cluster_bits = read_uint32_be_m(header + 20);
+    qcow->l1_size = read_uint32_be_m(header + 36);
+    qcow->l1_offset = read_uint64_be_m(header + 40);
+    qcow->reftable_offset = read_uint64_be_m(header + 48);
+    qcow->ref_order = (qcow->version >= 3) ? read_uint32_be_m(header + 96) : 4;
+    *size = read_uint64_be_m(header + 24);
+
+    if (qcow->cluster_bits < 9 || qcow->cluster_bits > 21) {
+        rvvm_error("Invalid QCOW2 cluster size");
+        return false;
+    }
+    qcow->cluster_size = 1U << qcow->cluster_bits;
+    qcow->l2_bits = qcow->cluster_bits - 3;
+    if (read_uint32_be_m(header + 32)) {
+        rvvm_error("Encrypted QCOW2 images aren't supported");
+        return false;
+    }
+    if (incompat & ~(uint64_t)QCOW2_INCOMPAT_KNOWN) {
+        rvvm_error("Unsupported QCOW2 features 0x%llx", (unsigned long long)(incompat & ~(uint64_t)QCOW2_INCOMPAT_KNOWN));
+        return false;
+    }
+    if ((filemode & RVFILE_RW) && (incompat & (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT))) {
+        rvvm_error("QCOW2 image %s needs repair, use qemu-img check -r all", filename);
+        return false;
+    }
+    if ((filemode & RVFILE_RW) && read_uint32_be_m(header + 60)) {
+        rvvm_error("QCOW2 images with internal snapshots can only be opened read-only");
+        return false;
+    }
+    if (qcow->ref_order < 3 || qcow->ref_order > 6) {
+        rvvm_error("Unsupported QCOW2 refcount width %u", 1U << qcow->ref_order);
+        return false;
+    }
+    qcow->refblk_bits = qcow->cluster_bits + 3 - qcow->ref_order;
+
+    // Validate tables
+    uint64_t l2_coverage = 1ULL << (qcow->cluster_bits + qcow->l2_bits);
+    uint64_t reftable_bytes = (uint64_t)read_uint32_be_m(header + 56) << qcow->cluster_bits;
+    if (!*size || !qcow->l1_offset || !qcow->reftable_offset || qcow->l1_size > QCOW2_MAX_L1_SIZE / 8 || qcow->l1_size < (*size + l2_coverage - 1) / l2_coverage
+     || (qcow->l1_offset & (qcow->cluster_size - 1)) || (qcow->reftable_offset & (qcow->cluster_size - 1))
+     || !reftable_bytes || reftable_bytes > QCOW2_MAX_REFTABLE_SIZE) {
+        rvvm_error("Invalid QCOW2 image %s", filename);
+        return false;
+    }
+    qcow->reftable_size = reftable_bytes >> 3;
+    if (!qcow2_load_table(qcow, &qcow->l1, qcow->l1_offset, qcow->l1_size)
+     || !qcow2_load_table(qcow, &qcow->reftable, qcow->reftable_offset, qcow->reftable_size)) {
+        rvvm_error("Failed to read QCOW2 tables");
+        return false;
+    }
+    for (size_t i = 0; i < qcow->reftable_size; ++i) {
+        qcow->reftable[i] &= ~0x1FFULL;
+    }
+
+    if (backing_offset && backing_size) {
+        char name[QCOW2_MAX_BACKING_NAME + 1] = {0};
+        if (backing_size > QCOW2_MAX_BACKING_NAME
+         || rvread(qcow->file, name, backing_size, backing_offset) != backing_size) {
+            rvvm_error("Invalid QCOW2 backing file name");
+            return false;
+        }
+        qcow->backing = qcow2_open_backing(filename, name, depth);
+        if (!qcow->backing) {
+            return false;
+        }
+    }
+
+    if ((filemode & RVFILE_RW) && qcow->version >= 3 && read_uint64_be_m(header + 88)) {
+        // Clear autoclear features we don't maintain
+        uint8_t autoclear[8] = {0};
+        if (!qcow2_write_meta(qcow, autoclear, sizeof(autoclear), 88)) {
+            return false;
+        }
+    }
+    qcow->alloc_offset = align_size_up(rvfilesize(qcow->file), qcow->cluster_size);
+    return true;
+}
+
+static blkdev_t* qcow2_open_internal(const char* filename, uint8_t filemode, uint32_t depth)
+{
+    rvfile_t* file = rvopen(filename, filemode);
+    if (!file) return NULL;
+    qcow2_image_t* qcow = safe_new_obj(qcow2_image_t);
+    uint64_t size = 0;
+    qcow->file = file;
+    spin_init(&qcow->lock);
+    if (!qcow2_parse_header(qcow, filename, filemode, depth, &size)) {
+        qcow2_close(qcow);
+        return NULL;
+    }
+    qcow->buffer = safe_malloc(qcow->cluster_size);
+
+    blkdev_t* dev = safe_new_obj(blkdev_t);
+    dev->type = &blkdev_type_qcow2;
+    dev->size = size;
+    dev->data = qcow;
+    return dev;
+}
+
+blkdev_t* blk_qcow2_open(const char* filename, uint8_t filemode)
+{
+    return qcow2_open_internal(filename, filemode, 0);
+}
@@ -0,0 +1,235 @@
+/*
+blk_stats.c - Block IO statistics
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "blk_io.h"
+#include "rvvmlib.h"
+#include "utils.h"
+#include "atomics.h"
+#include "bit_ops.h"
+#include "spinlock.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "vector.h"
+
+#include <string.h>
+
+BUILD_ASSERT(BLKDEV_IO_OPS == RVVM_BLK_STAT_OPS);
+BUILD_ASSERT(BLK_STATS_BUCKETS == RVVM_BLK_STAT_BUCKETS);
+
+typedef struct {
+    blk_stats_t* stats;
+    char name[64];
+    // Counters at the previous periodic dump, to report rates
+    uint64_t last_ops[BLKDEV_IO_OPS];
+    uint64_t last_bytes[BLKDEV_IO_OPS];
+} blk_stats_entry_t;
+
+static spinlock_t blk_stats_lock;
+static vector_t(blk_stats_entry_t) blk_stats_list;
+static uint64_t blk_stats_last_dump;
+
+// Periodic dump requested by -blk_stats
+static thread_ctx_t* blk_stats_thread;
+static cond_var_t* blk_stats_cond;
+static uint32_t blk_stats_stop;
+
+static const char* blk_stats_op_names[BLKDEV_IO_OPS] = { "read", "write", "sync", "trim", };
+
+static uint64_t blk_stats_clock(void)
+{
+    return rvtimer_clocksource(1000000000ULL);
+}
+
+uint64_t blk_stats_begin(blk_stats_t* stats)
+{
+    uint32_t depth = atomic_add_uint32_ex(&stats->inflight, 1, ATOMIC_RELAXED) + 1;
+    uint32_t max = atomic_load_uint32_relax(&stats->inflight_max);
+    while (depth > max && !atomic_cas_uint32_ex(&stats->inflight_max, max, depth, true, ATOMIC_RELAXED, ATOMIC_RELAXED)) {
+        max = atomic_load_uint32_relax(&stats->inflight_max);
+    }
+    return blk_stats_clock();
+}
+
+void blk_stats_end(blk_stats_t* stats, uint32_t op, uint64_t bytes, uint64_t start, bool success)
+{
+    atomic_sub_uint32_ex(&stats->inflight, 1, ATOMIC_RELAXED);
+    if (!success) {
+        atomic_add_uint64_ex(&stats->errors, 1, ATOMIC_RELAXED);
+    } else if (op < BLKDEV_IO_OPS) {
+        uint64_t usec = (blk_stats_clock() - start) / 1000;
+        size_t bucket = EVAL_MIN(64 - bit_clz64(usec), BLK_STATS_BUCKETS - 1);
+        atomic_add_uint64_ex(&stats->ops[op], 1, ATOMIC_RELAXED);
+        atomic_add_uint64_ex(&stats->bytes[op], bytes, ATOMIC_RELAXED);
+        atomic_add_uint64_ex(&stats->latency[op][bucket], 1, ATOMIC_RELAXED);
+    }
+}
+
+void blk_stats_merged(blk_stats_t* stats, uint64_t count)
+{
+    if (count) {
+        atomic_add_uint64_ex(&stats->merged, count, ATOMIC_RELAXED);
+    }
+}
+
+static void* blk_stats_dump_worker(void* arg)
+{
+    uint64_t interval = ((size_t)arg) * 1000000000ULL;
+    uint64_t deadline = blk_stats_clock();
+    while (true) {
+        deadline += interval;
+        uint64_t now = blk_stats_clock();
+        while (!atomic_load_uint32(&blk_stats_stop) && now < deadline) {
+            condvar_wait_ns(blk_stats_cond, deadline - now);
+            now = blk_stats_clock();
+        }
+        if (atomic_load_uint32(&blk_stats_stop)) {
+            return NULL;
+        }
+        rvvm_dump_blk_stats();
+    }
+}
+
+static void blk_stats_deinit(void)
+{
+    // Devices go away at deinit, stop reading them
+    atomic_store_uint32(&blk_stats_stop, 1);
+    condvar_wake(blk_stats_cond);
+    thread_join(blk_stats_thread);
+    condvar_free(blk_stats_cond);
+    blk_stats_thread = NULL;
+    blk_stats_cond = NULL;
+}
+
+static void blk_stats_init(void)
+{
+    spin_init(&blk_stats_lock);
+    vector_init(blk_stats_list);
+    blk_stats_last_dump = blk_stats_clock();
+    int interval = rvvm_getarg_int("blk_stats");
+    if (interval > 0) {
+        blk_stats_cond = condvar_create();
+        blk_stats_thread = thread_create(blk_stats_dump_worker, (void*)(size_t)interval);
+        if (blk_stats_thread) {
+            call_at_deinit(blk_stats_deinit);
+        }
+    }
+}
+
+static void blk_stats_init_once(void)
+{
+    DO_ONCE(blk_stats_init());
+}
+
+void blk_stats_register(blk_stats_t* stats, const char* name)
+{
+    blk_stats_init_once();
+    size_t len = rvvm_strlen(name);
+    blk_stats_entry_t entry = { .stats = stats, };
+    // Keep the tail of long paths, it's the distinctive part
+    rvvm_strlcpy(entry.name, name + (len >= sizeof(entry.name) ? len - sizeof(entry.name) + 1 : 0), sizeof(entry.name));
+    spin_lock_slow(&blk_stats_lock);
+    vector_push_back(blk_stats_list, entry);
+    spin_unlock(&blk_stats_lock);
+}
+
+void blk_stats_unregister(blk_stats_t* stats)
+{
+    blk_stats_init_once();
+    spin_lock_slow(&blk_stats_lock);
+    vector_foreach(blk_stats_list, i) {
+        if (vector_at(blk_stats_list, i).stats == stats) {
+            vector_erase(blk_stats_list, i);
+            break;
+        }
+    }
+    spin_unlock(&blk_stats_lock);
+}
+
+static void blk_stats_snapshot(rvvm_blk_stats_t* dst, const blk_stats_entry_t* entry)
+{
+    const blk_stats_t* stats = entry->stats;
+    memset(dst, 0, sizeof(rvvm_blk_stats_t));
+    rvvm_strlcpy(dst->name, entry->name, sizeof(dst->name));
+    for (size_t op = 0; op < BLKDEV_IO_OPS; ++op) {
+        dst->ops[op] = atomic_load_uint64_relax(&stats->ops[op]);
+        dst->bytes[op] = atomic_load_uint64_relax(&stats->bytes[op]);
+        for (size_t i = 0; i < BLK_STATS_BUCKETS; ++i) {
+            dst->latency[op][i] = atomic_load_uint64_relax(&stats->latency[op][i]);
+        }
+    }
+    dst->errors = atomic_load_uint64_relax(&stats->errors);
+    dst->merged = atomic_load_uint64_relax(&stats->merged);
+    dst->inflight = atomic_load_uint32_relax(&stats->inflight);
+    dst->inflight_max = atomic_load_uint32_relax(&stats->inflight_max);
+}
+
+PUBLIC size_t rvvm_get_blk_stats(rvvm_blk_stats_t* stats, size_t count)
+{
+    blk_stats_init_once();
+    spin_lock_slow(&blk_stats_lock);
+    size_t total = vector_size(blk_stats_list);
+    for (size_t i = 0; stats && i < EVAL_MIN(total, count); ++i) {
+        blk_stats_snapshot(&stats[i], &vector_at(blk_stats_list, i));
+    }
+    spin_unlock(&blk_stats_lock);
+    return total;
+}
+
+// Upper bound of the histogram bucket containing the given percentile, in microseconds
+static uint64_t blk_stats_percentile(const rvvm_blk_stats_t* stats, size_t op, uint64_t permille)
+{
+    uint64_t target = (stats->ops[op] * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BLK_STATS_BUCKETS; ++i) {
+        seen += stats->latency[op][i];
+        if (seen >= target) {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << (BLK_STATS_BUCKETS - 1);
+}
+
+PUBLIC void rvvm_dump_blk_stats(void)
+{
+    blk_stats_init_once();
+    spin_lock_slow(&blk_stats_lock);
+    uint64_t now = blk_stats_clock();
+    uint64_t elapsed_ms = EVAL_MAX((now - blk_stats_last_dump) / 1000000, 1);
+    blk_stats_last_dump = now;
+    vector_foreach(blk_stats_list, i) {
+        blk_stats_entry_t* entry = &vector_at(blk_stats_list, i);
+        rvvm_blk_stats_t stats;
+        blk_stats_snapshot(&stats, entry);
+        uint64_t total = 0;
+        for (size_t op = 0; op < BLKDEV_IO_OPS; ++op) {
+            total += stats.ops[op];
+        }
+        if (total == 0 && stats.errors == 0) {
+            // Skip idle entries
+            continue;
+        }
+        rvvm_report("IO stats %s: inflight %u (max %u), merged %llu, errors %llu", stats.name,
+                    stats.inflight, stats.inflight_max, (unsigned long long)stats.merged, (unsigned long long)stats.errors);
+        for (size_t op = 0; op < BLKDEV_IO_OPS; ++op) {
+            if (stats.ops[op]) {
+                uint64_t iops = (stats.ops[op] - entry->last_ops[op]) * 1000 / elapsed_ms;
+                uint64_t kbps = (stats.bytes[op] - entry->last_bytes[op]) * 1000 / elapsed_ms / 1024;
+                rvvm_report("  %-5s %llu ops, %llu KiB; %llu IOPS, %llu KiB/s; latency p50 <%lluus, p99 <%lluus, max <%lluus",
+                            blk_stats_op_names[op], (unsigned long long)stats.ops[op], (unsigned long long)(stats.bytes[op] >> 10),
+                            (unsigned long long)iops, (unsigned long long)kbps,
+                            (unsigned long long)blk_stats_percentile(&stats, op, 500),
+                            (unsigned long long)blk_stats_percentile(&stats, op, 990),
+                            (unsigned long long)blk_stats_percentile(&stats, op, 1000));
+            }
+            entry->last_ops[op] = stats.ops[op];
+            entry->last_bytes[op] = stats.bytes[op];
+        }
+    }
+    spin_unlock(&blk_stats_lock);
+}
@@ -0,0 +1,267 @@
+/*
+blk_uring.c - Asynchronous block IO via Linux io_uring
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_SETUP_R_DISABLED) && !defined(USE_NO_IO_URING)
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#define BLK_URING_IMPL
+#endif
+
+#include "blk_io.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "threading.h"
+#include "rvtimer.h"
+
+#ifdef BLK_URING_IMPL
+
+#define BLK_URING_ENTRIES 256
+
+// Readv/writev limits
+#define BLK_URING_MAX_IOV  1024
+#define BLK_URING_MAX_SIZE 0x7FFFF000
+
+// Guest DMA buffers are passed to the kernel directly as iovecs
+// Layout of blk_iovec_t is asserted to match struct iovec in blk_io.c
+
+typedef struct {
+    int fd;
+    uint32_t run;
+    uint32_t pending;
+    uint32_t inflight;
+    spinlock_t lock;
+    thread_ctx_t* thread;
+
+    void*  ring;
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t  sq_entries;
+    uint32_t  cq_entries;
+} blk_uring_t;
+
+static blk_uring_t uring = { .fd = -1, };
+
+static int blk_uring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static void blk_uring_flush(void)
+{
+    // Coalesce submissions from concurrent threads into a single syscall
+    if (!atomic_swap_uint32(&uring.pending, 1)) {
+        atomic_store_uint32(&uring.pending, 0);
+        blk_uring_enter(uring.sq_entries, 0, 0);
+    }
+}
+
+static bool blk_uring_push(uint8_t opcode, const blk_io_req_t* req, int fd)
+{
+    spin_lock(&uring.lock);
+    uint32_t tail = *uring.sq_tail;
+    if (tail - atomic_load_uint32_ex(uring.sq_head, ATOMIC_ACQUIRE) >= uring.sq_entries) {
+        // Submission ring is full
+        spin_unlock(&uring.lock);
+        return false;
+    }
+    struct io_uring_sqe* sqe = &uring.sqes[tail & (uring.sq_entries - 1)];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    if (req) {
+        sqe->addr = (size_t)req->iov;
+        sqe->len = req->iov_count;
+        sqe->off = req->offset;
+        sqe->user_data = (size_t)req;
+    }
+    atomic_store_uint32_ex(uring.sq_tail, tail + 1, ATOMIC_RELEASE);
+    spin_unlock(&uring.lock);
+    blk_uring_flush();
+    return true;
+}
+
+static void* blk_uring_worker(void* arg)
+{
+    while (atomic_load_uint32_relax(&uring.run)) {
+        uint32_t head = *uring.cq_head;
+        uint32_t tail = atomic_load_uint32_ex(uring.cq_tail, ATOMIC_ACQUIRE);
+        if (head == tail) {
+            blk_uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &uring.cqes[head & (uring.cq_entries - 1)];
+            blk_io_req_t* req = (blk_io_req_t*)(size_t)cqe->user_data;
+            int32_t res = cqe->res;
+            atomic_store_uint32_ex(uring.cq_head, ++head, ATOMIC_RELEASE);
+            if (req == NULL) {
+                // Wakeup request
+                continue;
+            }
+            atomic_sub_uint32(&uring.inflight, 1);
+            if (res >= 0 && (uint64_t)res == req->size) {
+                if (req->iov_count > 1) {
+                    // Multiple iovecs were transferred by a single host operation
+                    blk_stats_merged(&req->dev->stats, req->iov_count - 1);
+                }
+                blk_io_complete(req, true);
+            } else if (res >= 0 || res == -EAGAIN || res == -EINTR) {
+                // Short transfer, finish it synchronously
+                req->done = EVAL_MAX(res, 0);
+                blk_io_fallback(req);
+            } else {
+                blk_io_complete(req, false);
+            }
+        }
+    }
+    return arg;
+}
+
+static void blk_uring_terminate(void)
+{
+    atomic_store_uint32(&uring.run, 0);
+    while (!blk_uring_push(IORING_OP_NOP, NULL, -1)) {
+        sleep_ms(1);
+    }
+    thread_join(uring.thread);
+    munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+    munmap(uring.ring, uring.ring_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
+
+static void blk_uring_setup(void)
+{
+    if (rvvm_has_arg("no_io_uring")) {
+        return;
+    }
+
+    // Disabled ring allows to restrict it before use
+    struct io_uring_params params = { .flags = IORING_SETUP_R_DISABLED, };
+    int fd = syscall(__NR_io_uring_setup, BLK_URING_ENTRIES, &params);
+    if (fd < 0) {
+        rvvm_info("io_uring is not available, using threaded block IO");
+        return;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return;
+    }
+
+    // Requests submitted by the ring bypass seccomp, allow nothing but data transfers
+    struct io_uring_restriction res[3] = {0};
+    res[0].opcode = IORING_RESTRICTION_SQE_OP;
+    res[0].sqe_op = IORING_OP_READV;
+    res[1].opcode = IORING_RESTRICTION_SQE_OP;
+    res[1].sqe_op = IORING_OP_WRITEV;
+    res[2].opcode = IORING_RESTRICTION_SQE_OP;
+    res[2].sqe_op = IORING_OP_NOP;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_RESTRICTIONS, res, STATIC_ARRAY_SIZE(res))
+     || syscall(__NR_io_uring_register, fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0)) {
+        rvvm_info("io_uring restrictions are not supported, using threaded block IO");
+        close(fd);
+        return;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = EVAL_MAX(sq_size, cq_size);
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring != MAP_FAILED) munmap(ring, ring_size);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        close(fd);
+        return;
+    }
+
+    uring.fd = fd;
+    uring.ring = ring;
+    uring.ring_size = ring_size;
+    uring.sqes = sqes;
+    uring.cqes = (struct io_uring_cqe*)(((uint8_t*)ring) + params.cq_off.cqes);
+    uring.sq_head = (uint32_t*)(((uint8_t*)ring) + params.sq_off.head);
+    uring.sq_tail = (uint32_t*)(((uint8_t*)ring) + params.sq_off.tail);
+    uring.cq_head = (uint32_t*)(((uint8_t*)ring) + params.cq_off.head);
+    uring.cq_tail = (uint32_t*)(((uint8_t*)ring) + params.cq_off.tail);
+    uring.sq_entries = params.sq_entries;
+    uring.cq_entries = params.cq_entries;
+
+    // Submission slots are consumed in order
+    uint32_t* sq_array = (uint32_t*)(((uint8_t*)ring) + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+
+    atomic_store_uint32(&uring.run, 1);
+    uring.thread = thread_create(blk_uring_worker, NULL);
+    call_at_deinit(blk_uring_terminate);
+}
+
+bool blk_uring_init(void)
+{
+    DO_ONCE(blk_uring_setup());
+    return uring.fd >= 0;
+}
+
+bool blk_uring_submit(int fd, blk_io_req_t* req)
+{
+    if (uring.fd < 0 || req->iov_count > BLK_URING_MAX_IOV || req->size > BLK_URING_MAX_SIZE) {
+        return false;
+    }
+    if (req->opcode != BLKDEV_IO_READ && req->opcode != BLKDEV_IO_WRITE) {
+        return false;
+    }
+    // Never overflow the completion ring
+    if (atomic_add_uint32(&uring.inflight, 1) >= uring.cq_entries - 1) {
+        atomic_sub_uint32(&uring.inflight, 1);
+        return false;
+    }
+    if (!blk_uring_push(req->opcode == BLKDEV_IO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV, req, fd)) {
+        atomic_sub_uint32(&uring.inflight, 1);
+        return false;
+    }
+    return true;
+}
+
+#else
+
+bool blk_uring_init(void)
+{
+    return false;
+}
+
+bool blk_uring_submit(int fd, blk_io_req_t* req)
+{
+    UNUSED(fd);
+    UNUSED(req);
+    return false;
+}
+
+#endif
@@ -0,0 +1,1114 @@
+/*
+ahci.c - Advanced Host Controller Interface (SATA)
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "ahci.h"
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "bit_ops.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+
+/*
+ * Useful resources:
+ * - Serial ATA AHCI 1.3.1 Specification
+ * - https://wiki.osdev.org/AHCI
+ * - ATA/ATAPI Command Set (ACS-3), NCQ feature set
+ */
+
+// Generic Host Control registers
+#define AHCI_REG_CAP  0x00 // Host Capabilities
+#define AHCI_REG_GHC  0x04 // Global Host Control
+#define AHCI_REG_IS   0x08 // Interrupt Status
+#define AHCI_REG_PI   0x0C // Ports Implemented
+#define AHCI_REG_VS   0x10 // Version
+#define AHCI_REG_PORT 0x100 // Port registers, 0x80 bytes each
+
+// Port registers
+#define PORT_REG_CLB  0x00 // Command List Base Address
+#define PORT_REG_CLBU 0x04
+#define PORT_REG_FB   0x08 // FIS Base Address
+#define PORT_REG_FBU  0x0C
+#define PORT_REG_IS   0x10 // Interrupt Status
+#define PORT_REG_IE   0x14 // Interrupt Enable
+#define PORT_REG_CMD  0x18 // Command and Status
+#define PORT_REG_TFD  0x20 // Task File Data
+#define PORT_REG_SIG  0x24 // Signature
+#define PORT_REG_SSTS 0x28 // SATA Status (SStatus)
+#define PORT_REG_SCTL 0x2C // SATA Control (SControl)
+#define PORT_REG_SERR 0x30 // SATA Error (SError)
+#define PORT_REG_SACT 0x34 // SATA Active (Outstanding NCQ tags)
+#define PORT_REG_CI   0x38 // Command Issue
+
+// Host Capabilities
+#define AHCI_CAP_S64A 0x80000000 // 64-bit Addressing
+#define AHCI_CAP_SNCQ 0x40000000 // Native Command Queuing
+#define AHCI_CAP_SCLO 0x01000000 // Command List Override
+#define AHCI_CAP_ISS  0x00300000 // Interface Speed: Gen 3 (6 Gbps)
+#define AHCI_CAP_SAM  0x00040000 // AHCI mode only
+#define AHCI_CAP_NCS  0x00001F00 // Number of Command Slots: 32
+
+// Global Host Control
+#define AHCI_GHC_HR   0x00000001 // HBA Reset
+#define AHCI_GHC_IE   0x00000002 // Interrupt Enable
+#define AHCI_GHC_MRSM 0x00000004 // MSI Revert to Single Message
+#define AHCI_GHC_AE   0x80000000 // AHCI Enable
+
+#define AHCI_VS 0x10301 // AHCI v1.3.1
+
+// Port Command and Status
+#define PORT_CMD_ST   0x00000001 // Start
+#define PORT_CMD_SUD  0x00000002 // Spin-Up Device
+#define PORT_CMD_POD  0x00000004 // Power On Device
+#define PORT_CMD_CLO  0x00000008 // Command List Override
+#define PORT_CMD_FRE  0x00000010 // FIS Receive Enable
+#define PORT_CMD_FR   0x00004000 // FIS Receive Running
+#define PORT_CMD_CR   0x00008000 // Command List Running
+
+// Port Interrupt Status
+#define PORT_IS_DHRS  0x00000001 // Device to Host Register FIS
+#define PORT_IS_PSS   0x00000002 // PIO Setup FIS
+#define PORT_IS_SDBS  0x00000008 // Set Device Bits FIS
+#define PORT_IS_TFES  0x40000000 // Task File Error
+
+#define PORT_SIG_ATA  0x00000101 // SATA drive signature
+#define PORT_SSTS_ATA 0x00000133 // Device present, Gen 3 link, active state
+
+// FIS types
+#define FIS_H2D 0x27 // Register FIS, Host to Device
+#define FIS_D2H 0x34 // Register FIS, Device to Host
+#define FIS_SDB 0xA1 // Set Device Bits FIS
+#define FIS_PIO 0x5F // PIO Setup FIS
+
+// Received FIS area offsets
+#define RX_FIS_PIO 0x20
+#define RX_FIS_D2H 0x40
+#define RX_FIS_SDB 0x58
+
+// ATA status & error bits
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DSC 0x10
+#define ATA_STATUS_RDY 0x40
+#define ATA_STATUS_BSY 0x80
+#define ATA_ERROR_ABRT 0x04 // Aborted command
+#define ATA_ERROR_UNC  0x40 // Uncorrectable data error
+
+#define ATA_CTL_SRST   0x04 // Software reset
+
+// ATA commands
+#define ATA_CMD_DSM               0x06 // Data Set Management (TRIM)
+#define ATA_CMD_READ_SECTORS      0x20
+#define ATA_CMD_READ_SECTORS_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_READ_LOG_EXT      0x2F
+#define ATA_CMD_WRITE_SECTORS     0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_READ_LOG_DMA_EXT  0x47
+#define ATA_CMD_READ_FPDMA        0x60 // Read FPDMA Queued (NCQ)
+#define ATA_CMD_WRITE_FPDMA       0x61 // Write FPDMA Queued (NCQ)
+#define ATA_CMD_SET_MULTIPLE      0xC6
+#define ATA_CMD_READ_DMA          0xC8
+#define ATA_CMD_WRITE_DMA         0xCA
+#define ATA_CMD_STANDBY_IMMEDIATE 0xE0
+#define ATA_CMD_IDLE_IMMEDIATE    0xE1
+#define ATA_CMD_CHECK_POWER_MODE  0xE5
+#define ATA_CMD_FLUSH             0xE7
+#define ATA_CMD_FLUSH_EXT         0xEA
+#define ATA_CMD_IDENTIFY          0xEC
+#define ATA_CMD_SET_FEATURES      0xEF
+
+// General Purpose Log pages
+#define ATA_LOG_DIRECTORY 0x00
+#define ATA_LOG_NCQ_ERROR 0x10
+
+#define ATA_SECTOR_SHIFT 9
+#define ATA_SECTOR_SIZE  512
+
+#define AHCI_MAX_PORTS 8
+#define AHCI_SLOTS     32
+#define AHCI_DSM_PAGES 8 // Max 512-byte pages of TRIM ranges per command
+
+typedef struct ahci_dev ahci_dev_t;
+typedef struct ahci_port ahci_port_t;
+
+typedef struct {
+    blk_io_req_t req;
+    ahci_port_t* port;
+    blk_iovec_t* iov;
+    size_t   iov_size;
+    uint8_t* dsm_buf;
+    uint64_t ctba;
+    uint32_t prdtl;
+    uint32_t tag;
+    bool     ncq;
+    bool     fua;
+    bool     pio;
+} ahci_slot_t;
+
+struct ahci_port {
+    ahci_dev_t* ahci;
+    blkdev_t*   blk;
+    spinlock_t  lock;
+    rvvm_addr_t clb;
+    rvvm_addr_t fb;
+    uint32_t id;
+    uint32_t is;
+    uint32_t ie;
+    uint32_t cmd;
+    uint32_t tfd;
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact;
+    uint32_t ci;
+    // Slots fetched from the command list and still in progress
+    uint32_t active;
+    // Completed NCQ tags awaiting a Set Device Bits FIS
+    uint32_t sdb_pend;
+    // Command list is being processed, NCQ completions are batched
+    uint32_t issuing;
+    // Failed NCQ tag for the NCQ Command Error log
+    uint32_t ncq_err;
+    bool     halted;
+    char serial[12];
+    ahci_slot_t slots[AHCI_SLOTS];
+};
+
+struct ahci_dev {
+    pci_func_t* pci_func;
+    uint32_t ghc;
+    uint32_t is;
+    uint32_t port_count;
+    bool dma_map;
+    ahci_port_t ports[AHCI_MAX_PORTS];
+};
+
+static void ahci_port_process(ahci_port_t* port);
+
+static void ahci_port_irq(ahci_port_t* port)
+{
+    if (port->is & port->ie) {
+        atomic_or_uint32(&port->ahci->is, 1U << port->id);
+        if (atomic_load_uint32_relax(&port->ahci->ghc) & AHCI_GHC_IE) {
+            // All ports share a single vector, see AHCI_GHC_MRSM
+            pci_send_irq(port->ahci->pci_func, 0);
+        }
+    }
+}
+
+static void ahci_post_fis(ahci_port_t* port, size_t offset, const uint8_t* fis, size_t size)
+{
+    if (port->cmd & PORT_CMD_FRE) {
+        uint8_t* ptr = pci_get_dma_ptr(port->ahci->pci_func, port->fb + offset, size);
+        if (ptr) {
+            memcpy(ptr, fis, size);
+        }
+    }
+}
+
+// Device reset or link (re)establishment, reports drive signature
+static void ahci_port_reset_dev(ahci_port_t* port)
+{
+    uint8_t fis[20] = { FIS_D2H, 0, ATA_STATUS_RDY | ATA_STATUS_DSC, 0x1, };
+    fis[4] = 1;  // LBA Low
+    fis[12] = 1; // Sector Count
+    port->tfd = port->blk ? (0x100 | ATA_STATUS_RDY | ATA_STATUS_DSC) : 0x7F;
+    port->halted = false;
+    port->ncq_err = 0;
+    if (port->blk) {
+        ahci_post_fis(port, RX_FIS_D2H, fis, sizeof(fis));
+        port->is |= PORT_IS_DHRS;
+        ahci_port_irq(port);
+    }
+}
+
+static bool ahci_port_pending(ahci_port_t* port)
+{
+    spin_lock(&port->lock);
+    bool ret = !!(port->ci & ~port->active);
+    spin_unlock(&port->lock);
+    return ret;
+}
+
+// Completes a non-queued command, posts a register FIS
+static void ahci_cmd_done(ahci_port_t* port, uint32_t tag, uint8_t status, uint8_t error, uint32_t is)
+{
+    uint8_t fis[20] = { FIS_D2H, 0x40, status, error, };
+    spin_lock(&port->lock);
+    port->tfd = status | (error << 8);
+    if (port->cmd & PORT_CMD_ST) {
+        if (is & PORT_IS_PSS) {
+            // PIO Setup FIS carries the ending status of PIO data-in commands
+            uint8_t pio[20] = { FIS_PIO, 0x60, ATA_STATUS_RDY | ATA_STATUS_DRQ, error, };
+            pio[15] = status;
+            write_uint16_le(pio + 16, ATA_SECTOR_SIZE);
+            ahci_post_fis(port, RX_FIS_PIO, pio, sizeof(pio));
+        }
+        if (is & PORT_IS_DHRS) {
+            ahci_post_fis(port, RX_FIS_D2H, fis, sizeof(fis));
+        }
+        if (status & ATA_STATUS_ERR) {
+            // Stop processing the command list until the port is restarted
+            port->halted = true;
+            is |= PORT_IS_TFES;
+        }
+        port->is |= is;
+        ahci_port_irq(port);
+    }
+    port->ci &= ~(1U << tag);
+    port->active &= ~(1U << tag);
+    spin_unlock(&port->lock);
+    if (ahci_port_pending(port)) {
+        ahci_port_process(port);
+    }
+}
+
+// Reports all completed NCQ tags at once in a single Set Device Bits FIS
+static void ahci_post_sdb(ahci_port_t* port)
+{
+    spin_lock(&port->lock);
+    uint32_t done = atomic_swap_uint32(&port->sdb_pend, 0);
+    if (done) {
+        port->sact &= ~done;
+        port->active &= ~done;
+        if (port->cmd & PORT_CMD_ST) {
+            uint8_t fis[8] = { FIS_SDB, 0x40, ATA_STATUS_RDY, 0, };
+            write_uint32_le(fis + 4, done);
+            ahci_post_fis(port, RX_FIS_SDB, fis, sizeof(fis));
+            port->is |= PORT_IS_SDBS;
+            ahci_port_irq(port);
+        }
+    }
+    bool pending = !!(port->ci & ~port->active);
+    spin_unlock(&port->lock);
+    if (pending) {
+        ahci_port_process(port);
+    }
+}
+
+static void ahci_ncq_done(ahci_port_t* port, uint32_t tag)
+{
+    if (!atomic_or_uint32(&port->sdb_pend, 1U << tag)) {
+        // First pending completion, others are batched behind it
+        atomic_fence_ex(ATOMIC_SEQ_CST);
+        if (!atomic_load_uint32(&port->issuing)) {
+            ahci_post_sdb(port);
+        }
+    }
+}
+
+static void ahci_ncq_error(ahci_port_t* port, uint32_t tag, uint8_t error)
+{
+    uint8_t fis[8] = { FIS_SDB, 0x40, ATA_STATUS_RDY | ATA_STATUS_ERR, error, };
+    spin_lock(&port->lock);
+    // Failed tag stays in PxSACT, the host reads the NCQ error log and restarts the port
+    port->tfd = ATA_STATUS_RDY | ATA_STATUS_ERR | (error << 8);
+    port->ncq_err = tag | 0x100;
+    port->ci &= ~(1U << tag);
+    port->active &= ~(1U << tag);
+    port->halted = true;
+    if (port->cmd & PORT_CMD_ST) {
+        ahci_post_fis(port, RX_FIS_SDB, fis, sizeof(fis));
+        port->is |= PORT_IS_SDBS | PORT_IS_TFES;
+        ahci_port_irq(port);
+    }
+    spin_unlock(&port->lock);
+}
+
+static void ahci_slot_complete(ahci_slot_t* slot, bool success, uint32_t bytes)
+{
+    ahci_port_t* port = slot->port;
+    if (slot->ncq) {
+        if (success) {
+            ahci_ncq_done(port, slot->tag);
+        } else {
+            ahci_ncq_error(port, slot->tag, ATA_ERROR_UNC);
+        }
+        return;
+    }
+    // Report transferred byte count in the command header (PRDBC)
+    uint8_t* hdr = pci_get_dma_ptr(port->ahci->pci_func, port->clb + (slot->tag << 5), 32);
+    if (hdr) {
+        write_uint32_le_m(hdr + 4, success ? bytes : 0);
+    }
+    uint32_t is = PORT_IS_DHRS | (slot->pio ? PORT_IS_PSS : 0);
+    if (success) {
+        ahci_cmd_done(port, slot->tag, ATA_STATUS_RDY | ATA_STATUS_DSC, 0, is);
+    } else {
+        ahci_cmd_done(port, slot->tag, ATA_STATUS_RDY | ATA_STATUS_ERR, ATA_ERROR_UNC, is);
+    }
+}
+
+static void ahci_io_complete(blk_io_req_t* req, bool success)
+{
+    ahci_slot_t* slot = req->data;
+    if (success && slot->fua && req->opcode == BLKDEV_IO_WRITE && blk_write_cached(req->dev)) {
+        // Forced Unit Access, write is complete once it hits stable storage
+        slot->req.opcode = BLKDEV_IO_SYNC;
+        blk_submit(&slot->req);
+        return;
+    }
+    ahci_slot_complete(slot, success, req->size);
+}
+
+// Gather PRDT into iovecs, the transfer is truncated to size
+static bool ahci_map_prdt(ahci_port_t* port, ahci_slot_t* slot, size_t size)
+{
+    pci_func_t* func = port->ahci->pci_func;
+    const uint8_t* prdt = pci_get_dma_ptr(func, slot->ctba + 0x80, slot->prdtl << 4);
+    size_t iov_count = 0;
+    size_t total = 0;
+    if (prdt == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < slot->prdtl && total < size; ++i) {
+        const uint8_t* prd = prdt + (i << 4);
+        rvvm_addr_t addr = read_uint32_le_m(prd) | (((uint64_t)read_uint32_le_m(prd + 4)) << 32);
+        size_t len = EVAL_MIN((read_uint32_le_m(prd + 12) & 0x3FFFFF) + 1, size - total);
+        uint8_t* buffer = pci_get_dma_ptr(func, addr, len);
+        if (buffer == NULL) {
+            return false;
+        }
+        if (iov_count && ((uint8_t*)slot->iov[iov_count - 1].buffer) + slot->iov[iov_count - 1].size == buffer) {
+            // Merge physically adjacent buffers
+            slot->iov[iov_count - 1].size += len;
+        } else {
+            if (iov_count == slot->iov_size) {
+                slot->iov_size = slot->iov_size ? (slot->iov_size << 1) : 16;
+                slot->iov = safe_realloc(slot->iov, slot->iov_size * sizeof(blk_iovec_t));
+            }
+            slot->iov[iov_count].buffer = buffer;
+            slot->iov[iov_count].size = len;
+            iov_count++;
+        }
+        total += len;
+    }
+    slot->req.iov = slot->iov;
+    slot->req.iov_count = iov_count;
+    return total == size;
+}
+
+static bool ahci_copy_to_prdt(ahci_port_t* port, ahci_slot_t* slot, const uint8_t* data, size_t size)
+{
+    if (!ahci_map_prdt(port, slot, size)) {
+        return false;
+    }
+    for (size_t i = 0; i < slot->req.iov_count; ++i) {
+        memcpy(slot->iov[i].buffer, data, slot->iov[i].size);
+        data += slot->iov[i].size;
+    }
+    return true;
+}
+
+static void ahci_copy_id_string(uint8_t* buf, const char* str, size_t size)
+{
+    // Reverse each byte pair since they are little-endian words, pad with spaces
+    size_t len = rvvm_strnlen(str, size);
+    memset(buf, ' ', size);
+    for (size_t i = 0; i < len; ++i) {
+        buf[i ^ 1ULL] = str[i];
+    }
+}
+
+static void ahci_identify(ahci_port_t* port, uint8_t* id_buf)
+{
+    uint64_t lbas = blk_getsize(port->blk) >> ATA_SECTOR_SHIFT;
+    write_uint16_le(id_buf,       0x40);   // Non-removable, ATA device
+    write_uint16_le(id_buf + 94,  0x8010); // Max sectors per READ/WRITE MULTIPLE
+    write_uint16_le(id_buf + 98,  0x300);  // Capabilities - LBA supported, DMA supported
+    write_uint16_le(id_buf + 100, 0x4000); // Capabilities - bit 14 needs to be set as required by ATA/ATAPI-5 spec
+    write_uint16_le(id_buf + 106, 0x6);    // Fields 64-70 and 88 are valid
+    write_uint16_le(id_buf + 118, 0x110);  // Current READ/WRITE MULTIPLE setting
+    write_uint32_le(id_buf + 120, EVAL_MIN(lbas, 0x0FFFFFFF)); // 28-bit LBA capacity
+    write_uint16_le(id_buf + 126, 0x7);    // Multiword DMA modes supported
+    write_uint16_le(id_buf + 128, 0x3);    // Advanced PIO modes supported
+    write_uint16_le(id_buf + 130, 0x78);   // DMA/PIO cycle timings: 120ns
+    write_uint16_le(id_buf + 132, 0x78);
+    write_uint16_le(id_buf + 134, 0x78);
+    write_uint16_le(id_buf + 136, 0x78);
+    write_uint16_le(id_buf + 138, 0x4020); // Deterministic read zeroes after TRIM
+    write_uint16_le(id_buf + 150, AHCI_SLOTS - 1); // Queue depth
+    write_uint16_le(id_buf + 152, 0x10E);  // SATA Gen 1-3, Native Command Queuing
+    write_uint16_le(id_buf + 160, 0x1F0);  // ATA major version: ATA/ATAPI-4 to ACS-2
+    write_uint16_le(id_buf + 164, 0x4060); // Write cache, look-ahead, NOP supported
+    write_uint16_le(id_buf + 166, 0x7400); // 48-bit LBA, FLUSH CACHE (EXT) supported
+    write_uint16_le(id_buf + 168, 0x4040); // WRITE DMA FUA EXT supported
+    // Write cache enabled unless the drive is in writethrough mode, host is expected to flush
+    write_uint16_le(id_buf + 170, blk_write_cached(port->blk) ? 0x4060 : 0x4040);
+    write_uint16_le(id_buf + 172, 0x3400);
+    write_uint16_le(id_buf + 174, 0x4040);
+    write_uint16_le(id_buf + 176, 0x407F); // UDMA mode 6 active, All UDMA modes supported
+    write_uint64_le(id_buf + 200, lbas);   // 48-bit LBA capacity
+    write_uint16_le(id_buf + 210, AHCI_DSM_PAGES); // Max pages of DSM ranges
+    write_uint16_le(id_buf + 212, 0x4000); // One logical sector per physical sector
+    write_uint16_le(id_buf + 338, 0x1);    // Data Set Management TRIM supported
+    write_uint16_le(id_buf + 434, 0x1);    // Non-rotating media
+
+    // Serial Number
+    ahci_copy_id_string(id_buf + 20, port->serial, 20);
+    // Firmware Revision
+    ahci_copy_id_string(id_buf + 46, "R1847", 8);
+    // Model Number
+    ahci_copy_id_string(id_buf + 54, "SATA SSD", 40);
+}
+
+static bool ahci_read_log(ahci_port_t* port, uint8_t page, uint8_t* buf)
+{
+    switch (page) {
+        case ATA_LOG_DIRECTORY:
+            write_uint16_le(buf, 0x1); // General Purpose Logging version
+            write_uint16_le(buf + (ATA_LOG_NCQ_ERROR << 1), 0x1);
+            return true;
+        case ATA_LOG_NCQ_ERROR: {
+            spin_lock(&port->lock);
+            uint32_t ncq_err = port->ncq_err;
+            port->ncq_err = 0;
+            spin_unlock(&port->lock);
+            if (ncq_err) {
+                buf[0] = ncq_err & 0x1F;
+                buf[2] = ATA_STATUS_RDY | ATA_STATUS_ERR;
+                buf[3] = ATA_ERROR_UNC;
+            } else {
+                // No queued command failed
+                buf[0] = 0x80;
+            }
+            uint8_t csum = 0;
+            for (size_t i = 0; i < ATA_SECTOR_SIZE - 1; ++i) {
+                csum += buf[i];
+            }
+            buf[ATA_SECTOR_SIZE - 1] = -csum;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* ahci_dsm_worker(void* arg)
+{
+    ahci_slot_t* slot = arg;
+    blkdev_t* blk = slot->port->blk;
+    uint32_t size = slot->req.size;
+    blk_range_t* ranges = safe_new_arr(blk_range_t, size >> 3);
+    size_t count = 0;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t range = read_uint64_le(slot->dsm_buf + i);
+        uint64_t len = range >> 48;
+        if (len) {
+            ranges[count].offset = bit_cut(range, 0, 48) << ATA_SECTOR_SHIFT;
+            ranges[count].size = len << ATA_SECTOR_SHIFT;
+            count++;
+        }
+    }
+    // Adjacent ranges become a single host discard, RZAT requires zeroing what can't be discarded
+    bool success = blk_trim_ranges(blk, ranges, count, true);
+    free(ranges);
+    free(slot->dsm_buf);
+    slot->dsm_buf = NULL;
+    ahci_slot_complete(slot, success, size);
+    return NULL;
+}
+
+static void ahci_submit_rw(ahci_port_t* port, ahci_slot_t* slot, uint64_t lba, size_t sectors, bool write)
+{
+    if (!ahci_map_prdt(port, slot, sectors << ATA_SECTOR_SHIFT)) {
+        ahci_slot_complete(slot, false, 0);
+        return;
+    }
+    slot->req.dev = port->blk;
+    slot->req.offset = lba << ATA_SECTOR_SHIFT;
+    slot->req.opcode = write ? BLKDEV_IO_WRITE : BLKDEV_IO_READ;
+    slot->req.flags = (!write && port->ahci->dma_map) ? BLKDEV_IO_MAP : 0;
+    slot->req.complete = ahci_io_complete;
+    slot->req.data = slot;
+    if (slot->ncq) {
+        // Queued command is accepted, release the command slot
+        spin_lock(&port->lock);
+        port->ci &= ~(1U << slot->tag);
+        spin_unlock(&port->lock);
+    }
+    blk_submit(&slot->req);
+}
+
+static void ahci_exec_slot(ahci_port_t* port, uint32_t tag)
+{
+    pci_func_t* func = port->ahci->pci_func;
+    ahci_slot_t* slot = &port->slots[tag];
+    const uint8_t* hdr = pci_get_dma_ptr(func, port->clb + (tag << 5), 32);
+    const uint8_t* cfis = NULL;
+    uint8_t fis[20] = {0};
+    uint8_t buf[ATA_SECTOR_SIZE] = {0};
+
+    slot->ncq = false;
+    slot->fua = false;
+    slot->pio = false;
+    if (hdr) {
+        slot->prdtl = read_uint32_le_m(hdr) >> 16;
+        slot->ctba = (read_uint32_le_m(hdr + 8) | (((uint64_t)read_uint32_le_m(hdr + 12)) << 32)) & ~0x7FULL;
+        cfis = pci_get_dma_ptr(func, slot->ctba, sizeof(fis));
+    }
+    if (cfis == NULL) {
+        ahci_cmd_done(port, tag, ATA_STATUS_RDY | ATA_STATUS_ERR, ATA_ERROR_ABRT, PORT_IS_DHRS);
+        return;
+    }
+    memcpy(fis, cfis, sizeof(fis));
+
+    if (fis[0] != FIS_H2D) {
+        ahci_cmd_done(port, tag, ATA_STATUS_RDY | ATA_STATUS_ERR, ATA_ERROR_ABRT, PORT_IS_DHRS);
+        return;
+    }
+    if (!(fis[1] & 0x80)) {
+        // Device Control FIS, software reset is complete once SRST is cleared
+        if (!(fis[15] & ATA_CTL_SRST)) {
+            spin_lock(&port->lock);
+            ahci_port_reset_dev(port);
+            spin_unlock(&port->lock);
+        }
+        ahci_cmd_done(port, tag, ATA_STATUS_RDY | ATA_STATUS_DSC, 0, 0);
+        return;
+    }
+
+    uint8_t  command = fis[2];
+    uint16_t features = fis[3] | (fis[11] << 8);
+    uint16_t count = fis[12] | (fis[13] << 8);
+    uint64_t lba = fis[4] | (fis[5] << 8) | (fis[6] << 16) | (((uint64_t)fis[8]) << 24)
+                 | (((uint64_t)fis[9]) << 32) | (((uint64_t)fis[10]) << 40);
+    uint64_t lba28 = bit_cut(lba, 0, 24) | ((fis[7] & 0xF) << 24);
+
+    // PIO data-in commands report ending status in a PIO Setup FIS
+    slot->pio = command == ATA_CMD_IDENTIFY || command == ATA_CMD_READ_LOG_EXT
+             || command == ATA_CMD_READ_SECTORS || command == ATA_CMD_READ_SECTORS_EXT;
+
+    switch (command) {
+        case ATA_CMD_READ_FPDMA:
+        case ATA_CMD_WRITE_FPDMA:
+            // Sector count is passed in features, tag in the count field
+            slot->ncq = true;
+            slot->fua = !!(fis[7] & 0x80);
+            ahci_submit_rw(port, slot, lba, features ? features : 0x10000, command == ATA_CMD_WRITE_FPDMA);
+            return;
+        case ATA_CMD_READ_DMA_EXT:
+        case ATA_CMD_READ_SECTORS_EXT:
+            ahci_submit_rw(port, slot, lba, count ? count : 0x10000, false);
+            return;
+        case ATA_CMD_WRITE_DMA_FUA_EXT:
+            slot->fua = true;
+            ahci_submit_rw(port, slot, lba, count ? count : 0x10000, true);
+            return;
+        case ATA_CMD_WRITE_DMA_EXT:
+        case ATA_CMD_WRITE_SECTORS_EXT:
+            ahci_submit_rw(port, slot, lba, count ? count : 0x10000, true);
+            return;
+        case ATA_CMD_READ_DMA:
+        case ATA_CMD_READ_SECTORS:
+            ahci_submit_rw(port, slot, lba28, (count & 0xFF) ? (count & 0xFF) : 0x100, false);
+            return;
+        case ATA_CMD_WRITE_DMA:
+        case ATA_CMD_WRITE_SECTORS:
+            ahci_submit_rw(port, slot, lba28, (count & 0xFF) ? (count & 0xFF) : 0x100, true);
+            return;
+        case ATA_CMD_FLUSH:
+        case ATA_CMD_FLUSH_EXT:
+            slot->req = (blk_io_req_t) {
+                .dev = port->blk,
+                .opcode = BLKDEV_IO_SYNC,
+                .complete = ahci_io_complete,
+                .data = slot,
+            };
+            blk_submit(&slot->req);
+            return;
+        case ATA_CMD_DSM:
+            if ((features & 1) && count && count <= AHCI_DSM_PAGES) {
+                // TRIM ranges are processed on a worker thread
+                size_t size = count << ATA_SECTOR_SHIFT;
+                if (ahci_map_prdt(port, slot, size)) {
+                    uint8_t* ptr = slot->dsm_buf = safe_calloc(size, 1);
+                    for (size_t i = 0; i < slot->req.iov_count; ++i) {
+                        memcpy(ptr, slot->iov[i].buffer, slot->iov[i].size);
+                        ptr += slot->iov[i].size;
+                    }
+                    slot->req.size = size;
+                    thread_create_task(ahci_dsm_worker, slot);
+                    return;
+                }
+            }
+            break;
+        case ATA_CMD_IDENTIFY:
+            ahci_identify(port, buf);
+            if (ahci_copy_to_prdt(port, slot, buf, sizeof(buf))) {
+                ahci_slot_complete(slot, true, sizeof(buf));
+                return;
+            }
+            break;
+        case ATA_CMD_READ_LOG_EXT:
+        case ATA_CMD_READ_LOG_DMA_EXT:
+            if (count == 1 && ahci_read_log(port, fis[4], buf) && ahci_copy_to_prdt(port, slot, buf, sizeof(buf))) {
+                ahci_slot_complete(slot, true, sizeof(buf));
+                return;
+            }
+            break;
+        case ATA_CMD_SET_FEATURES:
+        case ATA_CMD_SET_MULTIPLE:
+        case ATA_CMD_IDLE_IMMEDIATE:
+        case ATA_CMD_STANDBY_IMMEDIATE:
+        case ATA_CMD_CHECK_POWER_MODE:
+            ahci_slot_complete(slot, true, 0);
+            return;
+        default:
+            rvvm_debug("Unknown AHCI ATA command 0x%02x", command);
+            break;
+    }
+    ahci_cmd_done(port, tag, ATA_STATUS_RDY | ATA_STATUS_ERR, ATA_ERROR_ABRT, PORT_IS_DHRS);
+}
+
+static void ahci_port_process(ahci_port_t* port)
+{
+    atomic_add_uint32(&port->issuing, 1);
+    while (true) {
+        spin_lock(&port->lock);
+        uint32_t pending = 0;
+        if ((port->cmd & PORT_CMD_ST) && !port->halted && port->blk) {
+            pending = port->ci & ~port->active;
+        }
+        port->active |= pending;
+        spin_unlock(&port->lock);
+        if (!pending) break;
+        for (uint32_t tag = 0; tag < AHCI_SLOTS; ++tag) {
+            if (pending & (1U << tag)) {
+                ahci_exec_slot(port, tag);
+            }
+        }
+    }
+    if (atomic_sub_uint32(&port->issuing, 1) == 1) {
+        // Report NCQ completions which arrived while issuing commands
+        atomic_fence_ex(ATOMIC_SEQ_CST);
+        if (atomic_load_uint32(&port->sdb_pend)) {
+            ahci_post_sdb(port);
+        }
+    }
+}
+
+static void ahci_port_wait_idle(ahci_port_t* port)
+{
+    while (true) {
+        spin_lock(&port->lock);
+        uint32_t active = port->active & ~atomic_load_uint32(&port->sdb_pend);
+        spin_unlock(&port->lock);
+        if (!active) break;
+        sleep_ms(1);
+    }
+    ahci_post_sdb(port);
+}
+
+static void ahci_port_reset(ahci_port_t* port)
+{
+    spin_lock(&port->lock);
+    port->cmd = 0;
+    spin_unlock(&port->lock);
+    ahci_port_wait_idle(port);
+    spin_lock(&port->lock);
+    port->clb = 0;
+    port->fb = 0;
+    port->is = 0;
+    port->ie = 0;
+    port->sctl = 0;
+    port->serr = 0;
+    port->sact = 0;
+    port->ci = 0;
+    port->active = 0;
+    ahci_port_reset_dev(port);
+    spin_unlock(&port->lock);
+}
+
+static uint32_t ahci_port_read(ahci_port_t* port, size_t offset)
+{
+    uint32_t val = 0;
+    spin_lock(&port->lock);
+    switch (offset) {
+        case PORT_REG_CLB:
+            val = port->clb;
+            break;
+        case PORT_REG_CLBU:
+            val = port->clb >> 32;
+            break;
+        case PORT_REG_FB:
+            val = port->fb;
+            break;
+        case PORT_REG_FBU:
+            val = port->fb >> 32;
+            break;
+        case PORT_REG_IS:
+            val = port->is;
+            break;
+        case PORT_REG_IE:
+            val = port->ie;
+            break;
+        case PORT_REG_CMD:
+            val = port->cmd;
+            if (port->cmd & PORT_CMD_FRE) val |= PORT_CMD_FR;
+            if ((port->cmd & PORT_CMD_ST) || port->active) val |= PORT_CMD_CR;
+            break;
+        case PORT_REG_TFD:
+            val = port->tfd;
+            break;
+        case PORT_REG_SIG:
+            val = port->blk ? PORT_SIG_ATA : 0xFFFFFFFF;
+            break;
+        case PORT_REG_SSTS:
+            val = (port->blk && (port->sctl & 0xF) != 1) ? PORT_SSTS_ATA : 0;
+            break;
+        case PORT_REG_SCTL:
+            val = port->sctl;
+            break;
+        case PORT_REG_SERR:
+            val = port->serr;
+            break;
+        case PORT_REG_SACT:
+            val = port->sact;
+            break;
+        case PORT_REG_CI:
+            val = port->ci;
+            break;
+    }
+    spin_unlock(&port->lock);
+    return val;
+}
+
+static void ahci_port_write(ahci_port_t* port, size_t offset, uint32_t val)
+{
+    bool process = false;
+    spin_lock(&port->lock);
+    switch (offset) {
+        case PORT_REG_CLB:
+            port->clb = bit_replace(port->clb, 0, 32, val & ~0x3FFU);
+            break;
+        case PORT_REG_CLBU:
+            port->clb = bit_replace(port->clb, 32, 32, val);
+            break;
+        case PORT_REG_FB:
+            port->fb = bit_replace(port->fb, 0, 32, val & ~0xFFU);
+            break;
+        case PORT_REG_FBU:
+            port->fb = bit_replace(port->fb, 32, 32, val);
+            break;
+        case PORT_REG_IS:
+            port->is &= ~val;
+            break;
+        case PORT_REG_IE:
+            port->ie = val;
+            ahci_port_irq(port);
+            break;
+        case PORT_REG_CMD:
+            if (val & PORT_CMD_CLO) {
+                // Command List Override, clear BSY & DRQ
+                port->tfd &= ~(ATA_STATUS_BSY | ATA_STATUS_DRQ);
+            }
+            if ((port->cmd & PORT_CMD_ST) && !(val & PORT_CMD_ST)) {
+                // Command list stopped, in-flight commands keep PxCMD.CR set until done
+                port->ci = 0;
+                port->sact = 0;
+            }
+            if (!(port->cmd & PORT_CMD_ST) && (val & PORT_CMD_ST)) {
+                if (port->active) {
+                    // PxCMD.CR is still set, stale completions would hit reused tags
+                    rvvm_debug("AHCI port %u started while the command list is running", port->id);
+                    val &= ~PORT_CMD_ST;
+                } else {
+                    port->halted = false;
+                    process = true;
+                }
+            }
+            port->cmd = val & (PORT_CMD_ST | PORT_CMD_SUD | PORT_CMD_POD | PORT_CMD_FRE);
+            break;
+        case PORT_REG_SCTL:
+            if ((port->sctl & 0xF) == 1 && (val & 0xF) != 1) {
+                // COMRESET released, link is re-established
+                ahci_port_reset_dev(port);
+            } else if ((val & 0xF) == 1) {
+                port->tfd = ATA_STATUS_BSY;
+            }
+            port->sctl = val;
+            break;
+        case PORT_REG_SERR:
+            port->serr &= ~val;
+            break;
+        case PORT_REG_SACT:
+            if (port->cmd & PORT_CMD_ST) {
+                port->sact |= val;
+            }
+            break;
+        case PORT_REG_CI:
+            if (port->cmd & PORT_CMD_ST) {
+                port->ci |= val;
+                process = true;
+            }
+            break;
+    }
+    spin_unlock(&port->lock);
+    if (process) {
+        ahci_port_process(port);
+    }
+}
+
+static bool ahci_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    ahci_dev_t* ahci = dev->data;
+    uint32_t val = 0;
+    UNUSED(size);
+
+    if (offset >= AHCI_REG_PORT) {
+        size_t port_id = (offset - AHCI_REG_PORT) >> 7;
+        if (port_id < ahci->port_count) {
+            val = ahci_port_read(&ahci->ports[port_id], offset & 0x7F);
+        }
+    } else switch (offset) {
+        case AHCI_REG_CAP:
+            val = AHCI_CAP_S64A | AHCI_CAP_SNCQ | AHCI_CAP_SCLO | AHCI_CAP_ISS
+                | AHCI_CAP_SAM | AHCI_CAP_NCS | (ahci->port_count - 1);
+            break;
+        case AHCI_REG_GHC:
+            val = atomic_load_uint32_relax(&ahci->ghc) | AHCI_GHC_AE;
+            if (ahci->port_count > 1) {
+                // Make guests fall back to a single shared MSI vector
+                val |= AHCI_GHC_MRSM;
+            }
+            break;
+        case AHCI_REG_IS:
+            val = atomic_load_uint32_relax(&ahci->is);
+            break;
+        case AHCI_REG_PI:
+            val = bit_mask(ahci->port_count);
+            break;
+        case AHCI_REG_VS:
+            val = AHCI_VS;
+            break;
+    }
+
+    write_uint32_le(data, val);
+    return true;
+}
+
+static bool ahci_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    ahci_dev_t* ahci = dev->data;
+    uint32_t val = read_uint32_le(data);
+    UNUSED(size);
+
+    if (offset >= AHCI_REG_PORT) {
+        size_t port_id = (offset - AHCI_REG_PORT) >> 7;
+        if (port_id < ahci->port_count) {
+            ahci_port_write(&ahci->ports[port_id], offset & 0x7F, val);
+        }
+    } else switch (offset) {
+        case AHCI_REG_GHC:
+            if (val & AHCI_GHC_HR) {
+                // HBA reset, the bit reads as 0 once reset is complete
+                atomic_store_uint32(&ahci->ghc, 0);
+                for (size_t i = 0; i < ahci->port_count; ++i) {
+                    ahci_port_reset(&ahci->ports[i]);
+                }
+                atomic_store_uint32(&ahci->is, 0);
+            } else {
+                atomic_store_uint32(&ahci->ghc, val & AHCI_GHC_IE);
+                if ((val & AHCI_GHC_IE) && atomic_load_uint32(&ahci->is)) {
+                    pci_send_irq(ahci->pci_func, 0);
+                }
+            }
+            break;
+        case AHCI_REG_IS:
+            atomic_and_uint32(&ahci->is, ~val);
+            break;
+    }
+    return true;
+}
+
+static void ahci_remove(rvvm_mmio_dev_t* dev)
+{
+    ahci_dev_t* ahci = dev->data;
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        ahci_port_t* port = &ahci->ports[i];
+        spin_lock(&port->lock);
+        port->cmd = 0;
+        spin_unlock(&port->lock);
+        ahci_port_wait_idle(port);
+        blk_close(port->blk);
+        for (size_t tag = 0; tag < AHCI_SLOTS; ++tag) {
+            free(port->slots[tag].iov);
+        }
+    }
+    free(ahci);
+}
+
+// Port has commands in flight, or some will be issued by a completion
+static bool ahci_port_busy(ahci_port_t* port)
+{
+    spin_lock(&port->lock);
+    bool ret = port->active || atomic_load_uint32(&port->issuing)
+            || ((port->cmd & PORT_CMD_ST) && !port->halted && port->blk && (port->ci & ~port->active));
+    spin_unlock(&port->lock);
+    return ret;
+}
+
+static void ahci_quiesce(rvvm_mmio_dev_t* dev)
+{
+    ahci_dev_t* ahci = dev->data;
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        ahci_port_t* port = &ahci->ports[i];
+        while (ahci_port_busy(port)) {
+            ahci_port_wait_idle(port);
+            sleep_ms(1);
+        }
+    }
+}
+
+static void ahci_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ahci_dev_t* ahci = dev->data;
+    uint64_t regs[] = {
+        atomic_load_uint32(&ahci->ghc), atomic_load_uint32(&ahci->is), ahci->port_count,
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        ahci_port_t* port = &ahci->ports[i];
+        spin_lock(&port->lock);
+        uint64_t port_regs[] = {
+            port->clb, port->fb, port->is, port->ie, port->cmd, port->tfd, port->sctl, port->serr,
+            port->sact, port->ci, port->ncq_err, port->halted, port->blk ? blk_getsize(port->blk) : 0,
+        };
+        rvvm_state_write(state, port_regs, sizeof(port_regs));
+        rvvm_state_write(state, port->serial, sizeof(port->serial));
+        spin_unlock(&port->lock);
+    }
+}
+
+static bool ahci_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ahci_dev_t* ahci = dev->data;
+    uint64_t regs[3] = {0};
+    if (!rvvm_state_read(state, regs, sizeof(regs)) || regs[2] != ahci->port_count) {
+        rvvm_error("AHCI ports don't match the saved state");
+        return false;
+    }
+    atomic_store_uint32(&ahci->ghc, regs[0]);
+    atomic_store_uint32(&ahci->is, regs[1]);
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        ahci_port_t* port = &ahci->ports[i];
+        uint64_t port_regs[13] = {0};
+        if (!rvvm_state_read(state, port_regs, sizeof(port_regs))
+         || port_regs[12] != (port->blk ? blk_getsize(port->blk) : 0)) {
+            rvvm_error("AHCI image size doesn't match the saved state");
+            return false;
+        }
+        // Stop the command list and let in-flight commands finish before replacing the port state
+        spin_lock(&port->lock);
+        port->cmd = 0;
+        spin_unlock(&port->lock);
+        ahci_port_wait_idle(port);
+        spin_lock(&port->lock);
+        port->active = 0;
+        port->clb = port_regs[0];
+        port->fb = port_regs[1];
+        port->is = port_regs[2];
+        port->ie = port_regs[3];
+        port->cmd = port_regs[4];
+        port->tfd = port_regs[5];
+        port->sctl = port_regs[6];
+        port->serr = port_regs[7];
+        port->sact = port_regs[8];
+        port->ci = port_regs[9];
+        port->ncq_err = port_regs[10];
+        port->halted = !!port_regs[11];
+        bool ret = rvvm_state_read(state, port->serial, sizeof(port->serial));
+        spin_unlock(&port->lock);
+        if (!ret) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static rvvm_mmio_type_t ahci_type = {
+    .name = "ahci",
+    .remove = ahci_remove,
+    .save = ahci_save,
+    .load = ahci_load,
+    .quiesce = ahci_quiesce,
+};
+
+PUBLIC pci_dev_t* ahci_init_ports(pci_bus_t* pci_bus, void** blk_devs, size_t count)
+{
+    if (count == 0 || count > AHCI_MAX_PORTS) {
+        rvvm_error("AHCI controller supports 1 to %d ports", AHCI_MAX_PORTS);
+        for (size_t i = 0; i < count; ++i) {
+            blk_close(blk_devs[i]);
+        }
+        return NULL;
+    }
+    ahci_dev_t* ahci = safe_new_obj(ahci_dev_t);
+    ahci->port_count = count;
+    for (size_t i = 0; i < count; ++i) {
+        ahci_port_t* port = &ahci->ports[i];
+        port->ahci = ahci;
+        port->blk = blk_devs[i];
+        port->id = i;
+        port->tfd = ATA_STATUS_RDY | ATA_STATUS_DSC;
+        rvvm_randomserial(port->serial, sizeof(port->serial));
+        for (size_t tag = 0; tag < AHCI_SLOTS; ++tag) {
+            port->slots[tag].port = port;
+            port->slots[tag].tag = tag;
+        }
+    }
+
+    pci_func_desc_t ahci_desc = {
+        .vendor_id = 0x1B21,  // ASMedia Technology Inc.
+        .device_id = 0x0612,  // ASM1062 Serial ATA Controller
+        .class_code = 0x0106, // Mass Storage, SATA
+        .prog_if = 0x01,      // AHCI 1.0
+        .irq_pin = PCI_IRQ_PIN_INTA,
+        // ABAR
+        .bar[5] = {
+            .size = 0x1000,
+            .min_op_size = 4,
+            .max_op_size = 4,
+            .read = ahci_mmio_read,
+            .write = ahci_mmio_write,
+            .data = ahci,
+            .type = &ahci_type,
+        },
+    };
+
+    pci_dev_t* pci_dev = pci_attach_func(pci_bus, &ahci_desc);
+    if (pci_dev) {
+        // Successfully plugged in
+        ahci->pci_func = pci_get_device_func(pci_dev, 0);
+        // Read-only image pages may be mapped directly into guest RAM
+        ahci->dma_map = rvvm_get_opt(pci_get_func_machine(ahci->pci_func), RVVM_OPT_MEM_PRIVATE);
+    }
+    return pci_dev;
+}
+
+PUBLIC pci_dev_t* ahci_init_blk(pci_bus_t* pci_bus, void* blk_dev)
+{
+    return ahci_init_ports(pci_bus, &blk_dev, 1);
+}
+
+PUBLIC pci_dev_t* ahci_init(pci_bus_t* pci_bus, const char* image_path, bool rw)
+{
+    blkdev_t* blk = blk_open_disk(pci_get_bus_machine(pci_bus), image_path, rw ? BLKDEV_RW : 0);
+    if (blk == NULL) return NULL;
+    return ahci_init_blk(pci_bus, blk);
+}
+
+PUBLIC pci_dev_t* ahci_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw)
+{
+    return ahci_init(rvvm_get_pci_bus(machine), image_path, rw);
+}
@@ -0,0 +1,22 @@
+/*
+ahci.h - Advanced Host Controller Interface (SATA)
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef RVVM_AHCI_H
+#define RVVM_AHCI_H
+
+#include "rvvmlib.h"
+#include "pci-bus.h"
+
+// Attaches an AHCI controller with a SATA drive on each port 0..count-1
+PUBLIC pci_dev_t* ahci_init_ports(pci_bus_t* pci_bus, void** blk_devs, size_t count);
+PUBLIC pci_dev_t* ahci_init_blk(pci_bus_t* pci_bus, void* blk_dev);
+PUBLIC pci_dev_t* ahci_init(pci_bus_t* pci_bus, const char* image_path, bool rw);
+PUBLIC pci_dev_t* ahci_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw);
+
+#endif
@@ -15,6 +15,7 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "spinlock.h"
 #include "utils.h"
 #include "threading.h"
+#include "rvtimer.h"
 #include "fdtlib.h"
 
 /*
@@ -93,6 +94,9 @@ typedef struct {
     uint32_t prdt_addr;
     uint32_t bmdma_command;
     uint32_t bmdma_status;
+    blk_io_req_t dma_req;
+    blk_iovec_t* dma_iov;
+    size_t dma_iov_size;
 
     // ATA generic
     uint16_t bytes_to_rw;
@@ -419,13 +423,71 @@ static void ata_data_remove(rvvm_mmio_dev_t* dev)
         spin_lock(&ata->dma_lock);
         blk_close(ata->blk);
         spin_unlock(&ata->dma_lock);
+        free(ata->dma_iov);
         free(ata);
     }
 }
 
+static void ata_data_quiesce(rvvm_mmio_dev_t* dev)
+{
+    ata_dev_t* ata = dev->data;
+    // BMDMA command bit is cleared once the transfer completes
+    while (atomic_load_uint32(&ata->bmdma_command) & ATA_BMDMA_COMMAND_DMA) {
+        sleep_ms(1);
+    }
+    spin_lock(&ata->dma_lock);
+    spin_unlock(&ata->dma_lock);
+}
+
+static void ata_data_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ata_dev_t* ata = dev->data;
+    spin_lock(&ata->lock);
+    uint64_t regs[] = {
+        ata->lba, atomic_load_uint32(&ata->prdt_addr), atomic_load_uint32(&ata->bmdma_command),
+        atomic_load_uint32(&ata->bmdma_status), ata->bytes_to_rw, ata->sectcount, ata->drive, ata->error,
+        ata->status, ata->blk ? blk_getsize(ata->blk) : 0, ata->blk ? blk_tell(ata->blk) : 0,
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+    rvvm_state_write(state, ata->buf, sizeof(ata->buf));
+    rvvm_state_write(state, ata->serial, sizeof(ata->serial));
+    spin_unlock(&ata->lock);
+}
+
+static bool ata_data_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ata_dev_t* ata = dev->data;
+    uint64_t regs[11] = {0};
+    if (!rvvm_state_read(state, regs, sizeof(regs)) || regs[9] != (ata->blk ? blk_getsize(ata->blk) : 0)) {
+        rvvm_error("ATA image size doesn't match the saved state");
+        return false;
+    }
+    spin_lock(&ata->lock);
+    ata->lba = regs[0];
+    atomic_store_uint32(&ata->prdt_addr, regs[1]);
+    atomic_store_uint32(&ata->bmdma_command, regs[2] & ~ATA_BMDMA_COMMAND_DMA);
+    atomic_store_uint32(&ata->bmdma_status, regs[3]);
+    ata->bytes_to_rw = EVAL_MIN(regs[4], ATA_SECTOR_SIZE);
+    ata->sectcount = regs[5];
+    ata->drive = regs[6];
+    ata->error = regs[7];
+    ata->status = regs[8];
+    if (ata->blk) {
+        // PIO transfers continue from the saved position
+        blk_seek(ata->blk, regs[10], BLKDEV_SEEK_SET);
+    }
+    bool ret = rvvm_state_read(state, ata->buf, sizeof(ata->buf));
+    ret = rvvm_state_read(state, ata->serial, sizeof(ata->serial)) && ret;
+    spin_unlock(&ata->lock);
+    return ret;
+}
+
 static rvvm_mmio_type_t ata_data_dev_type = {
     .name = "ata_data",
     .remove = ata_data_remove,
+    .save = ata_data_save,
+    .load = ata_data_load,
+    .quiesce = ata_data_quiesce,
 };
 
 static void ata_remove_dummy(rvvm_mmio_dev_t* device)
@@ -437,13 +499,15 @@ static void ata_remove_dummy(rvvm_mmio_dev_t* device)
 static rvvm_mmio_type_t ata_ctl_dev_type = {
     .name = "ata_ctl",
     .remove = ata_remove_dummy,
+    .save = rvvm_save_none, // Saved along with ata_data
 };
 
-static ata_dev_t* ata_create(const char* image, bool rw)
+static ata_dev_t* ata_create(rvvm_machine_t* machine, const char* image, bool rw)
 {
     blkdev_t* blk = NULL;
     if (image) {
-        blk = blk_open(image, rw ? BLKDEV_RW : 0);
+        // PIO transfers a sector at a time
+        blk = blk_open_disk(machine, image, BLKDEV_CACHE | (rw ? BLKDEV_RW : 0));
         if (!blk) {
             // Failed to open image
             return NULL;
@@ -457,7 +521,7 @@ static ata_dev_t* ata_create(const char* image, bool rw)
 
 PUBLIC bool ata_pio_init(rvvm_machine_t* machine, rvvm_addr_t ata_data_addr, rvvm_addr_t ata_ctl_addr, const char* image, bool rw)
 {
-    ata_dev_t* ata = ata_create(image, rw);
+    ata_dev_t* ata = ata_create(machine, image, rw);
     if (!ata) {
         return false;
     }
@@ -522,18 +586,40 @@ PUBLIC bool ata_pio_init_auto(rvvm_machine_t* machine, const char* image, bool r
 static rvvm_mmio_type_t ata_bmdma_dev_type = {
     .name = "ata_bmdma",
     .remove = ata_remove_dummy,
+    .save = rvvm_save_none, // Saved along with ata_data
 };
 
+static void ata_complete_dma(ata_dev_t* ata, bool success)
+{
+    atomic_store_uint32(&ata->bmdma_command, 0);
+
+    if (success) {
+        // Everything OK
+        atomic_store_uint32(&ata->bmdma_status, ATA_BMDMA_STATUS_IRQ);
+    } else {
+        // Error
+        atomic_store_uint32(&ata->bmdma_status, ATA_BMDMA_STATUS_IRQ | ATA_BMDMA_STATUS_ERR);
+    }
+
+    ata_send_interrupt(ata);
+}
+
+static void ata_dma_complete(blk_io_req_t* req, bool success)
+{
+    ata_complete_dma(req->data, success);
+}
+
 static void ata_process_prdt(ata_dev_t* ata)
 {
     rvvm_addr_t prdt_addr = atomic_load_uint32(&ata->prdt_addr);
     bool is_read = !!(atomic_load_uint32(&ata->bmdma_command) & ATA_BMDMA_COMMAND_READ);
     size_t to_process = ata->sectcount << ATA_SECTOR_SHIFT;
     size_t processed = 0;
+    size_t iov_count = 0;
 
     // According to spec, maximum amount of PRDT entries is 64k
     // This should prevent malicious guests from hanging up the thread
-    for (size_t i = 0; i < 0x10000; ++i) {
+    for (size_t i = 0; i < 0x10000 && processed < to_process; ++i) {
         // Read PRD
         const uint8_t* prd = pci_get_dma_ptr(ata->pci_func, prdt_addr, 8);
         if (!prd) {
@@ -548,6 +634,7 @@ static void ata_process_prdt(ata_dev_t* ata)
             // Value 0 means 64K
             buf_size = 0x10000;
         }
+        buf_size = EVAL_MIN(buf_size, to_process - processed);
 
         void* buffer = pci_get_dma_ptr(ata->pci_func, prd_physaddr, buf_size);
         if (!buffer) {
@@ -555,18 +642,13 @@ static void ata_process_prdt(ata_dev_t* ata)
             break;
         }
 
-        // Read/write data to/from RAM
-        if (is_read) {
-            if (blk_read(ata->blk, buffer, buf_size, BLKDEV_CUR) != buf_size) {
-                // IO error
-                break;
-            }
-        } else {
-            if (blk_write(ata->blk, buffer, buf_size, BLKDEV_CUR) != buf_size) {
-                // IO error
-                break;
-            }
+        if (iov_count == ata->dma_iov_size) {
+            ata->dma_iov_size = ata->dma_iov_size ? (ata->dma_iov_size << 1) : 16;
+            ata->dma_iov = safe_realloc(ata->dma_iov, ata->dma_iov_size * sizeof(blk_iovec_t));
         }
+        ata->dma_iov[iov_count].buffer = buffer;
+        ata->dma_iov[iov_count].size = buf_size;
+        iov_count++;
 
         processed += buf_size;
 
@@ -579,17 +661,22 @@ static void ata_process_prdt(ata_dev_t* ata)
         prdt_addr += 8;
     }
 
-    atomic_store_uint32(&ata->bmdma_command, 0);
-
-    if (processed == to_process) {
-        // Everything OK
-        atomic_store_uint32(&ata->bmdma_status, ATA_BMDMA_STATUS_IRQ);
-    } else {
-        // Error
-        atomic_store_uint32(&ata->bmdma_status, ATA_BMDMA_STATUS_IRQ | ATA_BMDMA_STATUS_ERR);
+    if (processed != to_process || !ata->blk) {
+        ata_complete_dma(ata, false);
+        return;
     }
 
-    ata_send_interrupt(ata);
+    // Read/write data to/from RAM
+    ata->dma_req = (blk_io_req_t) {
+        .dev = ata->blk,
+        .iov = ata->dma_iov,
+        .iov_count = iov_count,
+        .offset = blk_tell(ata->blk),
+        .opcode = is_read ? BLKDEV_IO_READ : BLKDEV_IO_WRITE,
+        .complete = ata_dma_complete,
+        .data = ata,
+    };
+    blk_submit(&ata->dma_req);
 }
 
 static void* ata_prdt_io_worker(void* arg)
@@ -663,12 +750,12 @@ static bool ata_pci_ctl_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, u
 
 PUBLIC pci_dev_t* ata_pci_init(pci_bus_t* pci_bus, const char* image, bool rw)
 {
-    ata_dev_t* ata = ata_create(image, rw);
+    ata_dev_t* ata = ata_create(pci_get_bus_machine(pci_bus), image, rw);
     if (ata == NULL) {
         return NULL;
     }
 
-    ata_dev_t* ata_secondary = ata_create(NULL, false);
+    ata_dev_t* ata_secondary = ata_create(NULL, NULL, false);
 
     pci_func_desc_t ata_desc = {
         .vendor_id = 0x1179,  // Toshiba
@@ -16,9 +16,21 @@ static void fb_remove(rvvm_mmio_dev_t* dev)
     UNUSED(dev);
 }
 
+static void fb_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    rvvm_state_write(state, dev->mapping, dev->size);
+}
+
+static bool fb_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    return rvvm_state_read(state, dev->mapping, dev->size);
+}
+
 static rvvm_mmio_type_t fb_dev_type = {
     .name = "framebuffer",
     .remove = fb_remove,
+    .save = fb_save,
+    .load = fb_load,
 };
 
 PUBLIC rvvm_mmio_dev_t* framebuffer_init(rvvm_machine_t* machine, rvvm_addr_t addr, const fb_ctx_t* fb)
@@ -111,6 +111,7 @@ static const rvvm_mmio_type_t gui_window_dev_type = {
     .remove = gui_window_remove,
     .update = gui_window_update,
     .reset = gui_window_reset,
+    .save = rvvm_save_none,
 };
 
 static void gui_on_close(gui_window_t* win)
@@ -180,9 +180,38 @@ static void i2c_oc_remove(rvvm_mmio_dev_t* dev)
     free(bus);
 }
 
+static void i2c_oc_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    i2c_bus_t* bus = dev->data;
+    spin_lock(&bus->lock);
+    uint32_t regs[] = {
+        bus->sel_addr, bus->clock, bus->control, bus->status, bus->tx_byte, bus->rx_byte,
+    };
+    spin_unlock(&bus->lock);
+    rvvm_state_write(state, regs, sizeof(regs));
+}
+
+static bool i2c_oc_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    i2c_bus_t* bus = dev->data;
+    uint32_t regs[6] = {0};
+    bool ret = rvvm_state_read(state, regs, sizeof(regs));
+    spin_lock(&bus->lock);
+    bus->sel_addr = regs[0];
+    bus->clock = regs[1];
+    bus->control = regs[2];
+    bus->status = regs[3];
+    bus->tx_byte = regs[4];
+    bus->rx_byte = regs[5];
+    spin_unlock(&bus->lock);
+    return ret;
+}
+
 static rvvm_mmio_type_t i2c_oc_dev_type = {
     .name = "i2c_opencores",
     .remove = i2c_oc_remove,
+    .save = i2c_oc_save,
+    .load = i2c_oc_load,
 };
 
 PUBLIC i2c_bus_t* i2c_oc_init(rvvm_machine_t* machine, rvvm_addr_t addr, rvvm_intc_t* intc, rvvm_irq_t irq)
@@ -62,6 +62,7 @@ static void intel_hda_remove(rvvm_mmio_dev_t* dev)
 static rvvm_mmio_type_t hda_type = {
     .name = "intel-hda",
     .remove = intel_hda_remove,
+    .save = rvvm_save_none,
 };
 
 static bool intel_hda_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
@@ -34,6 +34,7 @@ static rvvm_mmio_type_t mtd_type = {
     .name = "mtd_physmap",
     .remove = mtd_remove,
     .reset = mtd_reset,
+    .save = rvvm_save_none, // Flash contents live in the image file
 };
 
 static bool mtd_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
@@ -86,7 +87,8 @@ PUBLIC rvvm_mmio_dev_t* mtd_physmap_init_blk(rvvm_machine_t* machine, rvvm_addr_
 
 PUBLIC rvvm_mmio_dev_t* mtd_physmap_init(rvvm_machine_t* machine, rvvm_addr_t addr, const char* image_path, bool rw)
 {
-    blkdev_t* blk = blk_open(image_path, rw ? BLKDEV_RW : 0);
+    // Flash is accessed via small MMIO operations
+    blkdev_t* blk = blk_open_disk(machine, image_path, BLKDEV_CACHE | (rw ? BLKDEV_RW : 0));
     if (blk == NULL) return NULL;
     return mtd_physmap_init_blk(machine, addr, blk);
 }
@@ -177,10 +177,40 @@ static void ns16550a_remove(rvvm_mmio_dev_t* dev)
     free(uart);
 }
 
+static void ns16550a_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ns16550a_dev_t* uart = dev->data;
+    uint32_t regs[6] = {
+        atomic_load_uint32_relax(&uart->ier),
+        atomic_load_uint32_relax(&uart->lcr),
+        atomic_load_uint32_relax(&uart->mcr),
+        atomic_load_uint32_relax(&uart->scr),
+        atomic_load_uint32_relax(&uart->dll),
+        atomic_load_uint32_relax(&uart->dlm),
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+}
+
+static bool ns16550a_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ns16550a_dev_t* uart = dev->data;
+    uint32_t regs[6] = {0};
+    bool ret = rvvm_state_read(state, regs, sizeof(regs));
+    atomic_store_uint32_relax(&uart->ier, regs[0]);
+    atomic_store_uint32_relax(&uart->lcr, regs[1]);
+    atomic_store_uint32_relax(&uart->mcr, regs[2]);
+    atomic_store_uint32_relax(&uart->scr, regs[3]);
+    atomic_store_uint32_relax(&uart->dll, regs[4]);
+    atomic_store_uint32_relax(&uart->dlm, regs[5]);
+    return ret;
+}
+
 static rvvm_mmio_type_t ns16550a_dev_type = {
     .name = "ns16550a",
     .update = ns16550a_update,
     .remove = ns16550a_remove,
+    .save = ns16550a_save,
+    .load = ns16550a_load,
 };
 
 PUBLIC rvvm_mmio_dev_t* ns16550a_init(rvvm_machine_t* machine, chardev_t* chardev,
@@ -50,7 +50,10 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define IDENT_CTRL 0x1   // Identify Controller
 #define IDENT_NSLS 0x2   // Identify Namespace List
 #define IDENT_NIDS 0x3   // Identify Namespace Descriptors
+#define FEAT_VWC   0x6   // Volatile Write Cache feature
 #define FEAT_NQES  0x7   // Number of Queues feature
+#define FEAT_IRQC  0x8   // Interrupt Coalescing feature
+#define FEAT_IVC   0x9   // Interrupt Vector Configuration feature
 
 // NVM Command Set
 #define NVM_FLUSH  0x0
@@ -64,12 +67,18 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define SC_BAD_OP  0x1   // Invalid Command Opcode
 #define SC_BAD_FIL 0x2   // Invalid Field in Command
 #define SC_DT_ERR  0x4   // Data Transfer Error
+#define SC_INTERNAL 0x6  // Internal Error
 #define SC_ABORT   0x7   // Command Abort Requested
 #define SC_SQ_DEL  0x8   // Command Aborted due to SQ Deletion
 #define SC_BAD_NS  0xB   // Invalid Namespace or Format
+#define SC_SGL_LEN 0xF   // Data SGL Length Invalid
+#define SC_SGL_TYP 0x11  // SGL Descriptor Type Invalid
 #define SC_BAD_QI 0x101  // Invalid Queue ID
 #define SC_BAD_QS 0x102  // Invalid Queue Size
 
+// Broadcast NSID, refers to all attached namespaces
+#define NVME_NSID_ALL 0xFFFFFFFFU
+
 // Configurable constants
 #define NVME_MQES 0xFFFF // Maximum Queue Entries Supported: 65536
 #define NVME_CQR   0x1   // Contiguous Queues Required
@@ -81,29 +90,66 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define NVME_IOQES 0x46  // IO Queue Entry Sizes (16b:64b)
 #define NVME_LBAS  0x9   // LBA Block Size Shift (512b blocks)
 #define NVME_MAXQ  0x12  // Max Queues: 18 (Admin + IO, Submission & Completion)
+#define NVME_MDTS  0xA   // Maximum Data Transfer Size: 4M (Fits into a single readv)
+#define NVME_SGL_MAXD 0x10000 // Maximum SGL descriptors processed per command
+#define NVME_MAXNS 0x10  // Max Namespaces per controller: 16
 
 #define NVME_PAGE_SIZE 0x1000ULL
 #define NVME_PAGE_MASK 0xFFFULL
 #define NVME_PRP2_END  0xFF8ULL
 
+// Command PRP or SGL for Data Transfer
+#define NVME_PSDT 0xC0
+
+// SGL Descriptor Types
+#define SGL_DATA     0x0 // Data Block
+#define SGL_SEGMENT  0x2 // Segment
+#define SGL_LAST_SEG 0x3 // Last Segment
+
 typedef struct {
     rvvm_addr_t addr;
     spinlock_t lock;
     uint32_t size;
     uint32_t head;
     uint32_t tail;
+    // Completion queue interrupt state
+    uint32_t irq_vec;
+    uint32_t irq_pend;
+    uint64_t irq_time;
+    bool     irq_en;
 } nvme_queue_t;
 
+typedef struct nvme_dev nvme_dev_t;
+
+// Dedicated worker per IO submission queue
 typedef struct {
+    nvme_dev_t*   nvme;
+    thread_ctx_t* thread;
+    cond_var_t*   cond;
+    spinlock_t    lock;
+    uint32_t      run;
+    uint32_t      joining; // Stopped thread is being joined outside the lock
+} nvme_worker_t;
+
+struct nvme_dev {
     pci_func_t* pci_func;
-    blkdev_t*   blk;
+    blkdev_t*   ns[NVME_MAXNS];
+    uint32_t    ns_count;
+    uint8_t     ns_uuid[NVME_MAXNS][16];
     spinlock_t  lock;
     uint32_t threads;
+    uint32_t resetting; // Controller shutdown or reset still in progress
     uint32_t conf;
     uint32_t irq_mask;
+    uint32_t irq_coalesce;
+    uint32_t irq_no_coalesce;
+    uint32_t wc_disable; // Volatile write cache disabled by the host
+    bool dma_map;
     char serial[12];
-    nvme_queue_t queues[NVME_MAXQ];
-} nvme_dev_t;
+    nvme_queue_t  queues[NVME_MAXQ];
+    nvme_worker_t workers[NVME_MAXQ >> 1];
+    blk_stats_t   stats[NVME_MAXQ >> 1]; // Per IO submission queue
+};
 
 typedef struct {
     rvvm_addr_t prp1;
@@ -122,11 +168,18 @@ typedef struct {
     uint16_t sq_id;
     uint16_t sq_head;
     uint8_t  opcode;
+    uint64_t start; // IO statistics timestamp
 } nvme_cmd_t;
 
+static void nvme_stop_worker(nvme_dev_t* nvme, size_t sq_id);
+
 static void nvme_shutdown(nvme_dev_t* nvme)
 {
+    for (size_t sq_id = 1; sq_id < (NVME_MAXQ >> 1); ++sq_id) {
+        nvme_stop_worker(nvme, sq_id);
+    }
     while (atomic_load_uint32(&nvme->threads)) sleep_ms(1);
+    spin_lock(&nvme->lock);
     rvvm_addr_t asq = nvme->queues[ADMIN_SUBQ].addr;
     rvvm_addr_t acq = nvme->queues[ADMIN_COMQ].addr;
     uint32_t asqs = nvme->queues[ADMIN_SUBQ].size;
@@ -136,24 +189,118 @@ static void nvme_shutdown(nvme_dev_t* nvme)
     nvme->queues[ADMIN_COMQ].addr = acq;
     nvme->queues[ADMIN_SUBQ].size = asqs;
     nvme->queues[ADMIN_COMQ].size = acqs;
+    atomic_store_uint32(&nvme->wc_disable, 0);
+    spin_unlock(&nvme->lock);
 }
 
 static void nvme_remove(rvvm_mmio_dev_t* dev)
 {
     nvme_dev_t* nvme = (nvme_dev_t*)dev->data;
     nvme_shutdown(nvme);
-    blk_close(nvme->blk);
+    for (size_t sq_id = 1; sq_id < (NVME_MAXQ >> 1); ++sq_id) {
+        blk_stats_unregister(&nvme->stats[sq_id]);
+    }
+    for (size_t i = 0; i < nvme->ns_count; ++i) {
+        blk_close(nvme->ns[i]);
+    }
+    for (size_t sq_id = 1; sq_id < (NVME_MAXQ >> 1); ++sq_id) {
+        condvar_free(nvme->workers[sq_id].cond);
+    }
     free(nvme);
 }
 
-static rvvm_mmio_type_t nvme_type = {
-    .name = "nvme",
-    .remove = nvme_remove,
-};
+// Controller index for statistics
+static uint32_t nvme_index = 0;
+
+// Volatile write cache is reported if any namespace has one
+static bool nvme_vwc_present(nvme_dev_t* nvme)
+{
+    for (size_t i = 0; i < nvme->ns_count; ++i) {
+        if (blk_write_cached(nvme->ns[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool nvme_flush_all(nvme_dev_t* nvme)
+{
+    bool ret = true;
+    for (size_t i = 0; i < nvme->ns_count; ++i) {
+        ret = blk_sync(nvme->ns[i]) && ret;
+    }
+    return ret;
+}
+
+static uint64_t nvme_clock(void)
+{
+    return rvtimer_clocksource(1000000000ULL);
+}
+
+// Signal all pending completions in a queue
+static void nvme_signal_cq(nvme_dev_t* nvme, nvme_queue_t* queue)
+{
+    if (atomic_swap_uint32(&queue->irq_pend, 0) && !(nvme->irq_mask & 1)) {
+        pci_send_irq(nvme->pci_func, queue->irq_vec);
+    }
+}
+
+static void nvme_queue_irq(nvme_dev_t* nvme, nvme_queue_t* queue)
+{
+    size_t cq_id = queue - nvme->queues;
+    uint32_t coalesce = atomic_load_uint32_relax(&nvme->irq_coalesce);
+    uint32_t threshold = (coalesce & 0xFF) + 1;
+    uint32_t time = (coalesce >> 8) & 0xFF;
+    if (cq_id != ADMIN_COMQ && !queue->irq_en) {
+        // Interrupts disabled for this queue
+        return;
+    }
+    uint32_t pending = atomic_add_uint32(&queue->irq_pend, 1) + 1;
+    if (cq_id == ADMIN_COMQ || threshold == 1 || time == 0 || pending >= threshold
+     || (queue->irq_vec < 32 && (atomic_load_uint32_relax(&nvme->irq_no_coalesce) & (1U << queue->irq_vec)))) {
+        nvme_signal_cq(nvme, queue);
+    } else if (pending == 1) {
+        // IO queue N always completes into CQ N, its worker owns the aggregation timer
+        nvme_worker_t* worker = &nvme->workers[cq_id >> 1];
+        if (!atomic_load_uint32(&worker->run)) {
+            // Submission queue is gone, nobody would send the interrupt later
+            nvme_signal_cq(nvme, queue);
+            return;
+        }
+        // Aggregation time is in 100 microsecond units, let the queue worker send the interrupt
+        atomic_store_uint64(&queue->irq_time, nvme_clock() + time * 100000ULL);
+        condvar_wake(worker->cond);
+    }
+}
+
+static void nvme_account_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd, uint32_t sf)
+{
+    uint32_t op = BLKDEV_IO_OPS;
+    switch (cmd->opcode) {
+        case NVM_READ:
+            op = BLKDEV_IO_READ;
+            break;
+        case NVM_WRITE:
+            op = BLKDEV_IO_WRITE;
+            break;
+        case NVM_FLUSH:
+            op = BLKDEV_IO_SYNC;
+            break;
+        case NVM_WRITEZ:
+        case NVM_DTSM:
+            op = BLKDEV_IO_TRIM;
+            break;
+    }
+    uint64_t bytes = (op == BLKDEV_IO_SYNC) ? 0 : cmd->prp.size;
+    blk_stats_end(&nvme->stats[cmd->sq_id], op, bytes, cmd->start, sf == SC_SUCCESS);
+}
 
 static void nvme_complete_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd, uint32_t sf)
 {
     nvme_queue_t* queue = cmd->queue;
+    if (cmd->sq_id != ADMIN_SUBQ) {
+        nvme_account_cmd(nvme, cmd, sf);
+    }
     spin_lock(&queue->lock);
     rvvm_addr_t addr = queue->addr + (queue->tail << 4);
     if (queue->tail++ >= queue->size) queue->tail = 0;
@@ -170,7 +317,7 @@ static void nvme_complete_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd, uint32_t sf)
         atomic_fence();
         write_uint16_le(ptr + 14, (sf & 0xFF) << 1 | phase); // Phase Bit, Status Field
     }
-    if (!(nvme->irq_mask & 1)) pci_send_irq(nvme->pci_func, 0);
+    nvme_queue_irq(nvme, queue);
 }
 
 static size_t nvme_process_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd)
@@ -259,18 +406,34 @@ static bool nvme_write_prp(nvme_dev_t* nvme, nvme_cmd_t* cmd, const void* data,
     return true;
 }
 
+static void nvme_start_worker(nvme_dev_t* nvme, size_t sq_id);
+
+// Namespaces are numbered starting from 1, returns NULL on invalid NSID
+static blkdev_t* nvme_get_ns(nvme_dev_t* nvme, uint32_t nsid)
+{
+    if (nsid == 0 || nsid > nvme->ns_count) return NULL;
+    return nvme->ns[nsid - 1];
+}
+
 static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
 {
     switch (cmd->opcode) {
         case A_IDENTIFY: {
+            uint32_t nsid = read_uint32_le(cmd->ptr + 4);
             uint8_t* ptr = safe_calloc(NVME_PAGE_SIZE, sizeof(uint8_t));
             switch (cmd->ptr[40]) {
                 case IDENT_NS: {
-                    uint64_t lbas = blk_getsize(nvme->blk) >> NVME_LBAS;
+                    blkdev_t* blk = nvme_get_ns(nvme, nsid);
+                    if (blk == NULL) {
+                        nvme_complete_cmd(nvme, cmd, SC_BAD_NS);
+                        free(ptr);
+                        return;
+                    }
+                    uint64_t lbas = blk_getsize(blk) >> NVME_LBAS;
                     write_uint64_le(ptr,      lbas);
                     write_uint64_le(ptr + 8,  lbas);
                     write_uint64_le(ptr + 16, lbas);
-                    ptr[33] = 0x8; // Supports Deallocate bit in Write Zeros
+                    ptr[33] = 0x9; // Supports Deallocate bit in Write Zeros, deallocated blocks read as zeroes
                     ptr[130] = NVME_LBAS;
                     break;
                 }
@@ -280,23 +443,43 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
                     memcpy(ptr + 4,  nvme->serial, sizeof(nvme->serial)); // Serial Number
                     rvvm_strlcpy((char*)ptr + 24, "NVMe Storage", 40);    // Model Number
                     rvvm_strlcpy((char*)ptr + 64, "R947", 8);             // Firmware Revision
+                    ptr[77] = NVME_MDTS; // Maximum Data Transfer Size
                     write_uint32_le(ptr + 80, NVME_V); // Version
                     ptr[111] = 1;    // Controller Type: I/O Controller
                     ptr[512] = 0x66; // Submission Queue Max/Cur Entry Size
                     ptr[513] = 0x44; // Completion Queue Max/Cur Entry Size
-                    ptr[516] = 1;    // Number of Namespaces
+                    ptr[516] = nvme->ns_count; // Number of Namespaces
                     ptr[520] = 0xC;  // Supports Write Zeroes, Dataset Management
+                    if (nvme_vwc_present(nvme)) {
+                        ptr[525] = 0x7; // Volatile Write Cache present, Flush with broadcast NSID
+                    }
+                    ptr[536] = 0x1;  // SGL Support, no alignment requirements
                     // NVMe Qualified Name (Includes serial to distinguish targets)
                     size_t nqn_off = rvvm_strlcpy((char*)ptr + 768, "nqn.2022-04.lekkit:nvme:", 256);
                     memcpy(ptr + 768 + nqn_off,  nvme->serial, sizeof(nvme->serial));
                     break;
                 }
                 case IDENT_NSLS:
-                    write_uint32_le(ptr, 0x1); // Namespace #1
+                    if (nsid >= 0xFFFFFFFE) {
+                        // Broadcast and 0xFFFFFFFE are not valid starting points
+                        nvme_complete_cmd(nvme, cmd, SC_BAD_NS);
+                        free(ptr);
+                        return;
+                    }
+                    // Active namespaces with NSID greater than requested, in ascending order
+                    for (uint32_t id = nsid + 1, i = 0; id > nsid && id <= nvme->ns_count; ++id, ++i) {
+                        write_uint32_le(ptr + (i << 2), id);
+                    }
                     break;
                 case IDENT_NIDS:
+                    if (nvme_get_ns(nvme, nsid) == NULL) {
+                        nvme_complete_cmd(nvme, cmd, SC_BAD_NS);
+                        free(ptr);
+                        return;
+                    }
                     ptr[0] = 3;  // Namespace UUID
                     ptr[1] = 16; // UUID length
+                    memcpy(ptr + 4, nvme->ns_uuid[nsid - 1], 16);
                     break;
                 default:
                     nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
@@ -323,7 +506,15 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
                 nvme->queues[q_id].size = q_size;
                 nvme->queues[q_id].head = 0;
                 nvme->queues[q_id].tail = 0;
+                if (cmd->opcode == A_MKIO_COM) {
+                    // Interrupt vector & Interrupts enabled
+                    nvme->queues[q_id].irq_vec = read_uint16_le(cmd->ptr + 46);
+                    nvme->queues[q_id].irq_en = !!(cmd->ptr[44] & 0x2);
+                }
                 spin_unlock(&nvme->queues[q_id].lock);
+                if (cmd->opcode == A_MKIO_SUB) {
+                    nvme_start_worker(nvme, q_id >> 1);
+                }
                 nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
             }
             break;
@@ -334,6 +525,9 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
             if (q_id <= ADMIN_COMQ || q_id >= NVME_MAXQ) {
                 nvme_complete_cmd(nvme, cmd, SC_BAD_QI);
             } else {
+                if (cmd->opcode == A_RMIO_SUB) {
+                    nvme_stop_worker(nvme, q_id >> 1);
+                }
                 spin_lock(&nvme->queues[q_id].lock);
                 nvme->queues[q_id].addr = 0;
                 nvme->queues[q_id].size = 0;
@@ -348,6 +542,37 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
         case A_GET_FEAT:
             if (cmd->ptr[40] == FEAT_NQES) {
                 nvme_complete_cmd(nvme, cmd, SC_SUCCESS | (NVME_MAXQ << 8));
+            } else if (cmd->ptr[40] == FEAT_IRQC) {
+                // Aggregation Time & Aggregation Threshold
+                if (cmd->opcode == A_SET_FEAT) {
+                    atomic_store_uint32(&nvme->irq_coalesce, read_uint16_le(cmd->ptr + 44));
+                }
+                nvme_complete_cmd(nvme, cmd, SC_SUCCESS | (atomic_load_uint32(&nvme->irq_coalesce) << 8));
+            } else if (cmd->ptr[40] == FEAT_IVC) {
+                // Coalescing Disable per Interrupt Vector
+                uint32_t vec = read_uint16_le(cmd->ptr + 44);
+                if (vec >= 32) {
+                    nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
+                    break;
+                }
+                if (cmd->opcode == A_SET_FEAT && (cmd->ptr[46] & 1)) {
+                    atomic_or_uint32(&nvme->irq_no_coalesce, 1U << vec);
+                } else if (cmd->opcode == A_SET_FEAT) {
+                    atomic_and_uint32(&nvme->irq_no_coalesce, ~(1U << vec));
+                }
+                uint32_t cd = !!(atomic_load_uint32(&nvme->irq_no_coalesce) & (1U << vec));
+                nvme_complete_cmd(nvme, cmd, SC_SUCCESS | ((vec | (cd << 16)) << 8));
+            } else if (cmd->ptr[40] == FEAT_VWC && nvme_vwc_present(nvme)) {
+                if (cmd->opcode == A_SET_FEAT) {
+                    bool disable = !(cmd->ptr[44] & 1);
+                    if (disable && !atomic_swap_uint32(&nvme->wc_disable, 1)) {
+                        // Data cached so far must not be lost after disabling the cache
+                        nvme_flush_all(nvme);
+                    } else if (!disable) {
+                        atomic_store_uint32(&nvme->wc_disable, 0);
+                    }
+                }
+                nvme_complete_cmd(nvme, cmd, SC_SUCCESS | ((!atomic_load_uint32(&nvme->wc_disable)) << 8));
             } else {
                 nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
             }
@@ -362,52 +587,215 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
     }
 }
 
+typedef struct {
+    blk_io_req_t req;
+    nvme_dev_t*  nvme;
+    nvme_cmd_t   cmd;
+    blk_iovec_t* iov;
+    size_t       iov_size;
+    size_t       merged;
+    bool         fua;
+} nvme_io_req_t;
+
+static void nvme_io_complete(blk_io_req_t* req, bool success)
+{
+    nvme_io_req_t* io = req->data;
+    nvme_dev_t* nvme = io->nvme;
+    if (success && io->fua) {
+        // Write was cached, flush it before reporting completion
+        io->fua = false;
+        req->opcode = BLKDEV_IO_SYNC;
+        blk_submit(req);
+        return;
+    }
+    nvme_complete_cmd(nvme, &io->cmd, success ? SC_SUCCESS : SC_DT_ERR);
+    free(io->iov);
+    free(io);
+    atomic_sub_uint32(&nvme->threads, 1);
+}
+
+static void nvme_push_iov(nvme_io_req_t* io, void* buffer, size_t size)
+{
+    size_t count = io->req.iov_count;
+    if (count && ((uint8_t*)io->iov[count - 1].buffer) + io->iov[count - 1].size == buffer) {
+        // Merge contiguous host buffers
+        io->iov[count - 1].size += size;
+        io->merged++;
+        return;
+    }
+    if (count == io->iov_size) {
+        io->iov_size = io->iov_size ? (io->iov_size << 1) : 16;
+        io->iov = safe_realloc(io->iov, io->iov_size * sizeof(blk_iovec_t));
+    }
+    io->iov[count].buffer = buffer;
+    io->iov[count].size = size;
+    io->req.iov_count++;
+}
+
+static bool nvme_prp_iov(nvme_dev_t* nvme, nvme_cmd_t* cmd, nvme_io_req_t* io)
+{
+    while (cmd->prp.cur < cmd->prp.size) {
+        size_t size = 0;
+        void* buffer = nvme_get_prp_chunk(nvme, cmd, &size);
+        if (buffer == NULL) {
+            // Command was completed with an error
+            return false;
+        }
+        nvme_push_iov(io, buffer, size);
+    }
+    return true;
+}
+
+static bool nvme_sgl_iov(nvme_dev_t* nvme, nvme_cmd_t* cmd, nvme_io_req_t* io)
+{
+    // First descriptor resides in the command itself
+    const uint8_t* desc = cmd->ptr + 24;
+    size_t desc_count = 1;
+    size_t size = 0;
+
+    for (size_t i = 0; i < NVME_SGL_MAXD && size < cmd->prp.size; ++i) {
+        if (desc_count == 0) {
+            // SGL ended before the end of transfer
+            nvme_complete_cmd(nvme, cmd, SC_SGL_LEN);
+            return false;
+        }
+        uint64_t addr = read_uint64_le_m(desc);
+        uint32_t len = read_uint32_le_m(desc + 8);
+        uint8_t type = desc[15] >> 4;
+        desc += 16;
+        desc_count--;
+
+        switch (type) {
+            case SGL_DATA: {
+                len = EVAL_MIN(len, cmd->prp.size - size);
+                void* buffer = pci_get_dma_ptr(nvme->pci_func, addr, len);
+                if (buffer == NULL) {
+                    nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
+                    return false;
+                }
+                nvme_push_iov(io, buffer, len);
+                size += len;
+                break;
+            }
+            case SGL_SEGMENT:
+            case SGL_LAST_SEG:
+                // Continue with the next segment
+                desc = pci_get_dma_ptr(nvme->pci_func, addr, len);
+                desc_count = len >> 4;
+                if (desc == NULL || desc_count == 0 || (len & 0xF)) {
+                    nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
+                    return false;
+                }
+                break;
+            default:
+                nvme_complete_cmd(nvme, cmd, SC_SGL_TYP);
+                return false;
+        }
+    }
+
+    if (size < cmd->prp.size) {
+        nvme_complete_cmd(nvme, cmd, SC_SGL_LEN);
+        return false;
+    }
+    return true;
+}
+
+static void nvme_submit_rw(nvme_dev_t* nvme, nvme_cmd_t* cmd, blkdev_t* blk, uint64_t pos)
+{
+    if (cmd->prp.size > (NVME_PAGE_SIZE << NVME_MDTS)) {
+        // Maximum Data Transfer Size exceeded
+        nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
+        return;
+    }
+
+    // Gather the whole transfer into a single vectored request
+    nvme_io_req_t* io = safe_new_obj(nvme_io_req_t);
+    bool sgl = !!(cmd->ptr[1] & NVME_PSDT);
+    if (!(sgl ? nvme_sgl_iov(nvme, cmd, io) : nvme_prp_iov(nvme, cmd, io))) {
+        free(io->iov);
+        free(io);
+        return;
+    }
+
+    // Submission queue entry may be reused before the command completes
+    io->nvme = nvme;
+    io->cmd = *cmd;
+    io->cmd.ptr = NULL;
+    io->req.dev = blk;
+    io->req.iov = io->iov;
+    io->req.offset = pos;
+    io->req.opcode = (cmd->opcode == NVM_WRITE) ? BLKDEV_IO_WRITE : BLKDEV_IO_READ;
+    io->req.flags = (cmd->opcode == NVM_READ && nvme->dma_map) ? BLKDEV_IO_MAP : 0;
+    io->req.complete = nvme_io_complete;
+    io->req.data = io;
+    if (cmd->opcode == NVM_WRITE && blk_write_cached(blk)) {
+        // Force Unit Access, or the write cache is disabled
+        io->fua = (cmd->ptr[51] & 0x40) || atomic_load_uint32(&nvme->wc_disable);
+    }
+    blk_stats_merged(&nvme->stats[cmd->sq_id], io->merged);
+
+    atomic_add_uint32(&nvme->threads, 1);
+    blk_submit(&io->req);
+}
+
 static void nvme_io_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
 {
     uint64_t pos = read_uint64_le(cmd->ptr + 40) << NVME_LBAS;
+    uint32_t nsid = read_uint32_le(cmd->ptr + 4);
+    blkdev_t* blk = nvme_get_ns(nvme, nsid);
     uint8_t* buffer;
-    size_t   size, tmp;
+    size_t   size;
+
+    cmd->start = blk_stats_begin(&nvme->stats[cmd->sq_id]);
+    if (blk == NULL && !(cmd->opcode == NVM_FLUSH && nsid == NVME_NSID_ALL)) {
+        nvme_complete_cmd(nvme, cmd, SC_BAD_NS);
+        return;
+    }
 
     switch (cmd->opcode) {
         case NVM_READ:
         case NVM_WRITE:
-            while (cmd->prp.cur < cmd->prp.size) {
-                buffer = nvme_get_prp_chunk(nvme, cmd, &size);
-                if (buffer == NULL) return;
-                if (cmd->opcode == NVM_WRITE) {
-                    tmp = blk_write(nvme->blk, buffer, size, pos);
-                } else {
-                    tmp = blk_read(nvme->blk, buffer, size, pos);
-                }
-                if (tmp != size) {
-                    nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
-                    return;
-                }
-                pos += size;
-            }
-            nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            nvme_submit_rw(nvme, cmd, blk, pos);
             break;
         case NVM_FLUSH:
-            blk_sync(nvme->blk);
-            nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            if (blk ? blk_sync(blk) : nvme_flush_all(nvme)) {
+                nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            } else {
+                nvme_complete_cmd(nvme, cmd, SC_INTERNAL);
+            }
             break;
         case NVM_WRITEZ:
-            blk_trim(nvme->blk, pos, cmd->prp.size);
-            nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            if (blk_write_zeroes(blk, pos, cmd->prp.size)) {
+                nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            } else {
+                nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
+            }
             break;
         case NVM_DTSM:
             if (cmd->ptr[44] & 0x4) {
-                // Deallocate (TRIM)
+                // Deallocate (TRIM), ranges are merged into as few host discards as possible
+                blk_range_t ranges[256];
+                size_t count = 0;
+                uint64_t trimmed = 0;
                 cmd->prp.size = (((size_t)cmd->ptr[40]) + 1) << 4;
                 while (cmd->prp.cur < cmd->prp.size) {
                     buffer = nvme_get_prp_chunk(nvme, cmd, &size);
                     if (!buffer) return;
                     for (size_t i=0; i<size; i += 16) {
-                        uint64_t trim_len = ((uint64_t)read_uint32_le(buffer + i + 4)) << NVME_LBAS;
-                        uint64_t trim_pos = read_uint64_le(buffer + i + 8) << NVME_LBAS;
-                        blk_trim(nvme->blk, trim_pos, trim_len);
+                        ranges[count].size = ((uint64_t)read_uint32_le(buffer + i + 4)) << NVME_LBAS;
+                        ranges[count].offset = read_uint64_le(buffer + i + 8) << NVME_LBAS;
+                        trimmed += ranges[count++].size;
                     }
                 }
+                // Deallocated blocks are reported to read as zeroes, zero whatever the host can't discard
+                if (!blk_trim_ranges(blk, ranges, count, true)) {
+                    nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
+                    break;
+                }
+                // Account deallocated bytes rather than the range list
+                cmd->prp.size = trimmed;
+            } else {
+                cmd->prp.size = 0;
             }
             nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
             break;
@@ -418,15 +806,13 @@ static void nvme_io_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
     }
 }
 
-static void* nvme_cmd_worker(void** data)
+static void nvme_process_cmd(nvme_dev_t* nvme, size_t queue_id, uint32_t sq_head)
 {
-    nvme_dev_t* nvme = data[0];
-    size_t queue_id = (size_t)data[1];
     nvme_queue_t* queue = &nvme->queues[queue_id];
     nvme_cmd_t cmd = {
         .queue = &nvme->queues[queue_id + 1],
         .sq_id = queue_id >> 1,
-        .sq_head = (size_t)data[2],
+        .sq_head = sq_head,
     };
     cmd.ptr = pci_get_dma_ptr(nvme->pci_func, queue->addr + (cmd.sq_head << 6), 64);
     if (cmd.ptr) {
@@ -443,10 +829,97 @@ static void* nvme_cmd_worker(void** data)
             nvme_io_cmd(nvme, &cmd);
         }
     }
+}
+
+static void* nvme_cmd_worker(void** data)
+{
+    nvme_dev_t* nvme = data[0];
+    nvme_process_cmd(nvme, (size_t)data[1], (size_t)data[2]);
     atomic_sub_uint32(&nvme->threads, 1);
     return NULL;
 }
 
+static void* nvme_queue_worker(void* arg)
+{
+    nvme_worker_t* worker = arg;
+    nvme_dev_t* nvme = worker->nvme;
+    size_t queue_id = (worker - nvme->workers) << 1;
+    nvme_queue_t* sq = &nvme->queues[queue_id];
+    nvme_queue_t* cq = &nvme->queues[queue_id + 1];
+
+    while (atomic_load_uint32_relax(&worker->run)) {
+        // Drain the submission queue in a batch
+        while (true) {
+            spin_lock(&sq->lock);
+            uint32_t head = sq->head;
+            if (head == sq->tail) {
+                spin_unlock(&sq->lock);
+                break;
+            }
+            if (sq->head++ >= sq->size) sq->head = 0;
+            // Counted under the queue lock, so a quiesce never sees a popped but unprocessed command
+            atomic_add_uint32(&nvme->threads, 1);
+            spin_unlock(&sq->lock);
+            nvme_process_cmd(nvme, queue_id, head);
+            atomic_sub_uint32(&nvme->threads, 1);
+        }
+
+        // Send a coalesced interrupt when aggregation time passes
+        uint64_t timeout = CONDVAR_INFINITE;
+        if (atomic_load_uint32(&cq->irq_pend)) {
+            uint64_t now = nvme_clock();
+            uint64_t deadline = atomic_load_uint64(&cq->irq_time);
+            if (now >= deadline) {
+                nvme_signal_cq(nvme, cq);
+            } else {
+                timeout = deadline - now;
+            }
+        }
+        condvar_wait_ns(worker->cond, timeout);
+    }
+    // Don't leave completions unsignaled
+    nvme_signal_cq(nvme, cq);
+    return NULL;
+}
+
+static void nvme_start_worker(nvme_dev_t* nvme, size_t sq_id)
+{
+    nvme_worker_t* worker = &nvme->workers[sq_id];
+    spin_lock_slow(&worker->lock);
+    while (worker->joining) {
+        // The stopped thread would keep running if the run flag is raised before it exits
+        spin_unlock(&worker->lock);
+        sleep_ms(1);
+        spin_lock_slow(&worker->lock);
+    }
+    if (!worker->thread) {
+        atomic_store_uint32(&worker->run, 1);
+        worker->thread = thread_create(nvme_queue_worker, worker);
+    }
+    spin_unlock(&worker->lock);
+}
+
+static void nvme_stop_worker(nvme_dev_t* nvme, size_t sq_id)
+{
+    nvme_worker_t* worker = &nvme->workers[sq_id];
+    spin_lock_slow(&worker->lock);
+    thread_ctx_t* thread = worker->thread;
+    if (thread) {
+        atomic_store_uint32(&worker->run, 0);
+        condvar_wake(worker->cond);
+        worker->thread = NULL;
+        worker->joining++;
+    }
+    spin_unlock(&worker->lock);
+    if (thread) {
+        // Don't hold the lock while the worker finishes it's batch
+        thread_join(thread);
+        spin_lock_slow(&worker->lock);
+        worker->joining--;
+        spin_unlock(&worker->lock);
+    }
+}
+
 static void nvme_doorbell(nvme_dev_t* nvme, size_t queue_id, uint16_t val)
 {
     nvme_queue_t* queue = &nvme->queues[queue_id];
@@ -458,6 +931,10 @@ static void nvme_doorbell(nvme_dev_t* nvme, size_t queue_id, uint16_t val)
     if (queue_id & 1) {
         // Update completion queue head
         queue->head = val;
+    } else if (queue_id != ADMIN_SUBQ) {
+        // Kick the IO queue worker
+        queue->tail = val;
+        condvar_wake(nvme->workers[queue_id >> 1].cond);
     } else {
         queue->tail = val;
         while (queue->head != queue->tail) {
@@ -495,7 +972,12 @@ static bool nvme_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8
         case NVME_CSTS:
             // CC.EN  -> CSTS.EN
             // CC.SHN -> CSTS.SHST
-            write_uint32_le(data, (nvme->conf & 1) | ((!!(nvme->conf & 0xC000)) << 3));
+            if (atomic_load_uint32(&nvme->resetting)) {
+                // Not ready, shutdown processing occurring
+                write_uint32_le(data, (!!(nvme->conf & 0xC000)) << 2);
+            } else {
+                write_uint32_le(data, (nvme->conf & 1) | ((!!(nvme->conf & 0xC000)) << 3));
+            }
             break;
         case NVME_AQA:
             write_uint32_le(data, nvme->queues[ADMIN_SUBQ].size | (nvme->queues[ADMIN_COMQ].size <<  16));
@@ -523,6 +1005,7 @@ static bool nvme_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8
 static bool nvme_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
 {
     nvme_dev_t* nvme = dev->data;
+    bool shutdown = false;
     UNUSED(size);
     if (likely(offset >= 0x1000)) {
         // Doorbell
@@ -540,9 +1023,11 @@ static bool nvme_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint
             break;
         case NVME_CC:
             nvme->conf = read_uint32_le(data);
-            // Shutdown or reset the controller
-            if ((nvme->conf & 0xC000) || !(nvme->conf & 0x1))
-                nvme_shutdown(nvme);
+            // Shutdown or reset the controller, worker threads are joined outside the lock
+            shutdown = (nvme->conf & 0xC000) || !(nvme->conf & 0x1);
+            if (shutdown) {
+                atomic_add_uint32(&nvme->resetting, 1);
+            }
             break;
         case NVME_AQA:
             nvme->queues[ADMIN_SUBQ].size = bit_cut(read_uint32_le(data), 0, 12);
@@ -562,13 +1047,153 @@ static bool nvme_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint
             break;
     }
     spin_unlock(&nvme->lock);
+    if (shutdown) {
+        nvme_shutdown(nvme);
+        atomic_sub_uint32(&nvme->resetting, 1);
+    }
     return true;
 }
 
-PUBLIC pci_dev_t* nvme_init_blk(pci_bus_t* pci_bus, void* blk_dev)
+static void nvme_quiesce(rvvm_mmio_dev_t* dev)
+{
+    nvme_dev_t* nvme = dev->data;
+    while (true) {
+        bool busy = !!atomic_load_uint32(&nvme->threads);
+        for (size_t sq_id = 1; sq_id < (NVME_MAXQ >> 1) && !busy; ++sq_id) {
+            nvme_queue_t* sq = &nvme->queues[sq_id << 1];
+            if (atomic_load_uint32(&nvme->workers[sq_id].run)) {
+                spin_lock(&sq->lock);
+                busy = sq->head != sq->tail;
+                spin_unlock(&sq->lock);
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        sleep_ms(1);
+    }
+    // Coalesced interrupts are not saved, deliver them now
+    for (size_t cq_id = ADMIN_COMQ; cq_id < NVME_MAXQ; cq_id += 2) {
+        nvme_signal_cq(nvme, &nvme->queues[cq_id]);
+    }
+}
+
+static void nvme_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    nvme_dev_t* nvme = dev->data;
+    spin_lock(&nvme->lock);
+    uint64_t regs[] = {
+        nvme->conf, nvme->irq_mask, atomic_load_uint32(&nvme->irq_coalesce),
+        atomic_load_uint32(&nvme->irq_no_coalesce), atomic_load_uint32(&nvme->wc_disable), nvme->ns_count,
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+    for (size_t i = 0; i < nvme->ns_count; ++i) {
+        uint64_t ns_size = blk_getsize(nvme->ns[i]);
+        rvvm_state_write(state, &ns_size, sizeof(ns_size));
+    }
+    rvvm_state_write(state, nvme->ns_uuid, sizeof(nvme->ns_uuid));
+    rvvm_state_write(state, nvme->serial, sizeof(nvme->serial));
+    for (size_t i = 0; i < NVME_MAXQ; ++i) {
+        nvme_queue_t* queue = &nvme->queues[i];
+        spin_lock(&queue->lock);
+        uint64_t queue_regs[] = {
+            queue->addr, queue->size, queue->head, queue->tail, queue->irq_vec, queue->irq_en,
+        };
+        spin_unlock(&queue->lock);
+        rvvm_state_write(state, queue_regs, sizeof(queue_regs));
+    }
+    spin_unlock(&nvme->lock);
+}
+
+static bool nvme_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
 {
+    nvme_dev_t* nvme = dev->data;
+    uint64_t regs[6] = {0};
+    if (!rvvm_state_read(state, regs, sizeof(regs)) || regs[5] != nvme->ns_count) {
+        rvvm_error("NVMe namespaces don't match the saved state");
+        return false;
+    }
+    for (size_t i = 0; i < nvme->ns_count; ++i) {
+        uint64_t ns_size = 0;
+        if (!rvvm_state_read(state, &ns_size, sizeof(ns_size)) || ns_size != blk_getsize(nvme->ns[i])) {
+            rvvm_error("NVMe namespace size doesn't match the saved state");
+            return false;
+        }
+    }
+    // Drop the current queues before replacing them
+    nvme_shutdown(nvme);
+    bool ret = rvvm_state_read(state, nvme->ns_uuid, sizeof(nvme->ns_uuid));
+    ret = rvvm_state_read(state, nvme->serial, sizeof(nvme->serial)) && ret;
+    spin_lock(&nvme->lock);
+    nvme->conf = regs[0];
+    nvme->irq_mask = regs[1];
+    atomic_store_uint32(&nvme->irq_coalesce, regs[2]);
+    atomic_store_uint32(&nvme->irq_no_coalesce, regs[3]);
+    atomic_store_uint32(&nvme->wc_disable, regs[4]);
+    for (size_t i = 0; i < NVME_MAXQ; ++i) {
+        nvme_queue_t* queue = &nvme->queues[i];
+        uint64_t queue_regs[6] = {0};
+        ret = rvvm_state_read(state, queue_regs, sizeof(queue_regs)) && ret;
+        spin_lock(&queue->lock);
+        queue->addr = queue_regs[0];
+        queue->size = EVAL_MIN(queue_regs[1], NVME_MQES);
+        queue->head = EVAL_MIN(queue_regs[2], queue->size);
+        queue->tail = EVAL_MIN(queue_regs[3], queue->size);
+        queue->irq_vec = queue_regs[4];
+        queue->irq_en = !!queue_regs[5];
+        queue->irq_pend = 0;
+        spin_unlock(&queue->lock);
+    }
+    spin_unlock(&nvme->lock);
+    for (size_t sq_id = 1; sq_id < (NVME_MAXQ >> 1); ++sq_id) {
+        if (nvme->queues[sq_id << 1].size) {
+            // Picks up commands submitted before the save
+            nvme_start_worker(nvme, sq_id);
+            condvar_wake(nvme->workers[sq_id].cond);
+        }
+    }
+    return ret;
+}
+
+static rvvm_mmio_type_t nvme_type = {
+    .name = "nvme",
+    .remove = nvme_remove,
+    .save = nvme_save,
+    .load = nvme_load,
+    .quiesce = nvme_quiesce,
+};
+
+PUBLIC pci_dev_t* nvme_init_ns(pci_bus_t* pci_bus, void** blk_devs, size_t count)
+{
+    if (count == 0 || count > NVME_MAXNS) {
+        rvvm_error("NVMe controller supports 1 to %d namespaces", NVME_MAXNS);
+        for (size_t i = 0; i < count; ++i) {
+            blk_close(blk_devs[i]);
+        }
+        return NULL;
+    }
     nvme_dev_t* nvme = safe_new_obj(nvme_dev_t);
-    nvme->blk = blk_dev;
+    for (size_t i = 0; i < count; ++i) {
+        nvme->ns[i] = blk_devs[i];
+    }
+    nvme->ns_count = count;
+    for (size_t i = 0; i < count; ++i) {
+        // Random (Version 4) UUID for each namespace, stable for the controller lifetime
+        rvvm_randombytes(nvme->ns_uuid[i], sizeof(nvme->ns_uuid[i]));
+        nvme->ns_uuid[i][6] = (nvme->ns_uuid[i][6] & 0x0F) | 0x40;
+        nvme->ns_uuid[i][8] = (nvme->ns_uuid[i][8] & 0x3F) | 0x80;
+    }
+    uint32_t index = atomic_add_uint32(&nvme_index, 1);
+    for (size_t sq_id = 1; sq_id < (NVME_MAXQ >> 1); ++sq_id) {
+        char name[32] = {0};
+        nvme->workers[sq_id].nvme = nvme;
+        nvme->workers[sq_id].cond = condvar_create();
+        size_t len = rvvm_strlcpy(name, "nvme", sizeof(name));
+        len += int_to_str_dec(name + len, sizeof(name) - len, index);
+        len += rvvm_strlcpy(name + len, " sq", sizeof(name) - len);
+        int_to_str_dec(name + len, sizeof(name) - len, sq_id);
+        blk_stats_register(&nvme->stats[sq_id], name);
+    }
     rvvm_randomserial(nvme->serial, sizeof(nvme->serial));
 
     pci_func_desc_t nvme_desc = {
@@ -592,13 +1217,20 @@ PUBLIC pci_dev_t* nvme_init_blk(pci_bus_t* pci_bus, void* blk_dev)
     if (pci_dev) {
         // Successfully plugged in
         nvme->pci_func = pci_get_device_func(pci_dev, 0);
+        // Read-only image pages may be mapped directly into guest RAM
+        nvme->dma_map = rvvm_get_opt(pci_get_func_machine(nvme->pci_func), RVVM_OPT_MEM_PRIVATE);
     }
     return pci_dev;
 }
 
+PUBLIC pci_dev_t* nvme_init_blk(pci_bus_t* pci_bus, void* blk_dev)
+{
+    return nvme_init_ns(pci_bus, &blk_dev, 1);
+}
+
 PUBLIC pci_dev_t* nvme_init(pci_bus_t* pci_bus, const char* image_path, bool rw)
 {
-    blkdev_t* blk = blk_open(image_path, rw ? BLKDEV_RW : 0);
+    blkdev_t* blk = blk_open_disk(pci_get_bus_machine(pci_bus), image_path, rw ? BLKDEV_RW : 0);
     if (blk == NULL) return NULL;
     return nvme_init_blk(pci_bus, blk);
 }
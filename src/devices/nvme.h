@@ -13,6 +13,8 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "rvvmlib.h"
 #include "pci-bus.h"
 
+// Attaches a controller with namespaces 1..count backed by blk_devs
+PUBLIC pci_dev_t* nvme_init_ns(pci_bus_t* pci_bus, void** blk_devs, size_t count);
 PUBLIC pci_dev_t* nvme_init_blk(pci_bus_t* pci_bus, void* blk_dev);
 PUBLIC pci_dev_t* nvme_init(pci_bus_t* pci_bus, const char* image_path, bool rw);
 PUBLIC pci_dev_t* nvme_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw);
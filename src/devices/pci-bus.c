@@ -81,8 +81,8 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define PCIE_CAP_INTEGRATED_ENDPOINT 0x9
 
 // MSI-X interrupts
-#define PCI_MSIX_MAX_IRQS 1
-#define PCI_MSIX_TBL_SIZE (((PCI_MSIX_MAX_IRQS + 1) >> 1) << 3)
+#define PCI_MSIX_MAX_IRQS 32
+#define PCI_MSIX_TBL_SIZE (PCI_MSIX_MAX_IRQS << 2)
 #define PCI_MSIX_PBA_SIZE ((PCI_MSIX_MAX_IRQS + 0x1F) >> 5)
 #define PCI_MSIX_BAR_SIZE (PCI_MSIX_TBL_SIZE + PCI_MSIX_PBA_SIZE)
 
@@ -162,6 +162,7 @@ struct rvvm_pci_function {
     uint32_t msi_pending;
 
     // RO attributes
+    uint8_t  vendor_caps[PCI_VENDOR_CAPS_SIZE];
     uint16_t vendor_id;
     uint16_t device_id;
     uint16_t class_code;
@@ -241,10 +242,11 @@ static bool pci_func_send_msix_irq(pci_func_t* func, uint32_t msi_id)
         uint32_t command = atomic_load_uint32_relax(&func->command);
         if (likely((command & PCI_CMD_BUS_MASTER) && (msi_id < PCI_MSIX_MAX_IRQS))) {
             // Bus mastering enabled, valid MSI-X vector
-            uint32_t mask = atomic_load_uint32_relax(&func->msix[msi_id + 3]);
-            uint32_t data = atomic_load_uint32_relax(&func->msix[msi_id + 2]);
-            rvvm_addr_t addr = atomic_load_uint32_relax(&func->msix[msi_id])
-                  | ((uint64_t)atomic_load_uint32_relax(&func->msix[msi_id + 1]) << 32);
+            const uint32_t* entry = &func->msix[msi_id << 2];
+            uint32_t mask = atomic_load_uint32_relax(&entry[3]);
+            uint32_t data = atomic_load_uint32_relax(&entry[2]);
+            rvvm_addr_t addr = atomic_load_uint32_relax(&entry[0])
+                  | ((uint64_t)atomic_load_uint32_relax(&entry[1]) << 32);
 
             if (likely(!(msix_control & PCI_MSIX_MASKED) && !(mask & 1))) {
                 // Perform an MSI write
@@ -285,7 +287,9 @@ static void pci_func_update_msix_mask(pci_func_t* func)
             if (pending) {
                 pending = atomic_swap_uint32(&func->msix[PCI_MSIX_TBL_SIZE + reg], 0);
                 for (size_t bit = 0; bit < 32; ++bit) {
-                    pci_func_send_msix_irq(func, (reg << 5) | bit);
+                    if (pending & (1U << bit)) {
+                        pci_func_send_msix_irq(func, (reg << 5) | bit);
+                    }
                 }
             }
         }
@@ -327,6 +331,7 @@ static void msix_bar_remove(rvvm_mmio_dev_t* dev)
 static const rvvm_mmio_type_t pci_msix_dev_type = {
     .name = "msix_bar",
     .remove = msix_bar_remove,
+    .save = rvvm_save_none, // MSI-X table is saved by the PCI bus
 };
 
 // Free a PCI function description that we've failed to attach
@@ -430,6 +435,15 @@ static pci_func_t* pci_attach_func_internal(pci_bus_t* bus, const pci_func_desc_
     func->rev        = desc->rev;
     func->irq_pin    = desc->irq_pin;
 
+    if (desc->vendor_caps_size > sizeof(func->vendor_caps)) {
+        rvvm_warn("PCI vendor capabilities don't fit into config space");
+        free(func);
+        return NULL;
+    }
+    if (desc->vendor_caps_size) {
+        memcpy(func->vendor_caps, desc->vendor_caps, desc->vendor_caps_size);
+    }
+
     func->addr  = bus_addr;
 
     func->command  = PCI_CMD_DEFAULT;
@@ -513,6 +527,8 @@ static bool pci_bus_read(rvvm_mmio_dev_t* ecam, void* data, size_t offset, uint8
         size_t cap_id = (reg - PCI_CAP_LIST_OFF) >> 2;
         if (cap_id < STATIC_ARRAY_SIZE(pci_express_caps_ro)) {
             val = pci_express_caps_ro[cap_id];
+        } else if (reg >= PCI_VENDOR_CAPS_OFF && reg < PCI_VENDOR_CAPS_OFF + PCI_VENDOR_CAPS_SIZE) {
+            val = read_uint32_le(func->vendor_caps + reg - PCI_VENDOR_CAPS_OFF);
         }
     }
 
@@ -624,6 +640,9 @@ static bool pci_bus_read(rvvm_mmio_dev_t* ecam, void* data, size_t offset, uint8
             if (!func->msix_bar) {
                 // Hide MSI-X capability if MSI-X BAR is missing
                 val &= ~(0xFF00U);
+                if (func->vendor_caps[0]) {
+                    val |= PCI_VENDOR_CAPS_OFF << 8;
+                }
             }
             break;
         case PCI_REG_MSI_AL:
@@ -644,12 +663,16 @@ static bool pci_bus_read(rvvm_mmio_dev_t* ecam, void* data, size_t offset, uint8
 
         case PCI_REG_MSIX:
             val |= atomic_load_uint32_relax(&func->msix_control);
+            if (func->vendor_caps[0]) {
+                // Chain vendor-specific capabilities
+                val |= PCI_VENDOR_CAPS_OFF << 8;
+            }
             break;
         case PCI_REG_MSIX_TBL:
             val = func->msix_bar;
             break;
         case PCI_REG_MSIX_PBO:
-            val = func->msix_bar | PCI_MSIX_TBL_SIZE;
+            val = func->msix_bar | (PCI_MSIX_TBL_SIZE << 2);
             break;
     }
 
@@ -766,9 +789,95 @@ static void pci_bus_remove(rvvm_mmio_dev_t* ecam)
     free(bus);
 }
 
+static void pci_func_save(pci_func_t* func, rvvm_state_t* state)
+{
+    uint32_t regs[] = {
+        func->addr, func->command, func->irq_line, func->bridge_io, func->bridge_mem, func->msix_control,
+        func->msi_control, func->msi_addr_low, func->msi_addr_high, func->msi_data, func->msi_mask, func->msi_pending,
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+    rvvm_state_write(state, func->msix, sizeof(func->msix));
+    for (size_t bar_id = 0; bar_id < PCI_FUNC_BARS; ++bar_id) {
+        rvvm_addr_t bar_addr = func->bar[bar_id] ? func->bar[bar_id]->addr : 0;
+        rvvm_state_write(state, &bar_addr, sizeof(bar_addr));
+    }
+    rvvm_addr_t rom_addr = func->expansion_rom ? func->expansion_rom->addr : 0;
+    rvvm_state_write(state, &rom_addr, sizeof(rom_addr));
+}
+
+static void pci_func_load(pci_func_t* func, const uint32_t* regs, rvvm_state_t* state)
+{
+    func->command = regs[1];
+    func->irq_line = regs[2];
+    func->bridge_io = regs[3];
+    func->bridge_mem = regs[4];
+    func->msix_control = regs[5];
+    func->msi_control = regs[6];
+    func->msi_addr_low = regs[7];
+    func->msi_addr_high = regs[8];
+    func->msi_data = regs[9];
+    func->msi_mask = regs[10];
+    func->msi_pending = regs[11];
+    rvvm_state_read(state, func->msix, sizeof(func->msix));
+    for (size_t bar_id = 0; bar_id < PCI_FUNC_BARS; ++bar_id) {
+        rvvm_addr_t bar_addr = 0;
+        rvvm_state_read(state, &bar_addr, sizeof(bar_addr));
+        if (func->bar[bar_id]) {
+            func->bar[bar_id]->addr = bar_addr;
+        }
+    }
+    rvvm_addr_t rom_addr = 0;
+    rvvm_state_read(state, &rom_addr, sizeof(rom_addr));
+    if (func->expansion_rom) {
+        func->expansion_rom->addr = rom_addr;
+    }
+}
+
+static void pci_bus_save(rvvm_mmio_dev_t* ecam, rvvm_state_t* state)
+{
+    pci_bus_t* bus = ecam->data;
+    spin_lock(&bus->lock);
+    vector_foreach(bus->dev, i) {
+        pci_dev_t* dev = vector_at(bus->dev, i);
+        for (size_t func_id = 0; dev && func_id < PCI_DEV_FUNCS; ++func_id) {
+            if (dev->func[func_id]) {
+                pci_func_save(dev->func[func_id], state);
+            }
+        }
+    }
+    spin_unlock(&bus->lock);
+}
+
+static bool pci_bus_load(rvvm_mmio_dev_t* ecam, rvvm_state_t* state)
+{
+    pci_bus_t* bus = ecam->data;
+    bool ret = true;
+    spin_lock(&bus->lock);
+    vector_foreach(bus->dev, i) {
+        pci_dev_t* dev = vector_at(bus->dev, i);
+        for (size_t func_id = 0; dev && func_id < PCI_DEV_FUNCS; ++func_id) {
+            pci_func_t* func = dev->func[func_id];
+            if (func) {
+                // Functions are saved in bus order, bail on topology mismatch
+                uint32_t regs[12] = {0};
+                if (!rvvm_state_read(state, regs, sizeof(regs)) || regs[0] != func->addr) {
+                    ret = false;
+                    break;
+                }
+                pci_func_load(func, regs, state);
+            }
+        }
+    }
+    spin_unlock(&bus->lock);
+    atomic_fence();
+    return ret;
+}
+
 static const rvvm_mmio_type_t pci_bus_type = {
     .name = "pci_bus",
     .remove = pci_bus_remove,
+    .save = pci_bus_save,
+    .load = pci_bus_load,
 };
 
 PUBLIC pci_bus_t* pci_bus_init(rvvm_machine_t* machine, rvvm_intc_t* intc, const rvvm_irq_t* irqs,
@@ -1062,6 +1171,16 @@ PUBLIC pci_func_t* pci_get_device_func(pci_dev_t* dev, size_t func_id)
     return NULL;
 }
 
+PUBLIC rvvm_machine_t* pci_get_func_machine(pci_func_t* func)
+{
+    return func->bus->machine;
+}
+
+PUBLIC rvvm_machine_t* pci_get_bus_machine(pci_bus_t* bus)
+{
+    return bus->machine;
+}
+
 PUBLIC void pci_send_irq(pci_func_t* func, uint32_t msi_id)
 {
     UNUSED(msi_id);
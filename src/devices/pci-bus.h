@@ -32,6 +32,10 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define PCI_MEM_ADDR_DEFAULT  0x40000000U
 #define PCI_MEM_SIZE_DEFAULT  0x40000000U
 
+// Vendor-specific capabilities are chained after the standard ones
+#define PCI_VENDOR_CAPS_OFF  0xBC
+#define PCI_VENDOR_CAPS_SIZE 0x44
+
 // PCI function address in the form of [bus:8] | [dev:5] | [func:3]
 typedef uint32_t pci_bus_addr_t;
 
@@ -51,6 +55,9 @@ typedef struct {
     uint8_t  irq_pin;
     rvvm_mmio_dev_t bar[PCI_FUNC_BARS];
     rvvm_mmio_dev_t expansion_rom;
+    // Raw capability list placed at PCI_VENDOR_CAPS_OFF, with absolute next pointers
+    const uint8_t* vendor_caps;
+    size_t vendor_caps_size;
 } pci_func_desc_t;
 
 // PCI multi-function device description
@@ -151,6 +158,12 @@ PUBLIC void pci_remove_device(pci_dev_t* dev);
 //! \return PCI function handle, or NULL on failure
 PUBLIC pci_func_t* pci_get_device_func(pci_dev_t* dev, size_t func_id);
 
+//! \brief  Get the machine a PCI function belongs to
+PUBLIC rvvm_machine_t* pci_get_func_machine(pci_func_t* func);
+
+//! \brief  Get the machine a PCI bus belongs to
+PUBLIC rvvm_machine_t* pci_get_bus_machine(pci_bus_t* bus);
+
 //! \brief Send INTx/MSI/MSI-X interrupt to the PCI host
 //! \param func   Valid handle to a PCI function which sent the IRQ
 //! \param msi_id MSI/MSI-X IRQ Vector ID (Ignored with INTx emulation)
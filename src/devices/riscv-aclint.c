@@ -16,12 +16,15 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define ACLINT_MSWI_SIZE   0x4000
 #define ACLINT_MTIMER_SIZE 0x8000
 
+// Both are views of the hart state, which is saved separately
 static rvvm_mmio_type_t aclint_mswi_dev_type = {
     .name = "riscv_aclint_mswi",
+    .save = rvvm_save_none,
 };
 
 static rvvm_mmio_type_t aclint_mtimer_dev_type = {
     .name = "riscv_aclint_mtimer",
+    .save = rvvm_save_none,
 };
 
 static bool aclint_mswi_read(rvvm_mmio_dev_t* device, void* data, size_t offset, uint8_t size)
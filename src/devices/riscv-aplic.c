@@ -124,8 +124,28 @@ static bool aplic_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, ui
     return true;
 }
 
+static void aplic_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    aplic_ctx_t* aplic = dev->data;
+    rvvm_state_write(state, &aplic->domaincfg, sizeof(aplic->domaincfg));
+    rvvm_state_write(state, &aplic->msicfg, sizeof(aplic->msicfg));
+    rvvm_state_write(state, aplic->source, sizeof(aplic->source));
+    rvvm_state_write(state, aplic->target, sizeof(aplic->target));
+}
+
+static bool aplic_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    aplic_ctx_t* aplic = dev->data;
+    rvvm_state_read(state, &aplic->domaincfg, sizeof(aplic->domaincfg));
+    rvvm_state_read(state, &aplic->msicfg, sizeof(aplic->msicfg));
+    rvvm_state_read(state, aplic->source, sizeof(aplic->source));
+    return rvvm_state_read(state, aplic->target, sizeof(aplic->target));
+}
+
 static rvvm_mmio_type_t aplic_dev_type = {
     .name = "riscv_aplic",
+    .save = aplic_save,
+    .load = aplic_load,
 };
 
 static bool aplic_send_irq(rvvm_intc_t* intc, rvvm_irq_t irq)
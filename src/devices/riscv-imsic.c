@@ -44,6 +44,7 @@ static bool imsic_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, ui
 
 static rvvm_mmio_type_t imsic_dev_type = {
     .name = "riscv_imsic",
+    .save = rvvm_save_none, // Interrupt files are saved with the hart state
 };
 
 PUBLIC void riscv_imsic_init(rvvm_machine_t* machine, rvvm_addr_t addr, bool smode)
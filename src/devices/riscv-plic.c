@@ -338,10 +338,39 @@ static void plic_reset(rvvm_mmio_dev_t* dev)
     memset(plic->threshold, 0, plic_ctx_count(plic) << 2);
 }
 
+static void plic_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    plic_ctx_t* plic = dev->data;
+
+    rvvm_state_write(state, plic->prio, sizeof(plic->prio));
+    rvvm_state_write(state, plic->pending, sizeof(plic->pending));
+    rvvm_state_write(state, plic->raised, sizeof(plic->raised));
+    for (size_t ctx = 0; ctx < plic_ctx_count(plic); ++ctx) {
+        rvvm_state_write(state, plic->enable[ctx], PLIC_SRC_REGS << 2);
+    }
+    rvvm_state_write(state, plic->threshold, plic_ctx_count(plic) << 2);
+}
+
+static bool plic_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    plic_ctx_t* plic = dev->data;
+
+    // Hart external interrupt lines are restored along with the harts
+    rvvm_state_read(state, plic->prio, sizeof(plic->prio));
+    rvvm_state_read(state, plic->pending, sizeof(plic->pending));
+    rvvm_state_read(state, plic->raised, sizeof(plic->raised));
+    for (size_t ctx = 0; ctx < plic_ctx_count(plic); ++ctx) {
+        rvvm_state_read(state, plic->enable[ctx], PLIC_SRC_REGS << 2);
+    }
+    return rvvm_state_read(state, plic->threshold, plic_ctx_count(plic) << 2);
+}
+
 static rvvm_mmio_type_t plic_dev_type = {
     .name = "riscv_plic",
     .remove = plic_remove,
     .reset = plic_reset,
+    .save = plic_save,
+    .load = plic_load,
 };
 
 /*
@@ -117,8 +117,34 @@ static bool rtc_goldfish_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t off
     return true;
 }
 
+static void rtc_goldfish_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    rtc_goldfish_dev_t* rtc = dev->data;
+    uint32_t regs[4] = {
+        atomic_load_uint32_relax(&rtc->alarm_low),
+        atomic_load_uint32_relax(&rtc->alarm_high),
+        atomic_load_uint32_relax(&rtc->alarm_enabled),
+        atomic_load_uint32_relax(&rtc->irq_enabled),
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+}
+
+static bool rtc_goldfish_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    rtc_goldfish_dev_t* rtc = dev->data;
+    uint32_t regs[4] = {0};
+    bool ret = rvvm_state_read(state, regs, sizeof(regs));
+    atomic_store_uint32_relax(&rtc->alarm_low, regs[0]);
+    atomic_store_uint32_relax(&rtc->alarm_high, regs[1]);
+    atomic_store_uint32_relax(&rtc->alarm_enabled, regs[2]);
+    atomic_store_uint32_relax(&rtc->irq_enabled, regs[3]);
+    return ret;
+}
+
 static rvvm_mmio_type_t rtc_goldfish_dev_type = {
     .name = "rtc_goldfish",
+    .save = rtc_goldfish_save,
+    .load = rtc_goldfish_load,
 };
 
 PUBLIC rvvm_mmio_dev_t* rtc_goldfish_init(rvvm_machine_t* machine, rvvm_addr_t addr,
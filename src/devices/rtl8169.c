@@ -262,6 +262,11 @@ static bool rtl8169_feed_rx(void* net_dev, const void* data, size_t size)
     if (likely(atomic_load_uint32_relax(&rtl8169->cr) & RTL8169_CR_RE)) {
         // Receiver enabled
         spin_lock(&rtl8169->rx_lock);
+        if (!rvvm_machine_running(pci_get_func_machine(rtl8169->pci_func))) {
+            // Guest RAM must stay untouched while the machine is paused
+            spin_unlock(&rtl8169->rx_lock);
+            return false;
+        }
         uint8_t* cmd = pci_get_dma_ptr(rtl8169->pci_func, rtl8169->rx.addr + (rtl8169->rx.index << 4), 16);
         if (cmd == NULL) {
             // FIFO DMA error
@@ -513,10 +518,81 @@ static void rtl8169_remove(rvvm_mmio_dev_t* dev)
     free(rtl8169);
 }
 
+static void rtl8169_quiesce(rvvm_mmio_dev_t* dev)
+{
+    rtl8169_dev_t* rtl8169 = dev->data;
+    // Wait for the packet being received or transmitted, further RX is dropped until resume
+    spin_lock(&rtl8169->rx_lock);
+    spin_unlock(&rtl8169->rx_lock);
+    spin_lock(&rtl8169->lock);
+    spin_unlock(&rtl8169->lock);
+}
+
+static void rtl8169_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    rtl8169_dev_t* rtl8169 = dev->data;
+    spin_lock(&rtl8169->lock);
+    spin_lock(&rtl8169->rx_lock);
+    uint64_t regs[] = {
+        rtl8169->rx.addr, rtl8169->rx.index, rtl8169->tx.addr, rtl8169->tx.index,
+        rtl8169->txp.addr, rtl8169->txp.index, atomic_load_uint32_relax(&rtl8169->cr), rtl8169->phyar,
+        atomic_load_uint32_relax(&rtl8169->imr), atomic_load_uint32_relax(&rtl8169->isr),
+        rtl8169->eeprom.pins, rtl8169->eeprom.addr, rtl8169->eeprom.word, rtl8169->eeprom.cur_bit,
+        rtl8169->eeprom.addr_ok, rtl8169->seg_size,
+    };
+    spin_unlock(&rtl8169->rx_lock);
+    rvvm_state_write(state, regs, sizeof(regs));
+    rvvm_state_write(state, rtl8169->mac, sizeof(rtl8169->mac));
+    if (rtl8169->seg_size <= RTL8169_MAX_PKT_SIZE) {
+        // Partially reassembled packet
+        rvvm_state_write(state, rtl8169->seg_buff, rtl8169->seg_size);
+    }
+    spin_unlock(&rtl8169->lock);
+}
+
+static bool rtl8169_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    rtl8169_dev_t* rtl8169 = dev->data;
+    uint64_t regs[16] = {0};
+    bool ret = rvvm_state_read(state, regs, sizeof(regs));
+    spin_lock(&rtl8169->lock);
+    spin_lock(&rtl8169->rx_lock);
+    rtl8169->rx.addr = regs[0];
+    rtl8169->rx.index = EVAL_MIN(regs[1], RTL8169_MAX_FIFO_SIZE - 1);
+    rtl8169->tx.addr = regs[2];
+    rtl8169->tx.index = EVAL_MIN(regs[3], RTL8169_MAX_FIFO_SIZE - 1);
+    rtl8169->txp.addr = regs[4];
+    rtl8169->txp.index = EVAL_MIN(regs[5], RTL8169_MAX_FIFO_SIZE - 1);
+    atomic_store_uint32_relax(&rtl8169->cr, regs[6] & RTL8169_CR_RW);
+    rtl8169->phyar = regs[7];
+    atomic_store_uint32_relax(&rtl8169->imr, regs[8]);
+    atomic_store_uint32_relax(&rtl8169->isr, regs[9]);
+    rtl8169->eeprom.pins = regs[10];
+    rtl8169->eeprom.addr = regs[11];
+    rtl8169->eeprom.word = regs[12];
+    rtl8169->eeprom.cur_bit = regs[13];
+    rtl8169->eeprom.addr_ok = !!regs[14];
+    rtl8169->seg_size = regs[15];
+    spin_unlock(&rtl8169->rx_lock);
+    ret = rvvm_state_read(state, rtl8169->mac, sizeof(rtl8169->mac)) && ret;
+    if (rtl8169->seg_size <= RTL8169_MAX_PKT_SIZE) {
+        ret = rvvm_state_read(state, rtl8169->seg_buff, rtl8169->seg_size) && ret;
+    } else {
+        // Drop the rest of a failed packet
+        rtl8169->seg_size = -1;
+    }
+    tap_set_mac(rtl8169->tap, rtl8169->mac);
+    spin_unlock(&rtl8169->lock);
+    return ret;
+}
+
 static rvvm_mmio_type_t rtl8169_type = {
     .name = "rtl8169",
     .remove = rtl8169_remove,
     .reset = rtl8169_reset,
+    .save = rtl8169_save,
+    .load = rtl8169_load,
+    .quiesce = rtl8169_quiesce,
 };
 
 PUBLIC pci_dev_t* rtl8169_init(pci_bus_t* pci_bus, tap_dev_t* tap)
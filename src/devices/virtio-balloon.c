@@ -0,0 +1,146 @@
+/*
+virtio-balloon.c - Virtio memory balloon with free page reporting
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "virtio-balloon.h"
+#include "virtio-pci.h"
+#include "vma_ops.h"
+#include "mem_ops.h"
+#include "utils.h"
+
+// Feature bits
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM 2
+#define VIRTIO_BALLOON_F_REPORTING      5
+
+// Queues (Indices are compacted by the driver when stats & hinting are not offered)
+#define VIRTIO_BALLOON_Q_INFLATE   0
+#define VIRTIO_BALLOON_Q_DEFLATE   1
+#define VIRTIO_BALLOON_Q_REPORTING 2
+
+// Balloon PFNs are always in 4K units
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+#define VIRTIO_BALLOON_PAGE_SIZE (1U << VIRTIO_BALLOON_PFN_SHIFT)
+
+// Configuration space
+#define VIRTIO_BALLOON_CFG_NUM_PAGES 0x0 // Target balloon size in pages, set by the device
+#define VIRTIO_BALLOON_CFG_ACTUAL    0x4 // Current balloon size in pages, set by the driver
+
+struct virtio_balloon {
+    virtio_dev_t* vdev;
+};
+
+static void virtio_balloon_release(virtio_dev_t* vdev, rvvm_addr_t addr, size_t size, bool lazy)
+{
+    // Only whole host pages inside the range may be released
+    size_t page = vma_page_size();
+    rvvm_addr_t start = align_size_up(addr, page);
+    rvvm_addr_t end = align_size_down(addr + size, page);
+    if (end > start) {
+        void* ptr = pci_get_dma_ptr(virtio_get_pci_func(vdev), start, end - start);
+        if (ptr) {
+            vma_clean(ptr, end - start, lazy);
+        }
+    }
+}
+
+static void virtio_balloon_inflate(virtio_dev_t* vdev, const virtio_chain_t* chain)
+{
+    for (size_t i = 0; i < chain->count; ++i) {
+        const virtio_buf_t* buf = &chain->buf[i];
+        const uint8_t* pfns = buf->write ? NULL : pci_get_dma_ptr(virtio_get_pci_func(vdev), buf->addr, buf->len);
+        if (pfns == NULL) {
+            continue;
+        }
+        for (size_t off = 0; off + 4 <= buf->len; off += 4) {
+            rvvm_addr_t addr = ((rvvm_addr_t)read_uint32_le(pfns + off)) << VIRTIO_BALLOON_PFN_SHIFT;
+            virtio_balloon_release(vdev, addr, VIRTIO_BALLOON_PAGE_SIZE, false);
+        }
+    }
+}
+
+static void virtio_balloon_report(virtio_dev_t* vdev, const virtio_chain_t* chain)
+{
+    for (size_t i = 0; i < chain->count; ++i) {
+        const virtio_buf_t* buf = &chain->buf[i];
+        if (buf->write) {
+            // Reported pages may be lazily freed, the guest doesn't touch them until reused
+            virtio_balloon_release(vdev, buf->addr, buf->len, true);
+        }
+    }
+}
+
+static void virtio_balloon_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_chain_t chain;
+    while (virtio_queue_pop(vdev, queue, &chain)) {
+        switch (queue) {
+            case VIRTIO_BALLOON_Q_INFLATE:
+                virtio_balloon_inflate(vdev, &chain);
+                break;
+            case VIRTIO_BALLOON_Q_REPORTING:
+                virtio_balloon_report(vdev, &chain);
+                break;
+        }
+        // Deflated pages are faulted back in on access, nothing to do
+        virtio_queue_push(vdev, queue, &chain, 0);
+    }
+    virtio_queue_notify(vdev, queue);
+}
+
+static void virtio_balloon_reset(virtio_dev_t* vdev)
+{
+    // The guest owns all of it's memory again, the target is kept
+    write_uint32_le(virtio_config(vdev) + VIRTIO_BALLOON_CFG_ACTUAL, 0);
+}
+
+static void virtio_balloon_remove(virtio_dev_t* vdev)
+{
+    virtio_balloon_t* balloon = virtio_get_data(vdev);
+    free(balloon);
+}
+
+static const virtio_dev_type_t virtio_balloon_type = {
+    .name = "virtio_balloon",
+    .features = (1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) | (1ULL << VIRTIO_BALLOON_F_REPORTING),
+    .device_id = VIRTIO_ID_BALLOON,
+    .class_code = 0xFF00,
+    .queue_count = 3,
+    .config_size = 16, // num_pages, actual, free_page_hint_cmd_id, poison_val
+    .queue_notify = virtio_balloon_notify,
+    .reset = virtio_balloon_reset,
+    .remove = virtio_balloon_remove,
+};
+
+PUBLIC virtio_balloon_t* virtio_balloon_init(pci_bus_t* pci_bus)
+{
+    virtio_balloon_t* balloon = safe_new_obj(virtio_balloon_t);
+    balloon->vdev = virtio_pci_init(pci_bus, &virtio_balloon_type, balloon);
+    if (balloon->vdev == NULL) {
+        // Device data is cleaned up by PCI bus on attach failure
+        return NULL;
+    }
+    return balloon;
+}
+
+PUBLIC virtio_balloon_t* virtio_balloon_init_auto(rvvm_machine_t* machine)
+{
+    return virtio_balloon_init(rvvm_get_pci_bus(machine));
+}
+
+PUBLIC void virtio_balloon_set_target(virtio_balloon_t* balloon, uint64_t size)
+{
+    uint8_t* config = virtio_config(balloon->vdev);
+    write_uint32_le(config + VIRTIO_BALLOON_CFG_NUM_PAGES, size >> VIRTIO_BALLOON_PFN_SHIFT);
+    virtio_config_changed(balloon->vdev);
+}
+
+PUBLIC uint64_t virtio_balloon_get_actual(virtio_balloon_t* balloon)
+{
+    uint8_t* config = virtio_config(balloon->vdev);
+    return ((uint64_t)read_uint32_le(config + VIRTIO_BALLOON_CFG_ACTUAL)) << VIRTIO_BALLOON_PFN_SHIFT;
+}
@@ -0,0 +1,28 @@
+/*
+virtio-balloon.h - Virtio memory balloon with free page reporting
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef RVVM_VIRTIO_BALLOON_H
+#define RVVM_VIRTIO_BALLOON_H
+
+#include "rvvmlib.h"
+#include "pci-bus.h"
+
+typedef struct virtio_balloon virtio_balloon_t;
+
+PUBLIC virtio_balloon_t* virtio_balloon_init(pci_bus_t* pci_bus);
+PUBLIC virtio_balloon_t* virtio_balloon_init_auto(rvvm_machine_t* machine);
+
+// Ask the guest to inflate or deflate the balloon to hold this much of guest RAM, in bytes.
+// Pages handed to the balloon are released on the host, the guest takes them back on OOM
+PUBLIC void     virtio_balloon_set_target(virtio_balloon_t* balloon, uint64_t size);
+
+// Amount of guest RAM currently held by the balloon, in bytes
+PUBLIC uint64_t virtio_balloon_get_actual(virtio_balloon_t* balloon);
+
+#endif
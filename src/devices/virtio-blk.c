@@ -0,0 +1,404 @@
+/*
+virtio-blk.c - Virtio block device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "virtio-blk.h"
+#include "virtio-pci.h"
+#include "blk_io.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "mem_ops.h"
+#include "utils.h"
+
+#include <string.h>
+
+// Feature bits
+#define VIRTIO_BLK_F_SEG_MAX      2
+#define VIRTIO_BLK_F_BLK_SIZE     6
+#define VIRTIO_BLK_F_FLUSH        9
+#define VIRTIO_BLK_F_MQ           12
+#define VIRTIO_BLK_F_DISCARD      13
+#define VIRTIO_BLK_F_WRITE_ZEROES 14
+
+// Request types
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_T_FLUSH        4
+#define VIRTIO_BLK_T_GET_ID       8
+#define VIRTIO_BLK_T_DISCARD      11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+// Request status
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+// Configuration space layout
+#define VIRTIO_BLK_CFG_CAPACITY    0x00
+#define VIRTIO_BLK_CFG_SEG_MAX     0x0C
+#define VIRTIO_BLK_CFG_BLK_SIZE    0x14
+#define VIRTIO_BLK_CFG_NUM_QUEUES  0x22
+#define VIRTIO_BLK_CFG_DISCARD_MAX 0x24
+#define VIRTIO_BLK_CFG_DISCARD_SEG 0x28
+#define VIRTIO_BLK_CFG_DISCARD_ALN 0x2C
+#define VIRTIO_BLK_CFG_WZEROES_MAX 0x30
+#define VIRTIO_BLK_CFG_WZEROES_SEG 0x34
+#define VIRTIO_BLK_CFG_WZEROES_MAP 0x38
+#define VIRTIO_BLK_CFG_SIZE        0x3C
+
+#define VIRTIO_BLK_SECTOR_SHIFT 9
+#define VIRTIO_BLK_HDR_SIZE     16
+#define VIRTIO_BLK_ID_BYTES     20
+
+// Discard & write zeroes segments: sector, num_sectors, flags
+#define VIRTIO_BLK_SEG_SIZE     16
+#define VIRTIO_BLK_SEG_UNMAP    0x1
+#define VIRTIO_BLK_SEG_MAX      256
+#define VIRTIO_BLK_SEG_SECTORS  0x400000 // 2GiB per segment
+#define VIRTIO_BLK_DISCARD_ALN  8        // 4K discard granularity
+
+typedef struct {
+    virtio_dev_type_t type; // Queue count depends on the machine
+    blkdev_t* blk;
+    uint32_t inflight;
+    bool dma_map;
+    char serial[VIRTIO_BLK_ID_BYTES];
+} virtio_blk_dev_t;
+
+typedef struct {
+    blk_io_req_t req;
+    virtio_dev_t* vdev;
+    uint32_t queue;
+    uint32_t type;
+    uint64_t sector;
+    uint8_t* status;
+    uint32_t written; // Bytes written into device-writable buffers, excluding status
+    bool data_in;     // All data buffers are device-writable
+    bool data_out;    // All data buffers are device-readable
+    virtio_chain_t chain;
+    blk_iovec_t iov[VIRTIO_CHAIN_MAX];
+} virtio_blk_req_t;
+
+static void virtio_blk_complete(virtio_blk_req_t* vreq, uint8_t status)
+{
+    virtio_dev_t* vdev = vreq->vdev;
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    write_uint8(vreq->status, status);
+    virtio_queue_push(vdev, vreq->queue, &vreq->chain, vreq->written + 1);
+    virtio_queue_notify(vdev, vreq->queue);
+    free(vreq);
+    atomic_sub_uint32(&vblk->inflight, 1);
+}
+
+static void virtio_blk_io_complete(blk_io_req_t* req, bool success)
+{
+    virtio_blk_req_t* vreq = req->data;
+    if (success && vreq->type == VIRTIO_BLK_T_IN) {
+        vreq->written = req->size;
+    }
+    virtio_blk_complete(vreq, success ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+}
+
+// Map the chain into host buffers, strip the request header and the trailing status byte
+static bool virtio_blk_map_chain(virtio_dev_t* vdev, virtio_blk_req_t* vreq)
+{
+    uint8_t hdr[VIRTIO_BLK_HDR_SIZE] = {0};
+    size_t hdr_left = sizeof(hdr);
+    const virtio_chain_t* chain = &vreq->chain;
+    vreq->data_in = true;
+    vreq->data_out = true;
+    for (size_t i = 0; i < chain->count; ++i) {
+        const virtio_buf_t* buf = &chain->buf[i];
+        uint8_t* ptr = pci_get_dma_ptr(virtio_get_pci_func(vdev), buf->addr, buf->len);
+        size_t len = buf->len;
+        if (ptr == NULL && len) {
+            return false;
+        }
+        if (i + 1 == chain->count) {
+            if (!len || !buf->write) {
+                return false;
+            }
+            vreq->status = ptr + --len;
+        }
+        size_t hdr_len = EVAL_MIN(hdr_left, len);
+        memcpy(hdr + sizeof(hdr) - hdr_left, ptr, hdr_len);
+        hdr_left -= hdr_len;
+        ptr += hdr_len;
+        len -= hdr_len;
+        if (len) {
+            size_t count = vreq->req.iov_count;
+            if (count && ((uint8_t*)vreq->iov[count - 1].buffer) + vreq->iov[count - 1].size == ptr) {
+                // Merge contiguous host buffers
+                vreq->iov[count - 1].size += len;
+            } else {
+                vreq->iov[count].buffer = ptr;
+                vreq->iov[count].size = len;
+                vreq->req.iov_count++;
+            }
+            vreq->data_in = vreq->data_in && buf->write;
+            vreq->data_out = vreq->data_out && !buf->write;
+            vreq->req.size += len;
+        }
+    }
+    if (hdr_left) {
+        return false;
+    }
+    vreq->type = read_uint32_le(hdr);
+    vreq->sector = read_uint64_le(hdr + 8);
+    return true;
+}
+
+static size_t virtio_blk_copy_from(virtio_blk_req_t* vreq, void* data, size_t size)
+{
+    size_t copied = 0;
+    for (size_t i = 0; i < vreq->req.iov_count && copied < size; ++i) {
+        size_t len = EVAL_MIN(vreq->iov[i].size, size - copied);
+        memcpy(((uint8_t*)data) + copied, vreq->iov[i].buffer, len);
+        copied += len;
+    }
+    return copied;
+}
+
+static size_t virtio_blk_copy_to(virtio_blk_req_t* vreq, const void* data, size_t size)
+{
+    size_t copied = 0;
+    for (size_t i = 0; i < vreq->req.iov_count && copied < size; ++i) {
+        size_t len = EVAL_MIN(vreq->iov[i].size, size - copied);
+        memcpy(vreq->iov[i].buffer, ((const uint8_t*)data) + copied, len);
+        copied += len;
+    }
+    return copied;
+}
+
+static void* virtio_blk_discard_worker(void* arg)
+{
+    virtio_blk_req_t* vreq = arg;
+    virtio_blk_dev_t* vblk = virtio_get_data(vreq->vdev);
+    size_t count = vreq->req.size / VIRTIO_BLK_SEG_SIZE;
+    uint8_t* segs = safe_new_arr(uint8_t, count * VIRTIO_BLK_SEG_SIZE);
+    blk_range_t* ranges = safe_new_arr(blk_range_t, count);
+    uint8_t status = VIRTIO_BLK_S_OK;
+    virtio_blk_copy_from(vreq, segs, count * VIRTIO_BLK_SEG_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* seg = segs + (i * VIRTIO_BLK_SEG_SIZE);
+        uint64_t sector = read_uint64_le(seg);
+        uint32_t sectors = read_uint32_le(seg + 8);
+        uint32_t flags = read_uint32_le(seg + 12);
+        uint32_t flags_mask = (vreq->type == VIRTIO_BLK_T_WRITE_ZEROES) ? VIRTIO_BLK_SEG_UNMAP : 0;
+        if ((flags & ~flags_mask) || sectors > VIRTIO_BLK_SEG_SECTORS) {
+            status = VIRTIO_BLK_S_UNSUPP;
+            break;
+        }
+        if (sector > (blk_getsize(vblk->blk) >> VIRTIO_BLK_SECTOR_SHIFT)
+         || sectors > (blk_getsize(vblk->blk) >> VIRTIO_BLK_SECTOR_SHIFT) - sector) {
+            status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        ranges[i].offset = sector << VIRTIO_BLK_SECTOR_SHIFT;
+        ranges[i].size = ((uint64_t)sectors) << VIRTIO_BLK_SECTOR_SHIFT;
+    }
+    if (status == VIRTIO_BLK_S_OK) {
+        if (vreq->type == VIRTIO_BLK_T_DISCARD) {
+            // Discard is only a hint, adjacent segments become a single host discard
+            blk_trim_ranges(vblk->blk, ranges, count, false);
+        } else {
+            // Write zeroes may always unmap, zeroed blocks read back the same way
+            for (size_t i = 0; i < count && status == VIRTIO_BLK_S_OK; ++i) {
+                if (!blk_write_zeroes(vblk->blk, ranges[i].offset, ranges[i].size)) {
+                    status = VIRTIO_BLK_S_IOERR;
+                }
+            }
+        }
+    }
+    free(ranges);
+    free(segs);
+    virtio_blk_complete(vreq, status);
+    return NULL;
+}
+
+static void virtio_blk_submit(virtio_dev_t* vdev, virtio_blk_req_t* vreq)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    if (!virtio_blk_map_chain(vdev, vreq)) {
+        if (vreq->status) {
+            virtio_blk_complete(vreq, VIRTIO_BLK_S_IOERR);
+        } else {
+            // Nowhere to report the status
+            virtio_queue_push(vdev, vreq->queue, &vreq->chain, 0);
+            virtio_queue_notify(vdev, vreq->queue);
+            free(vreq);
+            atomic_sub_uint32(&vblk->inflight, 1);
+        }
+        return;
+    }
+
+    vreq->req.dev = vblk->blk;
+    vreq->req.iov = vreq->iov;
+    vreq->req.offset = vreq->sector << VIRTIO_BLK_SECTOR_SHIFT;
+    vreq->req.complete = virtio_blk_io_complete;
+    vreq->req.data = vreq;
+    switch (vreq->type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT: {
+            bool write = vreq->type == VIRTIO_BLK_T_OUT;
+            if ((vreq->req.size & ((1U << VIRTIO_BLK_SECTOR_SHIFT) - 1)) || !(write ? vreq->data_out : vreq->data_in)
+             || vreq->sector > (UINT64_MAX >> VIRTIO_BLK_SECTOR_SHIFT)) {
+                break;
+            }
+            vreq->req.opcode = write ? BLKDEV_IO_WRITE : BLKDEV_IO_READ;
+            vreq->req.flags = (!write && vblk->dma_map) ? BLKDEV_IO_MAP : 0;
+            blk_submit(&vreq->req);
+            return;
+        }
+        case VIRTIO_BLK_T_FLUSH:
+            vreq->req.opcode = BLKDEV_IO_SYNC;
+            blk_submit(&vreq->req);
+            return;
+        case VIRTIO_BLK_T_GET_ID:
+            if (vreq->data_in) {
+                vreq->written = virtio_blk_copy_to(vreq, vblk->serial, sizeof(vblk->serial));
+                virtio_blk_complete(vreq, VIRTIO_BLK_S_OK);
+                return;
+            }
+            break;
+        case VIRTIO_BLK_T_DISCARD:
+        case VIRTIO_BLK_T_WRITE_ZEROES: {
+            size_t count = vreq->req.size / VIRTIO_BLK_SEG_SIZE;
+            if (!vreq->data_out || (vreq->req.size % VIRTIO_BLK_SEG_SIZE) || count == 0) {
+                break;
+            }
+            if (count > VIRTIO_BLK_SEG_MAX) {
+                virtio_blk_complete(vreq, VIRTIO_BLK_S_UNSUPP);
+                return;
+            }
+            // Segments are processed on a worker thread
+            thread_create_task(virtio_blk_discard_worker, vreq);
+            return;
+        }
+        default:
+            virtio_blk_complete(vreq, VIRTIO_BLK_S_UNSUPP);
+            return;
+    }
+    virtio_blk_complete(vreq, VIRTIO_BLK_S_IOERR);
+}
+
+static void virtio_blk_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    while (true) {
+        virtio_blk_req_t* vreq = safe_new_obj(virtio_blk_req_t);
+        // Count the request before popping it, so a concurrent quiesce can't miss it
+        atomic_add_uint32(&vblk->inflight, 1);
+        if (!virtio_queue_pop(vdev, queue, &vreq->chain)) {
+            atomic_sub_uint32(&vblk->inflight, 1);
+            free(vreq);
+            break;
+        }
+        vreq->vdev = vdev;
+        vreq->queue = queue;
+        virtio_blk_submit(vdev, vreq);
+    }
+}
+
+static void virtio_blk_quiesce(virtio_dev_t* vdev)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    while (atomic_load_uint32(&vblk->inflight)) sleep_ms(1);
+}
+
+static void virtio_blk_save(virtio_dev_t* vdev, rvvm_state_t* state)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    uint8_t tmp[8] = {0};
+    write_uint64_le_m(tmp, blk_getsize(vblk->blk));
+    rvvm_state_write(state, tmp, sizeof(tmp));
+    rvvm_state_write(state, vblk->serial, sizeof(vblk->serial));
+}
+
+static bool virtio_blk_load(virtio_dev_t* vdev, rvvm_state_t* state)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    uint8_t tmp[8] = {0};
+    if (!rvvm_state_read(state, tmp, sizeof(tmp)) || !rvvm_state_read(state, vblk->serial, sizeof(vblk->serial))) {
+        return false;
+    }
+    if (read_uint64_le_m(tmp) != blk_getsize(vblk->blk)) {
+        rvvm_error("virtio-blk image size doesn't match the saved state");
+        return false;
+    }
+    return true;
+}
+
+static void virtio_blk_remove(virtio_dev_t* vdev)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    virtio_blk_quiesce(vdev);
+    blk_close(vblk->blk);
+    free(vblk);
+}
+
+PUBLIC pci_dev_t* virtio_blk_init_blk(pci_bus_t* pci_bus, void* blk_dev)
+{
+    // Host bridge is always at 00:00.0, use it to find the machine hart count
+    pci_func_t* host = pci_get_bus_func(pci_bus, 0);
+    size_t harts = host ? rvvm_get_opt(pci_get_func_machine(host), RVVM_OPT_HART_COUNT) : 1;
+    virtio_blk_dev_t* vblk = safe_new_obj(virtio_blk_dev_t);
+    blkdev_t* blk = blk_dev;
+    vblk->blk = blk;
+    vblk->type = (virtio_dev_type_t) {
+        .name = "virtio_blk",
+        .features = (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_FLUSH)
+                  | (1ULL << VIRTIO_BLK_F_MQ) | (1ULL << VIRTIO_BLK_F_DISCARD) | (1ULL << VIRTIO_BLK_F_WRITE_ZEROES),
+        .device_id = VIRTIO_ID_BLOCK,
+        .class_code = 0x0100, // Mass Storage, SCSI
+        .queue_count = EVAL_MAX(EVAL_MIN(harts, VIRTIO_QUEUE_MAX), 1),
+        .config_size = VIRTIO_BLK_CFG_SIZE,
+        .queue_notify = virtio_blk_notify,
+        .quiesce = virtio_blk_quiesce,
+        .save = virtio_blk_save,
+        .load = virtio_blk_load,
+        .remove = virtio_blk_remove,
+    };
+    rvvm_randomserial(vblk->serial, sizeof(vblk->serial));
+
+    virtio_dev_t* vdev = virtio_pci_init(pci_bus, &vblk->type, vblk);
+    if (vdev == NULL) {
+        // Device data is cleaned up by PCI bus on attach failure
+        return NULL;
+    }
+
+    // Read-only image pages may be mapped directly into guest RAM
+    vblk->dma_map = rvvm_get_opt(pci_get_func_machine(virtio_get_pci_func(vdev)), RVVM_OPT_MEM_PRIVATE);
+
+    // Header & status take two chain entries
+    uint8_t* config = virtio_config(vdev);
+    write_uint64_le(config + VIRTIO_BLK_CFG_CAPACITY, blk_getsize(blk) >> VIRTIO_BLK_SECTOR_SHIFT);
+    write_uint32_le(config + VIRTIO_BLK_CFG_SEG_MAX, VIRTIO_CHAIN_MAX - 2);
+    write_uint32_le(config + VIRTIO_BLK_CFG_BLK_SIZE, 1U << VIRTIO_BLK_SECTOR_SHIFT);
+    write_uint16_le(config + VIRTIO_BLK_CFG_NUM_QUEUES, vblk->type.queue_count);
+    write_uint32_le(config + VIRTIO_BLK_CFG_DISCARD_MAX, VIRTIO_BLK_SEG_SECTORS);
+    write_uint32_le(config + VIRTIO_BLK_CFG_DISCARD_SEG, VIRTIO_BLK_SEG_MAX);
+    write_uint32_le(config + VIRTIO_BLK_CFG_DISCARD_ALN, VIRTIO_BLK_DISCARD_ALN);
+    write_uint32_le(config + VIRTIO_BLK_CFG_WZEROES_MAX, VIRTIO_BLK_SEG_SECTORS);
+    write_uint32_le(config + VIRTIO_BLK_CFG_WZEROES_SEG, VIRTIO_BLK_SEG_MAX);
+    write_uint8(config + VIRTIO_BLK_CFG_WZEROES_MAP, 1);
+    return virtio_get_pci_dev(vdev);
+}
+
+PUBLIC pci_dev_t* virtio_blk_init(pci_bus_t* pci_bus, const char* image_path, bool rw)
+{
+    blkdev_t* blk = blk_open_disk(pci_get_bus_machine(pci_bus), image_path, rw ? BLKDEV_RW : 0);
+    if (blk == NULL) return NULL;
+    return virtio_blk_init_blk(pci_bus, blk);
+}
+
+PUBLIC pci_dev_t* virtio_blk_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw)
+{
+    return virtio_blk_init(rvvm_get_pci_bus(machine), image_path, rw);
+}
@@ -0,0 +1,21 @@
+/*
+virtio-blk.h - Virtio block device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef RVVM_VIRTIO_BLK_H
+#define RVVM_VIRTIO_BLK_H
+
+#include "rvvmlib.h"
+#include "pci-bus.h"
+
+// Attaches a virtio-blk drive with a request queue per each machine hart
+PUBLIC pci_dev_t* virtio_blk_init_blk(pci_bus_t* pci_bus, void* blk_dev);
+PUBLIC pci_dev_t* virtio_blk_init(pci_bus_t* pci_bus, const char* image_path, bool rw);
+PUBLIC pci_dev_t* virtio_blk_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw);
+
+#endif
@@ -0,0 +1,684 @@
+/*
+virtio-pci.c - Virtio PCI 1.x transport
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "virtio-pci.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+#include "utils.h"
+#include "bit_ops.h"
+
+// PCI IDs
+#define VIRTIO_PCI_VENDOR_ID 0x1AF4
+#define VIRTIO_PCI_DEVICE_ID 0x1040 // Plus virtio device ID
+
+// BAR0 layout
+#define VIRTIO_PCI_COMMON_OFF  0x0000
+#define VIRTIO_PCI_ISR_OFF     0x1000
+#define VIRTIO_PCI_DEVICE_OFF  0x2000
+#define VIRTIO_PCI_NOTIFY_OFF  0x3000
+#define VIRTIO_PCI_BAR_SIZE    0x4000
+#define VIRTIO_PCI_NOTIFY_MULT 4
+
+// Capability types
+#define VIRTIO_PCI_CAP_VENDOR 0x09
+#define VIRTIO_PCI_CAP_COMMON 0x1
+#define VIRTIO_PCI_CAP_NOTIFY 0x2
+#define VIRTIO_PCI_CAP_ISR    0x3
+#define VIRTIO_PCI_CAP_DEVICE 0x4
+
+// Common configuration registers
+#define VIRTIO_REG_DFSELECT  0x00 // Device feature select
+#define VIRTIO_REG_DF        0x04 // Device feature
+#define VIRTIO_REG_GFSELECT  0x08 // Driver (Guest) feature select
+#define VIRTIO_REG_GF        0x0C // Driver (Guest) feature
+#define VIRTIO_REG_MSIX      0x10 // Config MSI-X vector
+#define VIRTIO_REG_NUMQ      0x12 // Number of queues
+#define VIRTIO_REG_STATUS    0x14 // Device status
+#define VIRTIO_REG_CFGGEN    0x15 // Config generation
+#define VIRTIO_REG_Q_SELECT  0x16
+#define VIRTIO_REG_Q_SIZE    0x18
+#define VIRTIO_REG_Q_MSIX    0x1A
+#define VIRTIO_REG_Q_ENABLE  0x1C
+#define VIRTIO_REG_Q_NOFF    0x1E // Queue notify offset
+#define VIRTIO_REG_Q_DESCLO  0x20
+#define VIRTIO_REG_Q_DESCHI  0x24
+#define VIRTIO_REG_Q_AVAILLO 0x28
+#define VIRTIO_REG_Q_AVAILHI 0x2C
+#define VIRTIO_REG_Q_USEDLO  0x30
+#define VIRTIO_REG_Q_USEDHI  0x34
+
+// Device status bits
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+
+// ISR bits
+#define VIRTIO_ISR_QUEUE  0x1
+#define VIRTIO_ISR_CONFIG 0x2
+
+#define VIRTIO_NO_VECTOR 0xFFFF
+
+// Split virtqueue layout
+#define VIRTQ_DESC_SIZE       16
+#define VIRTQ_DESC_F_NEXT     0x1
+#define VIRTQ_DESC_F_WRITE    0x2
+#define VIRTQ_DESC_F_INDIRECT 0x4
+#define VIRTQ_AVAIL_F_NO_INTR 0x1
+
+typedef struct {
+    rvvm_addr_t desc;
+    rvvm_addr_t avail;
+    rvvm_addr_t used;
+    uint32_t size;
+    uint32_t enable;
+    uint32_t msix_vector;
+    uint16_t last_avail;
+    uint16_t used_idx;
+    uint16_t signalled_used; // Used index at the last interrupt
+    bool event_idx;          // Event index notification suppression negotiated
+    spinlock_t lock;
+} virtio_queue_t;
+
+struct virtio_dev {
+    const virtio_dev_type_t* type;
+    void* data;
+    pci_dev_t* pci_dev;
+    pci_func_t* pci_func;
+    rvvm_mmio_type_t mmio_type;
+    spinlock_t lock;
+
+    uint64_t driver_features;
+    uint32_t device_feature_sel;
+    uint32_t driver_feature_sel;
+    uint32_t config_msix_vector;
+    uint32_t queue_sel;
+    uint32_t status;
+    uint32_t config_gen;
+    uint32_t isr;
+
+    virtio_queue_t queues[VIRTIO_QUEUE_MAX];
+    uint8_t config[VIRTIO_CONFIG_SIZE];
+};
+
+static inline uint64_t virtio_device_features(virtio_dev_t* vdev)
+{
+    return vdev->type->features | (1ULL << VIRTIO_RING_F_INDIRECT_DESC)
+         | (1ULL << VIRTIO_RING_F_EVENT_IDX) | (1ULL << VIRTIO_F_VERSION_1);
+}
+
+static void virtio_reset_internal(virtio_dev_t* vdev)
+{
+    // Stop popping new chains and let in-flight requests finish before the rings go away
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; ++i) {
+        atomic_store_uint32(&vdev->queues[i].enable, false);
+    }
+    if (vdev->type->quiesce) {
+        vdev->type->quiesce(vdev);
+    }
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; ++i) {
+        virtio_queue_t* vq = &vdev->queues[i];
+        spin_lock(&vq->lock);
+        vq->desc = 0;
+        vq->avail = 0;
+        vq->used = 0;
+        vq->size = VIRTIO_QUEUE_SIZE;
+        vq->last_avail = 0;
+        vq->used_idx = 0;
+        vq->signalled_used = 0;
+        vq->event_idx = false;
+        atomic_store_uint32(&vq->enable, false);
+        atomic_store_uint32(&vq->msix_vector, VIRTIO_NO_VECTOR);
+        spin_unlock(&vq->lock);
+    }
+    vdev->driver_features = 0;
+    vdev->device_feature_sel = 0;
+    vdev->driver_feature_sel = 0;
+    vdev->queue_sel = 0;
+    atomic_store_uint32(&vdev->config_msix_vector, VIRTIO_NO_VECTOR);
+    atomic_store_uint32(&vdev->status, 0);
+    atomic_store_uint32(&vdev->isr, 0);
+    if (vdev->type->reset) {
+        vdev->type->reset(vdev);
+    }
+}
+
+static void virtio_send_irq(virtio_dev_t* vdev, uint32_t isr, uint32_t vector)
+{
+    atomic_or_uint32(&vdev->isr, isr);
+    if (vector != VIRTIO_NO_VECTOR) {
+        pci_send_irq(vdev->pci_func, vector);
+    } else if (!(atomic_load_uint32_relax(&vdev->status) & VIRTIO_STATUS_DRIVER_OK)) {
+        // Driver isn't ready yet
+        return;
+    } else {
+        // INTx fallback, the driver checks ISR
+        pci_send_irq(vdev->pci_func, 0);
+    }
+}
+
+static void virtio_set_needs_reset(virtio_dev_t* vdev)
+{
+    rvvm_warn("virtio %s: Malformed virtqueue, device needs reset", vdev->type->name);
+    atomic_or_uint32(&vdev->status, VIRTIO_STATUS_NEEDS_RESET);
+    virtio_send_irq(vdev, VIRTIO_ISR_CONFIG, atomic_load_uint32_relax(&vdev->config_msix_vector));
+}
+
+static uint32_t virtio_common_read(virtio_dev_t* vdev, size_t reg)
+{
+    virtio_queue_t* vq = NULL;
+    if (vdev->queue_sel < vdev->type->queue_count) {
+        vq = &vdev->queues[vdev->queue_sel];
+    }
+    switch (reg) {
+        case VIRTIO_REG_DFSELECT:
+            return vdev->device_feature_sel;
+        case VIRTIO_REG_DF:
+            if (vdev->device_feature_sel < 2) {
+                return virtio_device_features(vdev) >> (vdev->device_feature_sel << 5);
+            }
+            return 0;
+        case VIRTIO_REG_GFSELECT:
+            return vdev->driver_feature_sel;
+        case VIRTIO_REG_GF:
+            if (vdev->driver_feature_sel < 2) {
+                return vdev->driver_features >> (vdev->driver_feature_sel << 5);
+            }
+            return 0;
+        case VIRTIO_REG_MSIX:
+            return atomic_load_uint32_relax(&vdev->config_msix_vector)
+                 | ((uint32_t)vdev->type->queue_count << 16);
+        case VIRTIO_REG_STATUS:
+            return atomic_load_uint32_relax(&vdev->status)
+                 | (atomic_load_uint32_relax(&vdev->config_gen) << 8)
+                 | (vdev->queue_sel << 16);
+        case VIRTIO_REG_Q_SIZE:
+            return vq ? (vq->size | (atomic_load_uint32_relax(&vq->msix_vector) << 16)) : 0;
+        case VIRTIO_REG_Q_ENABLE:
+            // Queue notify offset equals queue index
+            return vq ? (atomic_load_uint32_relax(&vq->enable) | (vdev->queue_sel << 16)) : 0;
+        case VIRTIO_REG_Q_DESCLO:
+            return vq ? vq->desc : 0;
+        case VIRTIO_REG_Q_DESCHI:
+            return vq ? (vq->desc >> 32) : 0;
+        case VIRTIO_REG_Q_AVAILLO:
+            return vq ? vq->avail : 0;
+        case VIRTIO_REG_Q_AVAILHI:
+            return vq ? (vq->avail >> 32) : 0;
+        case VIRTIO_REG_Q_USEDLO:
+            return vq ? vq->used : 0;
+        case VIRTIO_REG_Q_USEDHI:
+            return vq ? (vq->used >> 32) : 0;
+    }
+    return 0;
+}
+
+static void virtio_write_status(virtio_dev_t* vdev, uint32_t status)
+{
+    if (status == 0) {
+        virtio_reset_internal(vdev);
+        return;
+    }
+    if ((status & VIRTIO_STATUS_FEATURES_OK) && !(atomic_load_uint32_relax(&vdev->status) & VIRTIO_STATUS_FEATURES_OK)) {
+        // Reject unsupported feature sets, legacy drivers are not supported
+        uint64_t features = vdev->driver_features;
+        if ((features & ~virtio_device_features(vdev)) || !(features & (1ULL << VIRTIO_F_VERSION_1))) {
+            status &= ~VIRTIO_STATUS_FEATURES_OK;
+        }
+    }
+    atomic_store_uint32(&vdev->status, status & 0xFF);
+}
+
+static void virtio_common_write(virtio_dev_t* vdev, size_t offset, uint32_t val)
+{
+    virtio_queue_t* vq = NULL;
+    if (vdev->queue_sel < vdev->type->queue_count) {
+        vq = &vdev->queues[vdev->queue_sel];
+    }
+    switch (offset) {
+        case VIRTIO_REG_DFSELECT:
+            vdev->device_feature_sel = val;
+            break;
+        case VIRTIO_REG_GFSELECT:
+            vdev->driver_feature_sel = val;
+            break;
+        case VIRTIO_REG_GF:
+            if (vdev->driver_feature_sel < 2) {
+                size_t shift = vdev->driver_feature_sel << 5;
+                vdev->driver_features &= ~(0xFFFFFFFFULL << shift);
+                vdev->driver_features |= ((uint64_t)val) << shift;
+            }
+            break;
+        case VIRTIO_REG_MSIX:
+            atomic_store_uint32_relax(&vdev->config_msix_vector, (uint16_t)val);
+            break;
+        case VIRTIO_REG_STATUS:
+            virtio_write_status(vdev, val);
+            break;
+        case VIRTIO_REG_Q_SELECT:
+            vdev->queue_sel = (uint16_t)val;
+            break;
+        case VIRTIO_REG_Q_SIZE:
+            // Queue size should be a power of 2
+            if (vq && val && val <= VIRTIO_QUEUE_SIZE && !(val & (val - 1))) {
+                vq->size = val;
+            }
+            break;
+        case VIRTIO_REG_Q_MSIX:
+            if (vq) atomic_store_uint32_relax(&vq->msix_vector, (uint16_t)val);
+            break;
+        case VIRTIO_REG_Q_ENABLE:
+            if (vq) {
+                spin_lock(&vq->lock);
+                vq->last_avail = 0;
+                vq->used_idx = 0;
+                vq->signalled_used = 0;
+                // Features are final once queues are set up
+                vq->event_idx = !!(vdev->driver_features & (1ULL << VIRTIO_RING_F_EVENT_IDX));
+                atomic_store_uint32(&vq->enable, val & 1);
+                spin_unlock(&vq->lock);
+            }
+            break;
+        case VIRTIO_REG_Q_DESCLO:
+            if (vq) vq->desc = bit_replace(vq->desc, 0, 32, val);
+            break;
+        case VIRTIO_REG_Q_DESCHI:
+            if (vq) vq->desc = bit_replace(vq->desc, 32, 32, val);
+            break;
+        case VIRTIO_REG_Q_AVAILLO:
+            if (vq) vq->avail = bit_replace(vq->avail, 0, 32, val);
+            break;
+        case VIRTIO_REG_Q_AVAILHI:
+            if (vq) vq->avail = bit_replace(vq->avail, 32, 32, val);
+            break;
+        case VIRTIO_REG_Q_USEDLO:
+            if (vq) vq->used = bit_replace(vq->used, 0, 32, val);
+            break;
+        case VIRTIO_REG_Q_USEDHI:
+            if (vq) vq->used = bit_replace(vq->used, 32, 32, val);
+            break;
+    }
+}
+
+static uint32_t virtio_read_val(const void* data, uint8_t size)
+{
+    switch (size) {
+        case 1: return read_uint8(data);
+        case 2: return read_uint16_le(data);
+        default: return read_uint32_le(data);
+    }
+}
+
+static void virtio_write_val(void* data, uint32_t val, uint8_t size)
+{
+    switch (size) {
+        case 1: write_uint8(data, val); break;
+        case 2: write_uint16_le(data, val); break;
+        default: write_uint32_le(data, val); break;
+    }
+}
+
+static bool virtio_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    virtio_dev_t* vdev = dev->data;
+    uint32_t val = 0;
+    if (offset < VIRTIO_PCI_ISR_OFF) {
+        spin_lock(&vdev->lock);
+        val = virtio_common_read(vdev, offset & ~3ULL) >> ((offset & 3) << 3);
+        spin_unlock(&vdev->lock);
+    } else if (offset < VIRTIO_PCI_DEVICE_OFF) {
+        // Reading ISR acknowledges the interrupt
+        if (offset == VIRTIO_PCI_ISR_OFF) {
+            val = atomic_swap_uint32(&vdev->isr, 0);
+        }
+    } else if (offset < VIRTIO_PCI_NOTIFY_OFF) {
+        size_t cfg_off = offset - VIRTIO_PCI_DEVICE_OFF;
+        if (cfg_off + size <= vdev->type->config_size) {
+            val = virtio_read_val(vdev->config + cfg_off, size);
+        }
+    }
+    virtio_write_val(data, val, size);
+    return true;
+}
+
+static bool virtio_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    virtio_dev_t* vdev = dev->data;
+    uint32_t val = virtio_read_val(data, size);
+    if (offset < VIRTIO_PCI_ISR_OFF) {
+        spin_lock(&vdev->lock);
+        virtio_common_write(vdev, offset, val);
+        spin_unlock(&vdev->lock);
+    } else if (offset >= VIRTIO_PCI_DEVICE_OFF && offset < VIRTIO_PCI_NOTIFY_OFF) {
+        size_t cfg_off = offset - VIRTIO_PCI_DEVICE_OFF;
+        if (cfg_off + size <= vdev->type->config_size) {
+            virtio_write_val(vdev->config + cfg_off, val, size);
+            if (vdev->type->config_write) {
+                vdev->type->config_write(vdev, cfg_off, size);
+            }
+        }
+    } else if (offset >= VIRTIO_PCI_NOTIFY_OFF) {
+        uint32_t queue = (offset - VIRTIO_PCI_NOTIFY_OFF) / VIRTIO_PCI_NOTIFY_MULT;
+        if (queue < vdev->type->queue_count && (atomic_load_uint32_relax(&vdev->status) & VIRTIO_STATUS_DRIVER_OK)
+         && atomic_load_uint32_relax(&vdev->queues[queue].enable)) {
+            vdev->type->queue_notify(vdev, queue);
+        }
+    }
+    return true;
+}
+
+static void virtio_pci_remove(rvvm_mmio_dev_t* dev)
+{
+    virtio_dev_t* vdev = dev->data;
+    if (vdev->type->remove) {
+        vdev->type->remove(vdev);
+    }
+    free(vdev);
+}
+
+static void virtio_pci_reset(rvvm_mmio_dev_t* dev)
+{
+    virtio_dev_t* vdev = dev->data;
+    spin_lock(&vdev->lock);
+    virtio_reset_internal(vdev);
+    spin_unlock(&vdev->lock);
+}
+
+static void virtio_pci_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    virtio_dev_t* vdev = dev->data;
+    spin_lock(&vdev->lock);
+    uint64_t regs[] = {
+        vdev->driver_features, vdev->device_feature_sel, vdev->driver_feature_sel, vdev->config_msix_vector,
+        vdev->queue_sel, vdev->status, vdev->config_gen, vdev->isr,
+    };
+    rvvm_state_write(state, regs, sizeof(regs));
+    for (size_t i = 0; i < vdev->type->queue_count; ++i) {
+        virtio_queue_t* vq = &vdev->queues[i];
+        spin_lock(&vq->lock);
+        uint64_t queue[] = {
+            vq->desc, vq->avail, vq->used, vq->size, vq->enable, vq->msix_vector, vq->last_avail, vq->used_idx,
+        };
+        spin_unlock(&vq->lock);
+        rvvm_state_write(state, queue, sizeof(queue));
+    }
+    rvvm_state_write(state, vdev->config, vdev->type->config_size);
+    spin_unlock(&vdev->lock);
+    if (vdev->type->save) {
+        vdev->type->save(vdev, state);
+    }
+}
+
+static bool virtio_pci_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    virtio_dev_t* vdev = dev->data;
+    uint64_t regs[8] = {0};
+    bool ret = rvvm_state_read(state, regs, sizeof(regs));
+    spin_lock(&vdev->lock);
+    vdev->driver_features = regs[0];
+    vdev->device_feature_sel = regs[1];
+    vdev->driver_feature_sel = regs[2];
+    vdev->config_msix_vector = regs[3];
+    vdev->queue_sel = regs[4];
+    vdev->status = regs[5];
+    vdev->config_gen = regs[6];
+    vdev->isr = regs[7];
+    for (size_t i = 0; i < vdev->type->queue_count; ++i) {
+        virtio_queue_t* vq = &vdev->queues[i];
+        uint64_t queue[8] = {0};
+        ret = rvvm_state_read(state, queue, sizeof(queue)) && ret;
+        spin_lock(&vq->lock);
+        vq->desc = queue[0];
+        vq->avail = queue[1];
+        vq->used = queue[2];
+        vq->size = EVAL_MIN(queue[3], VIRTIO_QUEUE_SIZE);
+        vq->enable = queue[4];
+        vq->msix_vector = queue[5];
+        vq->last_avail = queue[6];
+        vq->used_idx = queue[7];
+        vq->signalled_used = vq->used_idx;
+        vq->event_idx = !!(vdev->driver_features & (1ULL << VIRTIO_RING_F_EVENT_IDX));
+        spin_unlock(&vq->lock);
+    }
+    ret = rvvm_state_read(state, vdev->config, vdev->type->config_size) && ret;
+    spin_unlock(&vdev->lock);
+    if (vdev->type->load) {
+        ret = vdev->type->load(vdev, state) && ret;
+    }
+    return ret;
+}
+
+static void virtio_pci_quiesce(rvvm_mmio_dev_t* dev)
+{
+    virtio_dev_t* vdev = dev->data;
+    // Saved ring indices must not cover requests that are still in flight
+    if (vdev->type->quiesce) {
+        vdev->type->quiesce(vdev);
+    }
+}
+
+PUBLIC virtio_dev_t* virtio_pci_init(pci_bus_t* pci_bus, const virtio_dev_type_t* type, void* data)
+{
+    if (type->queue_count > VIRTIO_QUEUE_MAX || type->config_size > VIRTIO_CONFIG_SIZE) {
+        rvvm_error("Invalid virtio device description");
+        return NULL;
+    }
+
+    virtio_dev_t* vdev = safe_new_obj(virtio_dev_t);
+    vdev->type = type;
+    vdev->data = data;
+    vdev->mmio_type.name = type->name;
+    vdev->mmio_type.remove = virtio_pci_remove;
+    vdev->mmio_type.reset = virtio_pci_reset;
+    vdev->mmio_type.save = virtio_pci_save;
+    vdev->mmio_type.load = virtio_pci_load;
+    vdev->mmio_type.quiesce = virtio_pci_quiesce;
+    virtio_reset_internal(vdev);
+
+    // Common, notify, ISR & device config capabilities, all in BAR0
+    uint8_t caps[PCI_VENDOR_CAPS_SIZE] = {
+        VIRTIO_PCI_CAP_VENDOR, PCI_VENDOR_CAPS_OFF + 0x10, 0x10, VIRTIO_PCI_CAP_COMMON, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        VIRTIO_PCI_CAP_VENDOR, PCI_VENDOR_CAPS_OFF + 0x24, 0x14, VIRTIO_PCI_CAP_NOTIFY, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        VIRTIO_PCI_CAP_VENDOR, PCI_VENDOR_CAPS_OFF + 0x34, 0x10, VIRTIO_PCI_CAP_ISR, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        VIRTIO_PCI_CAP_VENDOR, 0, 0x10, VIRTIO_PCI_CAP_DEVICE, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+    };
+    write_uint32_le(caps + 0x08, VIRTIO_PCI_COMMON_OFF);
+    write_uint32_le(caps + 0x0C, VIRTIO_PCI_ISR_OFF - VIRTIO_PCI_COMMON_OFF);
+    write_uint32_le(caps + 0x18, VIRTIO_PCI_NOTIFY_OFF);
+    write_uint32_le(caps + 0x1C, VIRTIO_PCI_BAR_SIZE - VIRTIO_PCI_NOTIFY_OFF);
+    write_uint32_le(caps + 0x20, VIRTIO_PCI_NOTIFY_MULT);
+    write_uint32_le(caps + 0x2C, VIRTIO_PCI_ISR_OFF);
+    write_uint32_le(caps + 0x30, VIRTIO_PCI_DEVICE_OFF - VIRTIO_PCI_ISR_OFF);
+    write_uint32_le(caps + 0x3C, VIRTIO_PCI_DEVICE_OFF);
+    write_uint32_le(caps + 0x40, VIRTIO_PCI_NOTIFY_OFF - VIRTIO_PCI_DEVICE_OFF);
+
+    pci_func_desc_t virtio_desc = {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_PCI_DEVICE_ID + type->device_id,
+        .class_code = type->class_code,
+        .rev = 1,
+        .irq_pin = PCI_IRQ_PIN_INTA,
+        .bar[0] = {
+            .size = VIRTIO_PCI_BAR_SIZE,
+            .min_op_size = 1,
+            .max_op_size = 4,
+            .read = virtio_pci_read,
+            .write = virtio_pci_write,
+            .data = vdev,
+            .type = &vdev->mmio_type,
+        },
+        .vendor_caps = caps,
+        .vendor_caps_size = sizeof(caps),
+    };
+
+    // Device data is cleaned up by PCI bus on failure
+    vdev->pci_dev = pci_attach_func(pci_bus, &virtio_desc);
+    if (vdev->pci_dev == NULL) {
+        return NULL;
+    }
+    vdev->pci_func = pci_get_device_func(vdev->pci_dev, 0);
+    return vdev;
+}
+
+void* virtio_get_data(virtio_dev_t* vdev)
+{
+    return vdev->data;
+}
+
+pci_dev_t* virtio_get_pci_dev(virtio_dev_t* vdev)
+{
+    return vdev->pci_dev;
+}
+
+pci_func_t* virtio_get_pci_func(virtio_dev_t* vdev)
+{
+    return vdev->pci_func;
+}
+
+bool virtio_has_feature(virtio_dev_t* vdev, uint32_t feature)
+{
+    spin_lock(&vdev->lock);
+    bool ret = feature < 64 && (vdev->driver_features & (1ULL << feature));
+    spin_unlock(&vdev->lock);
+    return ret;
+}
+
+uint8_t* virtio_config(virtio_dev_t* vdev)
+{
+    return vdev->config;
+}
+
+void virtio_config_changed(virtio_dev_t* vdev)
+{
+    atomic_add_uint32(&vdev->config_gen, 1);
+    virtio_send_irq(vdev, VIRTIO_ISR_CONFIG, atomic_load_uint32_relax(&vdev->config_msix_vector));
+}
+
+static bool virtio_queue_read_chain(virtio_dev_t* vdev, virtio_queue_t* vq, uint16_t head, virtio_chain_t* chain)
+{
+    const uint8_t* table = pci_get_dma_ptr(vdev->pci_func, vq->desc, vq->size * VIRTQ_DESC_SIZE);
+    size_t table_size = vq->size;
+    bool indirect = false;
+    uint16_t id = head;
+    chain->head = head;
+    chain->count = 0;
+    if (table == NULL) {
+        return false;
+    }
+    while (id < table_size && chain->count < VIRTIO_CHAIN_MAX) {
+        const uint8_t* desc = table + (id * VIRTQ_DESC_SIZE);
+        uint16_t flags = read_uint16_le(desc + 12);
+        if (flags & VIRTQ_DESC_F_INDIRECT) {
+            // Rest of the chain is in an indirect table, which can't be nested or followed
+            uint32_t len = read_uint32_le(desc + 8);
+            if (indirect || (flags & VIRTQ_DESC_F_NEXT) || len == 0 || (len & (VIRTQ_DESC_SIZE - 1))) {
+                return false;
+            }
+            table = pci_get_dma_ptr(vdev->pci_func, read_uint64_le(desc), len);
+            if (table == NULL) {
+                return false;
+            }
+            table_size = len / VIRTQ_DESC_SIZE;
+            indirect = true;
+            id = 0;
+            continue;
+        }
+        virtio_buf_t* buf = &chain->buf[chain->count++];
+        buf->addr = read_uint64_le(desc);
+        buf->len = read_uint32_le(desc + 8);
+        buf->write = !!(flags & VIRTQ_DESC_F_WRITE);
+        if (!(flags & VIRTQ_DESC_F_NEXT)) {
+            return true;
+        }
+        id = read_uint16_le(desc + 14);
+    }
+    // Out of bounds descriptor or a loop
+    return false;
+}
+
+bool virtio_queue_pop(virtio_dev_t* vdev, uint32_t queue, virtio_chain_t* chain)
+{
+    virtio_queue_t* vq = &vdev->queues[queue];
+    bool ret = false, valid = true;
+    spin_lock(&vq->lock);
+    if (atomic_load_uint32_relax(&vq->enable)) {
+        const uint8_t* avail = pci_get_dma_ptr(vdev->pci_func, vq->avail, 4 + (vq->size << 1));
+        uint16_t avail_idx = avail ? read_uint16_le(avail + 2) : vq->last_avail;
+        if (avail && avail_idx == vq->last_avail && vq->event_idx) {
+            // Ring drained, ask for a kick on the next buffer and recheck to not miss one published meanwhile
+            uint8_t* used = pci_get_dma_ptr(vdev->pci_func, vq->used, 6 + (vq->size << 3));
+            if (used) {
+                write_uint16_le(used + 4 + (vq->size << 3), vq->last_avail);
+                atomic_fence();
+                avail_idx = read_uint16_le(avail + 2);
+            }
+        }
+        if (avail_idx != vq->last_avail) {
+            // Read ring entries only after the index
+            atomic_fence_ex(ATOMIC_ACQUIRE);
+            uint16_t head = read_uint16_le(avail + 4 + ((vq->last_avail & (vq->size - 1)) << 1));
+            vq->last_avail++;
+            valid = virtio_queue_read_chain(vdev, vq, head, chain);
+            ret = valid;
+        }
+    }
+    spin_unlock(&vq->lock);
+    if (!valid) {
+        virtio_set_needs_reset(vdev);
+    }
+    return ret;
+}
+
+void virtio_queue_push(virtio_dev_t* vdev, uint32_t queue, const virtio_chain_t* chain, uint32_t len)
+{
+    virtio_queue_t* vq = &vdev->queues[queue];
+    spin_lock(&vq->lock);
+    if (atomic_load_uint32_relax(&vq->enable)) {
+        uint8_t* used = pci_get_dma_ptr(vdev->pci_func, vq->used, 4 + (vq->size << 3));
+        if (used) {
+            uint8_t* elem = used + 4 + ((vq->used_idx & (vq->size - 1)) << 3);
+            write_uint32_le(elem, chain->head);
+            write_uint32_le(elem + 4, len);
+            vq->used_idx++;
+            // Publish the element before the index
+            atomic_fence_ex(ATOMIC_RELEASE);
+            write_uint16_le(used + 2, vq->used_idx);
+        }
+    }
+    spin_unlock(&vq->lock);
+}
+
+void virtio_queue_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_queue_t* vq = &vdev->queues[queue];
+    bool notify = false;
+    spin_lock(&vq->lock);
+    if (vq->event_idx) {
+        // Interrupt only when used index crosses the driver's used event since the last interrupt
+        const uint8_t* avail = pci_get_dma_ptr(vdev->pci_func, vq->avail, 6 + (vq->size << 1));
+        atomic_fence();
+        if (avail) {
+            uint16_t event = read_uint16_le(avail + 4 + (vq->size << 1));
+            notify = (uint16_t)(vq->used_idx - event - 1) < (uint16_t)(vq->used_idx - vq->signalled_used);
+        }
+        vq->signalled_used = vq->used_idx;
+    } else {
+        const uint8_t* avail = pci_get_dma_ptr(vdev->pci_func, vq->avail, 2);
+        atomic_fence();
+        notify = avail && !(read_uint16_le(avail) & VIRTQ_AVAIL_F_NO_INTR);
+    }
+    spin_unlock(&vq->lock);
+    if (notify) {
+        virtio_send_irq(vdev, VIRTIO_ISR_QUEUE, atomic_load_uint32_relax(&vq->msix_vector));
+    }
+}
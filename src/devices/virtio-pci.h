@@ -0,0 +1,100 @@
+/*
+virtio-pci.h - Virtio PCI 1.x transport
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef RVVM_VIRTIO_PCI_H
+#define RVVM_VIRTIO_PCI_H
+
+#include "pci-bus.h"
+
+// Virtio device IDs
+#define VIRTIO_ID_BLOCK   2
+#define VIRTIO_ID_BALLOON 5
+
+// Transport feature bits, ring features are always offered
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+
+#define VIRTIO_QUEUE_MAX   16   // Maximum queues per device, each gets an MSI-X vector
+#define VIRTIO_QUEUE_SIZE  256  // Maximum queue size
+#define VIRTIO_CHAIN_MAX   64   // Maximum buffers in a descriptor chain
+#define VIRTIO_CONFIG_SIZE 0x100
+
+typedef struct virtio_dev virtio_dev_t;
+
+// Guest buffer from a descriptor chain
+typedef struct {
+    rvvm_addr_t addr;
+    uint32_t    len;
+    bool        write; // Device-writable buffer
+} virtio_buf_t;
+
+// Descriptor chain popped from the available ring
+typedef struct {
+    uint16_t head;
+    uint16_t count;
+    virtio_buf_t buf[VIRTIO_CHAIN_MAX];
+} virtio_chain_t;
+
+// Virtio device class description
+typedef struct {
+    const char* name;
+    uint64_t features;    // Device-specific features offered to the driver
+    uint16_t device_id;   // Virtio device ID
+    uint16_t class_code;  // PCI class code
+    uint16_t queue_count;
+    uint16_t config_size; // Device-specific configuration space size
+
+    // Driver notified a queue
+    void (*queue_notify)(virtio_dev_t* vdev, uint32_t queue);
+
+    // Driver wrote to device configuration space, may be NULL
+    void (*config_write)(virtio_dev_t* vdev, size_t offset, size_t size);
+
+    // Wait for in-flight requests to complete, may be NULL.
+    // Called before queues are reset and before the device state is saved
+    void (*quiesce)(virtio_dev_t* vdev);
+
+    // Device reset by the driver or the machine, may be NULL
+    void (*reset)(virtio_dev_t* vdev);
+
+    // Save & load device-specific state after the common virtio state, may be NULL
+    void (*save)(virtio_dev_t* vdev, rvvm_state_t* state);
+    bool (*load)(virtio_dev_t* vdev, rvvm_state_t* state);
+
+    // Free device-specific data
+    void (*remove)(virtio_dev_t* vdev);
+} virtio_dev_type_t;
+
+// Attach a virtio device to the PCI bus, type should stay valid until the device is removed
+PUBLIC virtio_dev_t* virtio_pci_init(pci_bus_t* pci_bus, const virtio_dev_type_t* type, void* data);
+
+// Device-specific data & handles
+void*      virtio_get_data(virtio_dev_t* vdev);
+pci_dev_t* virtio_get_pci_dev(virtio_dev_t* vdev);
+pci_func_t* virtio_get_pci_func(virtio_dev_t* vdev);
+
+// Check whether a feature was negotiated
+bool virtio_has_feature(virtio_dev_t* vdev, uint32_t feature);
+
+// Device-specific configuration space, notify the driver on device-side changes
+uint8_t* virtio_config(virtio_dev_t* vdev);
+void     virtio_config_changed(virtio_dev_t* vdev);
+
+// Pop a descriptor chain from the available ring, returns false if there's none.
+// Indirect descriptor tables are flattened into the chain
+bool virtio_queue_pop(virtio_dev_t* vdev, uint32_t queue, virtio_chain_t* chain);
+
+// Return a chain to the used ring, len is amount of bytes written into device-writable buffers
+void virtio_queue_push(virtio_dev_t* vdev, uint32_t queue, const virtio_chain_t* chain, uint32_t len);
+
+// Interrupt the driver after pushing used buffers, unless suppressed via flags or used event index
+void virtio_queue_notify(virtio_dev_t* vdev, uint32_t queue);
+
+#endif
@@ -12,6 +12,7 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "mem_ops.h"
 #include "utils.h"
 #include "vma_ops.h"
+#include "threading.h"
 
 #define ELF_ET_NONE 0x0
 #define ELF_ET_REL  0x1
@@ -34,6 +35,85 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 // TODO: Handling >64k PHENTs
 #define ELF_PN_XNUM 0xFFFF
 
+// Split reads larger than this between threads
+#define ELF_PARALLEL_CHUNK (16U << 20)
+#define ELF_PARALLEL_MAX   8
+
+typedef struct {
+    rvfile_t* file;
+    void*     dst;
+    size_t    size;
+    uint64_t  offset;
+    size_t    ret;
+} elf_read_job_t;
+
+static void* elf_read_worker(void* arg)
+{
+    elf_read_job_t* job = arg;
+    job->ret = rvread(job->file, job->dst, job->size, job->offset);
+    return NULL;
+}
+
+static size_t elf_read_parallel(rvfile_t* file, void* dst, size_t size, uint64_t offset)
+{
+    uint64_t file_size = rvfilesize(file);
+    size = offset < file_size ? EVAL_MIN(size, file_size - offset) : 0;
+    size_t jobs = EVAL_MIN(size / ELF_PARALLEL_CHUNK, ELF_PARALLEL_MAX);
+    if (jobs < 2) {
+        return rvread(file, dst, size, offset);
+    }
+
+    elf_read_job_t job[ELF_PARALLEL_MAX] = {0};
+    thread_ctx_t* threads[ELF_PARALLEL_MAX] = {0};
+    size_t chunk = align_size_up(size / jobs, vma_page_size());
+    for (size_t i = 0; i < jobs; ++i) {
+        size_t pos = EVAL_MIN(chunk * i, size);
+        job[i].file = file;
+        job[i].dst = ((uint8_t*)dst) + pos;
+        job[i].size = (i == jobs - 1) ? size - pos : EVAL_MIN(chunk, size - pos);
+        job[i].offset = offset + pos;
+        if (i) threads[i] = thread_create(elf_read_worker, &job[i]);
+    }
+    for (size_t i = 0; i < jobs; ++i) {
+        if (threads[i]) {
+            thread_join(threads[i]);
+        } else {
+            // First chunk or failed to spawn a thread
+            elf_read_worker(&job[i]);
+        }
+    }
+    size_t ret = 0;
+    for (size_t i = 0; i < jobs; ++i) {
+        ret += job[i].ret;
+        // Short read in the middle means an IO error
+        if (job[i].ret != job[i].size) break;
+    }
+    return ret;
+}
+
+// Load a file range into buffer, whole pages are mapped copy-on-write if possible
+static size_t elf_load_range(rvfile_t* file, void* dst, size_t size, uint64_t offset, bool map_file)
+{
+    uint8_t* ptr = dst;
+    size_t page_mask = vma_page_size() - 1;
+    uint64_t file_size = rvfilesize(file);
+    if (map_file && (((size_t)ptr) & page_mask) == (offset & page_mask) && offset < file_size) {
+        size_t head = (page_mask + 1 - (((size_t)ptr) & page_mask)) & page_mask;
+        uint64_t end = EVAL_MIN(offset + size, file_size);
+        size_t map_size = (end > offset + head) ? ((end - offset - head) & ~(uint64_t)page_mask) : 0;
+        if (map_size && vma_remap_file(ptr + head, map_size, VMA_RDWR, file, offset + head)) {
+            // Read the unaligned head & tail
+            size_t tail = head + map_size;
+            size_t ret = rvread(file, ptr, head, offset);
+            if (ret == head) {
+                ret += map_size + rvread(file, ptr + tail, size - tail, offset + tail);
+            }
+            return ret;
+        }
+    }
+    return elf_read_parallel(file, ptr, size, offset);
+}
+
 #define WRAP_ERR(cond, error) \
     if (!(cond)) { \
         rvvm_error(error); \
@@ -115,7 +195,8 @@ bool elf_load_file(rvfile_t* file, elf_desc_t* elf)
             // Load ELF program segment or PHDR segment
             void* vaddr = ((uint8_t*)elf->base) + (p_vaddr - elf_loaddr);
             WRAP_ERR(p_vaddr + p_memsz <= elf_loaddr + elf->buf_size, "ELF segment does not fit in memory");
-            WRAP_ERR(rvread(file, vaddr, p_fsize, p_offset) == p_fsize, "Failed to read ELF segment");
+            bool map_file = objcopy && elf->map_file;
+            WRAP_ERR(elf_load_range(file, vaddr, p_fsize, p_offset, map_file) == p_fsize, "Failed to read ELF segment");
         }
         if (p_type == ELF_PT_INTERP && !objcopy && !elf->interp_path) {
             // Get ELF interpreter path
@@ -128,15 +209,45 @@ bool elf_load_file(rvfile_t* file, elf_desc_t* elf)
     return true;
 }
 
-bool bin_objcopy(rvfile_t* file, void* buffer, size_t size, bool try_elf)
+bool bin_objcopy(rvfile_t* file, void* buffer, size_t size, bool try_elf, bool map_file)
 {
     uint8_t mag[4] = {0};
     if (try_elf && rvread(file, mag, 4, 0) == 4 && read_uint32_le_m(mag) == 0x464c457F) {
         elf_desc_t elf = {
             .base = buffer,
             .buf_size = size,
+            .map_file = map_file,
         };
         if (elf_load_file(file, &elf)) return true;
     }
-    return rvread(file, buffer, size, 0);
+    return elf_load_range(file, buffer, size, 0, map_file);
+}
+
+size_t bin_objcopy_size(rvfile_t* file, bool try_elf)
+{
+    uint8_t tmp[64] = {0};
+    if (try_elf && rvread(file, tmp, 64, 0) == 64 && read_uint32_le_m(tmp) == 0x464c457F) {
+        bool class64 = (tmp[4] == 2);
+        uint64_t elf_phoff = class64 ? read_uint64_le_m(tmp + 32) : read_uint32_le_m(tmp + 28);
+        size_t   elf_phnsz = class64 ? 56 : 32;
+        size_t   elf_phnum = read_uint16_le_m(tmp + (class64 ? 56 : 44));
+        uint64_t elf_loaddr = (uint64_t)-1;
+        uint64_t elf_hiaddr = 0;
+        for (size_t i=0; i<elf_phnum; ++i) {
+            if (rvread(file, tmp, elf_phnsz, elf_phoff + (elf_phnsz * i)) != elf_phnsz) {
+                return 0;
+            }
+            uint32_t p_type = read_uint32_le_m(tmp);
+            uint64_t p_vaddr = class64 ? read_uint64_le_m(tmp + 16) : read_uint32_le_m(tmp + 8);
+            uint64_t p_memsz = class64 ? read_uint64_le_m(tmp + 40) : read_uint32_le_m(tmp + 20);
+            if (p_type == ELF_PT_LOAD || p_type == ELF_PT_PHDR) {
+                if (p_vaddr < elf_loaddr) elf_loaddr = p_vaddr;
+                if (p_vaddr + p_memsz > elf_hiaddr) elf_hiaddr = p_vaddr + p_memsz;
+            }
+        }
+        if (elf_loaddr != (uint64_t)-1) {
+            return elf_hiaddr - elf_loaddr;
+        }
+    }
+    return rvfilesize(file);
 }
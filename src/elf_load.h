@@ -19,6 +19,8 @@ typedef struct {
     void*  base;
     // Objcopy buffer size
     size_t buf_size;
+    // Map page-aligned segments copy-on-write into objcopy buffer
+    bool   map_file;
 
     // Various loaded ELF info
     size_t entry;
@@ -29,6 +31,10 @@ typedef struct {
 
 bool elf_load_file(rvfile_t* file, elf_desc_t* elf);
 
-bool bin_objcopy(rvfile_t* file, void* buffer, size_t size, bool try_elf);
+// Copy raw or ELF image into a buffer, map_file allows replacing buffer pages with file mappings
+bool bin_objcopy(rvfile_t* file, void* buffer, size_t size, bool try_elf, bool map_file);
+
+// Memory span occupied by bin_objcopy() of this image, including zero-initialized ELF segments
+size_t bin_objcopy_size(rvfile_t* file, bool try_elf);
 
 #endif
@@ -607,6 +607,7 @@ static void gdbstub_remove(rvvm_mmio_dev_t* dev)
 static const rvvm_mmio_type_t gdbstub_dev_type = {
     .name = "gdbstub",
     .remove = gdbstub_remove,
+    .save = rvvm_save_none,
 };
 
 bool gdbstub_init(rvvm_machine_t* machine, const char* bind)
@@ -26,6 +26,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "utils.h"
 #include "dlib.h"
 #include "gdbstub.h"
+#include "threading.h"
+#include "atomics.h"
+#include "rvtimer.h"
+#include "blk_io.h"
 
 #include "devices/riscv-imsic.h"
 #include "devices/riscv-aplic.h"
@@ -39,13 +43,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "devices/pci-bus.h"
 #include "devices/pci-vfio.h"
 #include "devices/nvme.h"
+#include "devices/virtio-balloon.h"
+#include "devices/virtio-blk.h"
 #include "devices/ata.h"
+#include "devices/ahci.h"
 #include "devices/rtl8169.h"
 #include "devices/i2c-oc.h"
 #include "devices/usb-xhci.h"
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <signal.h>
 
 #ifdef _WIN32
 // For unicode args/console
@@ -80,9 +88,18 @@ static void rvvm_print_help(void)
            "\n"
            "    <firmware>       Initial M-mode firmware (OpenSBI [+ U-Boot], etc)\n"
            "    -k, -kernel ...  Optional S-mode kernel payload (Linux, U-Boot, etc)\n"
+           "    -initrd     ...  Initial ramdisk for the kernel payload\n"
            "    -i, -image  ...  Attach preferred storage image (Currently as NVMe)\n"
            "    -m, -mem 1G      Memory amount, default: 256M\n"
+           "    -mem_path   ...  Back memory by a file or hugetlbfs mount directory\n"
+           "    -mem_share       Back memory by a shareable memfd\n"
+           "    -mem_prealloc    Prefault memory upfront\n"
+           "    -mem_lock        Lock memory in host RAM\n"
+           "    -reset_zero      Zero memory on reset, releasing it to the host\n"
+           "    -map_images      Map firmware, kernel & initrd copy-on-write instead of copying\n"
+           "                     Don't modify these files while the machine runs\n"
            "    -s, -smp 4       Cores count, default: 1\n"
+           "    -numa 2          Split cores and memory into NUMA nodes\n"
            "    -rv32            Enable 32-bit RISC-V, 64-bit by default\n"
            "    -cmdline    ...  Override payload kernel command line\n"
            "    -append     ...  Modify payload kernel command line\n"
@@ -91,12 +108,32 @@ static void rvvm_print_help(void)
            "    -portfwd 8080=80 Port forwarding (Extended: tcp/127.0.0.1:8080=80)\n"
            "    -vfio_pci   ...  PCI passthrough via VFIO (Example: 00:02.0), needs root\n"
            "    -nvme       ...  Explicitly attach storage image as NVMe device\n"
+           "                     Each -nvme adds a controller, images in a comma-separated\n"
+           "                     list become its namespaces (Example: data1.img,data2.img)\n"
+           "    -nvme_ro    ...  Attach read-only NVMe image, pages are shared between VMs\n"
+           "    -overlay    ...  Attach copy-on-write overlay, created if missing (vm.ovl=base.img)\n"
+           "    -commit     ...  Merge overlay changes into its base image and exit\n"
+           "    -mkdedup    ...  Convert image into deduplicated image and exit (out.bdv=in.img)\n"
+           "    -compress   lz4  Compress deduplicated image chunks (lz4 or zstd)\n"
            "    -ata        ...  Explicitly attach storage image as ATA (IDE) device\n"
+           "    -ahci       ...  Attach AHCI SATA controller with NCQ, one port per listed image\n"
+           "    -virtio_blk ...  Attach storage image as virtio-blk device, a queue per hart\n"
+           "    -cache      ...  Host caching of drives listed after it: writeback (default),\n"
+           "                     writethrough, direct (O_DIRECT, raw images) or unsafe\n"
+           "    -blk_stats  10   Print drive & NVMe queue IO statistics every N seconds\n"
+           "    -balloon         Attach virtio-balloon with free page reporting\n"
+           "    -balloon_size 1G Ask the guest to hand this much RAM to the balloon\n"
            "    -nogui           Disable display GUI\n"
            "    -nonet           Disable networking\n"
            "    -serial     ...  Add more serial ports (Via pty/pipe path), or null\n"
            "    -dtb        ...  Pass custom Device Tree Blob to the machine\n"
            "    -dumpdtb    ...  Dump auto-generated DTB to file\n"
+           "    -snapshot-load . Restore machine state from a snapshot file\n"
+#ifdef SIGUSR1
+           "    -snapshot-save . Save machine snapshot on SIGUSR1, disables isolation\n"
+           "    -migrate-to .... Live migrate on SIGUSR2 (Example: 127.0.0.1:7000)\n"
+#endif
+           "    -migrate-listen  Wait for incoming migration (Example: 127.0.0.1:7000)\n"
            "    -v, -verbose     Enable verbose logging\n"
            "    -h, -help        Show this help message\n"
            "\n"
@@ -110,6 +147,45 @@ static void rvvm_print_help(void)
 #endif
 }
 
+// Opens a comma-separated list of images, returns amount of opened images
+static size_t rvvm_cli_open_images(const char* images, bool rw, void** blk_devs, size_t max)
+{
+    size_t count = 0;
+    while (*images) {
+        char path[256] = {0};
+        const char* next = rvvm_strfind(images, ",");
+        size_t len = next ? (size_t)(next - images) : rvvm_strlen(images);
+        rvvm_strlcpy(path, images, EVAL_MIN(len + 1, sizeof(path)));
+        images = next ? next + 1 : images + len;
+        if (!path[0]) continue;
+        blkdev_t* blk = count < max ? blk_open(path, rw ? BLKDEV_RW : 0) : NULL;
+        if (blk == NULL) {
+            rvvm_error("Failed to open image \"%s\"", path);
+            while (count) blk_close(blk_devs[--count]);
+            return 0;
+        }
+        blk_devs[count++] = blk;
+    }
+    return count;
+}
+
+static bool rvvm_cli_attach_nvme(rvvm_machine_t* machine, const char* images, bool rw)
+{
+    void* blk_devs[16] = {0};
+    if (!rvvm_strfind(images, ",")) {
+        return nvme_init_auto(machine, images, rw);
+    }
+    size_t count = rvvm_cli_open_images(images, rw, blk_devs, STATIC_ARRAY_SIZE(blk_devs));
+    return count && nvme_init_ns(rvvm_get_pci_bus(machine), blk_devs, count);
+}
+
+static bool rvvm_cli_attach_ahci(rvvm_machine_t* machine, const char* images)
+{
+    void* blk_devs[8] = {0};
+    size_t count = rvvm_cli_open_images(images, true, blk_devs, STATIC_ARRAY_SIZE(blk_devs));
+    return count && ahci_init_ports(rvvm_get_pci_bus(machine), blk_devs, count);
+}
+
 static bool rvvm_cli_configure(rvvm_machine_t* machine, const char* bios, tap_dev_t* tap)
 {
     UNUSED(tap);
@@ -130,6 +206,9 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, const char* bios, tap_de
     if (rvvm_getarg("dtb") && !rvvm_load_dtb(machine, rvvm_getarg("dtb"))) {
         return false;
     }
+    if (rvvm_getarg("initrd") && !rvvm_load_initrd(machine, rvvm_getarg("initrd"))) {
+        return false;
+    }
 
     int arg_iter = 1;
     const char* arg_name = NULL;
@@ -139,18 +218,65 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, const char* bios, tap_de
         rvvm_error("Failed to attach Intel HDA device");
     }
 
+    if (rvvm_has_arg("balloon") || rvvm_getarg_size("balloon_size")) {
+        virtio_balloon_t* balloon = virtio_balloon_init_auto(machine);
+        if (balloon == NULL) {
+            rvvm_error("Failed to attach virtio-balloon device");
+        } else {
+            virtio_balloon_set_target(balloon, rvvm_getarg_size("balloon_size"));
+        }
+    }
+
     while ((arg_name = rvvm_next_arg(&arg_val, &arg_iter))) {
         if (arg_val) {
-            if (rvvm_strcmp(arg_name, "i") || rvvm_strcmp(arg_name, "image") || rvvm_strcmp(arg_name, "nvme")) {
-                if (!nvme_init_auto(machine, arg_val, true)) {
+            if (rvvm_strcmp(arg_name, "cache")) {
+                uint8_t mode = blk_parse_mode(arg_val);
+                if (mode == BLKDEV_MODE_DEFAULT) {
+                    rvvm_error("Invalid cache mode: %s", arg_val);
+                    return false;
+                }
+                blk_set_default_mode(mode);
+            } else if (rvvm_strcmp(arg_name, "i") || rvvm_strcmp(arg_name, "image") || rvvm_strcmp(arg_name, "nvme")) {
+                if (!rvvm_cli_attach_nvme(machine, arg_val, true)) {
+                    rvvm_error("Failed to attach image \"%s\"", arg_val);
+                    return false;
+                }
+            } else if (rvvm_strcmp(arg_name, "nvme_ro")) {
+                if (!rvvm_cli_attach_nvme(machine, arg_val, false)) {
                     rvvm_error("Failed to attach image \"%s\"", arg_val);
                     return false;
                 }
+            } else if (rvvm_strcmp(arg_name, "overlay")) {
+                char path[256] = {0};
+                size_t len = rvvm_strlcpy(path, arg_val, sizeof(path));
+                const char* base = rvvm_strfind(arg_val, "=");
+                if (base) path[EVAL_MIN((size_t)(base - arg_val), len)] = 0;
+                rvfile_t* file = rvopen(path, 0);
+                if (file) {
+                    rvclose(file);
+                } else if (!base || !blk_overlay_create(path, base + 1)) {
+                    rvvm_error("Failed to create overlay \"%s\"", path);
+                    return false;
+                }
+                if (!nvme_init_auto(machine, path, true)) {
+                    rvvm_error("Failed to attach image \"%s\"", path);
+                    return false;
+                }
             } else if (rvvm_strcmp(arg_name, "ata")) {
                 if (!ata_init_auto(machine, arg_val, true)) {
                     rvvm_error("Failed to attach image \"%s\"", arg_val);
                     return false;
                 }
+            } else if (rvvm_strcmp(arg_name, "ahci")) {
+                if (!rvvm_cli_attach_ahci(machine, arg_val)) {
+                    rvvm_error("Failed to attach image \"%s\"", arg_val);
+                    return false;
+                }
+            } else if (rvvm_strcmp(arg_name, "virtio_blk")) {
+                if (!virtio_blk_init_auto(machine, arg_val, true)) {
+                    rvvm_error("Failed to attach image \"%s\"", arg_val);
+                    return false;
+                }
             } else if (rvvm_strcmp(arg_name, "serial")) {
                 chardev_t* chardev = chardev_pty_create(arg_val);
                 if (chardev == NULL && !rvvm_strcmp(arg_val, "null")) {
@@ -183,6 +309,71 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, const char* bios, tap_de
     return true;
 }
 
+#ifdef SIGUSR1
+
+#define CLI_REQ_NONE     0 // Nothing to do
+#define CLI_REQ_SNAPSHOT 1 // SIGUSR1: Save a snapshot
+#define CLI_REQ_MIGRATE  2 // SIGUSR2: Live migrate the machine
+#define CLI_REQ_BUSY     3 // Request is being handled, the machine may be paused
+#define CLI_REQ_EXIT     4 // Watcher thread should exit
+
+static uint32_t cli_req = CLI_REQ_NONE;
+
+static void rvvm_cli_signal(int sig)
+{
+    atomic_cas_uint32(&cli_req, CLI_REQ_NONE, (sig == SIGUSR1) ? CLI_REQ_SNAPSHOT : CLI_REQ_MIGRATE);
+}
+
+static void* rvvm_cli_watcher(void* arg)
+{
+    rvvm_machine_t* machine = arg;
+    while (atomic_load_uint32(&cli_req) != CLI_REQ_EXIT) {
+        uint32_t req = atomic_load_uint32(&cli_req);
+        if ((req == CLI_REQ_SNAPSHOT || req == CLI_REQ_MIGRATE) && atomic_cas_uint32(&cli_req, req, CLI_REQ_BUSY)) {
+            if (req == CLI_REQ_SNAPSHOT && rvvm_getarg("snapshot-save")) {
+                rvvm_save_snapshot(machine, rvvm_getarg("snapshot-save"));
+            } else if (req == CLI_REQ_MIGRATE && rvvm_getarg("migrate-to")) {
+                // Machine stays paused after successful migration, so the CLI exits
+                rvvm_migrate_send(machine, rvvm_getarg("migrate-to"));
+            }
+            atomic_cas_uint32(&cli_req, CLI_REQ_BUSY, CLI_REQ_NONE);
+        }
+        sleep_ms(100);
+    }
+    return NULL;
+}
+
+#endif
+
+// Returns on machine shutdown
+static void rvvm_cli_run(rvvm_machine_t* machine)
+{
+#ifdef SIGUSR1
+    thread_ctx_t* watcher = NULL;
+    if (rvvm_getarg("snapshot-save") || rvvm_getarg("migrate-to")) {
+        signal(SIGUSR1, rvvm_cli_signal);
+        signal(SIGUSR2, rvvm_cli_signal);
+        watcher = thread_create(rvvm_cli_watcher, machine);
+    }
+
+    do {
+        rvvm_run_eventloop();
+        // Eventloop also returns when the watcher pauses the machine
+        while (atomic_load_uint32(&cli_req) == CLI_REQ_BUSY) {
+            sleep_ms(10);
+        }
+    } while (rvvm_machine_running(machine));
+
+    if (watcher) {
+        atomic_store_uint32(&cli_req, CLI_REQ_EXIT);
+        thread_join(watcher);
+    }
+#else
+    UNUSED(machine);
+    rvvm_run_eventloop();
+#endif
+}
+
 static int rvvm_cli_main(int argc, char** argv)
 {
     // Set up argparser
@@ -192,6 +383,24 @@ static int rvvm_cli_main(int argc, char** argv)
         return 0;
     }
 
+    if (rvvm_getarg("mkdedup")) {
+        char path[256] = {0};
+        size_t len = rvvm_strlcpy(path, rvvm_getarg("mkdedup"), sizeof(path));
+        const char* source = rvvm_strfind(path, "=");
+        if (source) path[EVAL_MIN((size_t)(source - path), len)] = 0;
+        if (!source || !blk_dedup_create(path, 0, source + 1, rvvm_getarg("compress"))) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (rvvm_getarg("commit")) {
+        blkdev_t* overlay = blk_open(rvvm_getarg("commit"), BLKDEV_RW);
+        bool ret = overlay && blk_overlay_commit(overlay);
+        blk_close(overlay);
+        return ret ? 0 : -1;
+    }
+
     // Default machine parameters: 1 core, 256M ram, riscv64, 640x480 screen
     size_t    mem = rvvm_getarg_size("m");
     if (!mem) mem = rvvm_getarg_size("mem");
@@ -277,15 +486,24 @@ static int rvvm_cli_main(int argc, char** argv)
         rvvm_dump_dtb(machine, rvvm_getarg("dumpdtb"));
     }
 
+    if (rvvm_getarg("snapshot-load") && !rvvm_load_snapshot(machine, rvvm_getarg("snapshot-load"))) {
+        rvvm_free_machine(machine);
+        return -1;
+    }
+    if (rvvm_getarg("migrate-listen") && !rvvm_migrate_receive(machine, rvvm_getarg("migrate-listen"))) {
+        rvvm_free_machine(machine);
+        return -1;
+    }
+
     rvvm_start_machine(machine);
 
-    if (!rvvm_has_arg("noisolation")) {
+    if (!rvvm_has_arg("noisolation") && !rvvm_has_arg("snapshot-save")) {
         // Preparations are done, isolate the process as much as possible
+        // Snapshot saving needs to create files, so it's incompatible with isolation
         rvvm_restrict_process();
     }
 
-    // Returns on machine shutdown
-    rvvm_run_eventloop();
+    rvvm_cli_run(machine);
 
     rvvm_free_machine(machine);
     return 0;
@@ -279,6 +279,7 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define CSR_ENVCFG_CBIE  (1ULL << 4)
 #define CSR_ENVCFG_CBCFE (1ULL << 6)
 #define CSR_ENVCFG_CBZE  (1ULL << 7)
+#define CSR_ENVCFG_PBMTE (1ULL << 62)
 #define CSR_ENVCFG_STCE  (1ULL << 63)
 
 #define CSR_MSECCFG_USEED (1ULL << 8)
@@ -315,7 +316,7 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
 #define CSR_COUNTEREN_MASK CSR_COUNTEREN_TM
 
-#define CSR_MENVCFG_MASK 0x80000000000000D0ULL
+#define CSR_MENVCFG_MASK 0xC0000000000000D0ULL
 #define CSR_SENVCFG_MASK 0xD0ULL
 
 #define CSR_MSECCFG_MASK 0x300ULL
@@ -20,8 +20,9 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "riscv_cpu.h"
 
 // Valid vm->pending_events bits deliverable to the hart
-#define HART_EVENT_PAUSE   0x1 // Pause the hart in a consistent state
-#define HART_EVENT_PREEMPT 0x2 // Preempt the hart for vm->preempt_ms
+#define HART_EVENT_PAUSE     0x1 // Pause the hart in a consistent state
+#define HART_EVENT_PREEMPT   0x2 // Preempt the hart for vm->preempt_ms
+#define HART_EVENT_TLB_FLUSH 0x4 // Flush the TLB (Shared MMIO mapping was removed)
 
 rvvm_hart_t* riscv_hart_init(rvvm_machine_t* machine)
 {
@@ -395,6 +396,8 @@ void riscv_hart_run(rvvm_hart_t* vm)
 {
     rvvm_info("Hart %p started", vm);
 
+    atomic_store_uint32(&vm->dispatching, true);
+
     while (true) {
         // Allow hart to run
         atomic_store_uint32_ex(&vm->running, true, ATOMIC_RELAXED);
@@ -403,14 +406,21 @@ void riscv_hart_run(rvvm_hart_t* vm)
         uint32_t events = atomic_swap_uint32(&vm->pending_events, 0);
         if (unlikely(events)) {
             if (events & HART_EVENT_PAUSE) {
+                atomic_store_uint32(&vm->dispatching, false);
                 rvvm_info("Hart %p stopped", vm);
                 return;
             }
+            if (events & HART_EVENT_TLB_FLUSH) {
+                riscv_tlb_flush(vm);
+            }
             if (events & HART_EVENT_PREEMPT) {
                 sleep_ms(atomic_swap_uint32(&vm->preempt_ms, 0));
             }
         }
 
+        // Report that events queued before this cycle were handled
+        atomic_add_uint32(&vm->dispatch_seq, 1);
+
         riscv_handle_irqs(vm);
 
         // Run the hart
@@ -425,6 +435,10 @@ void riscv_hart_run(rvvm_hart_t* vm)
 static void* riscv_hart_run_thread(void* ptr)
 {
     rvvm_hart_t* vm = ptr;
+    if (vm->machine->numa_nodes > 1 && thread_numa_nodes() > 1) {
+        // Pin the hart to CPUs of the host node backing its memory
+        thread_bind_numa_node(vm->numa_node % thread_numa_nodes());
+    }
     if (!rvvm_has_arg("noisolation")) {
         rvvm_restrict_this_thread();
     }
@@ -437,11 +451,29 @@ static void* riscv_hart_run_thread(void* ptr)
 void riscv_hart_spawn(rvvm_hart_t *vm)
 {
     if (!vm->thread) {
-        atomic_store_uint32(&vm->pending_events, 0);
+        // Drop stale pause/preempt events, but keep a pending TLB flush
+        atomic_and_uint32(&vm->pending_events, HART_EVENT_TLB_FLUSH);
         vm->thread = thread_create(riscv_hart_run_thread, vm);
     }
 }
 
+void riscv_hart_kick(rvvm_hart_t* vm)
+{
+    riscv_hart_notify(vm);
+}
+
+bool riscv_hart_passed_seq(rvvm_hart_t* vm, uint32_t seq)
+{
+    // Two bumps guarantee a full event handling pass after the sequence was read
+    return !atomic_load_uint32(&vm->dispatching) || (uint32_t)(atomic_load_uint32(&vm->dispatch_seq) - seq) >= 2;
+}
+
+void riscv_hart_queue_tlb_flush(rvvm_hart_t* vm)
+{
+    atomic_or_uint32(&vm->pending_events, HART_EVENT_TLB_FLUSH);
+    riscv_hart_notify(vm);
+}
+
 void riscv_hart_queue_pause(rvvm_hart_t* vm)
 {
     atomic_or_uint32(&vm->pending_events, HART_EVENT_PAUSE);
@@ -100,6 +100,16 @@ rvvm_addr_t riscv_hart_run_userland(rvvm_hart_t* vm);
 // Spawns hart vCPU thread, returns immediately
 void riscv_hart_spawn(rvvm_hart_t *vm);
 
+// Kicks the hart out of dispatch loop or WFI, making it handle pending events
+void riscv_hart_kick(rvvm_hart_t* vm);
+
+// Checks whether the hart handled it's events since vm->dispatch_seq was equal to seq,
+// or isn't running the dispatch loop at all (Events are then handled on next spawn)
+bool riscv_hart_passed_seq(rvvm_hart_t* vm, uint32_t seq);
+
+// Requests the hart to flush it's TLB before executing any further instructions
+void riscv_hart_queue_tlb_flush(rvvm_hart_t* vm);
+
 // Requests the hart to be paused as soon as possible
 void riscv_hart_queue_pause(rvvm_hart_t* vm);
 
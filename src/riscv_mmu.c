@@ -15,7 +15,9 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "atomics.h"
 #include "utils.h"
 #include "vma_ops.h"
+#include "rcu_lib.h"
 #include <string.h>
+#include <stdio.h>
 
 #define SV32_VPN_BITS     10
 #define SV32_VPN_MASK     0x3FF
@@ -30,8 +32,60 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define SV48_LEVELS       4
 #define SV57_LEVELS       5
 
+// Svpbmt & Svnapot PTE extension bits
+#define SV64_PTE_RSVD     0x1FC0000000000000ULL // Bits 60:54, must be zero
+#define SV64_PTE_PBMT     0x6000000000000000ULL // Page-based memory type
+#define SV64_PTE_NAPOT    0x8000000000000000ULL // NAPOT contiguous page
+#define SV64_PTE_EXT_MASK (SV64_PTE_RSVD | SV64_PTE_PBMT | SV64_PTE_NAPOT)
+
+// The only defined NAPOT size is 64K (ppn[3:0] = 1000)
+#define SV64_NAPOT_SHIFT  16
+#define SV64_NAPOT_MASK   0xFFFFULL
+#define SV64_NAPOT_PAGES  (1U << (SV64_NAPOT_SHIFT - RISCV_PAGE_SHIFT))
+
 #define RISCV_MMU_DEBUG_ACCESS (RISCV_MMU_READ | RISCV_MMU_EXEC | RISCV_MMU_WRITE)
 
+// Map guest RAM from a file, or from a unique unlinked file inside a directory (hugetlbfs mount)
+static void* riscv_map_ram_file(const char* path, size_t size, uint32_t vma_flags)
+{
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT);
+    if (file == NULL) {
+        char tmp[256] = {0};
+        size_t off = rvvm_strlcpy(tmp, path, sizeof(tmp));
+        off += rvvm_strlcpy(tmp + off, "/rvvm-ram-XXXXXXXX", sizeof(tmp) - off);
+        if (off >= sizeof(tmp) - 1) {
+            rvvm_error("RAM backing path too long!");
+            return NULL;
+        }
+        rvvm_randomserial(tmp + off - 8, 8);
+        file = rvopen(tmp, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+        if (file) {
+            // Backing pages are released when the mapping goes away
+            remove(tmp);
+        }
+    }
+    if (file == NULL) {
+        rvvm_error("Failed to open RAM backing file %s", path);
+        return NULL;
+    }
+    void* data = vma_mmap(NULL, size, vma_flags | VMA_SHARED, file, 0);
+    if (data == NULL) {
+        rvvm_error("Failed to map RAM backing file %s, size should be aligned to hugepage size on hugetlbfs", path);
+    }
+    rvclose(file);
+    return data;
+}
+
+uint32_t riscv_ram_vma_flags(void)
+{
+    uint32_t vma_flags = VMA_RDWR;
+    if (!rvvm_has_arg("no_ksm")) vma_flags |= VMA_KSM;
+    if (!rvvm_has_arg("no_thp")) vma_flags |= VMA_THP;
+    if (rvvm_has_arg("mem_prealloc")) vma_flags |= VMA_POPULATE;
+    if (rvvm_has_arg("mem_lock")) vma_flags |= VMA_LOCK;
+    return vma_flags;
+}
+
 bool riscv_init_ram(rvvm_ram_t* mem, rvvm_addr_t base_addr, size_t size)
 {
     // Memory boundaries should be always aligned to page size
@@ -40,10 +94,16 @@ bool riscv_init_ram(rvvm_ram_t* mem, rvvm_addr_t base_addr, size_t size)
         return false;
     }
 
-    uint32_t vma_flags = VMA_RDWR;
-    if (!rvvm_has_arg("no_ksm")) vma_flags |= VMA_KSM;
-    if (!rvvm_has_arg("no_thp")) vma_flags |= VMA_THP;
-    mem->data = vma_alloc(NULL, size, vma_flags);
+    uint32_t vma_flags = riscv_ram_vma_flags();
+    if (rvvm_getarg("mem_path")) {
+        // User file or hugetlbfs backing
+        mem->data = riscv_map_ram_file(rvvm_getarg("mem_path"), size, vma_flags);
+    } else if (rvvm_has_arg("mem_share")) {
+        // Shareable memfd backing
+        mem->data = vma_alloc(NULL, size, vma_flags | VMA_SHARED);
+    } else {
+        mem->data = vma_alloc(NULL, size, vma_flags);
+    }
 
     if (!mem->data) {
         rvvm_error("Memory allocation failure");
@@ -88,10 +148,9 @@ void riscv_tlb_flush(rvvm_hart_t* vm)
     riscv_restart_dispatch(vm);
 }
 
-void riscv_tlb_flush_page(rvvm_hart_t* vm, rvvm_addr_t addr)
+static void riscv_tlb_flush_vpn(rvvm_hart_t* vm, rvvm_addr_t vpn)
 {
     // TLB entry invalidation is done via off-by-1 VPN
-    const rvvm_addr_t vpn = (addr >> RISCV_PAGE_SHIFT);
     rvvm_tlb_entry_t* entry = &vm->tlb[vpn & RVVM_TLB_MASK];
     if (unlikely(entry->r == vpn)) {
         entry->r = vpn - 1;
@@ -108,6 +167,19 @@ void riscv_tlb_flush_page(rvvm_hart_t* vm, rvvm_addr_t addr)
     }
 }
 
+void riscv_tlb_flush_page(rvvm_hart_t* vm, rvvm_addr_t addr)
+{
+#ifdef USE_RV64
+    // The page may belong to a NAPOT range filled as a whole, flush every entry of it
+    const rvvm_addr_t vpn = (addr >> RISCV_PAGE_SHIFT) & ~(rvvm_addr_t)(SV64_NAPOT_PAGES - 1);
+    for (size_t i = 0; i < SV64_NAPOT_PAGES; ++i) {
+        riscv_tlb_flush_vpn(vm, vpn + i);
+    }
+#else
+    riscv_tlb_flush_vpn(vm, addr >> RISCV_PAGE_SHIFT);
+#endif
+}
+
 static void riscv_tlb_put(rvvm_hart_t* vm, rvvm_addr_t vaddr, void* ptr, uint8_t access)
 {
     const rvvm_addr_t vpn = vaddr >> RISCV_PAGE_SHIFT;
@@ -153,6 +225,40 @@ static forceinline void* riscv_phys_access(rvvm_hart_t* vm, rvvm_addr_t paddr)
     return NULL;
 }
 
+#ifdef USE_RV64
+
+// Fill the TLB with the whole 64K NAPOT range at once
+static void riscv_tlb_put_napot(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t paddr, void* ptr, uint8_t access)
+{
+    const rvvm_addr_t vbase = vaddr & ~SV64_NAPOT_MASK;
+    const rvvm_addr_t pbase = paddr & ~SV64_NAPOT_MASK;
+    uint8_t* base_ptr = riscv_phys_access(vm, pbase);
+    if (unlikely(!base_ptr || !riscv_phys_access(vm, pbase + SV64_NAPOT_MASK))) {
+        // Range is not entirely in RAM, cache a single page
+        riscv_tlb_put(vm, vaddr, ptr, access);
+        return;
+    }
+    if (access == RISCV_MMU_WRITE) {
+        // Neighbour pages become writable without passing the slow path
+        riscv_jit_mark_dirty_mem(vm->machine, pbase, SV64_NAPOT_MASK + 1);
+        rvvm_mark_dirty_mem(vm->machine, pbase, SV64_NAPOT_MASK + 1);
+    }
+    for (size_t i = 0; i < SV64_NAPOT_PAGES; ++i) {
+        const size_t off = i << RISCV_PAGE_SHIFT;
+        riscv_tlb_put(vm, vbase + off, base_ptr + off, access);
+    }
+}
+
+#else
+
+static forceinline void riscv_tlb_put_napot(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t paddr, void* ptr, uint8_t access)
+{
+    UNUSED(paddr);
+    riscv_tlb_put(vm, vaddr, ptr, access);
+}
+
+#endif
+
 static inline bool riscv_mmu_check_priv(rvvm_hart_t* vm, uint8_t priv, uint8_t access)
 {
     if (access == RISCV_MMU_DEBUG_ACCESS) {
@@ -214,6 +320,7 @@ static inline bool riscv_mmu_translate_sv32(rvvm_hart_t* vm, rvvm_addr_t vaddr,
                                 // CAS failed, reload the PTE and start over
                                 continue;
                             }
+                            rvvm_mark_dirty_mem(vm->machine, pagetable + pgt_off, 4);
                         }
                         // Combine ppn & vpn & pgoff
                         *paddr = (pte_shift & pmask) | (vaddr & vmask);
@@ -236,8 +343,30 @@ static inline bool riscv_mmu_translate_sv32(rvvm_hart_t* vm, rvvm_addr_t vaddr,
 
 #ifdef USE_RV64
 
+// Validate Svpbmt/Svnapot bits of a leaf PTE
+static bool riscv_mmu_check_pte_ext(rvvm_hart_t* vm, uint64_t pte, bitcnt_t bit_off)
+{
+    if (pte & SV64_PTE_RSVD) {
+        // Reserved for future extensions
+        return false;
+    }
+    if (pte & SV64_PTE_PBMT) {
+        // PBMT=3 is reserved, memory types are ignored otherwise since RAM is always coherent
+        if (!(vm->csr.envcfg[RISCV_PRIV_MACHINE] & CSR_ENVCFG_PBMTE) || (pte & SV64_PTE_PBMT) == SV64_PTE_PBMT) {
+            return false;
+        }
+    }
+    if (pte & SV64_PTE_NAPOT) {
+        // Only 64K NAPOT range on the last level is defined
+        if (bit_off != RISCV_PAGE_SHIFT || ((pte >> 10) & 0xF) != 0x8) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Virtual memory addressing mode (RV64 MMU template)
-static inline bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t* paddr, uint8_t priv, uint8_t access, uint8_t sv_levels)
+static inline bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t* paddr, bool* napot, uint8_t priv, uint8_t access, uint8_t sv_levels)
 {
     // Pagetable is always aligned to PAGE_SIZE
     rvvm_addr_t pagetable = vm->root_page_table;
@@ -259,6 +388,12 @@ static inline bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, rvvm_addr_t vaddr,
             uint64_t pte = read_uint64_le(pte_ptr);
             if (likely(pte & RISCV_PTE_VALID)) {
                 if (pte & RISCV_PTE_LEAF) {
+                    if (unlikely(pte & SV64_PTE_EXT_MASK)) {
+                        // Check PTE extension bits
+                        if (!riscv_mmu_check_pte_ext(vm, pte, bit_off)) {
+                            return false;
+                        }
+                    }
                     // PGT entry is a leaf, check permissions
                     // Check that PTE U-bit matches U-mode, otherwise do extended check
                     if (unlikely(!!(pte & RISCV_PTE_USER) == !!priv)) {
@@ -282,12 +417,18 @@ static inline bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, rvvm_addr_t vaddr,
                                 // CAS failed, reload the PTE and start over
                                 continue;
                             }
+                            rvvm_mark_dirty_mem(vm->machine, pagetable + pgt_off, 8);
                         }
                         // Combine ppn & vpn & pgoff
                         *paddr = (pte_shift & pmask) | (vaddr & vmask);
+                        if (unlikely(pte & SV64_PTE_NAPOT)) {
+                            // Take low VPN bits as part of the NAPOT page offset
+                            *paddr = (*paddr & ~SV64_NAPOT_MASK) | (vaddr & SV64_NAPOT_MASK);
+                            *napot = true;
+                        }
                         return true;
                     }
-                } else if (likely(!(pte & RISCV_MMU_WRITE))) {
+                } else if (likely(!(pte & (RISCV_MMU_WRITE | SV64_PTE_EXT_MASK)))) {
                     // PTE is a pointer to next pagetable level
                     pagetable = ((pte >> 10) << RISCV_PAGE_SHIFT) & SV64_PHYS_MASK;
                     bit_off -= SV64_VPN_BITS;
@@ -303,8 +444,12 @@ static inline bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, rvvm_addr_t vaddr,
 #endif
 
 // Translate virtual address to physical with respect to current CPU mode
-static inline bool riscv_mmu_translate(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t* paddr, uint8_t access)
+// Sets *napot when the translation belongs to a contiguous 64K NAPOT range
+static inline bool riscv_mmu_translate(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t* paddr, bool* napot, uint8_t access)
 {
+#ifndef USE_RV64
+    UNUSED(napot);
+#endif
     uint8_t priv = vm->priv_mode;
     // If MPRV is enabled, and we aren't fetching an instruction,
     // change effective privilege mode to STATUS.MPP
@@ -326,11 +471,11 @@ static inline bool riscv_mmu_translate(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_
 #endif
 #ifdef USE_RV64
             case CSR_SATP_MODE_SV39:
-                return riscv_mmu_translate_rv64(vm, vaddr, paddr, priv, access, SV39_LEVELS);
+                return riscv_mmu_translate_rv64(vm, vaddr, paddr, napot, priv, access, SV39_LEVELS);
             case CSR_SATP_MODE_SV48:
-                return riscv_mmu_translate_rv64(vm, vaddr, paddr, priv, access, SV48_LEVELS);
+                return riscv_mmu_translate_rv64(vm, vaddr, paddr, napot, priv, access, SV48_LEVELS);
             case CSR_SATP_MODE_SV57:
-                return riscv_mmu_translate_rv64(vm, vaddr, paddr, priv, access, SV57_LEVELS);
+                return riscv_mmu_translate_rv64(vm, vaddr, paddr, napot, priv, access, SV57_LEVELS);
 #endif
             default:
                 // satp is a WARL field
@@ -407,49 +552,53 @@ static bool riscv_mmio_unaligned_op(rvvm_mmio_dev_t* dev, void* dest, size_t off
     return true;
 }
 
-// Receives any operation on physical address space out of RAM region
-static bool riscv_mmio_scan(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t paddr, void* dest, uint8_t size, uint8_t access)
+static bool riscv_mmio_access(rvvm_hart_t* vm, rvvm_mmio_dev_t* mmio, rvvm_addr_t vaddr, rvvm_addr_t paddr, void* dest, uint8_t size, uint8_t access)
 {
-    vector_foreach(vm->machine->mmio_devs, i) {
-        rvvm_mmio_dev_t* mmio = vector_at(vm->machine->mmio_devs, i);
-        rvvm_mmio_handler_t rwfunc = NULL;
-        if (paddr >= mmio->addr && (paddr + size) <= (mmio->addr + mmio->size)) {
-            // Found the device, access lies in range
-            size_t offset = paddr - mmio->addr;
+    size_t offset = paddr - mmio->addr;
+    rvvm_mmio_handler_t rwfunc = (access == RISCV_MMU_WRITE) ? mmio->write : mmio->read;
+
+    if (mmio->mapping) {
+        // This is a direct memory region, cache translation in TLB if possible
+        if ((paddr & RISCV_PAGE_PNMASK) >= mmio->addr && mmio->size - (offset & RISCV_PAGE_PNMASK) >= RISCV_PAGE_SIZE) {
+            riscv_tlb_put(vm, vaddr, ((uint8_t*)mmio->mapping) + offset, access);
+        }
+        if (rwfunc == NULL) {
+            // Just copy the data over
             if (access == RISCV_MMU_WRITE) {
-                rwfunc = mmio->write;
+                atomic_memcpy_relaxed(((uint8_t*)mmio->mapping) + offset, dest, size);
             } else {
-                rwfunc = mmio->read;
+                atomic_memcpy_relaxed(dest, ((uint8_t*)mmio->mapping) + offset, size);
             }
+            return true;
+        }
+    } else if (rwfunc == NULL) {
+        return false;
+    }
 
-            if (mmio->mapping) {
-                // This is a direct memory region, cache translation in TLB if possible
-                if ((paddr & RISCV_PAGE_PNMASK) >= mmio->addr && mmio->size - (offset & RISCV_PAGE_PNMASK) >= RISCV_PAGE_SIZE) {
-                    riscv_tlb_put(vm, vaddr, ((uint8_t*)mmio->mapping) + offset, access);
-                }
-                if (rwfunc == NULL) {
-                    // Just copy the data over
-                    if (access == RISCV_MMU_WRITE) {
-                        atomic_memcpy_relaxed(((uint8_t*)mmio->mapping) + offset, dest, size);
-                    } else {
-                        atomic_memcpy_relaxed(dest, ((uint8_t*)mmio->mapping) + offset, size);
-                    }
-                    return true;
-                }
-            } else if (rwfunc == NULL) {
-                return false;
-            }
+    if (unlikely(size > mmio->max_op_size || size < mmio->min_op_size || (offset & (size - 1)))) {
+        // Misaligned or poorly sized operation, attempt fixup
+        rvvm_debug("Misaligned MMIO access to %s at %x, size %x", (mmio->type ? mmio->type->name : NULL), (uint32_t)offset, size);
+        return riscv_mmio_unaligned_op(mmio, dest, offset, size, access);
+    }
+    return rwfunc(mmio, dest, offset, size);
+}
 
-            if (unlikely(size > mmio->max_op_size || size < mmio->min_op_size || (offset & (size - 1)))) {
-                // Misaligned or poorly sized operation, attempt fixup
-                rvvm_debug("Misaligned MMIO access to %s at %x, size %x", (mmio->type ? mmio->type->name : NULL), (uint32_t)offset, size);
-                return riscv_mmio_unaligned_op(mmio, dest, offset, size, access);
-            }
-            return rwfunc(mmio, dest, offset, size);
+// Receives any operation on physical address space out of RAM region
+static bool riscv_mmio_scan(rvvm_hart_t* vm, rvvm_addr_t vaddr, rvvm_addr_t paddr, void* dest, uint8_t size, uint8_t access)
+{
+    bool ret = false;
+    rcu_read_lock();
+    rvvm_mmio_list_t* list = rcu_dereference(vm->machine->mmio_devs);
+    for (size_t i = 0; list && i < list->count; ++i) {
+        rvvm_mmio_dev_t* mmio = list->devs[i];
+        if (paddr >= mmio->addr && (paddr + size) <= (mmio->addr + mmio->size)) {
+            // Found the device, access lies in range
+            ret = riscv_mmio_access(vm, mmio, vaddr, paddr, dest, size, access);
+            break;
         }
     }
-
-    return false;
+    rcu_read_unlock();
+    return ret;
 }
 
 static forceinline bool riscv_block_in_page(rvvm_addr_t addr, size_t size)
@@ -493,6 +642,7 @@ static void riscv_mmu_pagefault(rvvm_hart_t* vm, rvvm_addr_t vaddr, uint32_t att
 no_inline void* riscv_mmu_op_internal(rvvm_hart_t* vm, rvvm_addr_t vaddr, void* data, uint32_t attr)
 {
     rvvm_addr_t paddr = 0;
+    bool napot = false;
     uint8_t access = attr & 0xFF;
     uint8_t mmu_access = access;
     size_t size = attr >> 16;
@@ -516,7 +666,7 @@ no_inline void* riscv_mmu_op_internal(rvvm_hart_t* vm, rvvm_addr_t vaddr, void*
         mmu_access = RISCV_MMU_DEBUG_ACCESS;
     }
 
-    if (likely(riscv_mmu_translate(vm, vaddr, &paddr, mmu_access))) {
+    if (likely(riscv_mmu_translate(vm, vaddr, &paddr, &napot, mmu_access))) {
         if (unlikely(attr & RISCV_MMU_ATTR_PHYS)) {
             // Physical translation requested
             *(rvvm_addr_t*)data = paddr;
@@ -526,7 +676,11 @@ no_inline void* riscv_mmu_op_internal(rvvm_hart_t* vm, rvvm_addr_t vaddr, void*
         void* ptr = riscv_phys_access(vm, paddr);
         if (likely(ptr)) {
             // Physical address in main memory, cache address translation
-            riscv_tlb_put(vm, vaddr, ptr, access);
+            if (unlikely(napot)) {
+                riscv_tlb_put_napot(vm, vaddr, paddr, ptr, access);
+            } else {
+                riscv_tlb_put(vm, vaddr, ptr, access);
+            }
             if (likely(!(attr & RISCV_MMU_ATTR_PTR))) {
                 // Perform actual load/store on translated pointer
                 if (access == RISCV_MMU_WRITE) {
@@ -538,6 +692,7 @@ no_inline void* riscv_mmu_op_internal(rvvm_hart_t* vm, rvvm_addr_t vaddr, void*
             if (access == RISCV_MMU_WRITE) {
                 // Clear JITted blocks & flush trace cache if necessary
                 riscv_jit_mark_dirty_mem(vm->machine, paddr, 8);
+                rvvm_mark_dirty_mem(vm->machine, paddr, size);
             }
             return ptr;
         }
@@ -36,6 +36,9 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 bool riscv_init_ram(rvvm_ram_t* mem, rvvm_addr_t base_addr, size_t size);
 void riscv_free_ram(rvvm_ram_t* mem);
 
+// VMA flags of anonymous guest RAM
+uint32_t riscv_ram_vma_flags(void);
+
 // Flush the TLB (For SFENCE.VMA, etc)
 void riscv_tlb_flush(rvvm_hart_t* vm);
 void riscv_tlb_flush_page(rvvm_hart_t* vm, rvvm_addr_t addr);
@@ -17,8 +17,10 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "mem_ops.h"
 #include "threading.h"
 #include "spinlock.h"
+#include "rcu_lib.h"
 #include "elf_load.h"
 #include "stacktrace.h"
+#include "vma_ops.h"
 
 static spinlock_t global_lock = SPINLOCK_INIT;
 static vector_t(rvvm_machine_t*) global_machines = {0};
@@ -55,6 +57,51 @@ void rvvm_append_isa_string(rvvm_machine_t* machine, const char* str)
 #endif
 }
 
+// NUMA node RAM regions are aligned to hugepage size
+#define RVVM_NUMA_ALIGN 0x200000
+
+// Get the RAM region of a guest NUMA node, the last node takes the remainder
+static void rvvm_numa_region(rvvm_machine_t* machine, uint32_t node, rvvm_addr_t* addr, size_t* size)
+{
+    size_t slice = align_size_down(machine->mem.size / machine->numa_nodes, RVVM_NUMA_ALIGN);
+    *addr = machine->mem.addr + (slice * node);
+    *size = (node + 1 == machine->numa_nodes) ? (machine->mem.size - (slice * node)) : slice;
+}
+
+static void rvvm_init_numa(rvvm_machine_t* machine)
+{
+    size_t nodes = rvvm_getarg_int("numa");
+    machine->numa_nodes = 1;
+    if (nodes <= 1) {
+        return;
+    }
+    if (nodes > vector_size(machine->harts) || nodes > 64 || machine->mem.size / nodes < RVVM_NUMA_ALIGN) {
+        rvvm_warn("Invalid NUMA node count %u, ignoring", (uint32_t)nodes);
+        return;
+    }
+    machine->numa_nodes = nodes;
+
+    // Guest nodes are placed on host nodes round-robin
+    uint32_t host_nodes = thread_numa_nodes();
+    if (host_nodes > 1) {
+        for (uint32_t node = 0; node < machine->numa_nodes; ++node) {
+            rvvm_addr_t addr = 0;
+            size_t size = 0;
+            rvvm_numa_region(machine, node, &addr, &size);
+            uint32_t host_node = thread_numa_node_id(node % host_nodes);
+            if (!vma_bind_numa(((uint8_t*)machine->mem.data) + (addr - machine->mem.addr), size, host_node)) {
+                rvvm_warn("Failed to bind guest NUMA node %u memory to host node %u", node, host_node);
+            }
+        }
+    } else {
+        rvvm_info("Host has a single NUMA node, guest NUMA placement is not backed by host");
+    }
+
+    vector_foreach(machine->harts, i) {
+        vector_at(machine->harts, i)->numa_node = i * machine->numa_nodes / vector_size(machine->harts);
+    }
+}
+
 #ifdef USE_FDT
 
 static void rvvm_init_fdt(rvvm_machine_t* machine)
@@ -72,11 +119,35 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
     fdt_node_add_prop(chosen, "rng-seed", rng_buffer, sizeof(rng_buffer));
     fdt_node_add_child(machine->fdt, chosen);
 
-    // FDT /memory node
-    struct fdt_node* memory = fdt_node_create_reg("memory", machine->mem.addr);
-    fdt_node_add_prop_str(memory, "device_type", "memory");
-    fdt_node_add_prop_reg(memory, "reg", machine->mem.addr, machine->mem.size);
-    fdt_node_add_child(machine->fdt, memory);
+    // FDT /memory nodes, one per NUMA node
+    for (uint32_t node = 0; node < machine->numa_nodes; ++node) {
+        rvvm_addr_t addr = 0;
+        size_t size = 0;
+        rvvm_numa_region(machine, node, &addr, &size);
+        struct fdt_node* memory = fdt_node_create_reg("memory", addr);
+        fdt_node_add_prop_str(memory, "device_type", "memory");
+        fdt_node_add_prop_reg(memory, "reg", addr, size);
+        if (machine->numa_nodes > 1) {
+            fdt_node_add_prop_u32(memory, "numa-node-id", node);
+        }
+        fdt_node_add_child(machine->fdt, memory);
+    }
+
+    if (machine->numa_nodes > 1) {
+        // FDT /distance-map node
+        struct fdt_node* distance_map = fdt_node_create("distance-map");
+        uint32_t count = machine->numa_nodes * machine->numa_nodes;
+        uint32_t* matrix = safe_new_arr(uint32_t, count * 3);
+        for (uint32_t i = 0; i < count; ++i) {
+            matrix[(i * 3)] = i / machine->numa_nodes;
+            matrix[(i * 3) + 1] = i % machine->numa_nodes;
+            matrix[(i * 3) + 2] = (matrix[i * 3] == matrix[(i * 3) + 1]) ? 10 : 20;
+        }
+        fdt_node_add_prop_str(distance_map, "compatible", "numa-distance-map-v1");
+        fdt_node_add_prop_cells(distance_map, "distance-matrix", matrix, count * 3);
+        fdt_node_add_child(machine->fdt, distance_map);
+        free(matrix);
+    }
 
     // FDT /cpus node
     struct fdt_node* cpus = fdt_node_create("cpus");
@@ -100,9 +171,9 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
         fdt_node_add_prop_u32(cpu, "riscv,cbom-block-size", 64);
         if (vector_at(machine->harts, i)->rv64) {
 #ifdef USE_FPU
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imafdcb_zicsr_zifencei_zkr_zicboz_zicbom_svadu_sstc");
+            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imafdcb_zicsr_zifencei_zkr_zicboz_zicbom_svadu_sstc_svnapot_svpbmt");
 #else
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imacb_zicsr_zifencei_zkr_zicboz_zicbom_svadu_sstc");
+            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imacb_zicsr_zifencei_zkr_zicboz_zicbom_svadu_sstc_svnapot_svpbmt");
 #endif
             fdt_node_add_prop_str(cpu, "mmu-type", "riscv,sv39");
         } else {
@@ -115,6 +186,9 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
         }
 
         fdt_node_add_prop_str(cpu, "status", "okay");
+        if (machine->numa_nodes > 1) {
+            fdt_node_add_prop_u32(cpu, "numa-node-id", vector_at(machine->harts, i)->numa_node);
+        }
 
         struct fdt_node* clic = fdt_node_create("interrupt-controller");
         fdt_node_add_prop_u32(clic, "#interrupt-cells", 1);
@@ -159,10 +233,6 @@ static void rvvm_prepare_fdt(rvvm_machine_t* machine)
 
 #endif
 
-#define RVVM_POWER_OFF   0
-#define RVVM_POWER_ON    1
-#define RVVM_POWER_RESET 2
-
 static size_t rvvm_dtb_addr(rvvm_machine_t* machine, size_t dtb_size)
 {
     return align_size_down(machine->mem.size > dtb_size ? machine->mem.size - dtb_size : 0, 8);
@@ -202,26 +272,124 @@ static rvvm_addr_t rvvm_pass_dtb(rvvm_machine_t* machine)
     return 0;
 }
 
+bool rvvm_private_ram(rvvm_machine_t* machine)
+{
+    // Shared, file-backed, locked or NUMA-bound RAM should keep it's mapping
+    return machine->numa_nodes <= 1 && !rvvm_getarg("mem_path") && !rvvm_has_arg("mem_share")
+        && !rvvm_has_arg("mem_prealloc") && !rvvm_has_arg("mem_lock");
+}
+
+static size_t rvvm_kernel_offset(rvvm_machine_t* machine)
+{
+    return machine->rv64 ? 0x200000 : 0x400000;
+}
+
+// RISC-V Linux Image header: effective image size including BSS, magic
+#define RVVM_IMAGE_SIZE_OFF  0x10
+#define RVVM_IMAGE_MAGIC_OFF 0x38
+#define RVVM_IMAGE_MAGIC     0x05435352 // "RSC\x05"
+
+static size_t rvvm_payload_size(rvvm_machine_t* machine, rvfile_t* file)
+{
+    bool elf = !rvvm_get_opt(machine, RVVM_OPT_HW_IMITATE);
+    uint8_t hdr[64] = {0};
+    if (rvread(file, hdr, sizeof(hdr), 0) == sizeof(hdr) && read_uint32_le_m(hdr + RVVM_IMAGE_MAGIC_OFF) == RVVM_IMAGE_MAGIC) {
+        // Raw Linux Image needs room for its BSS past the end of file
+        uint64_t image_size = read_uint64_le_m(hdr + RVVM_IMAGE_SIZE_OFF);
+        return EVAL_MAX(image_size, rvfilesize(file));
+    }
+    return bin_objcopy_size(file, elf);
+}
+
+static size_t rvvm_initrd_offset(rvvm_machine_t* machine)
+{
+    // Place initrd right after the firmware or kernel payload, whichever ends last
+    size_t end = 0;
+    if (machine->bootrom_file) {
+        end = rvvm_payload_size(machine, machine->bootrom_file);
+    }
+    if (machine->kernel_file) {
+        end = EVAL_MAX(end, rvvm_kernel_offset(machine) + rvvm_payload_size(machine, machine->kernel_file));
+    }
+    return align_size_up(end, 0x200000);
+}
+
+static bool rvvm_initrd_fits(rvvm_machine_t* machine, rvfile_t* file)
+{
+    size_t initrd_offset = rvvm_initrd_offset(machine);
+    if (initrd_offset >= machine->mem.size || rvfilesize(file) > machine->mem.size - initrd_offset) {
+        rvvm_error("Initrd does not fit in RAM after the kernel, use more RAM");
+        return false;
+    }
+    return true;
+}
+
+static void rvvm_load_initrd_state(rvvm_machine_t* machine, bool map_file)
+{
+#ifdef USE_FDT
+    struct fdt_node* chosen = fdt_node_find(machine->fdt, "chosen");
+    fdt_node_del_prop(chosen, "linux,initrd-start");
+    fdt_node_del_prop(chosen, "linux,initrd-end");
+#endif
+    if (machine->initrd_file && rvvm_initrd_fits(machine, machine->initrd_file)) {
+        size_t initrd_offset = rvvm_initrd_offset(machine);
+        uint64_t initrd_size = rvfilesize(machine->initrd_file);
+        bin_objcopy(machine->initrd_file, ((uint8_t*)machine->mem.data) + initrd_offset,
+                    machine->mem.size - initrd_offset, false, map_file);
+#ifdef USE_FDT
+        fdt_node_add_prop_u64(chosen, "linux,initrd-start", machine->mem.addr + initrd_offset);
+        fdt_node_add_prop_u64(chosen, "linux,initrd-end", machine->mem.addr + initrd_offset + initrd_size);
+#endif
+        rvvm_info("Loaded initrd at 0x%08"PRIx64", size %"PRIu64, machine->mem.addr + initrd_offset, initrd_size);
+    }
+}
+
+static void rvvm_zero_ram(rvvm_machine_t* machine)
+{
+    // Drop private RAM pages in O(1), they are zero-filled on next access.
+    // Replacing the mapping also discards file-backed snapshot, clone or image pages
+    if (!rvvm_private_ram(machine) || !vma_remap_file(machine->mem.data, machine->mem.size,
+                                                      riscv_ram_vma_flags(), NULL, 0)) {
+        // Shared or file-backed RAM is zeroed by hand
+        memset(machine->mem.data, 0, machine->mem.size);
+    }
+}
+
 static void rvvm_reset_machine_state(rvvm_machine_t* machine)
 {
     atomic_store_uint32(&machine->power_state, RVVM_POWER_ON);
 
     // Reset devices
-    vector_foreach(machine->mmio_devs, i) {
-        rvvm_mmio_dev_t* dev = vector_at(machine->mmio_devs, i);
+    rcu_read_lock();
+    rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+    for (size_t i = 0; mmio_devs && i < mmio_devs->count; ++i) {
+        rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
         if (dev->type && dev->type->reset) dev->type->reset(dev);
     }
-    // Load bootrom, kernel, dtb into RAM if needed
+    rcu_read_unlock();
+    if (rvvm_get_opt(machine, RVVM_OPT_RESET_ZERO)) {
+        rvvm_zero_ram(machine);
+    }
+    // Load bootrom, kernel, initrd, dtb into RAM if needed.
+    // Mapping them copy-on-write is opt-in: pages not yet touched by the guest
+    // follow changes to the files, and truncating a file raises SIGBUS
     bool elf = !rvvm_get_opt(machine, RVVM_OPT_HW_IMITATE);
+    bool map_file = rvvm_private_ram(machine) && rvvm_has_arg("map_images");
     if (machine->bootrom_file) {
-        bin_objcopy(machine->bootrom_file, machine->mem.data, machine->mem.size, elf);
+        bin_objcopy(machine->bootrom_file, machine->mem.data, machine->mem.size, elf, map_file);
     }
     if (machine->kernel_file) {
-        size_t kernel_offset = machine->rv64 ? 0x200000 : 0x400000;
+        size_t kernel_offset = rvvm_kernel_offset(machine);
         size_t kernel_size = machine->mem.size > kernel_offset ? machine->mem.size - kernel_offset : 0;
-        bin_objcopy(machine->kernel_file, ((uint8_t*)machine->mem.data) + kernel_offset, kernel_size, elf);
+        bin_objcopy(machine->kernel_file, ((uint8_t*)machine->mem.data) + kernel_offset, kernel_size, elf, map_file);
     }
+    rvvm_load_initrd_state(machine, map_file);
     rvvm_addr_t dtb_addr = rvvm_pass_dtb(machine);
+    if (machine->initrd_file && dtb_addr && dtb_addr - machine->mem.addr < rvvm_initrd_offset(machine)
+     + rvfilesize(machine->initrd_file)) {
+        rvvm_warn("Initrd is overwritten by DTB, use more RAM");
+    }
+    rvvm_mark_dirty_mem(machine, machine->mem.addr, machine->mem.size);
     // Reset CPUs
     rvtimer_init(&machine->timer, rvvm_get_opt(machine, RVVM_OPT_TIME_FREQ));
     vector_foreach(machine->harts, i) {
@@ -261,13 +429,16 @@ static bool rvvm_eventloop_tick(bool manual)
                 }
             }
 
-            vector_foreach(machine->mmio_devs, i) {
-                rvvm_mmio_dev_t* dev = vector_at(machine->mmio_devs, i);
+            rcu_read_lock();
+            rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+            for (size_t i = 0; mmio_devs && i < mmio_devs->count; ++i) {
+                rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
                 if (dev->type && dev->type->update) {
                     // Update device
                     dev->type->update(dev);
                 }
             }
+            rcu_read_unlock();
         } else {
             // The machine was shut down or reset
             vector_foreach(machine->harts, i) {
@@ -316,6 +487,10 @@ static void* rvvm_eventloop(void* manual)
     if (!manual && !rvvm_has_arg("noisolation")) {
         rvvm_restrict_this_thread();
     }
+    if (manual) {
+        // Manual eventloop runs on a foreign thread, register it as an RCU reader
+        rcu_register_thread();
+    }
 
     while (true) {
         spin_lock(&global_lock);
@@ -326,6 +501,10 @@ static void* rvvm_eventloop(void* manual)
         spin_unlock(&global_lock);
         condvar_wait(eventloop_cond, 16);
     }
+
+    if (manual) {
+        rcu_deregister_thread();
+    }
 #endif
     return NULL;
 }
@@ -405,6 +584,54 @@ static void rvvm_mmio_free(rvvm_mmio_dev_t* dev)
     free(dev);
 }
 
+/*
+ * MMIO device lists are published via RCU, so harts and device threads
+ * read them wait-free. Writers are serialized by machine->mmio_lock,
+ * each one publishes an updated copy and frees the old list after a grace period.
+ *
+ * NOTE: Device update/reset callbacks and MMIO handlers run inside RCU reader
+ * sections, attaching or removing MMIO devices from there would deadlock.
+ */
+
+// Publish a copy of the MMIO list with a device added and/or removed, returns the old list
+static rvvm_mmio_list_t* rvvm_mmio_list_update(rvvm_mmio_list_t** list_ptr, rvvm_mmio_dev_t* add, rvvm_mmio_dev_t* remove)
+{
+    rvvm_mmio_list_t* old = *list_ptr;
+    size_t old_count = old ? old->count : 0;
+    rvvm_mmio_list_t* list = safe_calloc(sizeof(rvvm_mmio_list_t) + sizeof(rvvm_mmio_dev_t*) * (old_count + 1), 1);
+    list->devs = (rvvm_mmio_dev_t**)(list + 1);
+    for (size_t i = 0; i < old_count; ++i) {
+        if (old->devs[i] != remove) {
+            list->devs[list->count++] = old->devs[i];
+        }
+    }
+    if (add) {
+        list->devs[list->count++] = add;
+    }
+    rcu_assign_pointer(*list_ptr, list);
+    return old;
+}
+
+// Wait until no hart or device thread observes previously published MMIO lists
+static void rvvm_mmio_synchronize(rvvm_machine_t* machine, bool flush_tlb)
+{
+    // Harts and device threads access the lists in short reader sections
+    rcu_synchronize();
+    if (flush_tlb) {
+        // Harts of this machine may still have the removed mapping cached in TLB,
+        // wait until each of them flushes it, kick them until they do so
+        vector_foreach(machine->harts, i) {
+            rvvm_hart_t* vm = vector_at(machine->harts, i);
+            riscv_hart_queue_tlb_flush(vm);
+            uint32_t seq = atomic_load_uint32(&vm->dispatch_seq);
+            while (!riscv_hart_passed_seq(vm, seq)) {
+                riscv_hart_kick(vm);
+                sleep_ms(1);
+            }
+        }
+    }
+}
+
 PUBLIC bool rvvm_check_abi(int abi)
 {
     if (RVVM_ABI_VERSION < 0) {
@@ -463,6 +690,7 @@ PUBLIC rvvm_machine_t* rvvm_create_machine(size_t mem_size, size_t hart_count, c
     rvvm_set_opt(machine, RVVM_OPT_MEM_BASE, RVVM_DEFAULT_MEMBASE);
     rvvm_set_opt(machine, RVVM_OPT_RESET_PC, RVVM_DEFAULT_MEMBASE);
     rvvm_set_opt(machine, RVVM_OPT_TIME_FREQ, 10000000);
+    rvvm_set_opt(machine, RVVM_OPT_RESET_ZERO, rvvm_has_arg("reset_zero"));
 
 #ifdef USE_JIT
     rvvm_set_opt(machine, RVVM_OPT_JIT, !rvvm_has_arg("nojit"));
@@ -481,6 +709,7 @@ PUBLIC rvvm_machine_t* rvvm_create_machine(size_t mem_size, size_t hart_count, c
     for (size_t i=0; i<hart_count; ++i) {
         vector_push_back(machine->harts, riscv_hart_init(machine));
     }
+    rvvm_init_numa(machine);
 #ifdef USE_FDT
     rvvm_init_fdt(machine);
 #endif
@@ -521,7 +750,7 @@ PUBLIC bool rvvm_load_bootrom(rvvm_machine_t* machine, const char* path)
 
 PUBLIC bool rvvm_load_kernel(rvvm_machine_t* machine, const char* path)
 {
-    size_t kernel_offset = machine->rv64 ? 0x200000 : 0x400000;
+    size_t kernel_offset = rvvm_kernel_offset(machine);
     size_t kernel_size = machine->mem.size > kernel_offset ? machine->mem.size - kernel_offset : 0;
     return rvvm_reopen_check_size(&machine->kernel_file, path, kernel_size);
 }
@@ -531,6 +760,19 @@ PUBLIC bool rvvm_load_dtb(rvvm_machine_t* machine, const char* path)
     return rvvm_reopen_check_size(&machine->dtb_file, path, machine->mem.size >> 1);
 }
 
+PUBLIC bool rvvm_load_initrd(rvvm_machine_t* machine, const char* path)
+{
+    if (!rvvm_reopen_check_size(&machine->initrd_file, path, machine->mem.size)) {
+        return false;
+    }
+    if (machine->initrd_file && !rvvm_initrd_fits(machine, machine->initrd_file)) {
+        rvclose(machine->initrd_file);
+        machine->initrd_file = NULL;
+        return false;
+    }
+    return true;
+}
+
 PUBLIC bool rvvm_dump_dtb(rvvm_machine_t* machine, const char* path)
 {
 #ifdef USE_FDT
@@ -561,6 +803,7 @@ PUBLIC rvvm_addr_t rvvm_get_opt(rvvm_machine_t* machine, uint32_t opt)
         case RVVM_OPT_MEM_BASE: return machine->mem.addr;
         case RVVM_OPT_MEM_SIZE: return machine->mem.size;
         case RVVM_OPT_HART_COUNT: return vector_size(machine->harts);
+        case RVVM_OPT_MEM_PRIVATE: return rvvm_private_ram(machine);
     }
     return 0;
 }
@@ -581,10 +824,16 @@ PUBLIC bool rvvm_set_opt(rvvm_machine_t* machine, uint32_t opt, rvvm_addr_t val)
 
 PUBLIC bool rvvm_start_machine(rvvm_machine_t* machine)
 {
+    if (machine->pending_state && !rvvm_machine_running(machine) && !rvvm_load_pending_state(machine)) {
+        return false;
+    }
     if (atomic_swap_uint32(&machine->running, true)) {
         return false;
     }
 
+    // Clones would no longer match the running machine
+    rvvm_drop_ram_template(machine);
+
     spin_lock(&global_lock);
 
     if (!rvvm_machine_powered(machine)) {
@@ -660,8 +909,9 @@ PUBLIC void rvvm_free_machine(rvvm_machine_t* machine)
     rvvm_reconfigure_eventloop();
 
     // Clean up devices in reversed order, something may reference older devices
-    vector_foreach_back(machine->mmio_devs, i) {
-        rvvm_mmio_free(vector_at(machine->mmio_devs, i));
+    rvvm_mmio_list_t* mmio_devs = rcu_swap_pointer(machine->mmio_devs, NULL);
+    for (size_t i = mmio_devs ? mmio_devs->count : 0; i--;) {
+        rvvm_mmio_free(mmio_devs->devs[i]);
     }
 
     vector_foreach_back(machine->harts, i) {
@@ -669,13 +919,17 @@ PUBLIC void rvvm_free_machine(rvvm_machine_t* machine)
     }
 
     vector_free(machine->harts);
-    vector_free(machine->mmio_devs);
-    vector_free(machine->msi_targets);
+    free(mmio_devs);
+    free(machine->msi_targets);
 
     riscv_free_ram(&machine->mem);
+    rvvm_drop_ram_template(machine);
+    free(machine->pending_state);
+    free(machine->dirty_log);
     rvclose(machine->bootrom_file);
     rvclose(machine->kernel_file);
     rvclose(machine->dtb_file);
+    rvclose(machine->initrd_file);
 #ifdef USE_FDT
     fdt_node_free(machine->fdt);
 #endif
@@ -705,8 +959,10 @@ PUBLIC bool rvvm_write_ram(rvvm_machine_t* machine, rvvm_addr_t dest, const void
 {
     if (dest < machine->mem.addr
     || (dest - machine->mem.addr + size) > machine->mem.size) return false;
+    if (machine->ram_template) rvvm_drop_ram_template(machine);
     memcpy(((uint8_t*)machine->mem.data) + (dest - machine->mem.addr), src, size);
     riscv_jit_mark_dirty_mem(machine, dest, size);
+    rvvm_mark_dirty_mem(machine, dest, size);
     return true;
 }
 
@@ -723,9 +979,65 @@ PUBLIC void* rvvm_get_dma_ptr(rvvm_machine_t* machine, rvvm_addr_t addr, size_t
     if (addr < machine->mem.addr
     || (addr - machine->mem.addr + size) > machine->mem.size) return NULL;
     riscv_jit_mark_dirty_mem(machine, addr, size);
+    rvvm_mark_dirty_mem(machine, addr, size);
     return ((uint8_t*)machine->mem.data) + (addr - machine->mem.addr);
 }
 
+PUBLIC bool rvvm_get_mem_stats(rvvm_machine_t* machine, rvvm_mem_stats_t* stats)
+{
+    memset(stats, 0, sizeof(rvvm_mem_stats_t));
+    stats->total = machine->mem.size / vma_page_size();
+    return vma_residency(machine->mem.data, machine->mem.size, &stats->resident, &stats->file, &stats->shared);
+}
+
+void rvvm_dirty_log_mark(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    if (size) {
+        size_t first = (addr - machine->mem.addr) >> RISCV_PAGE_SHIFT;
+        size_t last = (addr - machine->mem.addr + size - 1) >> RISCV_PAGE_SHIFT;
+        for (size_t page = first; page <= last; ++page) {
+            uint32_t* word = &machine->dirty_log[page >> 5];
+            uint32_t bit = 1U << (page & 31);
+            // Don't bounce the cacheline between harts on already dirty pages
+            if (!(atomic_load_uint32_relax(word) & bit)) {
+                atomic_or_uint32(word, bit);
+            }
+        }
+    }
+}
+
+PUBLIC void rvvm_set_dirty_log(rvvm_machine_t* machine, bool enable)
+{
+    if (enable && !machine->dirty_log) {
+        size_t pages = machine->mem.size >> RISCV_PAGE_SHIFT;
+        machine->dirty_log = safe_new_arr(uint32_t, (pages + 31) >> 5);
+    }
+    if (atomic_swap_uint32(&machine->dirty_logging, enable) != enable && enable) {
+        // Revoke cached write access, so that every page is logged on the next write
+        rvvm_mmio_synchronize(machine, true);
+    }
+}
+
+PUBLIC bool rvvm_get_dirty_log(rvvm_machine_t* machine, void* bitmap, size_t size)
+{
+    size_t pages = machine->mem.size >> RISCV_PAGE_SHIFT;
+    if (!atomic_load_uint32(&machine->dirty_logging) || size < ((pages + 7) >> 3)) {
+        return false;
+    }
+    uint8_t* dest = bitmap;
+    memset(dest, 0, size);
+    for (size_t i = 0; i < ((pages + 31) >> 5); ++i) {
+        uint32_t dirty = atomic_swap_uint32(&machine->dirty_log[i], 0);
+        for (size_t j = 0; dirty && j < 4 && ((i << 2) + j) < size; ++j) {
+            dest[(i << 2) + j] = dirty >> (j << 3);
+        }
+    }
+    // Any page writable through the TLB is already in the returned log.
+    // Flush write access so that further writes are logged again.
+    rvvm_mmio_synchronize(machine, true);
+    return true;
+}
+
 static inline bool rvvm_mmio_overlap_check(rvvm_addr_t addr1, size_t size1, rvvm_addr_t addr2, size_t size2)
 {
     return addr1 < (addr2 + size2) && addr2 < (addr1 + size1);
@@ -744,14 +1056,17 @@ PUBLIC rvvm_addr_t rvvm_mmio_zone_auto(rvvm_machine_t* machine, rvvm_addr_t addr
                 continue;
             }
 
-            vector_foreach(machine->mmio_devs, i) {
-                rvvm_mmio_dev_t* dev = vector_at(machine->mmio_devs, i);
+            rcu_read_lock();
+            rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+            for (size_t i = 0; mmio_devs && i < mmio_devs->count; ++i) {
+                rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
                 if (rvvm_mmio_overlap_check(addr, size, dev->addr, dev->size)) {
                     addr = (dev->addr + dev->size + 0xFFF) & ~0xFFFULL;
                     free_zone = false;
                     continue;
                 }
             }
+            rcu_read_unlock();
         }
     }
     return addr;
@@ -773,24 +1088,30 @@ PUBLIC rvvm_mmio_dev_t* rvvm_attach_mmio(rvvm_machine_t* machine, const rvvm_mmi
         rvvm_mmio_free(dev);
         return NULL;
     }
+    if (dev->mapping && ((dev->addr & 0xFFF) ^ (((size_t)dev->mapping) & 0xFFF))) {
+        // Misaligned mappings harm performance when used with KVM or shadow pagetable accel
+        rvvm_warn("MMIO device \"%s\" has misaligned mapping, expect lower perf",
+                  dev->type ? dev->type->name : "null");
+    }
+
+
+    spin_lock_slow(&machine->mmio_lock);
     if (rvvm_mmio_zone_auto(machine, dev->addr, dev->size) != dev->addr) {
+        spin_unlock(&machine->mmio_lock);
         rvvm_warn("Cannot attach MMIO device \"%s\" to occupied region 0x%08"PRIx64"",
                   dev->type ? dev->type->name : "null", dev->addr);
         rvvm_mmio_free(dev);
         return NULL;
     }
-    if (dev->mapping && ((dev->addr & 0xFFF) ^ (((size_t)dev->mapping) & 0xFFF))) {
-        // Misaligned mappings harm performance when used with KVM or shadow pagetable accel
-        rvvm_warn("MMIO device \"%s\" has misaligned mapping, expect lower perf",
-                  dev->type ? dev->type->name : "null");
-    }
+    rvvm_mmio_list_t* old = rvvm_mmio_list_update(&machine->mmio_devs, dev, NULL);
+    spin_unlock(&machine->mmio_lock);
 
     rvvm_info("Attached MMIO device at 0x%08"PRIx64", type \"%s\"",
               dev->addr, dev->type ? dev->type->name : "null");
 
-    bool was_running = rvvm_pause_machine(machine);
-    vector_push_back(machine->mmio_devs, dev);
-    if (was_running) rvvm_start_machine(machine);
+    // The new device is visible to running harts immediately, only reclaim the old list
+    rvvm_mmio_synchronize(machine, false);
+    free(old);
     return dev;
 }
 
@@ -799,24 +1120,17 @@ PUBLIC void rvvm_remove_mmio(rvvm_mmio_dev_t* mmio_dev)
     if (mmio_dev == NULL) return;
 
     rvvm_machine_t* machine = mmio_dev->machine;
-    bool was_running = rvvm_pause_machine(machine);
 
-    // Remove from machine device list
-    vector_foreach_back(machine->mmio_devs, i) {
-        if (vector_at(machine->mmio_devs, i) == mmio_dev) {
-            vector_erase(machine->mmio_devs, i);
-        }
-    }
-
-    // It's a shared memory mapping, flush each hart TLB
-    if (mmio_dev->mapping) {
-        vector_foreach(machine->harts, i) {
-            rvvm_hart_t* vm = vector_at(machine->harts, i);
-            riscv_tlb_flush(vm);
-        }
-    }
+    // Remove from machine device lists
+    spin_lock_slow(&machine->mmio_lock);
+    rvvm_mmio_list_t* old_devs = rvvm_mmio_list_update(&machine->mmio_devs, NULL, mmio_dev);
+    rvvm_mmio_list_t* old_msi = rvvm_mmio_list_update(&machine->msi_targets, NULL, mmio_dev);
+    spin_unlock(&machine->mmio_lock);
 
-    if (was_running) rvvm_start_machine(machine);
+    // If it's a shared memory mapping, each hart flushes it's TLB before the grace period ends
+    rvvm_mmio_synchronize(machine, !!mmio_dev->mapping);
+    free(old_devs);
+    free(old_msi);
 
     rvvm_mmio_free(mmio_dev);
 }
@@ -893,12 +1207,21 @@ PUBLIC bool rvvm_send_msi_irq(rvvm_machine_t* machine, rvvm_addr_t addr, uint32_
         write_uint32_le(&le, val);
         // Address must be aligned
         if (likely(!(addr & 3))) {
-            vector_foreach(machine->msi_targets, i) {
-                rvvm_mmio_dev_t* mmio = vector_at(machine->msi_targets, i);
+            bool ret = false, found = false;
+            rcu_read_lock();
+            rvvm_mmio_list_t* msi_targets = rcu_dereference(machine->msi_targets);
+            for (size_t i = 0; msi_targets && i < msi_targets->count; ++i) {
+                rvvm_mmio_dev_t* mmio = msi_targets->devs[i];
                 if (mmio->addr <= addr && addr < (mmio->addr + mmio->size)) {
-                    return mmio->write(mmio, &le, addr - mmio->addr, sizeof(le));
+                    ret = mmio->write(mmio, &le, addr - mmio->addr, sizeof(le));
+                    found = true;
+                    break;
                 }
             }
+            rcu_read_unlock();
+            if (found) {
+                return ret;
+            }
         }
         rvvm_debug("Failed to send MSI IRQ %x to %"PRIx64, val, addr);
     }
@@ -910,7 +1233,11 @@ PUBLIC bool rvvm_attach_msi_target(rvvm_machine_t* machine, const rvvm_mmio_dev_
     rvvm_mmio_dev_t* mmio = rvvm_attach_mmio(machine, mmio_desc);
     if (mmio) {
         if (mmio->min_op_size <= 4 && mmio->max_op_size >= 4) {
-            vector_push_back(machine->msi_targets, mmio);
+            spin_lock_slow(&machine->mmio_lock);
+            rvvm_mmio_list_t* old = rvvm_mmio_list_update(&machine->msi_targets, mmio, NULL);
+            spin_unlock(&machine->mmio_lock);
+            rvvm_mmio_synchronize(machine, false);
+            free(old);
             return true;
         }
         rvvm_warn("MSI target %s has invalid op sizes!", mmio->type ? mmio->type->name : NULL);
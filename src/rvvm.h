@@ -21,6 +21,8 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "vector.h"
 #include "rvtimer.h"
 #include "threading.h"
+#include "spinlock.h"
+#include "rcu_lib.h"
 #include "blk_io.h"
 #include "fdtlib.h"
 #include "gdbstub.h"
@@ -161,6 +163,15 @@ typedef struct {
     void*       data; // Pointer to memory data (Preferably page-aligned)
 } rvvm_ram_t;
 
+/*
+ * RCU-protected MMIO device list, immutable once published
+ */
+
+typedef struct {
+    size_t count;
+    rvvm_mmio_dev_t** devs;
+} rvvm_mmio_list_t;
+
 /*
  * AIA register file
  */
@@ -255,26 +266,42 @@ struct rvvm_hart_t {
 
     uint64_t pending_irqs;
     uint32_t pending_events;
+    uint32_t dispatch_seq; // Bumped after each event handling pass
+    uint32_t dispatching;  // Hart thread is inside the dispatch loop
     uint32_t preempt_ms;
+    uint32_t numa_node;
 
     // Cacheline alignment
     uint8_t align[64];
 };
 
+#define RVVM_POWER_OFF   0
+#define RVVM_POWER_ON    1
+#define RVVM_POWER_RESET 2
+
 struct rvvm_machine_t {
     rvvm_ram_t mem;
     vector_t(rvvm_hart_t*) harts;
-    vector_t(rvvm_mmio_dev_t*) mmio_devs;
-    vector_t(rvvm_mmio_dev_t*) msi_targets;
+    rvvm_mmio_list_t* mmio_devs;   // Read under rcu_read_lock()
+    rvvm_mmio_list_t* msi_targets; // Read under rcu_read_lock()
+    spinlock_t mmio_lock;          // Serializes MMIO list writers
     rvtimer_t timer;
 
     uint32_t running;
     uint32_t power_state;
+    uint32_t numa_nodes; // Guest NUMA nodes, RAM & harts are split evenly between them
+    uint32_t dirty_logging;
+    uint32_t* dirty_log; // Per-page RAM dirty bitmap, kept until machine cleanup
     bool rv64;
 
+    rvfile_t* ram_template;    // Copy-on-write RAM source for clones, valid while paused
+    void* pending_state;       // Hart & device state of a clone, restored on first start
+    size_t pending_state_size;
+
     rvfile_t* bootrom_file;
     rvfile_t* kernel_file;
     rvfile_t* dtb_file;
+    rvfile_t* initrd_file;
 
     rvvm_intc_t* intc;
     pci_bus_t* pci_bus;
@@ -292,4 +319,21 @@ struct rvvm_machine_t {
 
 void rvvm_append_isa_string(rvvm_machine_t* machine, const char* str);
 
+// RAM is private anonymous memory, so it's pages may be replaced with file mappings
+bool rvvm_private_ram(rvvm_machine_t* machine);
+
+// Machine cloning internals
+void rvvm_drop_ram_template(rvvm_machine_t* machine);
+bool rvvm_load_pending_state(rvvm_machine_t* machine);
+
+slow_path void rvvm_dirty_log_mark(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+// Mark the physical RAM as written for the dirty page log, when it's enabled
+static forceinline void rvvm_mark_dirty_mem(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    if (unlikely(atomic_load_uint32_relax(&machine->dirty_logging))) {
+        rvvm_dirty_log_mark(machine, addr, size);
+    }
+}
+
 #endif
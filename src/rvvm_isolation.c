@@ -15,6 +15,7 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "rvvm_isolation.h"
 #include "utils.h"
 #include "compiler.h"
+#include "vma_ops.h"
 
 #if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__) || defined(__SANITIZE_MEMORY)
 #define SANITIZERS_PRESENT
@@ -699,6 +700,8 @@ static void seccomp_setup_syscall_filter(bool all_threads) {
 
 void rvvm_restrict_this_thread(void)
 {
+    // Memory stats read procfs files, which can't be opened afterwards
+    vma_proc_init();
     drop_root_user();
     drop_thread_caps();
 #if defined(ISOLATION_SECCOMP_IMPL) && !defined(SANITIZERS_PRESENT)
@@ -709,6 +712,7 @@ void rvvm_restrict_this_thread(void)
 
 PUBLIC void rvvm_restrict_process(void)
 {
+    vma_proc_init();
     drop_root_user();
     drop_thread_caps();
 #if defined(SANITIZERS_PRESENT)
@@ -0,0 +1,965 @@
+/*
+rvvm_snapshot.c - Machine snapshots & live migration
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "rvvm.h"
+#include "riscv_hart.h"
+#include "riscv_mmu.h"
+#include "riscv_cpu.h"
+#include "riscv_csr.h"
+#include "vma_ops.h"
+#include "mem_ops.h"
+#include "networking.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Snapshot file layout:
+ * - 64 byte header
+ * - State stream: harts, then devices in attachment order
+ * - Guest RAM, aligned so that it could be mapped directly
+ */
+
+#define RVVM_SNAPSHOT_MAGIC   "RVVMSNAP"
+#define RVVM_SNAPSHOT_VERSION 2
+
+#define RVVM_SNAPSHOT_HDR_SIZE  64
+#define RVVM_SNAPSHOT_RAM_ALIGN 0x10000
+
+// Hart CSR block is saved as-is, reject snapshots from incompatible builds
+#define RVVM_SNAPSHOT_CSR_SIZE sizeof(((rvvm_hart_t*)NULL)->csr)
+
+#define RVVM_SNAPSHOT_FLAG_RV64 0x1
+#define RVVM_SNAPSHOT_FLAG_FPU  0x2
+
+struct rvvm_state {
+    // Backed by a file if non-NULL, by a memory buffer otherwise
+    rvfile_t* file;
+    uint8_t* buf;
+    size_t buf_size;
+
+    uint64_t pos;
+    uint64_t end;
+    bool error;
+};
+
+static void rvvm_state_pwrite(rvvm_state_t* state, const void* data, size_t size, uint64_t pos)
+{
+    if (state->file) {
+        if (rvwrite(state->file, data, size, pos) != size) {
+            state->error = true;
+        }
+    } else {
+        if (pos + size > state->buf_size) {
+            state->buf_size = EVAL_MAX(state->buf_size << 1, pos + size);
+            state->buf = safe_realloc(state->buf, state->buf_size);
+        }
+        memcpy(state->buf + pos, data, size);
+        state->end = EVAL_MAX(state->end, pos + size);
+    }
+}
+
+PUBLIC void rvvm_state_write(rvvm_state_t* state, const void* data, size_t size)
+{
+    rvvm_state_pwrite(state, data, size, state->pos);
+    state->pos += size;
+}
+
+PUBLIC bool rvvm_state_read(rvvm_state_t* state, void* data, size_t size)
+{
+    if (state->pos + size > state->end
+     || (state->file && rvread(state->file, data, size, state->pos) != size)) {
+        // Truncated state, don't leak garbage into the device
+        memset(data, 0, size);
+        state->error = true;
+        state->pos = state->end;
+        return false;
+    }
+    if (!state->file) {
+        memcpy(data, state->buf + state->pos, size);
+    }
+    state->pos += size;
+    return true;
+}
+
+PUBLIC void rvvm_save_none(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    UNUSED(dev);
+    UNUSED(state);
+}
+
+static void rvvm_state_write_u8(rvvm_state_t* state, uint8_t val)
+{
+    rvvm_state_write(state, &val, sizeof(val));
+}
+
+static void rvvm_state_write_u32(rvvm_state_t* state, uint32_t val)
+{
+    uint8_t tmp[4] = {0};
+    write_uint32_le_m(tmp, val);
+    rvvm_state_write(state, tmp, sizeof(tmp));
+}
+
+static void rvvm_state_write_u64(rvvm_state_t* state, uint64_t val)
+{
+    uint8_t tmp[8] = {0};
+    write_uint64_le_m(tmp, val);
+    rvvm_state_write(state, tmp, sizeof(tmp));
+}
+
+static uint8_t rvvm_state_read_u8(rvvm_state_t* state)
+{
+    uint8_t val = 0;
+    rvvm_state_read(state, &val, sizeof(val));
+    return val;
+}
+
+static uint32_t rvvm_state_read_u32(rvvm_state_t* state)
+{
+    uint8_t tmp[4] = {0};
+    rvvm_state_read(state, tmp, sizeof(tmp));
+    return read_uint32_le_m(tmp);
+}
+
+static uint64_t rvvm_state_read_u64(rvvm_state_t* state)
+{
+    uint8_t tmp[8] = {0};
+    rvvm_state_read(state, tmp, sizeof(tmp));
+    return read_uint64_le_m(tmp);
+}
+
+static uint32_t rvvm_snapshot_flags(rvvm_machine_t* machine)
+{
+    uint32_t flags = machine->rv64 ? RVVM_SNAPSHOT_FLAG_RV64 : 0;
+#ifdef USE_FPU
+    flags |= RVVM_SNAPSHOT_FLAG_FPU;
+#endif
+    return flags;
+}
+
+static const char* rvvm_snapshot_dev_name(rvvm_mmio_dev_t* dev)
+{
+    return (dev->type && dev->type->name) ? dev->type->name : "";
+}
+
+// Check that every attached device is able to save it's state
+static bool rvvm_snapshot_supported(rvvm_machine_t* machine)
+{
+    bool ret = true;
+    rcu_read_lock();
+    rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+    for (size_t i = 0; mmio_devs && i < mmio_devs->count; ++i) {
+        rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
+        if (dev->type == NULL || dev->type->save == NULL) {
+            rvvm_error("Device %s doesn't support snapshots", dev->type ? dev->type->name : "(untyped)");
+            ret = false;
+        }
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+// Wait for in-flight DMA of a paused machine, devices don't touch RAM afterwards
+static void rvvm_snapshot_quiesce(rvvm_machine_t* machine)
+{
+    rcu_read_lock();
+    rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+    for (size_t i = 0; mmio_devs && i < mmio_devs->count; ++i) {
+        rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
+        if (dev->type && dev->type->quiesce) {
+            dev->type->quiesce(dev);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void rvvm_snapshot_save_hart(rvvm_hart_t* vm, rvvm_state_t* state)
+{
+    for (size_t i = 0; i < RISCV_REGS_MAX; ++i) {
+        rvvm_state_write_u64(state, vm->registers[i]);
+    }
+#ifdef USE_FPU
+    for (size_t i = 0; i < RISCV_FPU_REGS_MAX; ++i) {
+        uint64_t tmp = 0;
+        memcpy(&tmp, &vm->fpu_registers[i], sizeof(tmp));
+        rvvm_state_write_u64(state, tmp);
+    }
+#endif
+    rvvm_state_write(state, &vm->csr, sizeof(vm->csr));
+    rvvm_state_write_u64(state, vm->root_page_table);
+    rvvm_state_write_u8(state, vm->mmu_mode);
+    rvvm_state_write_u8(state, vm->priv_mode);
+    rvvm_state_write_u8(state, vm->rv64);
+    rvvm_state_write_u8(state, vm->lrsc);
+    rvvm_state_write_u64(state, vm->lrsc_addr);
+    rvvm_state_write_u64(state, vm->lrsc_cas);
+    rvvm_state_write_u64(state, atomic_load_uint64(&vm->pending_irqs));
+    rvvm_state_write_u64(state, rvtimecmp_get(&vm->mtimecmp));
+    rvvm_state_write_u64(state, rvtimecmp_get(&vm->stimecmp));
+    rvvm_state_write_u8(state, !!vm->aia);
+    if (vm->aia) {
+        rvvm_state_write(state, vm->aia, sizeof(rvvm_aia_regfile_t) * 2);
+    }
+}
+
+static bool rvvm_snapshot_load_hart(rvvm_hart_t* vm, rvvm_state_t* state)
+{
+    for (size_t i = 0; i < RISCV_REGS_MAX; ++i) {
+        vm->registers[i] = rvvm_state_read_u64(state);
+    }
+#ifdef USE_FPU
+    for (size_t i = 0; i < RISCV_FPU_REGS_MAX; ++i) {
+        uint64_t tmp = rvvm_state_read_u64(state);
+        memcpy(&vm->fpu_registers[i], &tmp, sizeof(tmp));
+    }
+#endif
+    rvvm_state_read(state, &vm->csr, sizeof(vm->csr));
+    vm->root_page_table = rvvm_state_read_u64(state);
+    vm->mmu_mode = rvvm_state_read_u8(state);
+    vm->priv_mode = rvvm_state_read_u8(state);
+    vm->rv64 = !!rvvm_state_read_u8(state);
+    vm->lrsc = !!rvvm_state_read_u8(state);
+    vm->lrsc_addr = rvvm_state_read_u64(state);
+    vm->lrsc_cas = rvvm_state_read_u64(state);
+    atomic_store_uint64(&vm->pending_irqs, rvvm_state_read_u64(state));
+    atomic_store_uint32(&vm->pending_events, 0);
+    rvtimecmp_set(&vm->mtimecmp, rvvm_state_read_u64(state));
+    rvtimecmp_set(&vm->stimecmp, rvvm_state_read_u64(state));
+    if (rvvm_state_read_u8(state)) {
+        riscv_hart_aia_init(vm);
+        rvvm_state_read(state, vm->aia, sizeof(rvvm_aia_regfile_t) * 2);
+    }
+
+    // Drop any cached translations & code
+    riscv_update_xlen(vm);
+    riscv_tlb_flush(vm);
+    riscv_jit_flush_cache(vm);
+    return !state->error;
+}
+
+static bool rvvm_snapshot_zero_chunk(const void* data, size_t size)
+{
+    const size_t* ptr = data;
+    for (size_t i = 0; i < size / sizeof(size_t); ++i) {
+        if (ptr[i]) return false;
+    }
+    return true;
+}
+
+static bool rvvm_snapshot_save_ram(rvvm_machine_t* machine, rvfile_t* file, uint64_t ram_offset)
+{
+    // Leave the file sparse, only non-zero chunks are written
+    if (!rvtruncate(file, ram_offset + machine->mem.size)) {
+        return false;
+    }
+    const uint8_t* ram = machine->mem.data;
+    for (size_t pos = 0; pos < machine->mem.size; pos += RVVM_SNAPSHOT_RAM_ALIGN) {
+        size_t size = EVAL_MIN(machine->mem.size - pos, RVVM_SNAPSHOT_RAM_ALIGN);
+        if (!rvvm_snapshot_zero_chunk(ram + pos, size)) {
+            if (rvwrite(file, ram + pos, size, ram_offset + pos) != size) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Replace RAM of a paused machine with a private mapping of the file, pages are faulted in on access
+static bool rvvm_snapshot_map_ram(rvvm_machine_t* machine, rvfile_t* file, uint64_t ram_offset)
+{
+    void* ram = vma_mmap(NULL, machine->mem.size, VMA_RDWR, file, ram_offset);
+    if (ram == NULL) {
+        return false;
+    }
+    // Device threads may still hold DMA pointers into the old mapping
+    rvvm_snapshot_quiesce(machine);
+    void* old_ram = machine->mem.data;
+    machine->mem.data = ram;
+    vector_foreach(machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(machine->harts, i);
+        vm->mem.data = ram;
+        // Cached translations point into the old mapping
+        riscv_tlb_flush(vm);
+        riscv_jit_flush_cache(vm);
+    }
+    vma_free(old_ram, machine->mem.size);
+    return true;
+}
+
+static bool rvvm_snapshot_load_ram(rvvm_machine_t* machine, rvfile_t* file, uint64_t ram_offset)
+{
+    if (rvvm_private_ram(machine) && (ram_offset % vma_page_size()) == 0) {
+        if (rvvm_snapshot_map_ram(machine, file, ram_offset)) {
+            return true;
+        }
+        rvvm_info("Failed to map snapshot RAM, reading it instead");
+    }
+    return rvread(file, machine->mem.data, machine->mem.size, ram_offset) == machine->mem.size;
+}
+
+static void rvvm_snapshot_header(rvvm_machine_t* machine, uint8_t* hdr, uint64_t ram_offset)
+{
+    memset(hdr, 0, RVVM_SNAPSHOT_HDR_SIZE);
+    memcpy(hdr, RVVM_SNAPSHOT_MAGIC, 8);
+    write_uint32_le_m(hdr + 8, RVVM_SNAPSHOT_VERSION);
+    write_uint32_le_m(hdr + 12, vector_size(machine->harts));
+    write_uint32_le_m(hdr + 16, RVVM_SNAPSHOT_CSR_SIZE);
+    write_uint32_le_m(hdr + 20, rvvm_snapshot_flags(machine));
+    write_uint64_le_m(hdr + 24, machine->mem.addr);
+    write_uint64_le_m(hdr + 32, machine->mem.size);
+    write_uint64_le_m(hdr + 40, ram_offset);
+    write_uint64_le_m(hdr + 48, rvtimer_get(&machine->timer));
+    write_uint64_le_m(hdr + 56, rvtimer_freq(&machine->timer));
+}
+
+static bool rvvm_snapshot_check_header(rvvm_machine_t* machine, const uint8_t* hdr)
+{
+    return !memcmp(hdr, RVVM_SNAPSHOT_MAGIC, 8)
+        && read_uint32_le_m(hdr + 8) == RVVM_SNAPSHOT_VERSION
+        && read_uint32_le_m(hdr + 12) == vector_size(machine->harts)
+        && read_uint32_le_m(hdr + 16) == RVVM_SNAPSHOT_CSR_SIZE
+        && read_uint32_le_m(hdr + 20) == rvvm_snapshot_flags(machine)
+        && read_uint64_le_m(hdr + 24) == machine->mem.addr
+        && read_uint64_le_m(hdr + 32) == machine->mem.size;
+}
+
+static void rvvm_snapshot_load_timer(rvvm_machine_t* machine, const uint8_t* hdr)
+{
+    rvtimer_init(&machine->timer, read_uint64_le_m(hdr + 56));
+    rvtimer_rebase(&machine->timer, read_uint64_le_m(hdr + 48));
+}
+
+// Save harts & devices of a paused machine, fails if some device doesn't support snapshots
+static bool rvvm_snapshot_save_machine(rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    if (!rvvm_snapshot_supported(machine)) {
+        return false;
+    }
+    // Interrupts from completing requests must land in the saved hart state
+    rvvm_snapshot_quiesce(machine);
+
+    vector_foreach(machine->harts, i) {
+        rvvm_snapshot_save_hart(vector_at(machine->harts, i), state);
+    }
+
+    rcu_read_lock();
+    rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+    size_t dev_count = mmio_devs ? mmio_devs->count : 0;
+    rvvm_state_write_u32(state, dev_count);
+    for (size_t i = 0; i < dev_count; ++i) {
+        rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
+        const char* name = rvvm_snapshot_dev_name(dev);
+        rvvm_state_write_u32(state, rvvm_strlen(name));
+        rvvm_state_write(state, name, rvvm_strlen(name));
+
+        // Device state size is patched after the save handler
+        uint64_t size_pos = state->pos;
+        rvvm_state_write_u64(state, 0);
+        dev->type->save(dev, state);
+        uint8_t tmp[8] = {0};
+        write_uint64_le_m(tmp, state->pos - size_pos - sizeof(tmp));
+        rvvm_state_pwrite(state, tmp, sizeof(tmp), size_pos);
+    }
+    rcu_read_unlock();
+    return true;
+}
+
+// Restore harts & devices of a paused machine, reads the state up to state->end
+static bool rvvm_snapshot_load_machine(rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    uint64_t state_end = state->end;
+    bool ret = true;
+    vector_foreach(machine->harts, i) {
+        ret = ret && rvvm_snapshot_load_hart(vector_at(machine->harts, i), state);
+    }
+
+    rcu_read_lock();
+    rvvm_mmio_list_t* mmio_devs = rcu_dereference(machine->mmio_devs);
+    size_t dev_count = mmio_devs ? mmio_devs->count : 0;
+    if (ret && rvvm_state_read_u32(state) != dev_count) {
+        rvvm_error("Snapshot device count mismatch");
+        ret = false;
+    }
+    for (size_t i = 0; ret && i < dev_count; ++i) {
+        rvvm_mmio_dev_t* dev = mmio_devs->devs[i];
+        const char* name = rvvm_snapshot_dev_name(dev);
+        char tmp[64] = {0};
+        size_t name_len = rvvm_state_read_u32(state);
+        if (name_len != rvvm_strlen(name) || name_len >= sizeof(tmp)
+         || !rvvm_state_read(state, tmp, name_len) || !rvvm_strcmp(tmp, name)) {
+            rvvm_error("Snapshot device #%u mismatch, expected %s", (uint32_t)i, name);
+            ret = false;
+            break;
+        }
+
+        uint64_t dev_size = rvvm_state_read_u64(state);
+        uint64_t dev_end = state->pos + dev_size;
+        if (state->error || dev_end > state_end) {
+            ret = false;
+            break;
+        }
+        if (dev_size && dev->type && dev->type->load) {
+            // Don't let the device handler read past it's own state
+            state->end = dev_end;
+            if (!dev->type->load(dev, state) || state->error) {
+                rvvm_error("Failed to restore %s device state", name);
+                ret = false;
+            }
+            state->end = state_end;
+        }
+        state->pos = dev_end;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+// Restore a memory buffer holding snapshot header & machine state
+static bool rvvm_snapshot_load_buffer(rvvm_machine_t* machine, uint8_t* buf, size_t size)
+{
+    rvvm_state_t state = {
+        .buf = buf,
+        .buf_size = size,
+        .pos = RVVM_SNAPSHOT_HDR_SIZE,
+        .end = size,
+    };
+    if (size < RVVM_SNAPSHOT_HDR_SIZE || !rvvm_snapshot_check_header(machine, buf)) {
+        return false;
+    }
+    rvvm_snapshot_load_timer(machine, buf);
+    return rvvm_snapshot_load_machine(machine, &state);
+}
+
+PUBLIC bool rvvm_save_snapshot(rvvm_machine_t* machine, const char* path)
+{
+    // Write into a temporary file, the previous snapshot is only replaced on success
+    char tmp_path[256] = {0};
+    size_t len = rvvm_strlcpy(tmp_path, path, sizeof(tmp_path));
+    if (len + 4 >= sizeof(tmp_path)) {
+        rvvm_error("Snapshot path %s is too long", path);
+        return false;
+    }
+    rvvm_strlcpy(tmp_path + len, ".tmp", sizeof(tmp_path) - len);
+
+    bool was_running = rvvm_pause_machine(machine);
+
+    remove(tmp_path);
+    rvvm_state_t state = {
+        .file = rvopen(tmp_path, RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC),
+        .pos = RVVM_SNAPSHOT_HDR_SIZE,
+    };
+    if (state.file == NULL) {
+        rvvm_error("Failed to create snapshot file %s", tmp_path);
+        if (was_running) rvvm_start_machine(machine);
+        return false;
+    }
+
+    if (!rvvm_snapshot_save_machine(machine, &state)) {
+        rvvm_error("Failed to save snapshot %s", path);
+        rvclose(state.file);
+        remove(tmp_path);
+        if (was_running) rvvm_start_machine(machine);
+        return false;
+    }
+
+    uint64_t ram_offset = align_size_up(state.pos, RVVM_SNAPSHOT_RAM_ALIGN);
+    uint8_t hdr[RVVM_SNAPSHOT_HDR_SIZE] = {0};
+    rvvm_snapshot_header(machine, hdr, ram_offset);
+    rvvm_state_pwrite(&state, hdr, sizeof(hdr), 0);
+
+    bool ret = !state.error && rvvm_snapshot_save_ram(machine, state.file, ram_offset);
+    ret = rvfsync(state.file) && ret;
+    rvclose(state.file);
+    if (ret && rename(tmp_path, path) != 0) {
+        // Windows doesn't rename over an existing file. The previous file is unlinked,
+        // it's contents may still be mapped as guest RAM
+        ret = remove(path) == 0 && rename(tmp_path, path) == 0;
+    }
+    if (ret) {
+        rvvm_info("Saved snapshot %s", path);
+    } else {
+        rvvm_error("Failed to write snapshot file %s", path);
+        remove(tmp_path);
+    }
+
+    if (was_running) rvvm_start_machine(machine);
+    return ret;
+}
+
+PUBLIC bool rvvm_load_snapshot(rvvm_machine_t* machine, const char* path)
+{
+    rvvm_state_t state = {
+        .file = rvopen(path, 0),
+        .pos = RVVM_SNAPSHOT_HDR_SIZE,
+    };
+    if (state.file == NULL) {
+        rvvm_error("Failed to open snapshot file %s", path);
+        return false;
+    }
+
+    uint8_t hdr[RVVM_SNAPSHOT_HDR_SIZE] = {0};
+    if (rvread(state.file, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, RVVM_SNAPSHOT_MAGIC, 8)) {
+        rvvm_error("%s is not a RVVM snapshot", path);
+        rvclose(state.file);
+        return false;
+    }
+
+    uint64_t ram_offset = read_uint64_le_m(hdr + 40);
+    if (!rvvm_snapshot_check_header(machine, hdr) || ram_offset < RVVM_SNAPSHOT_HDR_SIZE
+     || rvfilesize(state.file) < ram_offset + machine->mem.size) {
+        rvvm_error("Snapshot %s doesn't match the machine configuration", path);
+        rvclose(state.file);
+        return false;
+    }
+    state.end = ram_offset;
+
+    bool was_running = rvvm_pause_machine(machine);
+    rvvm_drop_ram_template(machine);
+
+    rvvm_snapshot_load_timer(machine, hdr);
+    bool ret = rvvm_snapshot_load_machine(machine, &state);
+    if (ret && !rvvm_snapshot_load_ram(machine, state.file, ram_offset)) {
+        rvvm_error("Failed to read snapshot RAM");
+        ret = false;
+    }
+    rvclose(state.file);
+    rvvm_mark_dirty_mem(machine, machine->mem.addr, machine->mem.size);
+
+    if (ret) {
+        // Prevent the machine from being reset on start
+        atomic_store_uint32(&machine->power_state, RVVM_POWER_ON);
+        rvvm_info("Loaded snapshot %s", path);
+        if (was_running) rvvm_start_machine(machine);
+    } else {
+        rvvm_error("Failed to load snapshot %s", path);
+    }
+    return ret;
+}
+
+/*
+ * Machine cloning
+ *
+ * RAM of the source machine is copied once into an anonymous template file,
+ * which is then mapped privately (Copy-on-write) by the source and every clone.
+ * The template is dropped once the source runs again or it's RAM is written to.
+ * Writable disks of a clone are opened via private overlays on top of the source images.
+ */
+
+void rvvm_drop_ram_template(rvvm_machine_t* machine)
+{
+    rvclose(machine->ram_template);
+    machine->ram_template = NULL;
+}
+
+static rvfile_t* rvvm_clone_ram_template(rvvm_machine_t* machine)
+{
+    if (machine->ram_template == NULL && rvvm_private_ram(machine)) {
+        rvfile_t* file = rvopen_anon(machine->mem.size);
+        if (file && rvvm_snapshot_save_ram(machine, file, 0) && rvvm_snapshot_map_ram(machine, file, 0)) {
+            // Source RAM is now backed by the template as well
+            machine->ram_template = file;
+        } else {
+            rvvm_info("Failed to create RAM template, clones will copy RAM instead");
+            rvclose(file);
+        }
+    }
+    return machine->ram_template;
+}
+
+bool rvvm_load_pending_state(rvvm_machine_t* machine)
+{
+    bool ret = rvvm_snapshot_load_buffer(machine, machine->pending_state, machine->pending_state_size);
+    free(machine->pending_state);
+    machine->pending_state = NULL;
+    machine->pending_state_size = 0;
+    if (!ret) {
+        rvvm_error("Failed to restore cloned machine state, devices should match the source machine");
+        // Boot from scratch if started again
+        atomic_store_uint32(&machine->power_state, RVVM_POWER_OFF);
+    }
+    return ret;
+}
+
+PUBLIC void* rvvm_open_disk(rvvm_machine_t* machine, const char* image_path, bool rw)
+{
+    return blk_open_disk(machine, image_path, rw ? BLKDEV_RW : 0);
+}
+
+PUBLIC rvvm_machine_t* rvvm_clone_machine(rvvm_machine_t* machine)
+{
+    if (rvvm_machine_running(machine)) {
+        rvvm_error("Machine should be paused before cloning");
+        return NULL;
+    }
+    if (!rvvm_machine_powered(machine)) {
+        rvvm_error("Can't clone a powered off machine");
+        return NULL;
+    }
+    if (machine->pending_state == NULL && !rvvm_snapshot_supported(machine)) {
+        rvvm_error("Can't clone a machine with devices that don't support snapshots");
+        return NULL;
+    }
+
+    rvvm_machine_t* clone = rvvm_create_machine(machine->mem.size, vector_size(machine->harts),
+                                               machine->rv64 ? "rv64" : "rv32");
+    if (clone == NULL) {
+        return NULL;
+    }
+    memcpy(clone->opts, machine->opts, sizeof(clone->opts));
+    rvvm_set_opt(clone, RVVM_OPT_MEM_BASE, machine->mem.addr);
+    rvvm_set_opt(clone, RVVM_OPT_DISK_OVERLAY, true);
+
+    rvfile_t* tmpl = rvvm_clone_ram_template(machine);
+    if (tmpl == NULL || !rvvm_snapshot_map_ram(clone, tmpl, 0)) {
+        memcpy(clone->mem.data, machine->mem.data, machine->mem.size);
+    }
+
+    // Hart & device state is restored on first start, once the devices are attached
+    if (machine->pending_state) {
+        // Source is a clone that never ran, it's own harts & devices hold no state yet
+        clone->pending_state = safe_new_arr(uint8_t, machine->pending_state_size);
+        clone->pending_state_size = machine->pending_state_size;
+        memcpy(clone->pending_state, machine->pending_state, machine->pending_state_size);
+    } else {
+        rvvm_state_t state = {0};
+        uint8_t hdr[RVVM_SNAPSHOT_HDR_SIZE] = {0};
+        rvvm_snapshot_header(machine, hdr, 0);
+        rvvm_state_write(&state, hdr, sizeof(hdr));
+        if (!rvvm_snapshot_save_machine(machine, &state)) {
+            free(state.buf);
+            rvvm_free_machine(clone);
+            return NULL;
+        }
+        clone->pending_state = state.buf;
+        clone->pending_state_size = state.end;
+    }
+
+    // Prevent the clone from being reset on start
+    atomic_store_uint32(&clone->power_state, RVVM_POWER_ON);
+    return clone;
+}
+
+/*
+ * Live migration
+ *
+ * The stream starts with a snapshot header, followed by RAM page records.
+ * Dirty pages are sent in pre-copy rounds while the machine keeps running,
+ * then it's paused and the remaining pages are sent along with hart & device state.
+ */
+
+#ifdef USE_NET
+
+#define MIGRATE_REC_PAGE  'P' // Page index, page contents
+#define MIGRATE_REC_ZERO  'Z' // Page index of a zero page
+#define MIGRATE_REC_STATE 'S' // Snapshot header & machine state
+#define MIGRATE_REC_END   'E' // End of stream, target replies with MIGRATE_ACK
+#define MIGRATE_ACK       'A'
+
+// Stop pre-copy once the dirty set is this small, or after too many rounds
+#define MIGRATE_DIRTY_PAGES 256
+#define MIGRATE_MAX_ROUNDS  30
+
+#define MIGRATE_PAGE_SIZE 0x1000
+#define MIGRATE_BUF_SIZE  0x10000
+#define MIGRATE_STATE_MAX 0x10000000
+
+typedef struct {
+    net_sock_t* sock;
+    size_t pos;
+    size_t size;
+    bool error;
+    uint8_t buf[MIGRATE_BUF_SIZE];
+} rvvm_migrate_t;
+
+static bool rvvm_migrate_flush(rvvm_migrate_t* mig)
+{
+    size_t pos = 0;
+    while (!mig->error && pos < mig->pos) {
+        int32_t ret = net_tcp_send(mig->sock, mig->buf + pos, mig->pos - pos);
+        if (ret > 0) {
+            pos += ret;
+        } else if (ret != NET_ERR_BLOCK) {
+            mig->error = true;
+        }
+    }
+    mig->pos = 0;
+    return !mig->error;
+}
+
+static void rvvm_migrate_write(rvvm_migrate_t* mig, const void* data, size_t size)
+{
+    const uint8_t* ptr = data;
+    while (size && !mig->error) {
+        size_t chunk = EVAL_MIN(size, MIGRATE_BUF_SIZE - mig->pos);
+        memcpy(mig->buf + mig->pos, ptr, chunk);
+        mig->pos += chunk;
+        ptr += chunk;
+        size -= chunk;
+        if (mig->pos == MIGRATE_BUF_SIZE) {
+            rvvm_migrate_flush(mig);
+        }
+    }
+}
+
+static void rvvm_migrate_write_rec(rvvm_migrate_t* mig, uint8_t type, uint64_t arg)
+{
+    uint8_t tmp[9] = {type};
+    write_uint64_le_m(tmp + 1, arg);
+    rvvm_migrate_write(mig, tmp, sizeof(tmp));
+}
+
+static bool rvvm_migrate_read(rvvm_migrate_t* mig, void* data, size_t size)
+{
+    uint8_t* ptr = data;
+    while (size && !mig->error) {
+        if (mig->pos == mig->size) {
+            int32_t ret = net_tcp_recv(mig->sock, mig->buf, MIGRATE_BUF_SIZE);
+            if (ret > 0) {
+                mig->pos = 0;
+                mig->size = ret;
+            } else if (ret != NET_ERR_BLOCK) {
+                mig->error = true;
+            }
+            continue;
+        }
+        size_t chunk = EVAL_MIN(size, mig->size - mig->pos);
+        memcpy(ptr, mig->buf + mig->pos, chunk);
+        mig->pos += chunk;
+        ptr += chunk;
+        size -= chunk;
+    }
+    return !mig->error;
+}
+
+static void rvvm_migrate_send_page(rvvm_machine_t* machine, rvvm_migrate_t* mig, size_t page)
+{
+    const uint8_t* ptr = ((const uint8_t*)machine->mem.data) + (page * MIGRATE_PAGE_SIZE);
+    if (rvvm_snapshot_zero_chunk(ptr, MIGRATE_PAGE_SIZE)) {
+        rvvm_migrate_write_rec(mig, MIGRATE_REC_ZERO, page);
+    } else {
+        rvvm_migrate_write_rec(mig, MIGRATE_REC_PAGE, page);
+        rvvm_migrate_write(mig, ptr, MIGRATE_PAGE_SIZE);
+    }
+}
+
+// Send pages from the dirty log, returns dirty page count
+static size_t rvvm_migrate_send_dirty(rvvm_machine_t* machine, rvvm_migrate_t* mig, uint8_t* bitmap, size_t size)
+{
+    size_t pages = machine->mem.size / MIGRATE_PAGE_SIZE;
+    size_t dirty = 0;
+    rvvm_get_dirty_log(machine, bitmap, size);
+    for (size_t page = 0; page < pages && !mig->error; ++page) {
+        if (bitmap[page >> 3] & (1U << (page & 7))) {
+            rvvm_migrate_send_page(machine, mig, page);
+            dirty++;
+        }
+    }
+    return dirty;
+}
+
+static bool rvvm_migrate_send_internal(rvvm_machine_t* machine, rvvm_migrate_t* mig)
+{
+    size_t pages = machine->mem.size / MIGRATE_PAGE_SIZE;
+    size_t bitmap_size = (pages + 7) >> 3;
+    uint8_t* bitmap = safe_new_arr(uint8_t, bitmap_size);
+    uint8_t hdr[RVVM_SNAPSHOT_HDR_SIZE] = {0};
+
+    // Let the target validate machine configuration first
+    rvvm_snapshot_header(machine, hdr, 0);
+    rvvm_migrate_write(mig, hdr, sizeof(hdr));
+
+    // Initial full copy, writes from now on are logged
+    rvvm_set_dirty_log(machine, true);
+    for (size_t page = 0; page < pages && !mig->error; ++page) {
+        rvvm_migrate_send_page(machine, mig, page);
+    }
+
+    // Pre-copy rounds while the machine is running
+    for (size_t round = 0; round < MIGRATE_MAX_ROUNDS && !mig->error; ++round) {
+        size_t dirty = rvvm_migrate_send_dirty(machine, mig, bitmap, bitmap_size);
+        rvvm_info("Migration round %u: %u dirty pages", (uint32_t)round, (uint32_t)dirty);
+        if (dirty < MIGRATE_DIRTY_PAGES) {
+            break;
+        }
+    }
+
+    // Stop and copy the rest
+    uint64_t stop_time = rvtimer_clocksource(1000);
+    rvvm_pause_machine(machine);
+    // Let in-flight DMA land in the final dirty set
+    rvvm_snapshot_quiesce(machine);
+    rvvm_migrate_send_dirty(machine, mig, bitmap, bitmap_size);
+    rvvm_set_dirty_log(machine, false);
+    free(bitmap);
+
+    rvvm_state_t state = {0};
+    rvvm_snapshot_header(machine, hdr, 0);
+    rvvm_state_write(&state, hdr, sizeof(hdr));
+    if (!rvvm_snapshot_save_machine(machine, &state)) {
+        free(state.buf);
+        return false;
+    }
+    rvvm_migrate_write_rec(mig, MIGRATE_REC_STATE, state.end);
+    rvvm_migrate_write(mig, state.buf, state.end);
+    free(state.buf);
+
+    rvvm_migrate_write_rec(mig, MIGRATE_REC_END, 0);
+    uint8_t ack = 0;
+    if (rvvm_migrate_flush(mig) && rvvm_migrate_read(mig, &ack, sizeof(ack)) && ack == MIGRATE_ACK) {
+        rvvm_info("Migration downtime: %u ms", (uint32_t)(rvtimer_clocksource(1000) - stop_time));
+        return true;
+    }
+    return false;
+}
+
+static bool rvvm_migrate_receive_internal(rvvm_machine_t* machine, rvvm_migrate_t* mig)
+{
+    size_t pages = machine->mem.size / MIGRATE_PAGE_SIZE;
+    uint8_t hdr[RVVM_SNAPSHOT_HDR_SIZE] = {0};
+    if (!rvvm_migrate_read(mig, hdr, sizeof(hdr)) || !rvvm_snapshot_check_header(machine, hdr)) {
+        rvvm_error("Incoming migration doesn't match the machine configuration");
+        return false;
+    }
+
+    while (rvvm_migrate_read(mig, hdr, 9)) {
+        uint64_t arg = read_uint64_le_m(hdr + 1);
+        uint8_t* ram = machine->mem.data;
+        switch (hdr[0]) {
+            case MIGRATE_REC_PAGE:
+                if (arg >= pages || !rvvm_migrate_read(mig, ram + (arg * MIGRATE_PAGE_SIZE), MIGRATE_PAGE_SIZE)) {
+                    return false;
+                }
+                break;
+            case MIGRATE_REC_ZERO:
+                if (arg >= pages) {
+                    return false;
+                }
+                memset(ram + (arg * MIGRATE_PAGE_SIZE), 0, MIGRATE_PAGE_SIZE);
+                break;
+            case MIGRATE_REC_STATE: {
+                if (arg < RVVM_SNAPSHOT_HDR_SIZE || arg > MIGRATE_STATE_MAX) {
+                    return false;
+                }
+                uint8_t* buf = safe_new_arr(uint8_t, arg);
+                bool ret = rvvm_migrate_read(mig, buf, arg) && rvvm_snapshot_load_buffer(machine, buf, arg);
+                free(buf);
+                if (!ret) {
+                    return false;
+                }
+                break;
+            }
+            case MIGRATE_REC_END: {
+                // Reuse the drained receive buffer for the reply
+                uint8_t ack = MIGRATE_ACK;
+                mig->pos = 0;
+                mig->size = 0;
+                rvvm_migrate_write(mig, &ack, sizeof(ack));
+                return rvvm_migrate_flush(mig);
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+PUBLIC bool rvvm_migrate_send(rvvm_machine_t* machine, const char* addr)
+{
+    net_addr_t net_addr = {0};
+    if (!net_parse_addr(&net_addr, addr)) {
+        rvvm_error("Invalid migration address %s", addr);
+        return false;
+    }
+    if (!rvvm_snapshot_supported(machine)) {
+        rvvm_error("Can't migrate a machine with devices that don't support snapshots");
+        return false;
+    }
+    rvvm_migrate_t* mig = safe_new_obj(rvvm_migrate_t);
+    mig->sock = net_tcp_connect(&net_addr, NULL, true);
+    if (mig->sock == NULL) {
+        rvvm_error("Failed to connect to migration target %s", addr);
+        free(mig);
+        return false;
+    }
+
+    bool was_running = rvvm_machine_running(machine);
+    bool ret = rvvm_migrate_send_internal(machine, mig);
+    net_sock_close(mig->sock);
+    free(mig);
+
+    if (ret) {
+        // The machine now lives on the target, keep it paused here
+        rvvm_info("Migrated machine to %s", addr);
+    } else {
+        rvvm_error("Migration to %s failed", addr);
+        rvvm_set_dirty_log(machine, false);
+        if (was_running) rvvm_start_machine(machine);
+    }
+    return ret;
+}
+
+PUBLIC bool rvvm_migrate_receive(rvvm_machine_t* machine, const char* addr)
+{
+    net_addr_t net_addr = {0};
+    if (!net_parse_addr(&net_addr, addr)) {
+        rvvm_error("Invalid migration address %s", addr);
+        return false;
+    }
+    net_sock_t* listener = net_tcp_listen(&net_addr);
+    if (listener == NULL) {
+        rvvm_error("Failed to listen for incoming migration on %s", addr);
+        return false;
+    }
+
+    rvvm_info("Waiting for incoming migration on %s", addr);
+    rvvm_migrate_t* mig = safe_new_obj(rvvm_migrate_t);
+    mig->sock = net_tcp_accept(listener);
+    net_sock_close(listener);
+    if (mig->sock == NULL) {
+        free(mig);
+        return false;
+    }
+    net_sock_set_blocking(mig->sock, true);
+
+    bool was_running = rvvm_pause_machine(machine);
+    rvvm_drop_ram_template(machine);
+    bool ret = rvvm_migrate_receive_internal(machine, mig);
+    net_sock_close(mig->sock);
+    free(mig);
+    rvvm_mark_dirty_mem(machine, machine->mem.addr, machine->mem.size);
+
+    if (ret) {
+        // Prevent the machine from being reset on start
+        atomic_store_uint32(&machine->power_state, RVVM_POWER_ON);
+        rvvm_info("Incoming migration from %s complete", addr);
+        if (was_running) rvvm_start_machine(machine);
+    } else {
+        rvvm_error("Incoming migration on %s failed", addr);
+    }
+    return ret;
+}
+
+#else
+
+PUBLIC bool rvvm_migrate_send(rvvm_machine_t* machine, const char* addr)
+{
+    UNUSED(machine);
+    UNUSED(addr);
+    rvvm_error("Live migration requires networking support");
+    return false;
+}
+
+PUBLIC bool rvvm_migrate_receive(rvvm_machine_t* machine, const char* addr)
+{
+    UNUSED(machine);
+    UNUSED(addr);
+    rvvm_error("Live migration requires networking support");
+    return false;
+}
+
+#endif
@@ -77,14 +77,17 @@ typedef struct rvvm_machine_t rvvm_machine_t;
 #define RVVM_OPT_JIT          0x6 //!< Enable JIT
 #define RVVM_OPT_JIT_CACHE    0x7 //!< Amount of per-core JIT cache (In bytes)
 #define RVVM_OPT_JIT_HARVARD  0x8 //!< No dirty code tracking, explicit ifence, slower
+#define RVVM_OPT_RESET_ZERO   0x9 //!< Zero RAM on reset, drops host pages where possible
+#define RVVM_OPT_DISK_OVERLAY 0xA //!< Open writable disks via private temporary overlays, set on clones
 
 // Machine options (Special function or read-only)
 #define RVVM_OPT_MEM_BASE   0x80000001U //!< Physical RAM base address, defaults to 0x80000000
 #define RVVM_OPT_MEM_SIZE   0x80000002U //!< Physical RAM size
 #define RVVM_OPT_HART_COUNT 0x80000003U //!< Amount of harts
+#define RVVM_OPT_MEM_PRIVATE 0x80000004U //!< RAM is private anonymous memory, file pages may be mapped into it
 
 // Internal use ONLY!
-#define RVVM_OPTS_ARR_SIZE 0x9
+#define RVVM_OPTS_ARR_SIZE 0xB
 
 //! Default memory base address
 #define RVVM_DEFAULT_MEMBASE 0x80000000U
@@ -111,6 +114,9 @@ PUBLIC bool rvvm_load_kernel(rvvm_machine_t* machine, const char* path);
 //! \brief Load a custom Device Tree blob, which is passed to guest at reset.
 PUBLIC bool rvvm_load_dtb(rvvm_machine_t* machine, const char* path);
 
+//! \brief Load initial ramdisk for the kernel, it's location is passed via generated Device Tree
+PUBLIC bool rvvm_load_initrd(rvvm_machine_t* machine, const char* path);
+
 //! \brief Dump generated Device Tree to a file
 PUBLIC bool rvvm_dump_dtb(rvvm_machine_t* machine, const char* path);
 
@@ -144,6 +150,47 @@ PUBLIC void rvvm_free_machine(rvvm_machine_t* machine);
 //! \brief Run the event loop in the calling thread, returns when any machine is paused or powered off
 PUBLIC void rvvm_run_eventloop(void);
 
+//! \brief  Save complete machine state (Harts, devices, RAM) into a snapshot file
+//! \note   A running machine is paused for the duration of the save
+//! \return Snapshot save success, fails if any attached device doesn't support snapshots
+PUBLIC bool rvvm_save_snapshot(rvvm_machine_t* machine, const char* path);
+
+//! \brief  Restore machine state from a snapshot file, RAM is mapped lazily from it when possible
+//! \note   Machine should be created with same configuration (RAM, harts, devices) as the saved one
+//! \return Snapshot load success, machine state is undefined on failure
+PUBLIC bool rvvm_load_snapshot(rvvm_machine_t* machine, const char* path);
+
+//! \brief Enable or disable guest RAM dirty page logging, has overhead only while enabled
+PUBLIC void rvvm_set_dirty_log(rvvm_machine_t* machine, bool enable);
+
+//! \brief  Fetch and clear the RAM dirty page log, one bit per 4K page starting from RAM base
+//! \param bitmap Destination bitmap, at least (RAM size / 4096 + 7) / 8 bytes long
+//! \return False if dirty logging is disabled or the bitmap is too small
+PUBLIC bool rvvm_get_dirty_log(rvvm_machine_t* machine, void* bitmap, size_t size);
+
+//! \brief  Clone a paused machine, guest RAM is shared copy-on-write with the source when possible
+//! \note   Attach the same devices in the same order to the clone, their state is restored on it's first start.
+//!         Writable disks attached to the clone by path get private overlays, see RVVM_OPT_DISK_OVERLAY.
+//! \return Cloned machine handle, NULL on failure
+PUBLIC rvvm_machine_t* rvvm_clone_machine(rvvm_machine_t* machine);
+
+//! \brief  Open a disk image for use by the machine devices, as done when attaching disks by path
+//! \note   With RVVM_OPT_DISK_OVERLAY (Set on clones), a writable image is opened via a fresh overlay
+//!         in the temporary directory, which is deleted once opened. The base image is left untouched,
+//!         so the source machine should stay paused or use an overlay itself while clones run.
+//! \return Block device handle to pass to *_init_blk() functions, NULL on failure
+PUBLIC void* rvvm_open_disk(rvvm_machine_t* machine, const char* image_path, bool rw);
+
+//! \brief  Live migrate the machine to a target listening at addr (Example: 127.0.0.1:7000)
+//! \note   RAM is pre-copied while the machine runs, then it's briefly paused to send the rest
+//! \return Migration success, the machine is left paused. On failure, it's resumed
+PUBLIC bool rvvm_migrate_send(rvvm_machine_t* machine, const char* addr);
+
+//! \brief  Wait for an incoming migration on addr and restore the machine state from it
+//! \note   Machine should be created with same configuration (RAM, harts, devices) as the source
+//! \return Migration success, machine state is undefined on failure
+PUBLIC bool rvvm_migrate_receive(rvvm_machine_t* machine, const char* addr);
+
 /** @}*/
 
 /**
@@ -173,6 +220,19 @@ typedef struct rvvm_pci_bus pci_bus_t;
 //! I2C Bus handle
 typedef struct rvvm_i2c_bus i2c_bus_t;
 
+//! Snapshot state stream, passed to device save/load handlers
+typedef struct rvvm_state rvvm_state_t;
+
+//! \brief Write device state into a snapshot
+PUBLIC void rvvm_state_write(rvvm_state_t* state, const void* data, size_t size);
+
+//! \brief  Read device state from a snapshot
+//! \return False if the saved state is truncated
+PUBLIC bool rvvm_state_read(rvvm_state_t* state, void* data, size_t size);
+
+//! \brief Dummy save handler for devices without any state of their own
+PUBLIC void rvvm_save_none(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
+
 //! MMIO device type-specific information and handlers (Cleanup, reset, serialize)
 typedef struct {
     //! Human-readable device name
@@ -187,11 +247,15 @@ typedef struct {
     //! Called on machine reset
     void (*reset)(rvvm_mmio_dev_t* dev);
 
-    /*
-     * TODO
-     * void (*suspend)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
-     * void (*resume)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
-     */
+    //! Called on snapshot save, saving the machine fails if this is NULL (See rvvm_save_none())
+    void (*save)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
+
+    //! Called on snapshot load, returns false on malformed state
+    bool (*load)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
+
+    //! Called on a paused machine before it's state is saved or it's RAM is remapped,
+    //! waits for in-flight DMA and device threads to finish. May be NULL
+    void (*quiesce)(rvvm_mmio_dev_t* dev);
 
 } rvvm_mmio_type_t;
 
@@ -226,6 +290,50 @@ PUBLIC bool rvvm_read_ram(rvvm_machine_t* machine, void* dest, rvvm_addr_t src,
 //! \return Pointer to machine DMA region, or NULL on failure
 PUBLIC void* rvvm_get_dma_ptr(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
 
+//! Machine memory sharing statistics, in pages
+typedef struct {
+    size_t total;    //!< Guest RAM pages
+    size_t resident; //!< Pages present in host memory
+    size_t file;     //!< Resident pages backed by host page cache (Mapped images)
+    size_t shared;   //!< Resident pages also mapped by other processes (Other VMs, KSM)
+} rvvm_mem_stats_t;
+
+//! \brief  Query how much of machine RAM is resident and shared on the host (Linux only)
+//! \note   Works under isolation. Unreadable parts of RAM are left out of the counts
+//! \return True if any residency information was read, total is filled in any case
+PUBLIC bool rvvm_get_mem_stats(rvvm_machine_t* machine, rvvm_mem_stats_t* stats);
+
+//! Block IO operation types
+#define RVVM_BLK_STAT_READ  0
+#define RVVM_BLK_STAT_WRITE 1
+#define RVVM_BLK_STAT_SYNC  2
+#define RVVM_BLK_STAT_TRIM  3
+#define RVVM_BLK_STAT_OPS   4
+
+//! Amount of log-scale latency histogram buckets
+#define RVVM_BLK_STAT_BUCKETS 24
+
+//! Block IO statistics of an open drive image or an NVMe submission queue
+typedef struct {
+    char     name[64];                    //!< Image path, or controller and queue ("nvme0 sq1")
+    uint64_t ops[RVVM_BLK_STAT_OPS];      //!< Successful operations of each type
+    uint64_t bytes[RVVM_BLK_STAT_OPS];    //!< Bytes transferred (or discarded) by each operation type
+    uint64_t errors;                      //!< Failed operations
+    uint64_t merged;                      //!< Guest buffers coalesced into a single host operation
+    uint64_t latency[RVVM_BLK_STAT_OPS][RVVM_BLK_STAT_BUCKETS]; //!< Bucket N counts [2^(N-1), 2^N) microseconds
+    uint32_t inflight;                    //!< Operations currently in flight (Queue depth)
+    uint32_t inflight_max;                //!< Highest observed queue depth
+} rvvm_blk_stats_t;
+
+//! \brief  Snapshot IO statistics of all open drives and NVMe queues
+//! \param stats Destination array, may be NULL to query the amount of entries
+//! \return Total amount of entries, at most count are written
+PUBLIC size_t rvvm_get_blk_stats(rvvm_blk_stats_t* stats, size_t count);
+
+//! \brief Print IO statistics of all active drives and NVMe queues, regardless of loglevel.
+//! \note  Passing -blk_stats <seconds> does this periodically
+PUBLIC void rvvm_dump_blk_stats(void);
+
 //! \brief  Get usable address for a MMIO region
 //! \return Usable physical memory address, which is equal to addr if the requested region is free
 PUBLIC rvvm_addr_t rvvm_mmio_zone_auto(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
@@ -234,9 +342,11 @@ PUBLIC rvvm_addr_t rvvm_mmio_zone_auto(rvvm_machine_t* machine, rvvm_addr_t addr
 //! \param   mmio MMIO region description, doesn't need to be kept
 //! \return  Valid MMIO region handle, or NULL on failure
 //! \warning Dereferencing an attached rvvm_mmio_dev_t* should be done thread-safely using atomics/fences
+//! \note    Hotplug on a running machine doesn't pause it, but this shouldn't be called from MMIO handlers
 PUBLIC rvvm_mmio_dev_t* rvvm_attach_mmio(rvvm_machine_t* machine, const rvvm_mmio_dev_t* mmio_desc);
 
 //! \brief Detach (pull out) MMIO device from the owning machine, free it's state
+//! \note  Waits until no vCPU or device thread uses the device, shouldn't be called from MMIO handlers
 PUBLIC void rvvm_remove_mmio(rvvm_mmio_dev_t* mmio_dev);
 
 //! \brief Clean up MMIO device state if it's not attached to any machine
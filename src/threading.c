@@ -48,9 +48,11 @@ static void condvar_fill_timespec(struct timespec* ts)
 
 // RVVM internal headers come after system headers because of safe_free()
 #include "atomics.h"
+#include "rcu_lib.h"
 #include "rvtimer.h"
 #include "utils.h"
 #include "dlib.h"
+#include "blk_io.h"
 
 #define COND_FLAG_SIGNALED 0x1
 
@@ -74,31 +76,36 @@ struct cond_var {
 #endif
 };
 
-#if defined(_WIN32) && !defined(HOST_64BIT)
-// Wrap our function call to hide calling convention details
-typedef struct { thread_func_t func; void* arg; } thread_win32_wrap_t;
-static DWORD __stdcall thread_win32_wrap(void* arg)
+// Wrap our function call to hide calling convention details,
+// register each spawned thread as an RCU reader
+typedef struct { thread_func_t func; void* arg; } thread_wrap_t;
+
+#ifdef _WIN32
+static DWORD __stdcall thread_wrap(void* arg)
+#else
+static void* thread_wrap(void* arg)
+#endif
 {
-    thread_win32_wrap_t wrap = *(thread_win32_wrap_t*)arg;
+    thread_wrap_t wrap = *(thread_wrap_t*)arg;
     free(arg);
-    return (DWORD)(size_t)wrap.func(wrap.arg);
-}
+    rcu_register_thread();
+    void* ret = wrap.func(wrap.arg);
+    rcu_deregister_thread();
+#ifdef _WIN32
+    return (DWORD)(size_t)ret;
+#else
+    return ret;
 #endif
+}
 
 thread_ctx_t* thread_create_ex(thread_func_t func, void* arg, uint32_t stack_size)
 {
     thread_ctx_t* thread = safe_new_obj(thread_ctx_t);
-#ifdef _WIN32
-#if !defined(HOST_64BIT)
-    void* entry = thread_win32_wrap;
-    thread_win32_wrap_t* wrap = safe_new_obj(thread_win32_wrap_t);
+    thread_wrap_t* wrap = safe_new_obj(thread_wrap_t);
     wrap->func = func;
     wrap->arg = arg;
-    arg = wrap;
-#else
-    void* entry = func;
-#endif
-    thread->handle = CreateThread(NULL, stack_size, entry, arg, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, stack_size, thread_wrap, wrap, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
     if (thread->handle) {
         return thread;
     }
@@ -110,7 +117,7 @@ thread_ctx_t* thread_create_ex(thread_func_t func, void* arg, uint32_t stack_siz
     } else if (stack_size) {
         pthread_attr_setstacksize(pass_attr, stack_size);
     }
-    int ret = pthread_create(&thread->pthread, pass_attr, func, arg);
+    int ret = pthread_create(&thread->pthread, pass_attr, thread_wrap, wrap);
     if (pass_attr) {
         pthread_attr_destroy(pass_attr);
     }
@@ -119,6 +126,7 @@ thread_ctx_t* thread_create_ex(thread_func_t func, void* arg, uint32_t stack_siz
     }
 #endif
     rvvm_warn("Failed to spawn thread!");
+    free(wrap);
     free(thread);
     return NULL;
 }
@@ -506,3 +514,117 @@ void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_coun
         func(args);
     }
 }
+
+/*
+ * Host NUMA topology
+ */
+
+#if defined(__linux__) && !defined(_WIN32)
+#include <unistd.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_sched_setaffinity)
+#define THREAD_NUMA_IMPL
+#endif
+
+#endif
+
+#ifdef THREAD_NUMA_IMPL
+
+#define THREAD_NUMA_MAX_NODES 64
+#define THREAD_NUMA_MAX_CPUS  1024
+#define THREAD_NUMA_MASK_BITS (sizeof(unsigned long) * 8)
+
+// Indexed by online node, node IDs may be sparse
+static unsigned long numa_cpumask[THREAD_NUMA_MAX_NODES][THREAD_NUMA_MAX_CPUS / THREAD_NUMA_MASK_BITS];
+static uint32_t numa_node_ids[THREAD_NUMA_MAX_NODES];
+static uint32_t numa_node_count = 0;
+
+// Parse sysfs cpulist format (0-3,8-11)
+static void thread_numa_parse_cpulist(unsigned long* mask, const char* list)
+{
+    while (*list >= '0' && *list <= '9') {
+        size_t len = 0;
+        uint64_t first = str_to_uint_base(list, &len, 10);
+        uint64_t last = first;
+        list += len;
+        if (*list == '-') {
+            last = str_to_uint_base(list + 1, &len, 10);
+            list += len + 1;
+        }
+        for (uint64_t cpu = first; cpu <= last && cpu < THREAD_NUMA_MAX_CPUS; ++cpu) {
+            mask[cpu / THREAD_NUMA_MASK_BITS] |= 1UL << (cpu % THREAD_NUMA_MASK_BITS);
+        }
+        if (*list != ',') break;
+        list++;
+    }
+}
+
+static bool thread_numa_read_list(const char* path, unsigned long* mask)
+{
+    char list[1024] = {0};
+    rvfile_t* file = rvopen(path, 0);
+    if (file == NULL) return false;
+    rvread(file, list, sizeof(list) - 1, 0);
+    rvclose(file);
+    thread_numa_parse_cpulist(mask, list);
+    return true;
+}
+
+static void thread_numa_init_once(void)
+{
+    // Online nodes use the cpulist format as well, assume all of them otherwise
+    unsigned long online[THREAD_NUMA_MAX_CPUS / THREAD_NUMA_MASK_BITS] = {0};
+    if (!thread_numa_read_list("/sys/devices/system/node/online", online)) {
+        memset(online, 0xFF, sizeof(online));
+    }
+    for (uint32_t node = 0; node < THREAD_NUMA_MAX_NODES; ++node) {
+        if (!(online[node / THREAD_NUMA_MASK_BITS] & (1UL << (node % THREAD_NUMA_MASK_BITS)))) {
+            continue;
+        }
+        char path[64] = "/sys/devices/system/node/node";
+        size_t off = rvvm_strlen(path);
+        off += int_to_str_dec(path + off, sizeof(path) - off, node);
+        rvvm_strlcpy(path + off, "/cpulist", sizeof(path) - off);
+        if (thread_numa_read_list(path, numa_cpumask[numa_node_count])) {
+            numa_node_ids[numa_node_count++] = node;
+        }
+    }
+}
+
+#endif
+
+uint32_t thread_numa_nodes(void)
+{
+#ifdef THREAD_NUMA_IMPL
+    DO_ONCE(thread_numa_init_once());
+    if (numa_node_count) {
+        return numa_node_count;
+    }
+#endif
+    return 1;
+}
+
+uint32_t thread_numa_node_id(uint32_t node)
+{
+#ifdef THREAD_NUMA_IMPL
+    if (node < thread_numa_nodes() && numa_node_count) {
+        return numa_node_ids[node];
+    }
+#endif
+    return node;
+}
+
+bool thread_bind_numa_node(uint32_t node)
+{
+#ifdef THREAD_NUMA_IMPL
+    // Topology is cached upfront, so this works in a restricted thread
+    if (node < thread_numa_nodes() && numa_node_count) {
+        return syscall(__NR_sched_setaffinity, 0, sizeof(numa_cpumask[node]), numa_cpumask[node]) == 0;
+    }
+#else
+    UNUSED(node);
+#endif
+    return false;
+}
@@ -42,4 +42,10 @@ void        condvar_free(cond_var_t* cond);
 void thread_create_task(thread_func_t func, void* arg);
 void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_count);
 
+// Host NUMA topology, nodes are indexed densely from 0 to thread_numa_nodes() - 1
+uint32_t thread_numa_nodes(void);
+// Host node ID of a node index (IDs may be sparse), as passed to vma_bind_numa()
+uint32_t thread_numa_node_id(uint32_t node);
+bool     thread_bind_numa_node(uint32_t node);
+
 #endif
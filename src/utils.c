@@ -171,6 +171,23 @@ const char* rvvm_strfind(const char* string, const char* pattern)
     return NULL;
 }
 
+size_t rvvm_path_relative(char* dst, size_t size, const char* file, const char* path)
+{
+    size_t dir_len = 0;
+    for (size_t i = 0; file[i]; ++i) {
+        if (file[i] == '/' || file[i] == '\\') dir_len = i + 1;
+    }
+    if (path[0] == '/' || path[0] == '\\' || rvvm_strfind(path, ":")) {
+        // Absolute path
+        dir_len = 0;
+    }
+    dir_len = EVAL_MIN(dir_len, size ? size - 1 : 0);
+    for (size_t i = 0; i < dir_len; ++i) {
+        dst[i] = file[i];
+    }
+    return dir_len + rvvm_strlcpy(dst + dir_len, path, size - dir_len);
+}
+
 /*
  * Random generation
  */
@@ -494,6 +511,14 @@ PRINT_FORMAT void rvvm_error(const char* format_str, ...)
     }
 }
 
+PRINT_FORMAT void rvvm_report(const char* format_str, ...)
+{
+    va_list args;
+    va_start(args, format_str);
+    log_print(log_has_colors() ? "\033[32;1mSTATS\033[37;1m: " : "STATS: ", format_str, args);
+    va_end(args);
+}
+
 PRINT_FORMAT void rvvm_fatal(const char* format_str, ...)
 {
     va_list args;
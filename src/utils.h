@@ -56,6 +56,9 @@ bool        rvvm_strcmp(const char* s1, const char* s2);
 size_t      rvvm_strlcpy(char* dst, const char* src, size_t size);
 const char* rvvm_strfind(const char* string, const char* pattern);
 
+// Resolve a path relative to the directory of another file, absolute paths are kept as is
+size_t      rvvm_path_relative(char* dst, size_t size, const char* file, const char* path);
+
 static inline size_t mem_suffix_shift(char suffix)
 {
     switch (suffix) {
@@ -161,6 +164,9 @@ PRINT_FORMAT void rvvm_warn(const char* format_str, ...);
 PRINT_FORMAT void rvvm_error(const char* format_str, ...);
 PRINT_FORMAT void rvvm_fatal(const char* format_str, ...); // Aborts the process
 
+// Output explicitly requested by the user (Statistics dumps), printed regardless of loglevel
+PRINT_FORMAT void rvvm_report(const char* format_str, ...);
+
 /*
  * Initialization/deinitialization
  */
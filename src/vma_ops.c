@@ -302,20 +302,39 @@ static void* vma_mmap_aligned_internal(void* addr, size_t size, uint32_t flags,
             return NULL;
         }
     } else {
+        if (flags & VMA_SHARED) {
+            // No shareable anonymous memory on Win32
+            return NULL;
+        }
         ret = VirtualAlloc(addr, size, MEM_COMMIT | MEM_RESERVE, vma_native_prot(flags));
     }
+    if (ret && (flags & VMA_LOCK) && !VirtualLock(ret, size)) {
+        rvvm_warn("Failed to lock VMA in host RAM");
+    }
 
 #elif defined(VMA_MMAP_IMPL)
     // POSIX mmap() implementation
     int mmap_flags = (flags & VMA_EXEC) ? MAP_VMA_JIT : MAP_VMA_ANON;
     int mmap_fd = file ? rvfile_get_posix_fd(file) : -1;
+    int memfd = -1;
     if (file) {
         mmap_flags = (flags & VMA_SHARED) ? MAP_SHARED : MAP_PRIVATE;
         if (mmap_fd == -1) {
             // File doesn't have a native POSIX fd
             return NULL;
         }
+    } else if (flags & VMA_SHARED) {
+        // Shared anonymous memory, back it by memfd so it's visible to other processes
+        memfd = vma_anon_memfd(size);
+        if (memfd < 0) {
+            return NULL;
+        }
+        mmap_fd = memfd;
+        mmap_flags = MAP_SHARED;
     }
+#if defined(MAP_POPULATE)
+    if (flags & (VMA_POPULATE | VMA_LOCK)) mmap_flags |= MAP_POPULATE;
+#endif
     // Use MAP_FIXED_NOREPLACE on Linux for non-destructive behavior
 #if defined(MAP_FIXED_NOREPLACE)
     if (flags & VMA_FIXED) mmap_flags |= MAP_FIXED_NOREPLACE;
@@ -324,6 +343,13 @@ static void* vma_mmap_aligned_internal(void* addr, size_t size, uint32_t flags,
 #endif
     ret = mmap(addr, size, vma_native_prot(flags), mmap_flags, mmap_fd, offset);
     if (ret == MAP_FAILED) ret = NULL;
+    if (memfd >= 0) {
+        // The mapping keeps memfd alive
+        close(memfd);
+    }
+    if (ret && (flags & VMA_LOCK) && mlock(ret, size) < 0) {
+        rvvm_warn("Failed to lock VMA in host RAM, check RLIMIT_MEMLOCK");
+    }
     // Apply madvise() flags
 #if defined(__linux__) && defined(MADV_MERGEABLE)
     if (ret && (flags & VMA_KSM)) madvise(ret, size, MADV_MERGEABLE);
@@ -373,10 +399,6 @@ void* vma_mmap(void* addr, size_t size, uint32_t flags, rvfile_t* file, uint64_t
     } else {
         // Anonymous VMA allocation
         offset = 0;
-        if (flags & VMA_SHARED) {
-            // Mapping shared anonymous memory doesn't make a lot of sense
-            return NULL;
-        }
     }
 
     addr = align_ptr_down(addr, vma_granularity());
@@ -474,6 +496,42 @@ void* vma_remap(void* addr, size_t old_size, size_t new_size, uint32_t flags)
     return ret ? (ret + ptr_diff) : NULL;
 }
 
+bool vma_remap_file(void* addr, size_t size, uint32_t flags, rvfile_t* file, uint64_t offset)
+{
+    if (!addr || !size || ((((size_t)addr) | size | offset) & (vma_page_size() - 1))) {
+        // Misaligned address, size or offset
+        return false;
+    }
+    if (file && offset + size > rvfilesize(file)) {
+        // Don't map past the end of file, accessing such pages raises SIGBUS
+        return false;
+    }
+#if defined(VMA_MMAP_IMPL)
+    int fd = file ? rvfile_get_posix_fd(file) : -1;
+    int mmap_flags = file ? (MAP_PRIVATE | MAP_FIXED) : (MAP_PRIVATE | MAP_ANON | MAP_FIXED);
+    if (file && fd < 0) {
+        return false;
+    }
+    // MAP_FIXED atomically replaces the old pages
+    bool ret = mmap(addr, size, vma_native_prot(flags), mmap_flags, fd, file ? offset : 0) == addr;
+    if (!ret && mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) != addr) {
+        // The old mapping may be gone on failure, put anonymous memory back
+        rvvm_fatal("Failed to restore VMA after a failed remap");
+    }
+#if defined(__linux__) && defined(MADV_MERGEABLE)
+    if (ret && (flags & VMA_KSM)) madvise(addr, size, MADV_MERGEABLE);
+#endif
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (ret && (flags & VMA_THP)) madvise(addr, size, MADV_HUGEPAGE);
+#endif
+    return ret;
+#else
+    // Callers fall back to reading the file
+    UNUSED(flags);
+    return false;
+#endif
+}
+
 bool vma_protect(void* addr, size_t size, uint32_t flags)
 {
     size_t ptr_diff = ((size_t)addr) & (vma_page_size() - 1);
@@ -561,6 +619,120 @@ bool vma_pageout(void* addr, size_t size, bool lazy)
     return lazy;
 }
 
+bool vma_bind_numa(void* addr, size_t size, uint32_t node)
+{
+    size_t ptr_diff = ((size_t)addr) & (vma_page_size() - 1);
+    addr = align_ptr_down(addr, vma_page_size());
+    size = align_size_up(size + ptr_diff, vma_page_size());
+    if (!addr || !size) return false;
+#if defined(VMA_MMAP_IMPL) && defined(__linux__) && defined(__NR_mbind)
+    unsigned long nodemask[64 / (sizeof(unsigned long) * 8)] = {0};
+    if (node < 64) {
+        nodemask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+        // MPOL_BIND, MPOL_MF_MOVE
+        return syscall(__NR_mbind, addr, size, 2, nodemask, 65, 2) == 0;
+    }
+#else
+    UNUSED(node);
+#endif
+    return false;
+}
+
+#if defined(VMA_MMAP_IMPL) && defined(__linux__)
+
+// Opened once and kept, isolation forbids opening files later on
+static rvfile_t* vma_proc_pagemap = NULL;
+static rvfile_t* vma_proc_maps = NULL;
+
+static void vma_proc_close(void)
+{
+    rvclose(vma_proc_pagemap);
+    rvclose(vma_proc_maps);
+    vma_proc_pagemap = NULL;
+    vma_proc_maps = NULL;
+}
+
+#endif
+
+void vma_proc_init(void)
+{
+#if defined(VMA_MMAP_IMPL) && defined(__linux__)
+    DO_ONCE({
+        vma_proc_pagemap = rvopen("/proc/self/pagemap", 0);
+        vma_proc_maps = rvopen("/proc/self/maps", 0);
+        call_at_deinit(vma_proc_close);
+    });
+#endif
+}
+
+bool vma_residency(void* addr, size_t size, size_t* resident, size_t* file, size_t* shared)
+{
+    *resident = 0;
+    *file = 0;
+    *shared = 0;
+#if defined(VMA_MMAP_IMPL) && defined(__linux__)
+    // Each page has a 64-bit pagemap entry: bit 63 is present, 61 is file/shared-anon, 56 is exclusively mapped
+    vma_proc_init();
+    rvfile_t* pagemap = vma_proc_pagemap;
+    if (pagemap == NULL) {
+        return false;
+    }
+    size_t page_size = vma_page_size();
+    size_t first = ((size_t)addr) / page_size;
+    size_t pages = align_size_up(size + (((size_t)addr) & (page_size - 1)), page_size) / page_size;
+    uint8_t buffer[4096];
+    bool ret = false;
+    for (size_t i = 0; i < pages;) {
+        size_t count = EVAL_MIN(pages - i, sizeof(buffer) / 8);
+        // Skip unreadable chunks, the counts of the rest are still reported
+        bool valid = rvread(pagemap, buffer, count * 8, ((uint64_t)(first + i)) * 8) == count * 8;
+        ret = ret || valid;
+        for (size_t j = 0; valid && j < count; ++j) {
+            uint64_t entry = read_uint64_le_m(buffer + (j * 8));
+            if (entry & (1ULL << 63)) {
+                *resident += 1;
+                if (entry & (1ULL << 61)) *file += 1;
+                if (!(entry & (1ULL << 56))) *shared += 1;
+            }
+        }
+        i += count;
+    }
+    return ret;
+#else
+    UNUSED(addr);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+size_t vma_count(void)
+{
+#if defined(VMA_MMAP_IMPL) && defined(__linux__)
+    // Each VMA is a line in /proc/self/maps
+    vma_proc_init();
+    rvfile_t* maps = vma_proc_maps;
+    if (maps == NULL) {
+        return 0;
+    }
+    char buffer[4096];
+    size_t count = 0;
+    uint64_t pos = 0;
+    while (true) {
+        size_t size = rvread(maps, buffer, sizeof(buffer), pos);
+        if (size == 0) {
+            break;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            count += (buffer[i] == '\n');
+        }
+        pos += size;
+    }
+    return count;
+#else
+    return 0;
+#endif
+}
+
 bool vma_free(void* addr, size_t size)
 {
     size_t ptr_diff = ((size_t)addr) & (vma_granularity() - 1);
@@ -20,10 +20,12 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #define VMA_RDEX  (VMA_READ | VMA_EXEC)
 #define VMA_RWX   (VMA_READ | VMA_WRITE | VMA_EXEC)
 
-#define VMA_SHARED 0x08 // Shared file mapping, private by default
-#define VMA_FIXED  0x10 // Fixed mapping address (Non-destructive), pretty picky to use
-#define VMA_THP    0x20 // Transparent hugepages
-#define VMA_KSM    0x40 // Kernel same-page merging
+#define VMA_SHARED   0x08  // Shared mapping, private by default. Anonymous shared VMA is backed by memfd
+#define VMA_FIXED    0x10  // Fixed mapping address (Non-destructive), pretty picky to use
+#define VMA_THP      0x20  // Transparent hugepages
+#define VMA_KSM      0x40  // Kernel same-page merging
+#define VMA_POPULATE 0x80  // Prefault the whole mapping upfront
+#define VMA_LOCK     0x100 // Lock the mapping in host RAM (Implies VMA_POPULATE)
 
 /*
  * Misc memory helpers
@@ -43,6 +45,7 @@ bool   vma_broadcast_membarrier(void);
  */
 
 // Allocate anonymous VMA, force needed address using VMA_FIXED
+// Pass VMA_SHARED to get a memfd-backed shareable mapping (POSIX only!)
 void* vma_alloc(void* addr, size_t size, uint32_t flags);
 
 // Map file into memory, acts like vma_alloc() when file == NULL
@@ -53,6 +56,8 @@ bool  vma_multi_mmap(void** rw, void** exec, size_t size);
 
 // Resize anon VMA, pass VMA_FIXED to make sure it stays in place
 void* vma_remap(void* addr, size_t old_size, size_t new_size, uint32_t flags);
+// Replace pages of a private RW VMA with a copy-on-write file mapping, or zero pages if file is NULL (POSIX only!)
+bool  vma_remap_file(void* addr, size_t size, uint32_t flags, rvfile_t* file, uint64_t offset);
 
 /*
  * VMA operations
@@ -70,6 +75,16 @@ bool  vma_clean(void* addr, size_t size, bool lazy);
 // Hint to pageout memory, data is kept intact
 bool  vma_pageout(void* addr, size_t size, bool lazy);
 
+// Bind memory to a host NUMA node, moves already present pages
+bool  vma_bind_numa(void* addr, size_t size, uint32_t node);
+// Open procfs files used by vma_residency() and vma_count(), should be called before isolation
+void  vma_proc_init(void);
+// Count resident, file-backed and shared (Mapped by other processes) pages (Linux only!)
+// Unreadable parts of the range are skipped, fails only if nothing could be read
+bool  vma_residency(void* addr, size_t size, size_t* resident, size_t* file, size_t* shared);
+// Count VMAs of the process, returns 0 if unknown (Linux only!)
+size_t vma_count(void);
+
 // Unmap the VMA
 bool  vma_free(void* addr, size_t size);
 